@@ -1,6 +1,7 @@
 #pragma once
 
 #include "irendersvg.h"
+#include "surfacepool.h"
 #include "viewport.h"
 #include "uievent.h"
 
@@ -132,8 +133,12 @@ namespace waavs {
 		void setFrame(const BLRect& arect) override
 		{
 			GraphicView::setFrame(arect);
+
+			// Release the old surface before borrowing the new one, so
+			// resizing within the same bucket reuses the same memory
+			fCacheContext.end();
 			fCachedImage.reset();
-			fCachedImage.create(static_cast<int>(arect.w), static_cast<int>(arect.h), BL_FORMAT_PRGB32);
+			SurfacePool::pool().acquire(fCachedImage, static_cast<int>(arect.w), static_cast<int>(arect.h), BL_FORMAT_PRGB32);
 			fCacheContext.begin(fCachedImage);
 			fCacheContext.fontFamily("Arial");
 			fCacheContext.setViewport(arect);
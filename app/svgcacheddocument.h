@@ -33,12 +33,15 @@ namespace waavs {
 		}
 
 
+		// Only the nodes that change over time are updated.  When
+		// there aren't any, the cached image is still good, so
+		// there's no redraw either.
 		virtual void onFrameEvent(const FrameCountEvent& fe)
 		{
 			if (fDocument != nullptr)
 			{
-				setNeedsRedraw(true);
-				fDocument->update(fDocument.get());
+				if (fDocument->updateAnimatedNodes())
+					setNeedsRedraw(true);
 			}
 		}
 		
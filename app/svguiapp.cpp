@@ -47,21 +47,10 @@ bool loadFontDirectory(const char* dir) noexcept
 		return false;
 	}
 
-	for (const auto& dir_entry : std::filesystem::directory_iterator(fontPath))
-	{
-		if (dir_entry.is_regular_file())
-		{
-			if ((dir_entry.path().extension() == ".ttf") ||
-				(dir_entry.path().extension() == ".otf") ||
-				(dir_entry.path().extension() == ".TTF"))
-			{
-				BLFontFace ff{};
-				bool success = getFontHandler().loadFontFace(dir_entry.path().generic_string().c_str(), ff);
-			}
-		}
-	}
-
-	return true;
+	// Only index the fonts here, they are loaded when first used
+	// The index is cached, so unchanged fonts aren't opened next time
+	static const std::string cacheFile = FontIndex::defaultCacheFile("svgandme");
+	return getFontHandler().indexFontDirectory(dir, cacheFile.empty() ? nullptr : cacheFile.c_str());
 }
 
 bool loadDefaultFonts() noexcept
@@ -29,6 +29,11 @@ namespace waavs {
 				[](IAmGroot* groot, const XmlElement& elem) {
 					auto node = std::make_shared<DisplayCaptureElement>(groot);
 					node->loadFromXmlElement(elem, groot);
+
+					// The capture changes from frame to frame
+					if (nullptr != groot)
+						groot->addAnimatedNode(node);
+
 					return node;
 				});
 		}
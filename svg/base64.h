@@ -11,12 +11,38 @@
 //
 // The decode routine is tolerant of whitespace and other non-base64 characters.
 // it will just ignore them.
-// The routines here may not be the fastest vectorized versions, but they are simple
-// and easily portable.
+//
+// Embedded images can be many megabytes of base64, so on x86 both
+// directions have SSSE3 and AVX2 paths, selected at runtime based on
+// what the CPU supports.  The vector code works on runs of clean
+// base64 characters.  When it runs into whitespace, padding, or
+// anything else, it hands that stretch to the scalar code, which
+// skips over it, and then goes back to vectors.
+//
+// The vector algorithms are those of Wojciech Mula and Daniel Lemire
+// "Faster Base64 Encoding and Decoding using AVX2 Instructions"
 
 //#define BASE64_ENCODE_OUT_SIZE(s) ((unsigned int)((((s) + 2) / 3) * 4 + 1))
 //#define BASE64_DECODE_OUT_SIZE(s) ((unsigned int)(((s) / 4) * 3))
 
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+	#define WAAVS_BASE64_X86 1
+	#include <immintrin.h>
+	#if defined(_MSC_VER) && !defined(__clang__)
+		#include <intrin.h>
+		#define WAAVS_TARGET_SSSE3
+		#define WAAVS_TARGET_AVX2
+	#else
+		#include <cpuid.h>
+		#define WAAVS_TARGET_SSSE3 __attribute__((target("ssse3")))
+		#define WAAVS_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
 
 
 namespace waavs {
@@ -39,6 +65,7 @@ namespace waavs {
 	};
 	
 	// ASCII order for BASE 64 decode, 255 is unused and invalid character
+	// The full 256 entries, so any byte can be looked up directly
 	static const unsigned char base64de[] = {
 	 // nul, soh, stx, etx, eot, enq, ack, bel,
 		255, 255, 255, 255, 255, 255, 255, 255,
@@ -71,17 +98,373 @@ namespace waavs {
 	 // 'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
 	     41,  42,  43,  44,  45,  46,  47,  48,
 	 // 'x', 'y', 'z', '{', '|', '}', '~', del,
-	     49,  50,  51, 255, 255, 255, 255, 255
+	     49,  50,  51, 255, 255, 255, 255, 255,
+	 // 0x80 - 0xff, never valid
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255,
+		255, 255, 255, 255, 255, 255, 255, 255,  255, 255, 255, 255, 255, 255, 255, 255
 	};
 	
 
 	
+	// base64simd
+	// The vector kernels.  Each one consumes as many whole blocks as it
+	// can, and returns how much of the input it used.  Decoding stops at
+	// the first block that contains anything other than the 64 base64
+	// characters, leaving that for the scalar decoder.
+	//
+	// The kernels load and store full vectors, even though only 3/4 of the
+	// bytes are used on each side, so they require some slack at the end
+	// of both buffers.  The callers below make sure that's there.
+	struct base64simd
+	{
+#if defined(WAAVS_BASE64_X86)
+		enum {
+			CPU_SSSE3 = 0x01,
+			CPU_AVX2 = 0x02,
+		};
+
+		static int detectCpu() noexcept
+		{
+			int features = 0;
+
+#if defined(_MSC_VER) && !defined(__clang__)
+			int regs[4]{};
+			__cpuid(regs, 0);
+			int maxLeaf = regs[0];
+
+			__cpuid(regs, 1);
+			if (regs[2] & (1 << 9))
+				features |= CPU_SSSE3;
+
+			// AVX2 needs the OS to be saving the ymm registers as well
+			bool osAvx = ((regs[2] & (1 << 27)) != 0) && ((regs[2] & (1 << 28)) != 0) && ((_xgetbv(0) & 0x06) == 0x06);
+			if (osAvx && maxLeaf >= 7)
+			{
+				__cpuidex(regs, 7, 0);
+				if (regs[1] & (1 << 5))
+					features |= CPU_AVX2;
+			}
+#else
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("ssse3"))
+				features |= CPU_SSSE3;
+			if (__builtin_cpu_supports("avx2"))
+				features |= CPU_AVX2;
+#endif
+
+			return features;
+		}
+
+		static int cpuFeatures() noexcept
+		{
+			static const int sFeatures = detectCpu();
+			return sFeatures;
+		}
+
+		static bool hasSSSE3() noexcept { return (cpuFeatures() & CPU_SSSE3) != 0; }
+		static bool hasAVX2() noexcept { return (cpuFeatures() & CPU_AVX2) != 0; }
+
+
+		// Decode 16 characters to 12 bytes at a time
+		// 'in' must have at least 16, and 'out' at least 16 bytes available per block
+		WAAVS_TARGET_SSSE3
+		static size_t decodeSSSE3(const char* in, size_t inlen, unsigned char* out, size_t& outlen) noexcept
+		{
+			const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+			const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+			const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+			const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+			const __m128i slash = _mm_set1_epi8(0x2f);
+			const __m128i packShuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+			size_t i = 0;
+			size_t j = 0;
+
+			while (i + 16 <= inlen)
+			{
+				__m128i src = _mm_loadu_si128((const __m128i*)(in + i));
+				__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(src, 4), nibbleMask);
+				__m128i loNibbles = _mm_and_si128(src, nibbleMask);
+
+				// Every character outside the alphabet has some
+				// bit in common between its two lookups
+				__m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+				__m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+				if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+					break;
+
+				// ASCII to 6-bit values
+				__m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(src, slash), hiNibbles));
+				__m128i values = _mm_add_epi8(src, roll);
+
+				// Squeeze 4x6 bits into 3x8 bits
+				__m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+				merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+				merged = _mm_shuffle_epi8(merged, packShuffle);
+
+				_mm_storeu_si128((__m128i*)(out + j), merged);
+
+				i += 16;
+				j += 12;
+			}
+
+			outlen = j;
+			return i;
+		}
+
+		// Decode 32 characters to 24 bytes at a time
+		// 'in' must have at least 32, and 'out' at least 32 bytes available per block
+		WAAVS_TARGET_AVX2
+		static size_t decodeAVX2(const char* in, size_t inlen, unsigned char* out, size_t& outlen) noexcept
+		{
+			const __m256i lutLo = _mm256_setr_epi8(
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+			const __m256i lutHi = _mm256_setr_epi8(
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+			const __m256i lutRoll = _mm256_setr_epi8(
+				0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+				0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+			const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+			const __m256i slash = _mm256_set1_epi8(0x2f);
+			const __m256i packShuffle = _mm256_setr_epi8(
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+				2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+			const __m256i packLanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+			size_t i = 0;
+			size_t j = 0;
+
+			while (i + 32 <= inlen)
+			{
+				__m256i src = _mm256_loadu_si256((const __m256i*)(in + i));
+				__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(src, 4), nibbleMask);
+				__m256i loNibbles = _mm256_and_si256(src, nibbleMask);
+
+				__m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+				__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+				if (!_mm256_testz_si256(lo, hi))
+					break;
+
+				__m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(src, slash), hiNibbles));
+				__m256i values = _mm256_add_epi8(src, roll);
+
+				__m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+				merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+				merged = _mm256_shuffle_epi8(merged, packShuffle);
+				merged = _mm256_permutevar8x32_epi32(merged, packLanes);
+
+				_mm256_storeu_si256((__m256i*)(out + j), merged);
+
+				i += 32;
+				j += 24;
+			}
+
+			outlen = j;
+			return i;
+		}
+
+
+		// Count the leading characters that are in the base64 alphabet
+		WAAVS_TARGET_SSSE3
+		static size_t validPrefixSSSE3(const char* in, size_t inlen) noexcept
+		{
+			const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+			const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+			const __m128i nibbleMask = _mm_set1_epi8(0x0f);
+
+			size_t i = 0;
+			while (i + 16 <= inlen)
+			{
+				__m128i src = _mm_loadu_si128((const __m128i*)(in + i));
+				__m128i lo = _mm_shuffle_epi8(lutLo, _mm_and_si128(src, nibbleMask));
+				__m128i hi = _mm_shuffle_epi8(lutHi, _mm_and_si128(_mm_srli_epi32(src, 4), nibbleMask));
+				unsigned int invalid = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+				if (invalid != 0)
+					return i + countTrailingZeros(invalid);
+
+				i += 16;
+			}
+
+			return i + validPrefixScalar(in + i, inlen - i);
+		}
+
+		WAAVS_TARGET_AVX2
+		static size_t validPrefixAVX2(const char* in, size_t inlen) noexcept
+		{
+			const __m256i lutLo = _mm256_setr_epi8(
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+				0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+			const __m256i lutHi = _mm256_setr_epi8(
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+				0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+			const __m256i nibbleMask = _mm256_set1_epi8(0x0f);
+
+			size_t i = 0;
+			while (i + 32 <= inlen)
+			{
+				__m256i src = _mm256_loadu_si256((const __m256i*)(in + i));
+				__m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(src, nibbleMask));
+				__m256i hi = _mm256_shuffle_epi8(lutHi, _mm256_and_si256(_mm256_srli_epi32(src, 4), nibbleMask));
+				unsigned int invalid = (unsigned int)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+				if (invalid != 0)
+					return i + countTrailingZeros(invalid);
+
+				i += 32;
+			}
+
+			return i + validPrefixScalar(in + i, inlen - i);
+		}
+
+		static size_t validPrefixScalar(const char* in, size_t inlen) noexcept
+		{
+			size_t i = 0;
+			while ((i < inlen) && (base64de[(unsigned char)in[i]] != 255))
+				i++;
+
+			return i;
+		}
+
+		static unsigned int countTrailingZeros(unsigned int mask) noexcept
+		{
+#if defined(_MSC_VER) && !defined(__clang__)
+			unsigned long idx = 0;
+			_BitScanForward(&idx, mask);
+			return (unsigned int)idx;
+#else
+			return (unsigned int)__builtin_ctz(mask);
+#endif
+		}
+
+
+		// Decode whole blocks with the best kernel the CPU has, leaving at
+		// least one block of the input behind, so the full width stores stay
+		// within an output buffer sized with base64::getDecodeOutputSize()
+		static size_t decodeBlocks(const char* in, size_t inlen, unsigned char* out, size_t& outlen) noexcept
+		{
+			outlen = 0;
+
+			if (hasAVX2())
+				return (inlen >= 64) ? decodeAVX2(in, inlen - 32, out, outlen) : 0;
+
+			if (hasSSSE3())
+				return (inlen >= 32) ? decodeSSSE3(in, inlen - 16, out, outlen) : 0;
+
+			return 0;
+		}
+
+		static size_t validPrefix(const char* in, size_t inlen) noexcept
+		{
+			if (hasAVX2())
+				return validPrefixAVX2(in, inlen);
+
+			if (hasSSSE3())
+				return validPrefixSSSE3(in, inlen);
+
+			return validPrefixScalar(in, inlen);
+		}
+
+
+		// Encode 12 bytes to 16 characters at a time
+		// 'in' must have at least 16 bytes available per block
+		WAAVS_TARGET_SSSE3
+		static size_t encodeSSSE3(const unsigned char* in, size_t inlen, char* out, size_t& outlen) noexcept
+		{
+			const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+			const __m128i shiftLut = _mm_setr_epi8(
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+			size_t i = 0;
+			size_t j = 0;
+
+			while (i + 16 <= inlen)
+			{
+				__m128i src = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i)), spread);
+
+				// 3x8 bits into 4x6 bits
+				__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(src, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+				__m128i t1 = _mm_mullo_epi16(_mm_and_si128(src, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+				__m128i indices = _mm_or_si128(t0, t1);
+
+				// 6-bit values to ASCII
+				__m128i reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+				__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+				reduced = _mm_or_si128(reduced, _mm_and_si128(less, _mm_set1_epi8(13)));
+				__m128i chars = _mm_add_epi8(_mm_shuffle_epi8(shiftLut, reduced), indices);
+
+				_mm_storeu_si128((__m128i*)(out + j), chars);
+
+				i += 12;
+				j += 16;
+			}
+
+			outlen = j;
+			return i;
+		}
+
+		// Encode 24 bytes to 32 characters at a time
+		// 'in' must have at least 32 bytes available per block
+		WAAVS_TARGET_AVX2
+		static size_t encodeAVX2(const unsigned char* in, size_t inlen, char* out, size_t& outlen) noexcept
+		{
+			const __m256i spread = _mm256_set_epi8(
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+				10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+			const __m256i shiftLut = _mm256_setr_epi8(
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+				'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+			const __m256i spreadLanes = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+
+			size_t i = 0;
+			size_t j = 0;
+
+			while (i + 32 <= inlen)
+			{
+				// 12 bytes into each 128-bit lane
+				__m256i src = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(in + i)), spreadLanes);
+				src = _mm256_shuffle_epi8(src, spread);
+
+				__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(src, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+				__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(src, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+				__m256i indices = _mm256_or_si256(t0, t1);
+
+				__m256i reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+				__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+				reduced = _mm256_or_si256(reduced, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+				__m256i chars = _mm256_add_epi8(_mm256_shuffle_epi8(shiftLut, reduced), indices);
+
+				_mm256_storeu_si256((__m256i*)(out + j), chars);
+
+				i += 24;
+				j += 32;
+			}
+
+			outlen = j;
+			return i;
+		}
+#endif
+	};
+
+
 	struct base64 {
+		static constexpr size_t kStageSize = 4096;
+
 		// Given an input buffer size, getDecodeOutputSize() returns the size
 		// of buffer needed to contain the decoded data.
+		// Rounded up, so unpadded input still has room for its last bytes
 		static unsigned int getDecodeOutputSize(const size_t inputSize) noexcept
 		{
-			return ((unsigned int)(((inputSize) / 4) * 3));
+			return ((unsigned int)(((inputSize + 3) / 4) * 3));
 		}
 		
 		static unsigned int getEncodeOutputSize(const size_t inputSize) noexcept
@@ -89,102 +472,202 @@ namespace waavs {
 			return ((unsigned int)((((inputSize)+2) / 3) * 4 + 1));
 		}
 		
+		// encodeBlocks
+		// Encode 'inlen' bytes, 3 at a time, without padding or terminator
+		// return value is the number of characters written
+		static size_t encodeBlocks(const unsigned char* in, size_t inlen, char* out) noexcept
+		{
+			size_t i = 0;
+			size_t j = 0;
+
+			for (; i + 3 <= inlen; i += 3)
+			{
+				uint32_t triple = ((uint32_t)in[i] << 16) | ((uint32_t)in[i + 1] << 8) | (uint32_t)in[i + 2];
+				out[j++] = base64en[(triple >> 18) & 0x3F];
+				out[j++] = base64en[(triple >> 12) & 0x3F];
+				out[j++] = base64en[(triple >> 6) & 0x3F];
+				out[j++] = base64en[triple & 0x3F];
+			}
+
+			return j;
+		}
+
 		// base64_encode
 		// out is null-terminated encode string.
 		// return values is out length, excluding the terminating `\0'
 		static unsigned int encode(const unsigned char* in, unsigned int inlen, char* out) noexcept
 		{
-			int s;
-			unsigned int i;
-			unsigned int j;
-			unsigned char c;
-			unsigned char l;
-
-			s = 0;
-			l = 0;
-			for (i = j = 0; i < inlen; i++) {
-				c = in[i];
+			size_t i = 0;
+			size_t j = 0;
 
-
-				switch (s) {
-				case 0:
-					s = 1;
-					out[j++] = base64en[(c >> 2) & 0x3F];
-					break;
-				case 1:
-					s = 2;
-					out[j++] = base64en[((l & 0x3) << 4) | ((c >> 4) & 0xF)];
-					break;
-				case 2:
-					s = 0;
-					out[j++] = base64en[((l & 0xF) << 2) | ((c >> 6) & 0x3)];
-					out[j++] = base64en[c & 0x3F];
-					break;
-				}
-				l = c;
+#if defined(WAAVS_BASE64_X86)
+			// The vector encoders read a few bytes past the last
+			// block they encode, so stop them short of the end
+			size_t outlen = 0;
+			if (inlen >= 32 && base64simd::hasAVX2())
+			{
+				i = base64simd::encodeAVX2(in, inlen, out, outlen);
+				j = outlen;
 			}
+			else if (inlen >= 16 && base64simd::hasSSSE3())
+			{
+				i = base64simd::encodeSSSE3(in, inlen, out, outlen);
+				j = outlen;
+			}
+#endif
+
+			j += encodeBlocks(in + i, inlen - i, out + j);
+			i += ((inlen - i) / 3) * 3;
 
-			switch (s) {
+			switch (inlen - i) {
 			case 1:
-				out[j++] = base64en[(l & 0x3) << 4];
+				out[j++] = base64en[(in[i] >> 2) & 0x3F];
+				out[j++] = base64en[(in[i] & 0x3) << 4];
 				out[j++] = BASE64_PAD;
 				out[j++] = BASE64_PAD;
 				break;
 			case 2:
-				out[j++] = base64en[(l & 0xF) << 2];
+				out[j++] = base64en[(in[i] >> 2) & 0x3F];
+				out[j++] = base64en[((in[i] & 0x3) << 4) | ((in[i + 1] >> 4) & 0xF)];
+				out[j++] = base64en[(in[i + 1] & 0xF) << 2];
 				out[j++] = BASE64_PAD;
 				break;
 			}
 
 			out[j] = 0;
 
-			return j;
+			return (unsigned int)j;
 		}
 		
+		// isBase64Char
+		// Whether the character is one of the 64 in the alphabet
+		static bool isBase64Char(char ch) noexcept
+		{
+			return base64de[(unsigned char)ch] != 255;
+		}
+
+		// decodeScalar
+		// Table driven decoding, which skips over whitespace, padding and
+		// any other characters that are not part of the base64 alphabet.
+		// 'quad' and 'count' carry a partially assembled quantum between calls,
+		// so decoding can be stopped and resumed at any character.
+		static size_t decodeScalar(const char* in, size_t inlen, unsigned char* out, uint32_t& quad, int& count) noexcept
+		{
+			size_t j = 0;
+
+			size_t i = 0;
+
+			while (i < inlen)
+			{
+				// Whole quanta at a time, while there's nothing to skip
+				if (count == 0)
+				{
+					while (i + 4 <= inlen)
+					{
+						uint32_t a = base64de[(unsigned char)in[i]];
+						uint32_t b = base64de[(unsigned char)in[i + 1]];
+						uint32_t c = base64de[(unsigned char)in[i + 2]];
+						uint32_t d = base64de[(unsigned char)in[i + 3]];
+						if ((a | b | c | d) & 0x80)
+							break;
+
+						uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+						out[j++] = (unsigned char)(triple >> 16);
+						out[j++] = (unsigned char)(triple >> 8);
+						out[j++] = (unsigned char)triple;
+						i += 4;
+					}
+
+					if (i >= inlen)
+						break;
+				}
+
+				unsigned char c = base64de[(unsigned char)in[i++]];
+				if (c == 255)
+					continue;
+
+				quad = (quad << 6) | c;
+				if (++count == 4)
+				{
+					out[j++] = (unsigned char)(quad >> 16);
+					out[j++] = (unsigned char)(quad >> 8);
+					out[j++] = (unsigned char)quad;
+					quad = 0;
+					count = 0;
+				}
+			}
+
+			return j;
+		}
+
 		// decode
 		// Given an input that is base64 encoded, decode it to the output buffer.
 		// the return value of the function is the number of bytes that
-		// are in the 'out' buffer
+		// are in the 'out' buffer, which must be at least getDecodeOutputSize(inlen)
 		// skip over whitespace, ignore invalid characters
 		static size_t decode(const char* in, size_t inlen, unsigned char* out) noexcept
 		{
-			size_t i{ 0 };	// i - tracks the input location
-			unsigned int j;
-			unsigned char c;
+			size_t j = 0;	// j - tracks the output location
+			uint32_t quad = 0;
+			int count = 0;
 
+#if defined(WAAVS_BASE64_X86)
+			if (base64simd::hasSSSE3())
+			{
+				// Clean runs are decoded straight from the input.  Once
+				// something breaks up the run, whatever is left is gathered,
+				// minus whitespace and the like, into a staging buffer, and
+				// decoded from there.  Line breaks every 64 or 76 characters
+				// then cost a short copy, rather than dropping to scalar code.
+				char stage[kStageSize];
+				size_t n = 0;	// characters in the stage
+				size_t i = 0;	// i - tracks the input location
 
-			i = 0;
-			j = 0;
-			while (i < inlen) {
-				c = base64de[(unsigned char)in[i++]];
-				if (c == 255) {
-					continue;
-				}
-				out[j] = c << 2;
-				c = base64de[(unsigned char)in[i++]];
-				if (c == 255) {
-					continue;
-				}
-				out[j] |= c >> 4;
-				if (i < inlen) {
-					out[j + 1] = c << 4;
-					c = base64de[(unsigned char)in[i++]];
-					if (c == 255) {
-						continue;
+				while (i < inlen)
+				{
+					size_t outlen = 0;
+					if (n == 0)
+					{
+						i += base64simd::decodeBlocks(in + i, inlen - i, out + j, outlen);
+						j += outlen;
 					}
-					out[j + 1] |= c >> 2;
-				}
-				if (i < inlen) {
-					out[j + 2] = c << 6;
-					c = base64de[(unsigned char)in[i++]];
-					if (c == 255) {
-						continue;
+
+					while ((i < inlen) && (n < kStageSize))
+					{
+						size_t run = base64simd::validPrefix(in + i, std::min(inlen - i, kStageSize - n));
+						memcpy(stage + n, in + i, run);
+						n += run;
+						i += run;
+
+						while ((i < inlen) && !isBase64Char(in[i]))
+							i++;
 					}
-					out[j + 2] |= c;
+
+					// Always whole quanta, so what's left in the
+					// stage starts on a quantum boundary
+					size_t used = base64simd::decodeBlocks(stage, n, out + j, outlen);
+					j += outlen;
+					n -= used;
+					memmove(stage, stage + used, n);
 				}
-				j += 3;
+
+				j += decodeScalar(stage, n, out + j, quad, count);
+			}
+			else {
+				j = decodeScalar(in, inlen, out, quad, count);
 			}
+#else
+			j = decodeScalar(in, inlen, out, quad, count);
+#endif
 
+			// Whatever is left over, from unpadded or padded input
+			if (count == 2) {
+				out[j++] = (unsigned char)(quad >> 4);
+			}
+			else if (count == 3) {
+				out[j++] = (unsigned char)(quad >> 10);
+				out[j++] = (unsigned char)(quad >> 2);
+			}
 
 			return j;
 		}
@@ -192,4 +675,4 @@ namespace waavs {
 }
 
 
-#endif // BASE64_H
\ No newline at end of file
+#endif // BASE64_H
@@ -0,0 +1,664 @@
+#pragma once
+
+//
+// Gaussian blur, for feGaussianBlur
+//
+// The blur is separable, so it's done as a horizontal pass over rows,
+// followed by a vertical pass over columns.  For a small standard
+// deviation, the actual gaussian kernel is applied.  For larger ones,
+// the cost of that grows with the radius, so instead we use the
+// approximation the specification describes, three successive box
+// blurs, each of which costs the same no matter how wide it is.
+//
+// Pixels are premultiplied PRGB32, or A8 for alpha only images, like
+// the drop shadows made from SourceAlpha.  The horizontal pass works
+// one row at a time, with the channels of a pixel in the lanes of a
+// vector.  The vertical pass works on strips of columns, with a whole
+// run of pixels across a row in the lanes.  Both spread their rows, or
+// strips, across the worker pool, and only the output area, plus what
+// reaches into it, is ever touched.
+//
+// What reaches into the output grows with the standard deviation, and
+// the deviation can be anything.  Once it's several times wider than
+// the filter region, the kernel is all but flat across the region, so
+// a blur with a wider one only comes out fainter, in proportion.  The
+// deviation is capped there, and the result scaled down to match, so
+// the buffers stay in proportion to the filter region.
+//
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "filterengine.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_BLUR_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    // BlurKernel
+    // How to blur along one axis, for a given standard deviation in pixels
+    struct BlurKernel
+    {
+        static constexpr double kExactLimit = 2.0;      // below this, use the true gaussian
+        static constexpr double kMaxSigmaPerExtent = 4.0;   // cap, relative to the filter region
+
+        bool fExact{ false };
+        std::vector<float> fWeights{};      // exact; 2 * fRadius + 1 taps
+        int fRadius{ 0 };
+
+        int fPasses{ 0 };                   // box; how many, and the extent of each
+        int fLeft[3]{};
+        int fRight[3]{};
+
+        double fScale{ 1.0 };               // applied to the result, when the deviation was capped
+
+
+        // 'extent' is the size of the filter region along the axis,
+        // if it's known, which caps the deviation
+        static BlurKernel forSigma(double sigma, int extent = 0)
+        {
+            BlurKernel k{};
+
+            if (!(sigma > 0))
+                return k;
+
+            if (extent > 0)
+            {
+                double maxSigma = kMaxSigmaPerExtent * extent;
+                if (sigma > maxSigma)
+                {
+                    k.fScale = maxSigma / sigma;
+                    sigma = maxSigma;
+                }
+            }
+
+            if (sigma < kExactLimit)
+            {
+                k.fExact = true;
+                k.fRadius = (int)std::ceil(sigma * 3.0);
+
+                double sum = 0;
+                for (int i = -k.fRadius; i <= k.fRadius; i++)
+                {
+                    double w = std::exp(-(double)(i * i) / (2.0 * sigma * sigma));
+                    k.fWeights.push_back((float)w);
+                    sum += w;
+                }
+                for (auto& w : k.fWeights)
+                    w = (float)(w / sum);
+
+                return k;
+            }
+
+            // The box sizes from the specification
+            int d = (int)std::floor(sigma * 3.0 * std::sqrt(2.0 * 3.14159265358979323846) / 4.0 + 0.5);
+            k.fPasses = 3;
+
+            if (d & 1)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    k.fLeft[i] = d / 2;
+                    k.fRight[i] = d / 2;
+                }
+            }
+            else
+            {
+                // two of size d, one off to each side of the pixel,
+                // then one of size d + 1, centered on it
+                k.fLeft[0] = d / 2;      k.fRight[0] = d / 2 - 1;
+                k.fLeft[1] = d / 2 - 1;  k.fRight[1] = d / 2;
+                k.fLeft[2] = d / 2;      k.fRight[2] = d / 2;
+            }
+
+            return k;
+        }
+
+        bool isIdentity() const { return !fExact && (fPasses == 0); }
+
+        // How far the kernel reads, before and after a pixel
+        int reachBefore() const
+        {
+            if (fExact)
+                return fRadius;
+
+            int r = 0;
+            for (int i = 0; i < fPasses; i++)
+                r += fLeft[i];
+            return r;
+        }
+
+        int reachAfter() const
+        {
+            if (fExact)
+                return fRadius;
+
+            int r = 0;
+            for (int i = 0; i < fPasses; i++)
+                r += fRight[i];
+            return r;
+        }
+    };
+
+
+    struct GaussianBlur
+    {
+        static constexpr int kStripPixels32 = 64;
+        static constexpr int kStripPixels8 = 256;
+
+        // Everything rounds half to even, the way the SSE2 conversions
+        // do, so the vector and scalar paths agree exactly.
+
+#if defined(WAAVS_BLUR_SSE2)
+        static inline __m128i unpackPixel(uint32_t p, __m128i zero)
+        {
+            return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), zero), zero);
+        }
+
+        static inline uint32_t packPixel(__m128 v)
+        {
+            __m128i i = _mm_cvtps_epi32(v);
+            i = _mm_packs_epi32(i, i);
+            return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+        }
+#endif
+
+        //==================================================
+        // Along a row
+        // 'src' and 'dst' are 'n' pixels long, and anything
+        // before or after 'src' counts as transparent.
+        //==================================================
+        static void boxLine(const uint32_t* src, uint32_t* dst, int n, int left, int right)
+        {
+            float inv = 1.0f / (float)(left + right + 1);
+
+#if defined(WAAVS_BLUR_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 vinv = _mm_set1_ps(inv);
+
+            __m128i sum = zero;
+            for (int k = 0; k <= std::min(right, n - 1); k++)
+                sum = _mm_add_epi32(sum, unpackPixel(src[k], zero));
+
+            for (int i = 0; i < n; i++)
+            {
+                dst[i] = packPixel(_mm_mul_ps(_mm_cvtepi32_ps(sum), vinv));
+
+                if (i + 1 + right < n)
+                    sum = _mm_add_epi32(sum, unpackPixel(src[i + 1 + right], zero));
+                if (i - left >= 0)
+                    sum = _mm_sub_epi32(sum, unpackPixel(src[i - left], zero));
+            }
+#else
+            int32_t sum[4] = { 0, 0, 0, 0 };
+            for (int k = 0; k <= std::min(right, n - 1); k++)
+                for (int c = 0; c < 4; c++)
+                    sum[c] += (src[k] >> (c * 8)) & 0xff;
+
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t p = 0;
+                for (int c = 0; c < 4; c++)
+                    p |= (uint32_t)std::nearbyint(sum[c] * inv) << (c * 8);
+                dst[i] = p;
+
+                for (int c = 0; c < 4; c++)
+                {
+                    if (i + 1 + right < n)
+                        sum[c] += (src[i + 1 + right] >> (c * 8)) & 0xff;
+                    if (i - left >= 0)
+                        sum[c] -= (src[i - left] >> (c * 8)) & 0xff;
+                }
+            }
+#endif
+        }
+
+        static void boxLine(const uint8_t* src, uint8_t* dst, int n, int left, int right)
+        {
+            float inv = 1.0f / (float)(left + right + 1);
+
+            int32_t sum = 0;
+            for (int k = 0; k <= std::min(right, n - 1); k++)
+                sum += src[k];
+
+            for (int i = 0; i < n; i++)
+            {
+                dst[i] = (uint8_t)std::nearbyint(sum * inv);
+
+                if (i + 1 + right < n)
+                    sum += src[i + 1 + right];
+                if (i - left >= 0)
+                    sum -= src[i - left];
+            }
+        }
+
+        // dst[i] = sum of w[k] * src[i + k], for 'n' outputs,
+        // so 'src' has n + taps - 1 pixels
+        static void kernelLine(const uint32_t* src, uint32_t* dst, int n, const float* w, int taps)
+        {
+#if defined(WAAVS_BLUR_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+
+            for (int i = 0; i < n; i++)
+            {
+                __m128 acc = _mm_setzero_ps();
+                for (int k = 0; k < taps; k++)
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_cvtepi32_ps(unpackPixel(src[i + k], zero))));
+
+                dst[i] = packPixel(acc);
+            }
+#else
+            for (int i = 0; i < n; i++)
+            {
+                float acc[4] = { 0, 0, 0, 0 };
+                for (int k = 0; k < taps; k++)
+                    for (int c = 0; c < 4; c++)
+                        acc[c] += w[k] * (float)((src[i + k] >> (c * 8)) & 0xff);
+
+                uint32_t p = 0;
+                for (int c = 0; c < 4; c++)
+                    p |= (uint32_t)std::nearbyint(std::min(255.0f, acc[c])) << (c * 8);
+                dst[i] = p;
+            }
+#endif
+        }
+
+        static void kernelLine(const uint8_t* src, uint8_t* dst, int n, const float* w, int taps)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                float acc = 0;
+                for (int k = 0; k < taps; k++)
+                    acc += w[k] * src[i + k];
+
+                dst[i] = (uint8_t)std::nearbyint(std::min(255.0f, acc));
+            }
+        }
+
+
+        //==================================================
+        // Down columns
+        // 'src' and 'dst' are 'n' rows of 'width' pixels, each
+        // 'stride' bytes apart.  Rows before or after 'src' count
+        // as transparent.  'sums' has room for width * 4 values.
+        //==================================================
+        static void boxColumns(const uint32_t* src, uint32_t* dst, int n, int width, size_t stride, int left, int right, int32_t* sums)
+        {
+            float inv = 1.0f / (float)(left + right + 1);
+            memset(sums, 0, sizeof(int32_t) * 4 * width);
+
+            auto rowAt = [src, stride](int y) { return (const uint32_t*)((const uint8_t*)src + (intptr_t)y * stride); };
+
+#if defined(WAAVS_BLUR_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 vinv = _mm_set1_ps(inv);
+
+            auto accumulate = [&](const uint32_t* row, bool add) {
+                int x = 0;
+                for (; x + 4 <= width; x += 4)
+                {
+                    __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+                    __m128i lo = _mm_unpacklo_epi8(p, zero);
+                    __m128i hi = _mm_unpackhi_epi8(p, zero);
+                    __m128i v[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+
+                    for (int j = 0; j < 4; j++)
+                    {
+                        __m128i* s = (__m128i*)(sums + (x + j) * 4);
+                        __m128i cur = _mm_loadu_si128(s);
+                        _mm_storeu_si128(s, add ? _mm_add_epi32(cur, v[j]) : _mm_sub_epi32(cur, v[j]));
+                    }
+                }
+                for (; x < width; x++)
+                {
+                    __m128i* s = (__m128i*)(sums + x * 4);
+                    __m128i v = unpackPixel(row[x], zero);
+                    __m128i cur = _mm_loadu_si128(s);
+                    _mm_storeu_si128(s, add ? _mm_add_epi32(cur, v) : _mm_sub_epi32(cur, v));
+                }
+            };
+
+            auto emit = [&](uint32_t* out) {
+                int x = 0;
+                for (; x + 4 <= width; x += 4)
+                {
+                    __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x * 4))), vinv));
+                    __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x * 4 + 4))), vinv));
+                    __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x * 4 + 8))), vinv));
+                    __m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x * 4 + 12))), vinv));
+                    _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+                }
+                for (; x < width; x++)
+                    out[x] = packPixel(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x * 4))), vinv));
+            };
+#else
+            auto accumulate = [&](const uint32_t* row, bool add) {
+                for (int x = 0; x < width; x++)
+                    for (int c = 0; c < 4; c++)
+                    {
+                        int32_t v = (row[x] >> (c * 8)) & 0xff;
+                        sums[x * 4 + c] += add ? v : -v;
+                    }
+            };
+
+            auto emit = [&](uint32_t* out) {
+                for (int x = 0; x < width; x++)
+                {
+                    uint32_t p = 0;
+                    for (int c = 0; c < 4; c++)
+                        p |= (uint32_t)std::nearbyint(sums[x * 4 + c] * inv) << (c * 8);
+                    out[x] = p;
+                }
+            };
+#endif
+
+            for (int k = 0; k <= std::min(right, n - 1); k++)
+                accumulate(rowAt(k), true);
+
+            for (int i = 0; i < n; i++)
+            {
+                emit((uint32_t*)((uint8_t*)dst + (intptr_t)i * stride));
+
+                if (i + 1 + right < n)
+                    accumulate(rowAt(i + 1 + right), true);
+                if (i - left >= 0)
+                    accumulate(rowAt(i - left), false);
+            }
+        }
+
+        static void boxColumns(const uint8_t* src, uint8_t* dst, int n, int width, size_t stride, int left, int right, int32_t* sums)
+        {
+            float inv = 1.0f / (float)(left + right + 1);
+            memset(sums, 0, sizeof(int32_t) * width);
+
+            auto accumulate = [&](const uint8_t* row, bool add) {
+                int x = 0;
+#if defined(WAAVS_BLUR_SSE2)
+                const __m128i zero = _mm_setzero_si128();
+                for (; x + 16 <= width; x += 16)
+                {
+                    __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+                    __m128i lo = _mm_unpacklo_epi8(p, zero);
+                    __m128i hi = _mm_unpackhi_epi8(p, zero);
+                    __m128i v[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+
+                    for (int j = 0; j < 4; j++)
+                    {
+                        __m128i* s = (__m128i*)(sums + x + j * 4);
+                        __m128i cur = _mm_loadu_si128(s);
+                        _mm_storeu_si128(s, add ? _mm_add_epi32(cur, v[j]) : _mm_sub_epi32(cur, v[j]));
+                    }
+                }
+#endif
+                for (; x < width; x++)
+                    sums[x] += add ? row[x] : -(int32_t)row[x];
+            };
+
+            auto emit = [&](uint8_t* out) {
+                int x = 0;
+#if defined(WAAVS_BLUR_SSE2)
+                const __m128 vinv = _mm_set1_ps(inv);
+                for (; x + 16 <= width; x += 16)
+                {
+                    __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x))), vinv));
+                    __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x + 4))), vinv));
+                    __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x + 8))), vinv));
+                    __m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(sums + x + 12))), vinv));
+                    _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+                }
+#endif
+                for (; x < width; x++)
+                    out[x] = (uint8_t)std::nearbyint(sums[x] * inv);
+            };
+
+            for (int k = 0; k <= std::min(right, n - 1); k++)
+                accumulate(src + (intptr_t)k * stride, true);
+
+            for (int i = 0; i < n; i++)
+            {
+                emit(dst + (intptr_t)i * stride);
+
+                if (i + 1 + right < n)
+                    accumulate(src + (intptr_t)(i + 1 + right) * stride, true);
+                if (i - left >= 0)
+                    accumulate(src + (intptr_t)(i - left) * stride, false);
+            }
+        }
+
+        // dst row i = sum of w[k] * src row (i + k), for 'n' output rows
+        static void kernelColumns(const uint32_t* src, uint32_t* dst, int n, int width, size_t stride, const float* w, int taps, float* acc)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                memset(acc, 0, sizeof(float) * 4 * width);
+
+                for (int k = 0; k < taps; k++)
+                {
+                    const uint32_t* row = (const uint32_t*)((const uint8_t*)src + (intptr_t)(i + k) * stride);
+                    int x = 0;
+#if defined(WAAVS_BLUR_SSE2)
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128 vw = _mm_set1_ps(w[k]);
+                    for (; x + 4 <= width; x += 4)
+                    {
+                        __m128i p = _mm_loadu_si128((const __m128i*)(row + x));
+                        __m128i lo = _mm_unpacklo_epi8(p, zero);
+                        __m128i hi = _mm_unpackhi_epi8(p, zero);
+                        __m128i v[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+
+                        for (int j = 0; j < 4; j++)
+                        {
+                            float* a = acc + (x + j) * 4;
+                            _mm_storeu_ps(a, _mm_add_ps(_mm_loadu_ps(a), _mm_mul_ps(vw, _mm_cvtepi32_ps(v[j]))));
+                        }
+                    }
+#endif
+                    for (; x < width; x++)
+                        for (int c = 0; c < 4; c++)
+                            acc[x * 4 + c] += w[k] * (float)((row[x] >> (c * 8)) & 0xff);
+                }
+
+                uint32_t* out = (uint32_t*)((uint8_t*)dst + (intptr_t)i * stride);
+                for (int x = 0; x < width; x++)
+                {
+                    uint32_t p = 0;
+                    for (int c = 0; c < 4; c++)
+                        p |= (uint32_t)std::nearbyint(std::min(255.0f, acc[x * 4 + c])) << (c * 8);
+                    out[x] = p;
+                }
+            }
+        }
+
+        static void kernelColumns(const uint8_t* src, uint8_t* dst, int n, int width, size_t stride, const float* w, int taps, float* acc)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                memset(acc, 0, sizeof(float) * width);
+
+                for (int k = 0; k < taps; k++)
+                {
+                    const uint8_t* row = src + (intptr_t)(i + k) * stride;
+                    for (int x = 0; x < width; x++)
+                        acc[x] += w[k] * row[x];
+                }
+
+                uint8_t* out = dst + (intptr_t)i * stride;
+                for (int x = 0; x < width; x++)
+                    out[x] = (uint8_t)std::nearbyint(std::min(255.0f, acc[x]));
+            }
+        }
+
+
+        //==================================================
+        // Whole passes, for either pixel type
+        //==================================================
+
+        // Blur one line, of n = before + count + after pixels, in place,
+        // using 'tmp' (also n long).  The middle 'count' pixels are right.
+        template <typename Pixel>
+        static void blurLine(Pixel* line, Pixel* tmp, int n, const BlurKernel& k)
+        {
+            if (k.fExact)
+            {
+                int taps = (int)k.fWeights.size();
+                kernelLine(line, tmp + k.fRadius, n - taps + 1, k.fWeights.data(), taps);
+                memcpy(line + k.fRadius, tmp + k.fRadius, sizeof(Pixel) * (n - taps + 1));
+                return;
+            }
+
+            Pixel* a = line;
+            Pixel* b = tmp;
+            for (int p = 0; p < k.fPasses; p++)
+            {
+                boxLine(a, b, n, k.fLeft[p], k.fRight[p]);
+                std::swap(a, b);
+            }
+
+            if (a != line)
+                memcpy(line, a, sizeof(Pixel) * n);
+        }
+
+        // Same thing, down a strip of columns, 'width' pixels wide
+        template <typename Pixel>
+        static void blurColumns(Pixel* strip, Pixel* tmp, int n, int width, const BlurKernel& k, std::vector<int32_t>& sums, std::vector<float>& acc)
+        {
+            size_t stride = sizeof(Pixel) * width;
+            int channels = (sizeof(Pixel) == 4) ? 4 : 1;
+
+            if (k.fExact)
+            {
+                int taps = (int)k.fWeights.size();
+                acc.resize((size_t)width * channels);
+                kernelColumns(strip, tmp + (size_t)k.fRadius * width, n - taps + 1, width, stride, k.fWeights.data(), taps, acc.data());
+                memcpy(strip + (size_t)k.fRadius * width, tmp + (size_t)k.fRadius * width, stride * (n - taps + 1));
+                return;
+            }
+
+            sums.resize((size_t)width * channels);
+
+            Pixel* a = strip;
+            Pixel* b = tmp;
+            for (int p = 0; p < k.fPasses; p++)
+            {
+                boxColumns(a, b, n, width, stride, k.fLeft[p], k.fRight[p], sums.data());
+                std::swap(a, b);
+            }
+
+            if (a != strip)
+                memcpy(strip, a, stride * n);
+        }
+
+        template <typename Pixel>
+        static void blurImage(const FilterImage& in, const BlurKernel& kx, const BlurKernel& ky, FilterImage& out, const BLRectI& hRect)
+        {
+            const BLRectI& o = out.fRect;
+            int xBefore = kx.reachBefore();
+            int xAfter = kx.reachAfter();
+            int yBefore = ky.reachBefore();
+            int yAfter = ky.reachAfter();
+
+            // Horizontal, into 'h', which has the output's columns,
+            // and every row of the input that reaches the output
+            FilterImage h{};
+            if (!h.allocate(hRect, (BLFormat)in.fImage.format(), false))
+                return;
+
+            int lineLength = xBefore + o.w + xAfter;
+            int lineStart = o.x - xBefore;
+            BLRectI inCols = FilterPixels::intersect(BLRectI(lineStart, in.fRect.y, lineLength, in.fRect.h), in.fRect);
+
+            FilterPixels::forEachBand(hRect, [&](int y0, int y1) {
+                std::vector<Pixel> line(lineLength);
+                std::vector<Pixel> tmp(lineLength);
+
+                for (int y = y0; y < y1; y++)
+                {
+                    std::fill(line.begin(), line.end(), Pixel{});
+                    if (inCols.w > 0)
+                        memcpy(line.data() + (inCols.x - lineStart), (const Pixel*)in.row(y) + (inCols.x - in.fRect.x), sizeof(Pixel) * inCols.w);
+
+                    blurLine(line.data(), tmp.data(), lineLength, kx);
+
+                    memcpy(h.row(y), line.data() + xBefore, sizeof(Pixel) * o.w);
+                }
+            });
+
+            // Vertical, a strip of columns at a time
+            if (!out.allocate(o, (BLFormat)in.fImage.format(), false))
+                return;
+
+            int colLength = yBefore + o.h + yAfter;
+            int colStart = o.y - yBefore;
+            int stripPixels = (sizeof(Pixel) == 4) ? kStripPixels32 : kStripPixels8;
+            size_t nStrips = (size_t)((o.w + stripPixels - 1) / stripPixels);
+
+            auto doStrip = [&](size_t s) {
+                int x0 = o.x + (int)s * stripPixels;
+                int width = std::min(stripPixels, o.x + o.w - x0);
+
+                std::vector<Pixel> strip((size_t)width * colLength, Pixel{});
+                std::vector<Pixel> tmp((size_t)width * colLength);
+                std::vector<int32_t> sums{};
+                std::vector<float> acc{};
+
+                for (int y = std::max(colStart, hRect.y); y < std::min(colStart + colLength, hRect.y + hRect.h); y++)
+                    memcpy(strip.data() + (size_t)(y - colStart) * width, (const Pixel*)h.row(y) + (x0 - o.x), sizeof(Pixel) * width);
+
+                blurColumns(strip.data(), tmp.data(), colLength, width, ky, sums, acc);
+
+                for (int y = 0; y < o.h; y++)
+                    memcpy((Pixel*)out.row(o.y + y) + (x0 - o.x), strip.data() + (size_t)(yBefore + y) * width, sizeof(Pixel) * width);
+            };
+
+            if ((size_t)o.w * (size_t)o.h < FilterPixels::kMinParallelPixels)
+            {
+                for (size_t s = 0; s < nStrips; s++)
+                    doStrip(s);
+            }
+            else {
+                WorkerPool::pool().parallelFor(nStrips, doStrip);
+            }
+        }
+
+        // blur
+        // Produce out.fRect of 'in', blurred by the two kernels.  The
+        // output has the same format as the input.
+        static void blur(const FilterImage& in, const BlurKernel& kx, const BlurKernel& ky, FilterImage& out)
+        {
+            if (in.isEmpty() || FilterPixels::isEmpty(out.fRect))
+                return;
+
+            // Only rows of the input that reach the output matter
+            const BLRectI& o = out.fRect;
+            BLRectI rows(o.x, o.y - ky.reachBefore(), o.w, o.h + ky.reachBefore() + ky.reachAfter());
+            BLRectI hRect = FilterPixels::intersect(rows, BLRectI(o.x, in.fRect.y, o.w, in.fRect.h));
+            if (FilterPixels::isEmpty(hRect))
+                return;
+
+            if (in.isAlphaOnly())
+                blurImage<uint8_t>(in, kx, ky, out, hRect);
+            else
+                blurImage<uint32_t>(in, kx, ky, out, hRect);
+
+            // Make up for a capped deviation.  Premultiplied channels
+            // all scale the same, so the pixels stay valid.
+            double scale = kx.fScale * ky.fScale;
+            if ((scale < 1.0) && !out.isEmpty())
+            {
+                size_t rowBytes = (size_t)o.w * out.bytesPerPixel();
+                for (int y = o.y; y < o.y + o.h; y++)
+                {
+                    uint8_t* row = (uint8_t*)out.row(y);
+                    for (size_t i = 0; i < rowBytes; i++)
+                        row[i] = (uint8_t)std::nearbyint(row[i] * scale);
+                }
+            }
+        }
+    };
+}
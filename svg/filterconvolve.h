@@ -0,0 +1,401 @@
+#pragma once
+
+//
+// Neighbourhood kernels, for feConvolveMatrix and feDisplacementMap
+//
+// Both work in tiles, spread across the worker pool.
+//
+// A convolution first gathers what a tile reads into a buffer of float
+// pixels, with the edgeMode applied as it goes; duplicated, wrapped, or
+// transparent beyond the filter region, and transparent beyond what the
+// input has.  The inner loop then reads straight from the buffer, with
+// the four channels of a pixel in the lanes of a vector, and never has
+// to ask where the edge is.
+//
+// Displacement reads the map a tile at a time, works out the offsets
+// four pixels at a time, and copies the displaced pixels.
+//
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "filterengine.h"
+#include "filterkernels.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_CONVOLVE_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    enum FilterEdgeMode : int
+    {
+        FILTER_EDGE_DUPLICATE = 0,
+        FILTER_EDGE_WRAP,
+        FILTER_EDGE_NONE,
+    };
+
+    struct ConvolveParams
+    {
+        int fOrderX{ 3 };
+        int fOrderY{ 3 };
+        std::vector<float> fKernel{};       // fOrderX * fOrderY, as given, row by row
+        float fDivisor{ 1 };
+        float fBias{ 0 };
+        int fTargetX{ 1 };
+        int fTargetY{ 1 };
+        int fEdgeMode{ FILTER_EDGE_DUPLICATE };
+        bool fPreserveAlpha{ false };
+    };
+
+
+    struct ConvolveMatrix
+    {
+        // Where a pixel outside of 'bounds' comes from, or
+        // false if it's transparent
+        static inline bool edgeSource(int edgeMode, const BLRectI& bounds, int& x, int& y)
+        {
+            if ((x >= bounds.x) && (y >= bounds.y) && (x < bounds.x + bounds.w) && (y < bounds.y + bounds.h))
+                return true;
+
+            switch (edgeMode)
+            {
+            case FILTER_EDGE_DUPLICATE:
+                x = std::min(bounds.x + bounds.w - 1, std::max(bounds.x, x));
+                y = std::min(bounds.y + bounds.h - 1, std::max(bounds.y, y));
+                return true;
+
+            case FILTER_EDGE_WRAP:
+                x = bounds.x + (((x - bounds.x) % bounds.w) + bounds.w) % bounds.w;
+                y = bounds.y + (((y - bounds.y) % bounds.h) + bounds.h) % bounds.h;
+                return true;
+            }
+
+            return false;
+        }
+
+        // A source pixel, as floats B, G, R, A, 0..1, unpremultiplied
+        // when the alpha is to be preserved
+        static inline void sourcePixel(const FilterImage& in, const ConvolveParams& p, const BLRectI& bounds, int x, int y, float* px)
+        {
+            px[0] = px[1] = px[2] = px[3] = 0;
+
+            if (!edgeSource(p.fEdgeMode, bounds, x, y))
+                return;
+            if (in.isEmpty() || (x < in.fRect.x) || (y < in.fRect.y) || (x >= in.fRect.x + in.fRect.w) || (y >= in.fRect.y + in.fRect.h))
+                return;
+
+            toFloats(in.pixels(x, y)[0], p.fPreserveAlpha, px);
+        }
+
+        static inline void toFloats(uint32_t c, bool preserveAlpha, float* px)
+        {
+            float a = (float)(c >> 24);
+            float scale = 1.0f / 255.0f;
+            if (preserveAlpha)
+                scale = (a > 0) ? 1.0f / a : 0.0f;
+
+            px[0] = (float)(c & 0xff) * scale;
+            px[1] = (float)((c >> 8) & 0xff) * scale;
+            px[2] = (float)((c >> 16) & 0xff) * scale;
+            px[3] = a * (1.0f / 255.0f);
+        }
+
+        // The result from the sums, as a premultiplied pixel.  With the
+        // alpha preserved, the original alpha is used instead of its sum.
+        static inline uint32_t toPixel(const ConvolveParams& p, const float* sum, uint32_t original)
+        {
+            float c[4];
+            for (int k = 0; k < 4; k++)
+                c[k] = std::min(1.0f, std::max(0.0f, sum[k] / p.fDivisor + p.fBias));
+
+            uint32_t a;
+            if (p.fPreserveAlpha)
+            {
+                a = original >> 24;
+                for (int k = 0; k < 3; k++)
+                    c[k] *= a * (1.0f / 255.0f);
+            }
+            else
+            {
+                a = (uint32_t)std::lround(c[3] * 255.0f);
+                for (int k = 0; k < 3; k++)
+                    c[k] = std::min(c[k], c[3]);
+            }
+
+            return (a << 24) | ((uint32_t)std::lround(c[2] * 255.0f) << 16) | ((uint32_t)std::lround(c[1] * 255.0f) << 8) | (uint32_t)std::lround(c[0] * 255.0f);
+        }
+
+        // convolvePixelReference
+        // Straight from the specification's formula, for any one pixel.
+        // The kernel is applied rotated by 180 degrees.
+        static uint32_t convolvePixelReference(const ConvolveParams& p, const FilterImage& in, const BLRectI& bounds, int x, int y)
+        {
+            float sum[4] = { 0, 0, 0, 0 };
+
+            for (int i = 0; i < p.fOrderY; i++)
+            {
+                for (int j = 0; j < p.fOrderX; j++)
+                {
+                    float px[4];
+                    sourcePixel(in, p, bounds, x - p.fTargetX + j, y - p.fTargetY + i, px);
+
+                    float k = p.fKernel[(size_t)(p.fOrderY - i - 1) * p.fOrderX + (p.fOrderX - j - 1)];
+                    for (int c = 0; c < 4; c++)
+                        sum[c] += px[c] * k;
+                }
+            }
+
+            uint32_t original = FilterPixels::alphaAt(in, x, y) << 24;
+            return toPixel(p, sum, original);
+        }
+
+        // convolveTile
+        // Gather what 'tile' reads into 'buf', then run the kernel over it
+        static void convolveTile(const ConvolveParams& p, const FilterImage& in, const BLRectI& bounds, const BLRectI& tile, FilterImage& out, std::vector<float>& buf)
+        {
+            int bw = tile.w + p.fOrderX - 1;
+            int bh = tile.h + p.fOrderY - 1;
+            int x0 = tile.x - p.fTargetX;
+            int y0 = tile.y - p.fTargetY;
+
+            // Only the parts of rows that fall outside of the filter
+            // region, or the input, need to go through edgeSource()
+            int inX0 = std::max(bounds.x, in.fRect.x) - x0;
+            int inX1 = std::min(bounds.x + bounds.w, in.fRect.x + in.fRect.w) - x0;
+
+            buf.resize((size_t)bw * bh * 4);
+            for (int y = 0; y < bh; y++)
+            {
+                float* d = buf.data() + (size_t)y * bw * 4;
+                int sy = y0 + y;
+
+                int xa = bw;
+                int xb = bw;
+                if (!in.isEmpty() && (sy >= bounds.y) && (sy < bounds.y + bounds.h) && (sy >= in.fRect.y) && (sy < in.fRect.y + in.fRect.h))
+                {
+                    xa = std::min(bw, std::max(0, inX0));
+                    xb = std::max(xa, std::min(bw, inX1));
+                }
+
+                for (int x = 0; x < xa; x++)
+                    sourcePixel(in, p, bounds, x0 + x, sy, d + x * 4);
+
+                if (xb > xa)
+                {
+                    const uint32_t* s = in.pixels(x0 + xa, sy);
+                    for (int x = xa; x < xb; x++)
+                        toFloats(s[x - xa], p.fPreserveAlpha, d + x * 4);
+                }
+
+                for (int x = xb; x < bw; x++)
+                    sourcePixel(in, p, bounds, x0 + x, sy, d + x * 4);
+            }
+
+            // The kernel, turned around, so it lines up with the buffer
+            std::vector<float> k((size_t)p.fOrderX * p.fOrderY);
+            for (int i = 0; i < p.fOrderY; i++)
+                for (int j = 0; j < p.fOrderX; j++)
+                    k[(size_t)i * p.fOrderX + j] = p.fKernel[(size_t)(p.fOrderY - i - 1) * p.fOrderX + (p.fOrderX - j - 1)];
+
+#if defined(WAAVS_CONVOLVE_SSE2)
+            const __m128 invDivisor = _mm_set1_ps(1.0f / p.fDivisor);
+            const __m128 bias = _mm_set1_ps(p.fBias);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 v255 = _mm_set1_ps(255.0f);
+            const __m128 rgbMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+#endif
+
+            for (int y = 0; y < tile.h; y++)
+            {
+                uint32_t* dst = out.pixels(tile.x, tile.y + y);
+
+                // the pixel itself, for its alpha, is at the target offset
+                const float* self = buf.data() + ((size_t)(y + p.fTargetY) * bw + p.fTargetX) * 4;
+
+                for (int x = 0; x < tile.w; x++)
+                {
+#if defined(WAAVS_CONVOLVE_SSE2)
+                    __m128 acc = _mm_setzero_ps();
+                    for (int i = 0; i < p.fOrderY; i++)
+                    {
+                        const float* s = buf.data() + ((size_t)(y + i) * bw + x) * 4;
+                        const float* kr = k.data() + (size_t)i * p.fOrderX;
+                        for (int j = 0; j < p.fOrderX; j++)
+                            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(s + j * 4), _mm_set1_ps(kr[j])));
+                    }
+
+                    __m128 c = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(acc, invDivisor), bias), zero), one);
+                    if (p.fPreserveAlpha)
+                    {
+                        __m128 a = _mm_set1_ps(self[x * 4 + 3]);
+                        c = _mm_or_ps(_mm_and_ps(rgbMask, _mm_mul_ps(c, a)), _mm_andnot_ps(rgbMask, a));
+                    }
+                    else
+                    {
+                        c = _mm_min_ps(c, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)));
+                    }
+
+                    __m128i iv = _mm_cvtps_epi32(_mm_mul_ps(c, v255));
+                    iv = _mm_packs_epi32(iv, iv);
+                    dst[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(iv, iv));
+#else
+                    float sum[4] = { 0, 0, 0, 0 };
+                    for (int i = 0; i < p.fOrderY; i++)
+                    {
+                        const float* s = buf.data() + ((size_t)(y + i) * bw + x) * 4;
+                        const float* kr = k.data() + (size_t)i * p.fOrderX;
+                        for (int j = 0; j < p.fOrderX; j++)
+                            for (int c = 0; c < 4; c++)
+                                sum[c] += s[j * 4 + c] * kr[j];
+                    }
+
+                    uint32_t original = (uint32_t)std::lround(self[x * 4 + 3] * 255.0f) << 24;
+                    dst[x] = toPixel(p, sum, original);
+#endif
+                }
+            }
+        }
+
+        static bool render(const ConvolveParams& p, const FilterImage& in, const BLRectI& bounds, FilterImage& out)
+        {
+            if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, false))
+                return false;
+
+            FilterPixels::forEachTile(out.fRect, [&](const BLRectI& tile) {
+                std::vector<float> buf;
+                convolveTile(p, in, bounds, tile, out, buf);
+            });
+
+            return true;
+        }
+    };
+
+
+    struct DisplacementParams
+    {
+        double fScaleX{ 0 };                // in filter space pixels
+        double fScaleY{ 0 };
+        int fChannelX{ 3 };                 // 0..3 for R, G, B, A
+        int fChannelY{ 3 };
+    };
+
+    struct DisplacementMap
+    {
+        static inline uint32_t samplePixel(const FilterImage& in, int x, int y)
+        {
+            if (in.isEmpty() || (x < in.fRect.x) || (y < in.fRect.y) || (x >= in.fRect.x + in.fRect.w) || (y >= in.fRect.y + in.fRect.h))
+                return 0;
+
+            return in.pixels(x, y)[0];
+        }
+
+        // A channel of the map, unpremultiplied, 0..255
+        static inline uint32_t mapChannel(uint32_t c, int channel, const uint32_t* recip)
+        {
+            uint32_t a = c >> 24;
+            if (channel == 3)
+                return a;
+            if (a == 0)
+                return 0;
+
+            uint32_t v = (c >> (16 - channel * 8)) & 0xff;
+            return (a == 255) ? v : FilterKernels::unpremultiply(v, a, recip);
+        }
+
+        // Straight from the specification, nearest pixel
+        static uint32_t displacePixelReference(const DisplacementParams& p, const FilterImage& in, const FilterImage& map, int x, int y)
+        {
+            uint32_t m = samplePixel(map, x, y);
+            uint32_t a = m >> 24;
+
+            auto channel = [m, a](int c) {
+                if (c == 3)
+                    return a / 255.0;
+                return (a > 0) ? std::min(1.0, ((m >> (16 - c * 8)) & 0xff) / (double)a) : 0.0;
+            };
+
+            double dx = p.fScaleX * (channel(p.fChannelX) - 0.5);
+            double dy = p.fScaleY * (channel(p.fChannelY) - 0.5);
+
+            return samplePixel(in, (int)std::floor(x + dx + 0.5), (int)std::floor(y + dy + 0.5));
+        }
+
+        static void displaceTile(const DisplacementParams& p, const FilterImage& in, const FilterImage& map, const BLRectI& tile, FilterImage& out)
+        {
+            const uint32_t* recip = FilterKernels::unpremultiplyTable();
+
+            // offset = scale * (c / 255 - 0.5), and rounded to a pixel
+            float sx = (float)(p.fScaleX / 255.0);
+            float sy = (float)(p.fScaleY / 255.0);
+            float ox = (float)(-0.5 * p.fScaleX) + 0.5f;
+            float oy = (float)(-0.5 * p.fScaleY) + 0.5f;
+
+            for (int y = tile.y; y < tile.y + tile.h; y++)
+            {
+                uint32_t* dst = out.pixels(tile.x, y);
+                int x = 0;
+
+#if defined(WAAVS_CONVOLVE_SSE2)
+                const __m128 vsx = _mm_set1_ps(sx);
+                const __m128 vsy = _mm_set1_ps(sy);
+                const __m128 vox = _mm_set1_ps(ox);
+                const __m128 voy = _mm_set1_ps(oy);
+                const __m128 laneX = _mm_setr_ps(0, 1, 2, 3);
+
+                for (; x + 4 <= tile.w; x += 4)
+                {
+                    alignas(16) float cx[4], cy[4];
+                    for (int i = 0; i < 4; i++)
+                    {
+                        uint32_t m = samplePixel(map, tile.x + x + i, y);
+                        cx[i] = (float)mapChannel(m, p.fChannelX, recip);
+                        cy[i] = (float)mapChannel(m, p.fChannelY, recip);
+                    }
+
+                    __m128 px = _mm_add_ps(_mm_set1_ps((float)(tile.x + x)), laneX);
+                    __m128 fx = _mm_add_ps(_mm_add_ps(px, _mm_mul_ps(_mm_load_ps(cx), vsx)), vox);
+                    __m128 fy = _mm_add_ps(_mm_add_ps(_mm_set1_ps((float)y), _mm_mul_ps(_mm_load_ps(cy), vsy)), voy);
+
+                    // floor, as truncating rounds negatives the wrong way
+                    __m128i ix = _mm_cvttps_epi32(fx);
+                    __m128i iy = _mm_cvttps_epi32(fy);
+                    ix = _mm_add_epi32(ix, _mm_castps_si128(_mm_cmplt_ps(fx, _mm_cvtepi32_ps(ix))));
+                    iy = _mm_add_epi32(iy, _mm_castps_si128(_mm_cmplt_ps(fy, _mm_cvtepi32_ps(iy))));
+
+                    alignas(16) int32_t sxs[4], sys[4];
+                    _mm_store_si128((__m128i*)sxs, ix);
+                    _mm_store_si128((__m128i*)sys, iy);
+
+                    for (int i = 0; i < 4; i++)
+                        dst[x + i] = samplePixel(in, sxs[i], sys[i]);
+                }
+#endif
+
+                for (; x < tile.w; x++)
+                {
+                    uint32_t m = samplePixel(map, tile.x + x, y);
+                    float fx = (tile.x + x) + mapChannel(m, p.fChannelX, recip) * sx + ox;
+                    float fy = y + mapChannel(m, p.fChannelY, recip) * sy + oy;
+                    dst[x] = samplePixel(in, (int)std::floor(fx), (int)std::floor(fy));
+                }
+            }
+        }
+
+        static bool render(const DisplacementParams& p, const FilterImage& in, const FilterImage& map, FilterImage& out)
+        {
+            if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, false))
+                return false;
+
+            FilterPixels::forEachTile(out.fRect, [&](const BLRectI& tile) {
+                displaceTile(p, in, map, tile, out);
+            });
+
+            return true;
+        }
+    };
+}
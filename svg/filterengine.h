@@ -0,0 +1,677 @@
+#pragma once
+
+//
+// Filter graph execution
+//
+// A filter is a small graph of primitives, each one reading an image
+// or two (SourceGraphic, SourceAlpha, or the result of an earlier
+// primitive), and producing one of its own.  The plan for running the
+// graph is made once, when the filter is bound.  The 'in', 'in2' and
+// 'result' names are resolved to slot numbers, the primitives are
+// grouped into waves, each of which only depends on earlier waves, and
+// we note after which wave each slot is no longer read.
+//
+// Running the plan first works backward, from the part of the filter
+// region that shows up on the device, to find the smallest area each
+// primitive has to produce, and so what it needs from its inputs.
+// Nothing is computed, or allocated, that won't be seen, and primitives
+// whose output isn't needed at all are skipped.  Then the waves run in
+// order, the primitives within a wave in parallel on the worker pool,
+// and each intermediate buffer goes back to the SurfacePool as soon as
+// the last primitive reading it has finished.
+//
+// All the work is done in "filter space", which is device pixels,
+// offset so the filter region starts at (0,0).  Under a transform that
+// rotates or skews, the primitives still work along the device axes.
+//
+
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "blend2d.h"
+#include "bspan.h"
+#include "surfacepool.h"
+#include "workerpool.h"
+
+namespace waavs
+{
+    enum FilterColorSpace : int
+    {
+        FILTER_COLORSPACE_SRGB = 0,
+        FILTER_COLORSPACE_LINEARRGB = 1,
+    };
+
+
+    // FilterImage
+    // A buffer of pixels, and where it sits in filter space.  Buffers
+    // are PRGB32, or A8 when only the alpha matters, like SourceAlpha,
+    // and whatever is derived from it.  Anything outside of fRect is
+    // transparent black, and an empty image is transparent everywhere.
+    struct FilterImage
+    {
+        BLImage fImage{};
+        BLImageData fData{};
+        BLRectI fRect{};
+        int fColorSpace{ FILTER_COLORSPACE_SRGB };
+
+        bool isEmpty() const { return (fRect.w <= 0) || (fRect.h <= 0) || fImage.empty(); }
+        bool isAlphaOnly() const { return fImage.format() == BL_FORMAT_A8; }
+        size_t bytesPerPixel() const { return isAlphaOnly() ? 1 : 4; }
+
+        // Borrow pixels from the pool to cover 'area', zeroed unless told otherwise
+        bool allocate(const BLRectI& area, BLFormat format, bool clear = true)
+        {
+            // 'area' is often our own fRect, which reset() clears
+            BLRectI r = area;
+            reset();
+
+            if (!SurfacePool::pool().acquire(fImage, r.w, r.h, format))
+                return false;
+
+            if (fImage.makeMutable(&fData) != BL_SUCCESS)
+            {
+                reset();
+                return false;
+            }
+
+            fRect = r;
+
+            if (clear)
+            {
+                size_t rowBytes = (size_t)r.w * bytesPerPixel();
+                for (int y = 0; y < r.h; y++)
+                    memset((uint8_t*)fData.pixelData + (intptr_t)y * fData.stride, 0, rowBytes);
+            }
+
+            return true;
+        }
+
+        // Pick up the pixel pointer again, after something
+        // else (like a BLContext) has been working on the image
+        void refresh()
+        {
+            if (!fImage.empty())
+                fImage.makeMutable(&fData);
+        }
+
+        void reset()
+        {
+            fImage.reset();
+            fData = BLImageData{};
+            fRect = BLRectI{};
+        }
+
+        // Start of a row, 'y' being in filter space
+        uint8_t* row(int y) { return (uint8_t*)fData.pixelData + (intptr_t)(y - fRect.y) * fData.stride; }
+        const uint8_t* row(int y) const { return (const uint8_t*)fData.pixelData + (intptr_t)(y - fRect.y) * fData.stride; }
+
+        // Pixel at 'x' on a row, 'x' being in filter space
+        uint32_t* pixels(int x, int y) { return (uint32_t*)row(y) + (x - fRect.x); }
+        const uint32_t* pixels(int x, int y) const { return (const uint32_t*)row(y) + (x - fRect.x); }
+    };
+
+
+    // FilterSpace
+    // How the user space of the element being filtered, and of the
+    // filter's attributes, relates to filter space.
+    struct FilterSpace
+    {
+        BLRectI fArea{};                    // the filter region, in device space
+        BLMatrix2D fUserToFilter{};         // user space to filter space
+        BLPoint fScale{ 1, 1 };             // filter space pixels per user unit, along each axis
+        BLRect fRegion{};                   // the filter region, in user space
+        BLRect fObjectBox{};                // bounding box of the element being filtered
+        BLRect fViewport{};                 // for percentages in user space units
+        bool fPrimitiveObjectBox{ false };  // primitiveUnits="objectBoundingBox"
+
+        BLRectI bounds() const { return BLRectI(0, 0, fArea.w, fArea.h); }
+
+        // A length given by a primitive, in filter space pixels
+        double lengthX(double v) const { return (fPrimitiveObjectBox ? v * fObjectBox.w : v) * fScale.x; }
+        double lengthY(double v) const { return (fPrimitiveObjectBox ? v * fObjectBox.h : v) * fScale.y; }
+
+        // The filter space pixels covering a rectangle in user space
+        BLRectI mapUserRect(const BLRect& r) const
+        {
+            BLPoint pts[4] = { {r.x, r.y}, {r.x + r.w, r.y}, {r.x + r.w, r.y + r.h}, {r.x, r.y + r.h} };
+
+            BLBox box{};
+            for (int i = 0; i < 4; i++)
+            {
+                BLPoint p = fUserToFilter.mapPoint(pts[i]);
+                if (i == 0) {
+                    box = BLBox(p.x, p.y, p.x, p.y);
+                }
+                else {
+                    box.x0 = std::min(box.x0, p.x); box.y0 = std::min(box.y0, p.y);
+                    box.x1 = std::max(box.x1, p.x); box.y1 = std::max(box.y1, p.y);
+                }
+            }
+
+            // clamp before converting, so wild values can't overflow
+            const double lim = 1 << 28;
+            int x0 = (int)std::floor(std::max(-lim, box.x0));
+            int y0 = (int)std::floor(std::max(-lim, box.y0));
+            int x1 = (int)std::ceil(std::min(lim, box.x1));
+            int y1 = (int)std::ceil(std::min(lim, box.y1));
+
+            return BLRectI(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+        }
+    };
+
+
+    // IFilterPrimitive
+    // What the engine needs to know about a primitive
+    struct IFilterPrimitive
+    {
+        virtual ~IFilterPrimitive() = default;
+
+        virtual size_t filterInputCount() const { return 1; }
+        virtual ByteSpan filterInputName(size_t idx) const = 0;
+        virtual ByteSpan filterResultName() const = 0;
+
+        // The color space the primitive works in, given
+        // the one it would inherit from the filter
+        virtual int filterColorSpace(int inherited) const { return inherited; }
+
+        // Whether an input can be handed over as A8.  Otherwise
+        // alpha only inputs are expanded to PRGB32 first.
+        virtual bool filterAcceptsAlphaOnly(size_t) const { return false; }
+
+        // Where the primitive's output is allowed to go
+        virtual BLRectI filterSubregion(const FilterSpace& space) const { return space.bounds(); }
+
+        // The area of an input needed to produce 'outRect'
+        virtual BLRectI filterInputRegion(size_t, const BLRectI& outRect, const FilterSpace&) const { return outRect; }
+
+        // Produce 'out', which arrives with fRect and fColorSpace set,
+        // from the inputs.  Inputs may be empty, and must not be altered.
+        // Different primitives run on different threads at the same time.
+        virtual void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) = 0;
+    };
+
+
+    // FilterPixels
+    // Pixel operations the engine, and the simpler primitives, share
+    struct FilterPixels
+    {
+        static constexpr int kMinBandRows = 8;
+        static constexpr size_t kMinParallelPixels = 16384;
+
+        static bool isEmpty(const BLRectI& r) { return (r.w <= 0) || (r.h <= 0); }
+
+        static BLRectI intersect(const BLRectI& a, const BLRectI& b)
+        {
+            int x0 = std::max(a.x, b.x);
+            int y0 = std::max(a.y, b.y);
+            int x1 = std::min(a.x + a.w, b.x + b.w);
+            int y1 = std::min(a.y + a.h, b.y + b.h);
+
+            if ((x1 <= x0) || (y1 <= y0))
+                return BLRectI{};
+
+            return BLRectI(x0, y0, x1 - x0, y1 - y0);
+        }
+
+        static BLRectI unite(const BLRectI& a, const BLRectI& b)
+        {
+            if (isEmpty(a))
+                return b;
+            if (isEmpty(b))
+                return a;
+
+            int x0 = std::min(a.x, b.x);
+            int y0 = std::min(a.y, b.y);
+            int x1 = std::max(a.x + a.w, b.x + b.w);
+            int y1 = std::max(a.y + a.h, b.y + b.h);
+
+            return BLRectI(x0, y0, x1 - x0, y1 - y0);
+        }
+
+        // forEachBand
+        // Call fn(y0, y1) for bands of the rows of 'r', spread across
+        // the worker pool.  Small areas are done in one go.
+        static void forEachBand(const BLRectI& r, const std::function<void(int, int)>& fn)
+        {
+            if (isEmpty(r))
+                return;
+
+            size_t bands = 1;
+            if ((size_t)r.w * (size_t)r.h >= kMinParallelPixels)
+                bands = std::min((WorkerPool::pool().threadCount() + 1) * 2, (size_t)std::max(1, r.h / kMinBandRows));
+
+            if (bands <= 1)
+            {
+                fn(r.y, r.y + r.h);
+                return;
+            }
+
+            WorkerPool::pool().parallelFor(bands, [&r, &fn, bands](size_t b) {
+                int y0 = r.y + (int)(((int64_t)r.h * (int64_t)b) / (int64_t)bands);
+                int y1 = r.y + (int)(((int64_t)r.h * (int64_t)(b + 1)) / (int64_t)bands);
+                fn(y0, y1);
+            });
+        }
+
+        // forEachTile
+        // Call fn(tile) for square tiles of 'r', spread across the worker
+        // pool, for kernels that read a neighbourhood around each pixel,
+        // so what they read stays in cache.
+        static constexpr int kTileSize = 64;
+
+        static void forEachTile(const BLRectI& r, const std::function<void(const BLRectI&)>& fn)
+        {
+            if (isEmpty(r))
+                return;
+
+            int tilesX = (r.w + kTileSize - 1) / kTileSize;
+            int tilesY = (r.h + kTileSize - 1) / kTileSize;
+            size_t count = (size_t)tilesX * (size_t)tilesY;
+
+            auto tileAt = [&r, tilesX](size_t i) {
+                int tx = (int)(i % (size_t)tilesX) * kTileSize;
+                int ty = (int)(i / (size_t)tilesX) * kTileSize;
+                return BLRectI(r.x + tx, r.y + ty, std::min(kTileSize, r.w - tx), std::min(kTileSize, r.h - ty));
+            };
+
+            if ((count == 1) || ((size_t)r.w * (size_t)r.h < kMinParallelPixels))
+            {
+                for (size_t i = 0; i < count; i++)
+                    fn(tileAt(i));
+                return;
+            }
+
+            WorkerPool::pool().parallelFor(count, [&fn, &tileAt](size_t i) {
+                fn(tileAt(i));
+            });
+        }
+
+        // Alpha of a pixel, A8 or PRGB32, transparent outside of fRect
+        static uint32_t alphaAt(const FilterImage& img, int x, int y)
+        {
+            if (img.isEmpty() || (x < img.fRect.x) || (y < img.fRect.y) || (x >= img.fRect.x + img.fRect.w) || (y >= img.fRect.y + img.fRect.h))
+                return 0;
+
+            if (img.isAlphaOnly())
+                return img.row(y)[x - img.fRect.x];
+
+            return img.pixels(x, y)[0] >> 24;
+        }
+
+        // copy
+        // dst(x, y) = src(x - dx, y - dy), wherever both exist, converting
+        // between A8 and PRGB32 as needed.  The rest of dst is left alone.
+        static void copy(const FilterImage& src, FilterImage& dst, int dx = 0, int dy = 0)
+        {
+            if (src.isEmpty() || dst.isEmpty())
+                return;
+
+            BLRectI shifted(src.fRect.x + dx, src.fRect.y + dy, src.fRect.w, src.fRect.h);
+            BLRectI r = intersect(shifted, dst.fRect);
+            if (isEmpty(r))
+                return;
+
+            bool srcA8 = src.isAlphaOnly();
+            bool dstA8 = dst.isAlphaOnly();
+
+            for (int y = r.y; y < r.y + r.h; y++)
+            {
+                const uint8_t* sp = src.row(y - dy) + (size_t)(r.x - dx - src.fRect.x) * src.bytesPerPixel();
+                uint8_t* dp = dst.row(y) + (size_t)(r.x - dst.fRect.x) * dst.bytesPerPixel();
+
+                if (srcA8 == dstA8)
+                {
+                    memcpy(dp, sp, (size_t)r.w * dst.bytesPerPixel());
+                }
+                else if (srcA8)
+                {
+                    uint32_t* d = (uint32_t*)dp;
+                    for (int x = 0; x < r.w; x++)
+                        d[x] = (uint32_t)sp[x] << 24;
+                }
+                else
+                {
+                    const uint32_t* s = (const uint32_t*)sp;
+                    for (int x = 0; x < r.w; x++)
+                        dp[x] = (uint8_t)(s[x] >> 24);
+                }
+            }
+        }
+
+        // Lookup tables between sRGB and linearRGB, on 8-bit components
+        struct ColorTables
+        {
+            uint8_t fToLinear[256]{};
+            uint8_t fToSRGB[256]{};
+
+            ColorTables()
+            {
+                for (int i = 0; i < 256; i++)
+                {
+                    double c = i / 255.0;
+                    double lin = (c <= 0.04045) ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+                    double srgb = (c <= 0.0031308) ? c * 12.92 : 1.055 * std::pow(c, 1.0 / 2.4) - 0.055;
+
+                    fToLinear[i] = (uint8_t)std::lround(lin * 255.0);
+                    fToSRGB[i] = (uint8_t)std::lround(srgb * 255.0);
+                }
+            }
+        };
+
+        static const ColorTables& colorTables()
+        {
+            static const ColorTables sTables{};
+            return sTables;
+        }
+
+        // A (non-premultiplied) sRGB color, in the given color space
+        static BLRgba32 convertColor(const BLRgba32& c, int space)
+        {
+            if (space != FILTER_COLORSPACE_LINEARRGB)
+                return c;
+
+            const uint8_t* lut = colorTables().fToLinear;
+            return BLRgba32(lut[c.r()], lut[c.g()], lut[c.b()], c.a());
+        }
+
+        // Copy of a PRGB32 image, with its colors moved to another color
+        // space.  The tables work on straight color, so each pixel is
+        // unpremultiplied on the way through.
+        static bool convertColorSpace(const FilterImage& src, int space, FilterImage& dst)
+        {
+            if (!dst.allocate(src.fRect, BL_FORMAT_PRGB32, false))
+                return false;
+            dst.fColorSpace = space;
+
+            const uint8_t* lut = (space == FILTER_COLORSPACE_LINEARRGB) ? colorTables().fToLinear : colorTables().fToSRGB;
+
+            forEachBand(src.fRect, [&src, &dst, lut](int y0, int y1) {
+                for (int y = y0; y < y1; y++)
+                {
+                    const uint32_t* s = src.pixels(src.fRect.x, y);
+                    uint32_t* d = dst.pixels(dst.fRect.x, y);
+
+                    for (int x = 0; x < src.fRect.w; x++)
+                    {
+                        uint32_t p = s[x];
+                        uint32_t a = p >> 24;
+
+                        if (a == 0) {
+                            d[x] = 0;
+                        }
+                        else if (a == 255) {
+                            d[x] = (p & 0xff000000u) | ((uint32_t)lut[(p >> 16) & 0xff] << 16) | ((uint32_t)lut[(p >> 8) & 0xff] << 8) | lut[p & 0xff];
+                        }
+                        else {
+                            uint32_t out = a << 24;
+                            for (int shift = 0; shift < 24; shift += 8)
+                            {
+                                uint32_t c = std::min(255u, ((((p >> shift) & 0xff) * 255u) + (a >> 1)) / a);
+                                out |= ((lut[c] * a + 127u) / 255u) << shift;
+                            }
+                            d[x] = out;
+                        }
+                    }
+                }
+            });
+
+            return true;
+        }
+    };
+
+
+    // FilterPlan
+    // The bound form of a filter's graph of primitives
+    struct FilterPlan
+    {
+        static constexpr int kSourceGraphic = 0;
+        static constexpr int kSourceAlpha = 1;
+        static constexpr int kTransparent = 2;      // BackgroundImage, FillPaint, etc, which we don't have
+        static constexpr int kFirstResult = 3;
+
+        struct Node
+        {
+            IFilterPrimitive* fPrimitive{ nullptr };
+            std::vector<int> fInputs{};     // slot for each input
+            int fColorSpace{ FILTER_COLORSPACE_LINEARRGB };
+            int fWave{ 0 };
+        };
+
+        std::vector<Node> fNodes{};
+        std::vector<std::vector<size_t>> fWaves{};  // nodes, grouped by wave
+        std::vector<int> fReleaseAfter{};           // per slot, the wave after which nobody reads it
+
+
+        static int outputSlot(size_t nodeIdx) { return kFirstResult + (int)nodeIdx; }
+        size_t slotCount() const { return kFirstResult + fNodes.size(); }
+        bool isEmpty() const { return fNodes.empty(); }
+
+        void clear()
+        {
+            fNodes.clear();
+            fWaves.clear();
+            fReleaseAfter.clear();
+        }
+
+        // build
+        // Resolve the names of inputs and results to slots, and work out
+        // the order things can run in.  A result name refers to the most
+        // recent primitive that used it.  A missing name, or one that
+        // doesn't refer to anything, is the result of the previous
+        // primitive, or SourceGraphic for the first one.
+        void build(const std::vector<IFilterPrimitive*>& prims, int colorSpace)
+        {
+            clear();
+
+            std::unordered_map<ByteSpan, int, ByteSpanHash, ByteSpanEquivalent> named{};
+
+            for (size_t i = 0; i < prims.size(); i++)
+            {
+                Node node{};
+                node.fPrimitive = prims[i];
+                node.fColorSpace = prims[i]->filterColorSpace(colorSpace);
+
+                for (size_t k = 0; k < prims[i]->filterInputCount(); k++)
+                {
+                    int slot = resolveInput(prims[i]->filterInputName(k), named, i);
+                    node.fInputs.push_back(slot);
+
+                    if (slot >= kFirstResult)
+                        node.fWave = std::max(node.fWave, fNodes[slot - kFirstResult].fWave + 1);
+                }
+
+                ByteSpan resultName = prims[i]->filterResultName();
+                if (resultName)
+                    named[resultName] = outputSlot(i);
+
+                fNodes.push_back(node);
+            }
+
+            fReleaseAfter.assign(slotCount(), -1);
+            for (size_t i = 0; i < fNodes.size(); i++)
+            {
+                const Node& node = fNodes[i];
+                if ((size_t)node.fWave >= fWaves.size())
+                    fWaves.resize(node.fWave + 1);
+                fWaves[node.fWave].push_back(i);
+
+                for (int slot : node.fInputs)
+                    fReleaseAfter[slot] = std::max(fReleaseAfter[slot], node.fWave);
+            }
+
+            // The last result is what the filter produces
+            if (!fNodes.empty())
+                fReleaseAfter[outputSlot(fNodes.size() - 1)] = -1;
+        }
+
+        static int resolveInput(const ByteSpan& name, const std::unordered_map<ByteSpan, int, ByteSpanHash, ByteSpanEquivalent>& named, size_t nodeIdx)
+        {
+            if (name == "SourceGraphic")
+                return kSourceGraphic;
+            if (name == "SourceAlpha")
+                return kSourceAlpha;
+            if ((name == "BackgroundImage") || (name == "BackgroundAlpha") || (name == "FillPaint") || (name == "StrokePaint"))
+                return kTransparent;
+
+            if (name)
+            {
+                auto it = named.find(name);
+                if (it != named.end())
+                    return it->second;
+            }
+
+            return (nodeIdx == 0) ? kSourceGraphic : outputSlot(nodeIdx - 1);
+        }
+
+        // execute
+        // Run the plan.  'visible' is the part of filter space that will
+        // show up on the device.  'renderSource' draws the element being
+        // filtered into the image it's given, covering its fRect.  The
+        // result is sRGB PRGB32, and covers no more than 'visible'.
+        bool execute(const FilterSpace& space, const BLRectI& visible, const std::function<bool(FilterImage&)>& renderSource, FilterImage& result) const
+        {
+            result.reset();
+            if (fNodes.empty())
+                return false;
+
+            size_t nSlots = slotCount();
+            BLRectI bounds = space.bounds();
+
+            // Work backward, from what's visible, to what each
+            // primitive must produce, and what it reads to do it
+            std::vector<BLRectI> need(nSlots, BLRectI{});
+            std::vector<BLRectI> produce(fNodes.size(), BLRectI{});
+
+            need[outputSlot(fNodes.size() - 1)] = FilterPixels::intersect(visible, bounds);
+            for (size_t i = fNodes.size(); i-- > 0; )
+            {
+                const Node& node = fNodes[i];
+                BLRectI out = FilterPixels::intersect(need[outputSlot(i)], node.fPrimitive->filterSubregion(space));
+                produce[i] = out;
+
+                if (FilterPixels::isEmpty(out))
+                    continue;
+
+                for (size_t k = 0; k < node.fInputs.size(); k++)
+                {
+                    int slot = node.fInputs[k];
+                    BLRectI r = FilterPixels::intersect(node.fPrimitive->filterInputRegion(k, out, space), bounds);
+                    need[slot] = FilterPixels::unite(need[slot], r);
+                }
+            }
+
+            std::vector<FilterImage> slots(nSlots);
+
+            // Draw the source, only as much of it as is actually read
+            BLRectI srcRect = FilterPixels::unite(need[kSourceGraphic], need[kSourceAlpha]);
+            if (!FilterPixels::isEmpty(srcRect))
+            {
+                FilterImage src{};
+                if (src.allocate(srcRect, BL_FORMAT_PRGB32) && renderSource(src))
+                {
+                    src.refresh();
+
+                    if (!FilterPixels::isEmpty(need[kSourceAlpha]) && slots[kSourceAlpha].allocate(need[kSourceAlpha], BL_FORMAT_A8))
+                        FilterPixels::copy(src, slots[kSourceAlpha]);
+
+                    if (!FilterPixels::isEmpty(need[kSourceGraphic]))
+                        slots[kSourceGraphic] = src;
+                }
+            }
+
+            for (size_t w = 0; w < fWaves.size(); w++)
+            {
+                const std::vector<size_t>& wave = fWaves[w];
+
+                WorkerPool::pool().parallelFor(wave.size(), [this, &wave, &space, &produce, &slots](size_t j) {
+                    runNode(wave[j], space, produce[wave[j]], slots);
+                });
+
+                // Let go of whatever nobody reads any more
+                for (size_t s = 0; s < nSlots; s++)
+                {
+                    if (fReleaseAfter[s] == (int)w)
+                        slots[s].reset();
+                }
+            }
+
+            const FilterImage& last = slots[outputSlot(fNodes.size() - 1)];
+            if (last.isEmpty())
+                return false;
+
+            if (last.isAlphaOnly())
+            {
+                if (!result.allocate(last.fRect, BL_FORMAT_PRGB32, false))
+                    return false;
+                FilterPixels::copy(last, result);
+            }
+            else if (last.fColorSpace != FILTER_COLORSPACE_SRGB)
+            {
+                if (!FilterPixels::convertColorSpace(last, FILTER_COLORSPACE_SRGB, result))
+                    return false;
+            }
+            else {
+                result = last;
+            }
+
+            result.fColorSpace = FILTER_COLORSPACE_SRGB;
+
+            return true;
+        }
+
+    private:
+        void runNode(size_t idx, const FilterSpace& space, const BLRectI& outRect, std::vector<FilterImage>& slots) const
+        {
+            if (FilterPixels::isEmpty(outRect))
+                return;
+
+            const Node& node = fNodes[idx];
+            size_t nInputs = node.fInputs.size();
+
+            // Inputs in the form the primitive wants them
+            std::vector<FilterImage> adapted(nInputs);
+            std::vector<const FilterImage*> inputs(nInputs, nullptr);
+
+            for (size_t k = 0; k < nInputs; k++)
+                inputs[k] = adaptInput(slots[node.fInputs[k]], node.fPrimitive->filterAcceptsAlphaOnly(k), node.fColorSpace, adapted[k]);
+
+            FilterImage& out = slots[outputSlot(idx)];
+            out.fRect = outRect;
+            out.fColorSpace = node.fColorSpace;
+
+            node.fPrimitive->applyFilter(space, inputs.data(), nInputs, out);
+        }
+
+        static const FilterImage* adaptInput(const FilterImage& in, bool alphaOnlyOk, int space, FilterImage& scratch)
+        {
+            if (in.isEmpty())
+                return &in;
+
+            if (in.isAlphaOnly())
+            {
+                if (alphaOnlyOk)
+                    return &in;
+
+                // black is black in either color space
+                if (!scratch.allocate(in.fRect, BL_FORMAT_PRGB32, false))
+                    return &scratch;
+                FilterPixels::copy(in, scratch);
+                scratch.fColorSpace = space;
+
+                return &scratch;
+            }
+
+            if (in.fColorSpace == space)
+                return &in;
+
+            FilterPixels::convertColorSpace(in, space, scratch);
+
+            return &scratch;
+        }
+    };
+}
@@ -0,0 +1,753 @@
+#pragma once
+
+//
+// Per-pixel filter kernels
+//
+// feColorMatrix, feComponentTransfer, feComposite and feBlend all work
+// one pixel at a time, on premultiplied PRGB32.  Each has a reference
+// version, written straight from the specification in floating point,
+// which is what the others are checked against, and which handles the
+// less common modes.  The working versions use SSE2 where it's there,
+// with integer (or float) math that stays within a unit of the
+// reference, and a scalar tail that does exactly what the vector part
+// does.
+//
+// Kernels work on runs of 'n' pixels.  mapRows() feeds them the rows of
+// an area, with transparent black wherever an input has no pixels, and
+// spreads the rows across the worker pool.
+//
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "filterengine.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_KERNELS_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    enum FilterCompositeOp : int
+    {
+        FILTER_COMPOSITE_OVER = 0,
+        FILTER_COMPOSITE_IN,
+        FILTER_COMPOSITE_OUT,
+        FILTER_COMPOSITE_ATOP,
+        FILTER_COMPOSITE_XOR,
+        FILTER_COMPOSITE_LIGHTER,
+        FILTER_COMPOSITE_ARITHMETIC,
+    };
+
+    enum FilterBlendMode : int
+    {
+        FILTER_BLEND_NORMAL = 0,
+        FILTER_BLEND_MULTIPLY,
+        FILTER_BLEND_SCREEN,
+        FILTER_BLEND_DARKEN,
+        FILTER_BLEND_LIGHTEN,
+        FILTER_BLEND_DIFFERENCE,
+        FILTER_BLEND_EXCLUSION,
+
+        // These only have a reference version
+        FILTER_BLEND_OVERLAY,
+        FILTER_BLEND_COLOR_DODGE,
+        FILTER_BLEND_COLOR_BURN,
+        FILTER_BLEND_HARD_LIGHT,
+        FILTER_BLEND_SOFT_LIGHT,
+        FILTER_BLEND_HUE,
+        FILTER_BLEND_SATURATION,
+        FILTER_BLEND_COLOR,
+        FILTER_BLEND_LUMINOSITY,
+    };
+
+
+    // Lookup tables for feComponentTransfer, one per channel, R, G, B, A,
+    // applied to straight (not premultiplied) color
+    struct TransferTables
+    {
+        uint8_t fTable[4][256]{};
+
+        TransferTables()
+        {
+            for (int c = 0; c < 4; c++)
+                for (int i = 0; i < 256; i++)
+                    fTable[c][i] = (uint8_t)i;
+        }
+    };
+
+
+    struct FilterKernels
+    {
+        //==================================================
+        // Shared bits
+        //==================================================
+        static inline uint32_t div255(uint32_t x)
+        {
+            x += 128;
+            return (x + (x >> 8)) >> 8;
+        }
+
+        // 65536 * 255 / a, for unpremultiplying without a divide.  One
+        // more than the floor makes it round the same as dividing does.
+        static const uint32_t* unpremultiplyTable()
+        {
+            struct Table
+            {
+                uint32_t fRecip[256]{};
+                Table()
+                {
+                    for (int a = 1; a < 256; a++)
+                        fRecip[a] = (255u * 65536u) / a + 1;
+                }
+            };
+            static const Table sTable{};
+
+            return sTable.fRecip;
+        }
+
+        static inline uint32_t unpremultiply(uint32_t c, uint32_t a, const uint32_t* recip)
+        {
+            return std::min(255u, (c * recip[a] + 0x8000) >> 16);
+        }
+
+        static inline double channel(uint32_t p, int shift) { return ((p >> shift) & 0xff) / 255.0; }
+
+        static inline uint32_t packNormalized(double r, double g, double b, double a)
+        {
+            auto q = [](double v) { return (uint32_t)std::lround(std::min(1.0, std::max(0.0, v)) * 255.0); };
+            return (q(a) << 24) | (q(r) << 16) | (q(g) << 8) | q(b);
+        }
+
+#if defined(WAAVS_KERNELS_SSE2)
+        static inline __m128i unpackPixel(uint32_t p)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), zero), zero);
+        }
+
+        static inline uint32_t packPixel(__m128 v)
+        {
+            __m128i i = _mm_cvtps_epi32(v);
+            i = _mm_packs_epi32(i, i);
+            return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+        }
+
+        static inline __m128i div255x8(__m128i x)
+        {
+            x = _mm_adds_epu16(x, _mm_set1_epi16(128));
+            return _mm_srli_epi16(_mm_adds_epu16(x, _mm_srli_epi16(x, 8)), 8);
+        }
+
+        // alpha of each of the two pixels, in all four of its lanes
+        static inline __m128i alphas16(__m128i px)
+        {
+            return _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        }
+#endif
+
+
+        //==================================================
+        // Feeding rows to kernels
+        //==================================================
+
+        // Where an input actually has pixels
+        static BLRectI coverage(const FilterImage* in)
+        {
+            return ((nullptr == in) || in->isEmpty()) ? BLRectI{} : in->fRect;
+        }
+
+        // Pointer to 'n' pixels of 'in' starting at (x, y), copied into
+        // 'scratch' with transparent fill if 'in' doesn't cover them all
+        static const uint32_t* rowOf(const FilterImage* in, int x, int y, int n, uint32_t* scratch)
+        {
+            if ((nullptr != in) && !in->isEmpty() && (y >= in->fRect.y) && (y < in->fRect.y + in->fRect.h) &&
+                (x >= in->fRect.x) && (x + n <= in->fRect.x + in->fRect.w))
+                return in->pixels(x, y);
+
+            memset(scratch, 0, sizeof(uint32_t) * n);
+            if ((nullptr == in) || in->isEmpty() || (y < in->fRect.y) || (y >= in->fRect.y + in->fRect.h))
+                return scratch;
+
+            int x0 = std::max(x, in->fRect.x);
+            int x1 = std::min(x + n, in->fRect.x + in->fRect.w);
+            if (x1 > x0)
+                memcpy(scratch + (x0 - x), in->pixels(x0, y), sizeof(uint32_t) * (x1 - x0));
+
+            return scratch;
+        }
+
+        // mapRows
+        // fn(a, b, dst, n) for every row of 'area' within 'out', where 'a'
+        // and 'b' are the matching pixels of the inputs.  'b' may be null.
+        template <typename Fn>
+        static void mapRows(const FilterImage* a, const FilterImage* b, FilterImage& out, const BLRectI& area, Fn&& fn)
+        {
+            FilterPixels::forEachBand(area, [&](int y0, int y1) {
+                std::vector<uint32_t> scratchA(area.w);
+                std::vector<uint32_t> scratchB(area.w);
+
+                for (int y = y0; y < y1; y++)
+                {
+                    const uint32_t* ra = rowOf(a, area.x, y, area.w, scratchA.data());
+                    const uint32_t* rb = (nullptr != b) ? rowOf(b, area.x, y, area.w, scratchB.data()) : nullptr;
+                    fn(ra, rb, out.pixels(area.x, y), area.w);
+                }
+            });
+        }
+
+
+        //==================================================
+        // feColorMatrix
+        // 'm' is 4 rows (R, G, B, A) of 5 values, the last of each
+        // being an offset, with colors in the range [0..1]
+        //==================================================
+        static void colorMatrixReference(const uint32_t* src, uint32_t* dst, int n, const float* m)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t p = src[i];
+                double a = channel(p, 24);
+                double r = 0, g = 0, b = 0;
+                if (a > 0)
+                {
+                    r = channel(p, 16) / a;
+                    g = channel(p, 8) / a;
+                    b = channel(p, 0) / a;
+                }
+
+                double out[4]{};
+                for (int k = 0; k < 4; k++)
+                {
+                    const float* row = m + k * 5;
+                    out[k] = std::min(1.0, std::max(0.0, row[0] * r + row[1] * g + row[2] * b + row[3] * a + row[4]));
+                }
+
+                dst[i] = packNormalized(out[0] * out[3], out[1] * out[3], out[2] * out[3], out[3]);
+            }
+        }
+
+        static void colorMatrix(const uint32_t* src, uint32_t* dst, int n, const float* m)
+        {
+#if defined(WAAVS_KERNELS_SSE2)
+            // Columns of the matrix, lanes in pixel memory order, B, G, R, A
+            const __m128 colR = _mm_setr_ps(m[10], m[5], m[0], m[15]);
+            const __m128 colG = _mm_setr_ps(m[11], m[6], m[1], m[16]);
+            const __m128 colB = _mm_setr_ps(m[12], m[7], m[2], m[17]);
+            const __m128 colA = _mm_setr_ps(m[13], m[8], m[3], m[18]);
+            const __m128 offset = _mm_setr_ps(m[14] * 255.0f, m[9] * 255.0f, m[4] * 255.0f, m[19] * 255.0f);
+
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 v255 = _mm_set1_ps(255.0f);
+            const __m128 inv255 = _mm_set1_ps(1.0f / 255.0f);
+            const __m128 rgbMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+            uint32_t lastIn = 0;
+            uint32_t lastOut = 0;
+            bool haveLast = false;
+
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t p = src[i];
+
+                // runs of the same pixel are common, transparent ones especially
+                if (haveLast && (p == lastIn))
+                {
+                    dst[i] = lastOut;
+                    continue;
+                }
+
+                uint32_t a = p >> 24;
+                __m128 c = _mm_cvtepi32_ps(unpackPixel(p));
+
+                if ((a != 0) && (a != 255))
+                {
+                    float s = 255.0f / (float)a;
+                    c = _mm_mul_ps(c, _mm_setr_ps(s, s, s, 1.0f));
+                }
+
+                __m128 r = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(colB, _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 0))), _mm_mul_ps(colG, _mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1)))),
+                    _mm_add_ps(_mm_mul_ps(colR, _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 2, 2))), _mm_mul_ps(colA, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)))));
+                r = _mm_min_ps(_mm_max_ps(_mm_add_ps(r, offset), zero), v255);
+
+                // premultiply by the new alpha
+                __m128 aa = _mm_mul_ps(_mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3)), inv255);
+                r = _mm_mul_ps(r, _mm_or_ps(_mm_and_ps(rgbMask, aa), _mm_andnot_ps(rgbMask, one)));
+
+                lastIn = p;
+                lastOut = packPixel(r);
+                haveLast = true;
+                dst[i] = lastOut;
+            }
+#else
+            colorMatrixReference(src, dst, n, m);
+#endif
+        }
+
+
+        //==================================================
+        // feComponentTransfer
+        //==================================================
+        static void componentTransferReference(const uint32_t* src, uint32_t* dst, int n, const TransferTables& t)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t p = src[i];
+                uint32_t a = p >> 24;
+
+                uint32_t c[3] = { 0, 0, 0 };
+                for (int k = 0; k < 3; k++)
+                {
+                    if (a > 0)
+                        c[k] = (uint32_t)std::lround(std::min(255.0, ((p >> (16 - k * 8)) & 0xff) * 255.0 / a));
+                }
+
+                double oa = t.fTable[3][a] / 255.0;
+                dst[i] = packNormalized(t.fTable[0][c[0]] / 255.0 * oa, t.fTable[1][c[1]] / 255.0 * oa, t.fTable[2][c[2]] / 255.0 * oa, oa);
+            }
+        }
+
+        // There's no gather in SSE2, so the lookups are scalar, but
+        // unpremultiplying goes through a reciprocal table, and opaque
+        // pixels skip it altogether
+        static void componentTransfer(const uint32_t* src, uint32_t* dst, int n, const TransferTables& t)
+        {
+            const uint32_t* recip = unpremultiplyTable();
+            const uint8_t* tr = t.fTable[0];
+            const uint8_t* tg = t.fTable[1];
+            const uint8_t* tb = t.fTable[2];
+            const uint8_t* ta = t.fTable[3];
+
+            for (int i = 0; i < n; i++)
+            {
+                uint32_t p = src[i];
+                uint32_t a = p >> 24;
+                uint32_t r = (p >> 16) & 0xff;
+                uint32_t g = (p >> 8) & 0xff;
+                uint32_t b = p & 0xff;
+
+                if (a == 0) {
+                    r = g = b = 0;
+                }
+                else if (a != 255) {
+                    r = unpremultiply(r, a, recip);
+                    g = unpremultiply(g, a, recip);
+                    b = unpremultiply(b, a, recip);
+                }
+
+                uint32_t oa = ta[a];
+                if (oa == 255)
+                    dst[i] = 0xff000000u | ((uint32_t)tr[r] << 16) | ((uint32_t)tg[g] << 8) | tb[b];
+                else
+                    dst[i] = (oa << 24) | (div255(tr[r] * oa) << 16) | (div255(tg[g] * oa) << 8) | div255(tb[b] * oa);
+            }
+        }
+
+
+        //==================================================
+        // feComposite
+        // 'a' is 'in', 'b' is 'in2'.  'k' is k1..k4 for arithmetic.
+        //==================================================
+        static uint32_t compositePixelReference(uint32_t pa, uint32_t pb, int op, const float* k)
+        {
+            double aa = channel(pa, 24);
+            double ab = channel(pb, 24);
+
+            double out[4]{};
+            for (int c = 0; c < 4; c++)
+            {
+                int shift = (c == 3) ? 24 : (16 - c * 8);
+                double ca = channel(pa, shift);
+                double cb = channel(pb, shift);
+
+                switch (op)
+                {
+                case FILTER_COMPOSITE_OVER: out[c] = ca + cb * (1 - aa); break;
+                case FILTER_COMPOSITE_IN: out[c] = ca * ab; break;
+                case FILTER_COMPOSITE_OUT: out[c] = ca * (1 - ab); break;
+                case FILTER_COMPOSITE_ATOP: out[c] = ca * ab + cb * (1 - aa); break;
+                case FILTER_COMPOSITE_XOR: out[c] = ca * (1 - ab) + cb * (1 - aa); break;
+                case FILTER_COMPOSITE_LIGHTER: out[c] = ca + cb; break;
+                case FILTER_COMPOSITE_ARITHMETIC: out[c] = k[0] * ca * cb + k[1] * ca + k[2] * cb + k[3]; break;
+                }
+
+                out[c] = std::min(1.0, std::max(0.0, out[c]));
+            }
+
+            // keep the result a valid premultiplied color
+            for (int c = 0; c < 3; c++)
+                out[c] = std::min(out[c], out[3]);
+
+            return packNormalized(out[0], out[1], out[2], out[3]);
+        }
+
+        static void compositeReference(const uint32_t* a, const uint32_t* b, uint32_t* dst, int n, int op, const float* k)
+        {
+            for (int i = 0; i < n; i++)
+                dst[i] = compositePixelReference(a[i], b[i], op, k);
+        }
+
+        // The integer version of the Porter-Duff operators, which the
+        // vector code follows exactly
+        static inline uint32_t compositePixel(uint32_t pa, uint32_t pb, int op)
+        {
+            uint32_t aa = pa >> 24;
+            uint32_t ab = pb >> 24;
+
+            uint32_t out = 0;
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                uint32_t ca = (pa >> shift) & 0xff;
+                uint32_t cb = (pb >> shift) & 0xff;
+                uint32_t v = 0;
+
+                switch (op)
+                {
+                case FILTER_COMPOSITE_OVER: v = ca + div255(cb * (255 - aa)); break;
+                case FILTER_COMPOSITE_IN: v = div255(ca * ab); break;
+                case FILTER_COMPOSITE_OUT: v = div255(ca * (255 - ab)); break;
+                case FILTER_COMPOSITE_ATOP: v = div255(std::min(65535u, ca * ab + cb * (255 - aa))); break;
+                case FILTER_COMPOSITE_XOR: v = div255(std::min(65535u, ca * (255 - ab) + cb * (255 - aa))); break;
+                case FILTER_COMPOSITE_LIGHTER: v = ca + cb; break;
+                }
+
+                out |= std::min(255u, v) << shift;
+            }
+
+            return out;
+        }
+
+        static void composite(const uint32_t* a, const uint32_t* b, uint32_t* dst, int n, int op, const float* k)
+        {
+            int i = 0;
+
+#if defined(WAAVS_KERNELS_SSE2)
+            if (op == FILTER_COMPOSITE_ARITHMETIC)
+            {
+                const __m128 k1 = _mm_set1_ps(k[0] / 255.0f);
+                const __m128 k2 = _mm_set1_ps(k[1]);
+                const __m128 k3 = _mm_set1_ps(k[2]);
+                const __m128 k4 = _mm_set1_ps(k[3] * 255.0f);
+                const __m128 zero = _mm_setzero_ps();
+                const __m128 v255 = _mm_set1_ps(255.0f);
+                const __m128 alphaMask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+
+                for (; i < n; i++)
+                {
+                    __m128 ca = _mm_cvtepi32_ps(unpackPixel(a[i]));
+                    __m128 cb = _mm_cvtepi32_ps(unpackPixel(b[i]));
+
+                    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(k1, _mm_mul_ps(ca, cb)), _mm_mul_ps(k2, ca)), _mm_add_ps(_mm_mul_ps(k3, cb), k4));
+                    r = _mm_min_ps(_mm_max_ps(r, zero), v255);
+
+                    // colors no more than alpha
+                    __m128 ra = _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3));
+                    r = _mm_or_ps(_mm_and_ps(alphaMask, r), _mm_andnot_ps(alphaMask, _mm_min_ps(r, ra)));
+
+                    dst[i] = packPixel(r);
+                }
+
+                return;
+            }
+
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i v255 = _mm_set1_epi16(255);
+
+            for (; i + 4 <= n; i += 4)
+            {
+                __m128i pa = _mm_loadu_si128((const __m128i*)(a + i));
+                __m128i pb = _mm_loadu_si128((const __m128i*)(b + i));
+
+                if (op == FILTER_COMPOSITE_LIGHTER)
+                {
+                    _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(pa, pb));
+                    continue;
+                }
+
+                __m128i halves[2];
+                for (int h = 0; h < 2; h++)
+                {
+                    __m128i ca = h ? _mm_unpackhi_epi8(pa, zero) : _mm_unpacklo_epi8(pa, zero);
+                    __m128i cb = h ? _mm_unpackhi_epi8(pb, zero) : _mm_unpacklo_epi8(pb, zero);
+                    __m128i aa = alphas16(ca);
+                    __m128i ab = alphas16(cb);
+
+                    __m128i r{};
+                    switch (op)
+                    {
+                    case FILTER_COMPOSITE_OVER: r = _mm_adds_epu16(ca, div255x8(_mm_mullo_epi16(cb, _mm_sub_epi16(v255, aa)))); break;
+                    case FILTER_COMPOSITE_IN: r = div255x8(_mm_mullo_epi16(ca, ab)); break;
+                    case FILTER_COMPOSITE_OUT: r = div255x8(_mm_mullo_epi16(ca, _mm_sub_epi16(v255, ab))); break;
+                    case FILTER_COMPOSITE_ATOP: r = div255x8(_mm_adds_epu16(_mm_mullo_epi16(ca, ab), _mm_mullo_epi16(cb, _mm_sub_epi16(v255, aa)))); break;
+                    case FILTER_COMPOSITE_XOR: r = div255x8(_mm_adds_epu16(_mm_mullo_epi16(ca, _mm_sub_epi16(v255, ab)), _mm_mullo_epi16(cb, _mm_sub_epi16(v255, aa)))); break;
+                    }
+                    halves[h] = r;
+                }
+
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(halves[0], halves[1]));
+            }
+#else
+            if (op == FILTER_COMPOSITE_ARITHMETIC)
+            {
+                compositeReference(a, b, dst, n, op, k);
+                return;
+            }
+#endif
+
+            for (; i < n; i++)
+                dst[i] = compositePixel(a[i], b[i], op);
+        }
+
+
+        //==================================================
+        // feBlend
+        // 's' is the source, 'in', drawn on the backdrop 'b', 'in2'
+        //==================================================
+        static double blendChannel(int mode, double cb, double cs)
+        {
+            switch (mode)
+            {
+            case FILTER_BLEND_MULTIPLY: return cb * cs;
+            case FILTER_BLEND_SCREEN: return cb + cs - cb * cs;
+            case FILTER_BLEND_DARKEN: return std::min(cb, cs);
+            case FILTER_BLEND_LIGHTEN: return std::max(cb, cs);
+            case FILTER_BLEND_DIFFERENCE: return std::abs(cb - cs);
+            case FILTER_BLEND_EXCLUSION: return cb + cs - 2 * cb * cs;
+            case FILTER_BLEND_OVERLAY: return blendChannel(FILTER_BLEND_HARD_LIGHT, cs, cb);
+            case FILTER_BLEND_COLOR_DODGE:
+                if (cb <= 0) return 0;
+                if (cs >= 1) return 1;
+                return std::min(1.0, cb / (1 - cs));
+            case FILTER_BLEND_COLOR_BURN:
+                if (cb >= 1) return 1;
+                if (cs <= 0) return 0;
+                return 1 - std::min(1.0, (1 - cb) / cs);
+            case FILTER_BLEND_HARD_LIGHT:
+                if (cs <= 0.5) return cb * 2 * cs;
+                return blendChannel(FILTER_BLEND_SCREEN, cb, 2 * cs - 1);
+            case FILTER_BLEND_SOFT_LIGHT:
+            {
+                if (cs <= 0.5)
+                    return cb - (1 - 2 * cs) * cb * (1 - cb);
+                double d = (cb <= 0.25) ? ((16 * cb - 12) * cb + 4) * cb : std::sqrt(cb);
+                return cb + (2 * cs - 1) * (d - cb);
+            }
+            }
+
+            return cs;
+        }
+
+        static double lum(const double* c) { return 0.3 * c[0] + 0.59 * c[1] + 0.11 * c[2]; }
+        static double sat(const double* c) { return std::max(c[0], std::max(c[1], c[2])) - std::min(c[0], std::min(c[1], c[2])); }
+
+        static void setLum(double* c, double l)
+        {
+            double d = l - lum(c);
+            for (int i = 0; i < 3; i++)
+                c[i] += d;
+
+            // clip the color back into range, keeping its luminosity
+            l = lum(c);
+            double n = std::min(c[0], std::min(c[1], c[2]));
+            double x = std::max(c[0], std::max(c[1], c[2]));
+            for (int i = 0; i < 3; i++)
+            {
+                if (n < 0)
+                    c[i] = l + (c[i] - l) * l / (l - n);
+                if (x > 1)
+                    c[i] = l + (c[i] - l) * (1 - l) / (x - l);
+            }
+        }
+
+        static void setSat(double* c, double s)
+        {
+            int imax = 0, imin = 0;
+            for (int i = 1; i < 3; i++)
+            {
+                if (c[i] > c[imax]) imax = i;
+                if (c[i] < c[imin]) imin = i;
+            }
+
+            if (imax == imin)
+            {
+                c[0] = c[1] = c[2] = 0;
+                return;
+            }
+
+            int imid = 3 - imax - imin;
+            c[imid] = (c[imid] - c[imin]) * s / (c[imax] - c[imin]);
+            c[imax] = s;
+            c[imin] = 0;
+        }
+
+        static uint32_t blendPixelReference(uint32_t ps, uint32_t pb, int mode)
+        {
+            double as = channel(ps, 24);
+            double ab = channel(pb, 24);
+
+            double cs[3]{}, cb[3]{}, us[3]{}, ub[3]{};
+            for (int i = 0; i < 3; i++)
+            {
+                cs[i] = channel(ps, 16 - i * 8);
+                cb[i] = channel(pb, 16 - i * 8);
+                us[i] = (as > 0) ? std::min(1.0, cs[i] / as) : 0;
+                ub[i] = (ab > 0) ? std::min(1.0, cb[i] / ab) : 0;
+            }
+
+            double mixed[3]{};
+            switch (mode)
+            {
+            case FILTER_BLEND_HUE:
+                std::copy(us, us + 3, mixed);
+                setSat(mixed, sat(ub));
+                setLum(mixed, lum(ub));
+                break;
+            case FILTER_BLEND_SATURATION:
+                std::copy(ub, ub + 3, mixed);
+                setSat(mixed, sat(us));
+                setLum(mixed, lum(ub));
+                break;
+            case FILTER_BLEND_COLOR:
+                std::copy(us, us + 3, mixed);
+                setLum(mixed, lum(ub));
+                break;
+            case FILTER_BLEND_LUMINOSITY:
+                std::copy(ub, ub + 3, mixed);
+                setLum(mixed, lum(us));
+                break;
+            default:
+                for (int i = 0; i < 3; i++)
+                    mixed[i] = blendChannel(mode, ub[i], us[i]);
+                break;
+            }
+
+            double out[3]{};
+            for (int i = 0; i < 3; i++)
+                out[i] = cs[i] * (1 - ab) + cb[i] * (1 - as) + as * ab * mixed[i];
+
+            double ao = as + ab - as * ab;
+
+            return packNormalized(std::min(out[0], ao), std::min(out[1], ao), std::min(out[2], ao), ao);
+        }
+
+        static void blendReference(const uint32_t* s, const uint32_t* b, uint32_t* dst, int n, int mode)
+        {
+            for (int i = 0; i < n; i++)
+                dst[i] = blendPixelReference(s[i], b[i], mode);
+        }
+
+        // The integer form of the simpler separable modes,
+        // which the vector code follows exactly
+        static inline uint32_t blendPixel(uint32_t ps, uint32_t pb, int mode)
+        {
+            uint32_t as = ps >> 24;
+            uint32_t ab = pb >> 24;
+
+            uint32_t out = (as + ab - div255(as * ab)) << 24;
+            for (int shift = 0; shift < 24; shift += 8)
+            {
+                uint32_t cs = (ps >> shift) & 0xff;
+                uint32_t cb = (pb >> shift) & 0xff;
+                int32_t v = 0;
+
+                switch (mode)
+                {
+                case FILTER_BLEND_NORMAL: v = cs + div255(cb * (255 - as)); break;
+                case FILTER_BLEND_MULTIPLY: v = div255(std::min(65535u, cs * (255 - ab) + cb * (255 - as) + cs * cb)); break;
+                case FILTER_BLEND_SCREEN: v = (int32_t)(cs + cb) - (int32_t)div255(cs * cb); break;
+                case FILTER_BLEND_DARKEN: v = (int32_t)(cs + cb) - (int32_t)std::max(div255(cs * ab), div255(cb * as)); break;
+                case FILTER_BLEND_LIGHTEN: v = (int32_t)(cs + cb) - (int32_t)std::min(div255(cs * ab), div255(cb * as)); break;
+                case FILTER_BLEND_DIFFERENCE: v = (int32_t)(cs + cb) - 2 * (int32_t)std::min(div255(cs * ab), div255(cb * as)); break;
+                case FILTER_BLEND_EXCLUSION: v = (int32_t)(cs + cb) - 2 * (int32_t)div255(cs * cb); break;
+                }
+
+                out |= (uint32_t)std::min(255, std::max(0, v)) << shift;
+            }
+
+            return out;
+        }
+
+        static bool hasFastBlend(int mode) { return mode <= FILTER_BLEND_EXCLUSION; }
+
+        static void blend(const uint32_t* s, const uint32_t* b, uint32_t* dst, int n, int mode)
+        {
+            if (!hasFastBlend(mode))
+            {
+                blendReference(s, b, dst, n, mode);
+                return;
+            }
+
+            int i = 0;
+
+#if defined(WAAVS_KERNELS_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i v255 = _mm_set1_epi16(255);
+            const __m128i alphaMask = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+
+            for (; i + 4 <= n; i += 4)
+            {
+                __m128i ps = _mm_loadu_si128((const __m128i*)(s + i));
+                __m128i pb = _mm_loadu_si128((const __m128i*)(b + i));
+
+                __m128i halves[2];
+                for (int h = 0; h < 2; h++)
+                {
+                    __m128i cs = h ? _mm_unpackhi_epi8(ps, zero) : _mm_unpacklo_epi8(ps, zero);
+                    __m128i cb = h ? _mm_unpackhi_epi8(pb, zero) : _mm_unpacklo_epi8(pb, zero);
+                    __m128i as = alphas16(cs);
+                    __m128i ab = alphas16(cb);
+                    __m128i sum = _mm_add_epi16(cs, cb);
+
+                    __m128i r{};
+                    switch (mode)
+                    {
+                    case FILTER_BLEND_NORMAL:
+                        r = _mm_add_epi16(cs, div255x8(_mm_mullo_epi16(cb, _mm_sub_epi16(v255, as))));
+                        break;
+                    case FILTER_BLEND_MULTIPLY:
+                        r = div255x8(_mm_adds_epu16(_mm_adds_epu16(_mm_mullo_epi16(cs, _mm_sub_epi16(v255, ab)), _mm_mullo_epi16(cb, _mm_sub_epi16(v255, as))), _mm_mullo_epi16(cs, cb)));
+                        break;
+                    case FILTER_BLEND_SCREEN:
+                        r = _mm_sub_epi16(sum, div255x8(_mm_mullo_epi16(cs, cb)));
+                        break;
+                    case FILTER_BLEND_DARKEN:
+                        r = _mm_sub_epi16(sum, _mm_max_epi16(div255x8(_mm_mullo_epi16(cs, ab)), div255x8(_mm_mullo_epi16(cb, as))));
+                        break;
+                    case FILTER_BLEND_LIGHTEN:
+                        r = _mm_sub_epi16(sum, _mm_min_epi16(div255x8(_mm_mullo_epi16(cs, ab)), div255x8(_mm_mullo_epi16(cb, as))));
+                        break;
+                    case FILTER_BLEND_DIFFERENCE:
+                    {
+                        __m128i m = _mm_min_epi16(div255x8(_mm_mullo_epi16(cs, ab)), div255x8(_mm_mullo_epi16(cb, as)));
+                        r = _mm_sub_epi16(sum, _mm_add_epi16(m, m));
+                        break;
+                    }
+                    case FILTER_BLEND_EXCLUSION:
+                    {
+                        __m128i m = div255x8(_mm_mullo_epi16(cs, cb));
+                        r = _mm_sub_epi16(sum, _mm_add_epi16(m, m));
+                        break;
+                    }
+                    }
+
+                    // alpha is always as + ab - as * ab
+                    __m128i ra = _mm_sub_epi16(_mm_add_epi16(as, ab), div255x8(_mm_mullo_epi16(as, ab)));
+                    r = _mm_max_epi16(r, zero);
+                    halves[h] = _mm_or_si128(_mm_and_si128(alphaMask, ra), _mm_andnot_si128(alphaMask, r));
+                }
+
+                _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(halves[0], halves[1]));
+            }
+#endif
+
+            for (; i < n; i++)
+                dst[i] = blendPixel(s[i], b[i], mode);
+        }
+    };
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+//
+// Lighting, for feDiffuseLighting
+//
+// The alpha channel of the input is treated as a height map.  Surface
+// normals come from a Sobel filter over it, and each pixel is lit by a
+// distant, point or spot light, giving an opaque image.
+//
+// Work is done in tiles, spread across the worker pool.  Each tile's
+// alpha, plus a one pixel border, is gathered into a float buffer
+// first, with transparent black beyond the input, so the inner loop
+// never tests for edges.  It does four pixels at a time with SSE2.  The
+// specification uses different Sobel kernels along the edges of the
+// filter region.  Those few pixels are redone afterwards by the
+// reference version, shadePixelReference(), which handles any pixel.
+//
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "filterengine.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_LIGHTING_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    enum FilterLightType : int
+    {
+        FILTER_LIGHT_DISTANT = 0,
+        FILTER_LIGHT_POINT,
+        FILTER_LIGHT_SPOT,
+    };
+
+    // LightSource
+    // A light, already in filter space
+    struct LightSource
+    {
+        int fType{ FILTER_LIGHT_DISTANT };
+        double fDirection[3]{ 0, 0, 1 };    // distant, unit vector towards the light
+        double fPosition[3]{ 0, 0, 0 };     // point and spot
+        double fSpotAxis[3]{ 0, 0, -1 };    // spot, unit vector from the light to where it points
+        double fSpecularExponent{ 1 };      // spot
+        double fCosCone{ -2 };              // spot, no limit when below -1
+    };
+
+    struct DiffuseLightingParams
+    {
+        LightSource fLight{};
+        double fSurfaceScale{ 1 };
+        double fDiffuseConstant{ 1 };
+        double fColor[3]{ 1, 1, 1 };        // lighting-color, R, G, B, 0..1
+    };
+
+
+    struct DiffuseLighting
+    {
+        // How much of the light gets to a surface point, given the unit
+        // vector from the point to the light.  Only spot lights vary.
+        static inline double spotFactor(const LightSource& light, double lx, double ly, double lz)
+        {
+            if (light.fType != FILTER_LIGHT_SPOT)
+                return 1.0;
+
+            double minusLS = -(lx * light.fSpotAxis[0] + ly * light.fSpotAxis[1] + lz * light.fSpotAxis[2]);
+            if ((minusLS <= 0) || (minusLS < light.fCosCone))
+                return 0.0;
+
+            return std::pow(minusLS, light.fSpecularExponent);
+        }
+
+        static inline uint32_t toPixel(const DiffuseLightingParams& p, double factor)
+        {
+            uint32_t out = 0xff000000u;
+            for (int k = 0; k < 3; k++)
+            {
+                double v = std::min(1.0, std::max(0.0, factor * p.fColor[k]));
+                out |= (uint32_t)std::lround(v * 255.0) << (16 - k * 8);
+            }
+
+            return out;
+        }
+
+        // The lit color at (x, y, z), where the surface normal is (nx, ny, 1)
+        static uint32_t shadeNormal(const DiffuseLightingParams& p, double nx, double ny, double x, double y, double z)
+        {
+            double lx, ly, lz;
+            if (p.fLight.fType == FILTER_LIGHT_DISTANT)
+            {
+                lx = p.fLight.fDirection[0];
+                ly = p.fLight.fDirection[1];
+                lz = p.fLight.fDirection[2];
+            }
+            else
+            {
+                lx = p.fLight.fPosition[0] - x;
+                ly = p.fLight.fPosition[1] - y;
+                lz = p.fLight.fPosition[2] - z;
+                double len = std::sqrt(lx * lx + ly * ly + lz * lz);
+                if (len > 0)
+                {
+                    lx /= len;
+                    ly /= len;
+                    lz /= len;
+                }
+            }
+
+            double nDotL = (nx * lx + ny * ly + lz) / std::sqrt(nx * nx + ny * ny + 1.0);
+            double factor = p.fDiffuseConstant * std::max(0.0, nDotL) * spotFactor(p.fLight, lx, ly, lz);
+
+            return toPixel(p, factor);
+        }
+
+        // shadePixelReference
+        // One pixel, with the Sobel kernels the specification gives for
+        // the edges and corners of 'bounds'.  Those all come down to a
+        // weighted sum of differences, across whichever neighbours exist.
+        static uint32_t shadePixelReference(const DiffuseLightingParams& p, const FilterImage& in, const BLRectI& bounds, int x, int y)
+        {
+            auto A = [&in](int ax, int ay) { return FilterPixels::alphaAt(in, ax, ay) / 255.0; };
+
+            bool hasL = x > bounds.x;
+            bool hasR = x < bounds.x + bounds.w - 1;
+            bool hasU = y > bounds.y;
+            bool hasD = y < bounds.y + bounds.h - 1;
+
+            int xl = hasL ? x - 1 : x;
+            int xr = hasR ? x + 1 : x;
+            int yu = hasU ? y - 1 : y;
+            int yd = hasD ? y + 1 : y;
+
+            // x gradient, over the rows that exist, the middle one counting double
+            double gx = 0, wx = 0;
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                if ((dy < 0 && !hasU) || (dy > 0 && !hasD))
+                    continue;
+                double w = (dy == 0) ? 2.0 : 1.0;
+                gx += w * (A(xr, y + dy) - A(xl, y + dy));
+                wx += w * (xr - xl);
+            }
+
+            double gy = 0, wy = 0;
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                if ((dx < 0 && !hasL) || (dx > 0 && !hasR))
+                    continue;
+                double w = (dx == 0) ? 2.0 : 1.0;
+                gy += w * (A(x + dx, yd) - A(x + dx, yu));
+                wy += w * (yd - yu);
+            }
+
+            double nx = (wx > 0) ? -p.fSurfaceScale * 2.0 * gx / wx : 0.0;
+            double ny = (wy > 0) ? -p.fSurfaceScale * 2.0 * gy / wy : 0.0;
+
+            return shadeNormal(p, nx, ny, x, y, p.fSurfaceScale * A(x, y));
+        }
+
+        // shadeTile
+        // Every pixel of 'tile' with the interior Sobel kernel,
+        // 'buf' being scratch space for the gathered alpha
+        static void shadeTile(const DiffuseLightingParams& p, const FilterImage& in, const BLRectI& tile, FilterImage& out, std::vector<float>& buf)
+        {
+            // alpha, with a border of one pixel, and room for loads to overrun
+            int stride = tile.w + 2 + 4;
+            buf.assign((size_t)stride * (tile.h + 2), 0.0f);
+
+            BLRectI src = FilterPixels::intersect(BLRectI(tile.x - 1, tile.y - 1, tile.w + 2, tile.h + 2), in.fRect);
+            if (!in.isEmpty() && !FilterPixels::isEmpty(src))
+            {
+                for (int y = src.y; y < src.y + src.h; y++)
+                {
+                    float* d = buf.data() + (size_t)(y - tile.y + 1) * stride + (src.x - tile.x + 1);
+                    if (in.isAlphaOnly())
+                    {
+                        const uint8_t* s = in.row(y) + (src.x - in.fRect.x);
+                        for (int x = 0; x < src.w; x++)
+                            d[x] = s[x] * (1.0f / 255.0f);
+                    }
+                    else
+                    {
+                        const uint32_t* s = in.pixels(src.x, y);
+                        for (int x = 0; x < src.w; x++)
+                            d[x] = (s[x] >> 24) * (1.0f / 255.0f);
+                    }
+                }
+            }
+
+            const float ss = (float)(-p.fSurfaceScale * 0.25);
+            const LightSource& light = p.fLight;
+
+            for (int y = 0; y < tile.h; y++)
+            {
+                const float* up = buf.data() + (size_t)y * stride + 1;
+                const float* mid = up + stride;
+                const float* down = mid + stride;
+                uint32_t* dst = out.pixels(tile.x, tile.y + y);
+                double py = tile.y + y;
+
+                int x = 0;
+
+#if defined(WAAVS_LIGHTING_SSE2)
+                const __m128 vss = _mm_set1_ps(ss);
+                const __m128 two = _mm_set1_ps(2.0f);
+                const __m128 one = _mm_set1_ps(1.0f);
+                const __m128 zero = _mm_setzero_ps();
+                const __m128 kd = _mm_set1_ps((float)p.fDiffuseConstant);
+                const __m128 surface = _mm_set1_ps((float)p.fSurfaceScale);
+                const __m128 laneX = _mm_setr_ps(0, 1, 2, 3);
+
+                for (; x + 4 <= tile.w; x += 4)
+                {
+                    __m128 ul = _mm_loadu_ps(up + x - 1), uc = _mm_loadu_ps(up + x), ur = _mm_loadu_ps(up + x + 1);
+                    __m128 ml = _mm_loadu_ps(mid + x - 1), mc = _mm_loadu_ps(mid + x), mr = _mm_loadu_ps(mid + x + 1);
+                    __m128 dl = _mm_loadu_ps(down + x - 1), dc = _mm_loadu_ps(down + x), dr = _mm_loadu_ps(down + x + 1);
+
+                    __m128 gx = _mm_add_ps(_mm_add_ps(_mm_sub_ps(ur, ul), _mm_sub_ps(dr, dl)), _mm_mul_ps(two, _mm_sub_ps(mr, ml)));
+                    __m128 gy = _mm_add_ps(_mm_add_ps(_mm_sub_ps(dl, ul), _mm_sub_ps(dr, ur)), _mm_mul_ps(two, _mm_sub_ps(dc, uc)));
+                    __m128 nx = _mm_mul_ps(vss, gx);
+                    __m128 ny = _mm_mul_ps(vss, gy);
+
+                    __m128 lx, ly, lz;
+                    if (light.fType == FILTER_LIGHT_DISTANT)
+                    {
+                        lx = _mm_set1_ps((float)light.fDirection[0]);
+                        ly = _mm_set1_ps((float)light.fDirection[1]);
+                        lz = _mm_set1_ps((float)light.fDirection[2]);
+                    }
+                    else
+                    {
+                        __m128 px = _mm_add_ps(_mm_set1_ps((float)(tile.x + x)), laneX);
+                        lx = _mm_sub_ps(_mm_set1_ps((float)light.fPosition[0]), px);
+                        ly = _mm_set1_ps((float)(light.fPosition[1] - py));
+                        lz = _mm_sub_ps(_mm_set1_ps((float)light.fPosition[2]), _mm_mul_ps(surface, mc));
+
+                        __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz)));
+                        __m128 inv = _mm_div_ps(one, _mm_max_ps(len, _mm_set1_ps(1e-12f)));
+                        lx = _mm_mul_ps(lx, inv);
+                        ly = _mm_mul_ps(ly, inv);
+                        lz = _mm_mul_ps(lz, inv);
+                    }
+
+                    __m128 nLen = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), one));
+                    __m128 nDotL = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, lx), _mm_mul_ps(ny, ly)), lz), nLen);
+                    __m128 factor = _mm_mul_ps(kd, _mm_max_ps(nDotL, zero));
+
+                    alignas(16) float f[4];
+                    _mm_store_ps(f, factor);
+
+                    if (light.fType == FILTER_LIGHT_SPOT)
+                    {
+                        alignas(16) float vx[4], vy[4], vz[4];
+                        _mm_store_ps(vx, lx);
+                        _mm_store_ps(vy, ly);
+                        _mm_store_ps(vz, lz);
+                        for (int i = 0; i < 4; i++)
+                            f[i] *= (float)spotFactor(light, vx[i], vy[i], vz[i]);
+                    }
+
+                    for (int i = 0; i < 4; i++)
+                        dst[x + i] = toPixel(p, f[i]);
+                }
+#endif
+
+                for (; x < tile.w; x++)
+                {
+                    double gx = (up[x + 1] - up[x - 1]) + 2.0 * (mid[x + 1] - mid[x - 1]) + (down[x + 1] - down[x - 1]);
+                    double gy = (down[x - 1] - up[x - 1]) + 2.0 * (down[x] - up[x]) + (down[x + 1] - up[x + 1]);
+
+                    dst[x] = shadeNormal(p, ss * gx, ss * gy, tile.x + x, py, p.fSurfaceScale * mid[x]);
+                }
+            }
+        }
+
+        // render
+        // Light all of 'out', from the alpha of 'in'.  'bounds' is the
+        // filter region, whose edges get their own Sobel kernels.
+        static bool render(const DiffuseLightingParams& p, const FilterImage& in, const BLRectI& bounds, FilterImage& out)
+        {
+            if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, false))
+                return false;
+
+            FilterPixels::forEachTile(out.fRect, [&](const BLRectI& tile) {
+                std::vector<float> buf;
+                shadeTile(p, in, tile, out, buf);
+            });
+
+            // The pixels along the edges of the filter region
+            const BLRectI& r = out.fRect;
+            auto fixRow = [&](int y) {
+                if ((y >= r.y) && (y < r.y + r.h))
+                    for (int x = r.x; x < r.x + r.w; x++)
+                        out.pixels(x, y)[0] = shadePixelReference(p, in, bounds, x, y);
+            };
+            auto fixColumn = [&](int x) {
+                if ((x >= r.x) && (x < r.x + r.w))
+                    for (int y = r.y; y < r.y + r.h; y++)
+                        out.pixels(x, y)[0] = shadePixelReference(p, in, bounds, x, y);
+            };
+
+            fixRow(bounds.y);
+            fixRow(bounds.y + bounds.h - 1);
+            fixColumn(bounds.x);
+            fixColumn(bounds.x + bounds.w - 1);
+
+            return true;
+        }
+    };
+}
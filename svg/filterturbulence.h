@@ -0,0 +1,431 @@
+#pragma once
+
+//
+// Perlin turbulence, for feTurbulence
+//
+// The specification gives its algorithm as reference code, and the
+// results are expected to match it, so turbulenceReference() below is
+// that code, cleaned up a bit.  It evaluates each of the four channels
+// separately, working out the same lattice cell four times over.
+//
+// The working version does the lattice arithmetic once per pixel and
+// octave, then evaluates all four channels together, with the gradient
+// tables laid out so the R, G, B and A gradients of a lattice point
+// sit side by side in one vector.  The tables for a seed are built
+// once, and shared by every feTurbulence using that seed.  Rows are
+// spread across the worker pool.
+//
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "filterengine.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_TURBULENCE_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    // TurbulenceLattice
+    // The permutation and gradient tables for one seed
+    struct TurbulenceLattice
+    {
+        static constexpr int kSize = 0x100;
+        static constexpr int kMask = 0xff;
+        static constexpr int kPerlinN = 0x1000;
+        static constexpr int kEntries = kSize + kSize + 2;
+
+        int fSelector[kEntries]{};
+        double fGradient[4][kEntries][2]{};
+
+        // The same gradients, the four channels of each entry together
+        alignas(16) float fGradX[kEntries][4]{};
+        alignas(16) float fGradY[kEntries][4]{};
+
+
+        static long setupSeed(long seed)
+        {
+            if (seed <= 0)
+                seed = -(seed % (2147483647 - 1)) + 1;
+            if (seed > 2147483647 - 1)
+                seed = 2147483647 - 1;
+
+            return seed;
+        }
+
+        static long random(long seed)
+        {
+            long result = 16807 * (seed % 127773) - 2836 * (seed / 127773);
+            if (result <= 0)
+                result += 2147483647;
+
+            return result;
+        }
+
+        explicit TurbulenceLattice(long seed)
+        {
+            seed = setupSeed(seed);
+
+            int i = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                for (i = 0; i < kSize; i++)
+                {
+                    fSelector[i] = i;
+                    for (int j = 0; j < 2; j++)
+                    {
+                        seed = random(seed);
+                        fGradient[k][i][j] = (double)((seed % (kSize + kSize)) - kSize) / kSize;
+                    }
+
+                    double s = std::sqrt(fGradient[k][i][0] * fGradient[k][i][0] + fGradient[k][i][1] * fGradient[k][i][1]);
+                    fGradient[k][i][0] /= s;
+                    fGradient[k][i][1] /= s;
+                }
+            }
+
+            while (--i)
+            {
+                int k = fSelector[i];
+                seed = random(seed);
+                int j = (int)(seed % kSize);
+                fSelector[i] = fSelector[j];
+                fSelector[j] = k;
+            }
+
+            for (i = 0; i < kSize + 2; i++)
+            {
+                fSelector[kSize + i] = fSelector[i];
+                for (int k = 0; k < 4; k++)
+                    for (int j = 0; j < 2; j++)
+                        fGradient[k][kSize + i][j] = fGradient[k][i][j];
+            }
+
+            for (i = 0; i < kEntries; i++)
+            {
+                for (int k = 0; k < 4; k++)
+                {
+                    fGradX[i][k] = (float)fGradient[k][i][0];
+                    fGradY[i][k] = (float)fGradient[k][i][1];
+                }
+            }
+        }
+
+        // Tables for a seed, built the first time it's asked for
+        static std::shared_ptr<const TurbulenceLattice> forSeed(long seed)
+        {
+            static constexpr size_t kMaxCached = 16;
+            static std::mutex sLock;
+            static auto* sCache = new std::map<long, std::shared_ptr<const TurbulenceLattice>>();
+
+            std::lock_guard<std::mutex> lock(sLock);
+
+            auto it = sCache->find(seed);
+            if (it != sCache->end())
+                return it->second;
+
+            if (sCache->size() >= kMaxCached)
+                sCache->clear();
+
+            auto lattice = std::make_shared<const TurbulenceLattice>(seed);
+            (*sCache)[seed] = lattice;
+
+            return lattice;
+        }
+    };
+
+
+    // TurbulenceParams
+    // The attributes of an feTurbulence, with the tile for
+    // stitching being the primitive subregion, in user space
+    struct TurbulenceParams
+    {
+        double fBaseFreqX{ 0 };
+        double fBaseFreqY{ 0 };
+        int fOctaves{ 1 };
+        bool fFractalNoise{ false };
+        bool fStitch{ false };
+        BLRect fTile{};
+    };
+
+
+    struct Turbulence
+    {
+        struct StitchInfo
+        {
+            int fWidth{ 0 };
+            int fHeight{ 0 };
+            int fWrapX{ 0 };
+            int fWrapY{ 0 };
+        };
+
+        // Frequencies adjusted so the tile holds a whole number of
+        // lattice cells, and the matching stitch info for octave 0
+        static void setupStitch(TurbulenceParams& p, StitchInfo& stitch)
+        {
+            const BLRect& tile = p.fTile;
+
+            if (p.fBaseFreqX != 0.0)
+            {
+                double lo = std::floor(tile.w * p.fBaseFreqX) / tile.w;
+                double hi = std::ceil(tile.w * p.fBaseFreqX) / tile.w;
+                p.fBaseFreqX = ((lo > 0) && (p.fBaseFreqX / lo < hi / p.fBaseFreqX)) ? lo : hi;
+            }
+
+            if (p.fBaseFreqY != 0.0)
+            {
+                double lo = std::floor(tile.h * p.fBaseFreqY) / tile.h;
+                double hi = std::ceil(tile.h * p.fBaseFreqY) / tile.h;
+                p.fBaseFreqY = ((lo > 0) && (p.fBaseFreqY / lo < hi / p.fBaseFreqY)) ? lo : hi;
+            }
+
+            stitch.fWidth = (int)(tile.w * p.fBaseFreqX + 0.5);
+            stitch.fWrapX = (int)(tile.x * p.fBaseFreqX + TurbulenceLattice::kPerlinN + stitch.fWidth);
+            stitch.fHeight = (int)(tile.h * p.fBaseFreqY + 0.5);
+            stitch.fWrapY = (int)(tile.y * p.fBaseFreqY + TurbulenceLattice::kPerlinN + stitch.fHeight);
+        }
+
+        static void nextOctave(StitchInfo& stitch)
+        {
+            stitch.fWidth *= 2;
+            stitch.fWrapX = 2 * stitch.fWrapX - TurbulenceLattice::kPerlinN;
+            stitch.fHeight *= 2;
+            stitch.fWrapY = 2 * stitch.fWrapY - TurbulenceLattice::kPerlinN;
+        }
+
+        // The lattice cell a point falls in; the index of its four
+        // corners, and where the point sits inside it
+        struct Cell
+        {
+            int b00, b10, b01, b11;
+            double rx0, ry0;
+        };
+
+        static inline Cell lattice(const TurbulenceLattice& lat, double vx, double vy, const StitchInfo* stitch)
+        {
+            const int* sel = lat.fSelector;
+
+            double t = vx + TurbulenceLattice::kPerlinN;
+            int bx0 = (int)t;
+            int bx1 = bx0 + 1;
+            double rx0 = t - (int)t;
+
+            t = vy + TurbulenceLattice::kPerlinN;
+            int by0 = (int)t;
+            int by1 = by0 + 1;
+            double ry0 = t - (int)t;
+
+            // wrapping is tested before masking, as the wrap
+            // points include the kPerlinN offset too
+            if (nullptr != stitch)
+            {
+                if (bx0 >= stitch->fWrapX) bx0 -= stitch->fWidth;
+                if (bx1 >= stitch->fWrapX) bx1 -= stitch->fWidth;
+                if (by0 >= stitch->fWrapY) by0 -= stitch->fHeight;
+                if (by1 >= stitch->fWrapY) by1 -= stitch->fHeight;
+            }
+
+            bx0 &= TurbulenceLattice::kMask;
+            bx1 &= TurbulenceLattice::kMask;
+            by0 &= TurbulenceLattice::kMask;
+            by1 &= TurbulenceLattice::kMask;
+
+            int i = sel[bx0];
+            int j = sel[bx1];
+
+            return Cell{ sel[i + by0], sel[j + by0], sel[i + by1], sel[j + by1], rx0, ry0 };
+        }
+
+        static inline double sCurve(double t) { return t * t * (3.0 - 2.0 * t); }
+
+
+        //==================================================
+        // Reference
+        //==================================================
+        static double noise2Reference(const TurbulenceLattice& lat, int channel, double vx, double vy, const StitchInfo* stitch)
+        {
+            Cell c = lattice(lat, vx, vy, stitch);
+
+            double rx0 = c.rx0;
+            double rx1 = rx0 - 1.0;
+            double ry0 = c.ry0;
+            double ry1 = ry0 - 1.0;
+            double sx = sCurve(rx0);
+            double sy = sCurve(ry0);
+
+            const double* q = lat.fGradient[channel][c.b00];
+            double u = rx0 * q[0] + ry0 * q[1];
+            q = lat.fGradient[channel][c.b10];
+            double v = rx1 * q[0] + ry0 * q[1];
+            double a = u + sx * (v - u);
+
+            q = lat.fGradient[channel][c.b01];
+            u = rx0 * q[0] + ry1 * q[1];
+            q = lat.fGradient[channel][c.b11];
+            v = rx1 * q[0] + ry1 * q[1];
+            double b = u + sx * (v - u);
+
+            return a + sy * (b - a);
+        }
+
+        // 'p' already has its frequencies adjusted for stitching
+        static double turbulenceReference(const TurbulenceLattice& lat, int channel, const TurbulenceParams& p, const StitchInfo& stitch0, double px, double py)
+        {
+            StitchInfo stitch = stitch0;
+            const StitchInfo* pStitch = p.fStitch ? &stitch : nullptr;
+
+            double sum = 0;
+            double vx = px * p.fBaseFreqX;
+            double vy = py * p.fBaseFreqY;
+            double ratio = 1;
+
+            for (int octave = 0; octave < p.fOctaves; octave++)
+            {
+                double n = noise2Reference(lat, channel, vx, vy, pStitch);
+                sum += (p.fFractalNoise ? n : std::fabs(n)) / ratio;
+
+                vx *= 2;
+                vy *= 2;
+                ratio *= 2;
+
+                if (nullptr != pStitch)
+                    nextOctave(stitch);
+            }
+
+            return sum;
+        }
+
+        // The four channel sums, R, G, B, A, as a premultiplied pixel
+        static inline uint32_t toPixel(const double* sum, bool fractalNoise)
+        {
+            uint32_t c[4];
+            for (int k = 0; k < 4; k++)
+            {
+                double v = fractalNoise ? (sum[k] * 255.0 + 255.0) / 2.0 : sum[k] * 255.0;
+                c[k] = (uint32_t)std::lround(std::min(255.0, std::max(0.0, v)));
+            }
+
+            uint32_t a = c[3];
+            return (a << 24) | (((c[0] * a + 127) / 255) << 16) | (((c[1] * a + 127) / 255) << 8) | ((c[2] * a + 127) / 255);
+        }
+
+        // 'n' pixels along a row, the first at 'pt' in user space,
+        // each one 'step' further on
+        static void renderRowReference(const TurbulenceLattice& lat, const TurbulenceParams& p, const StitchInfo& stitch, BLPoint pt, BLPoint step, uint32_t* dst, int n)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                double sum[4];
+                for (int k = 0; k < 4; k++)
+                    sum[k] = turbulenceReference(lat, k, p, stitch, pt.x + step.x * i, pt.y + step.y * i);
+
+                dst[i] = toPixel(sum, p.fFractalNoise);
+            }
+        }
+
+
+        //==================================================
+        // Working version
+        //==================================================
+        static void renderRow(const TurbulenceLattice& lat, const TurbulenceParams& p, const StitchInfo& stitch0, BLPoint pt, BLPoint step, uint32_t* dst, int n)
+        {
+#if defined(WAAVS_TURBULENCE_SSE2)
+            const __m128 signMask = _mm_set1_ps(-0.0f);
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 v255 = _mm_set1_ps(255.0f);
+            const __m128 half255 = _mm_set1_ps(127.5f);
+            const __m128 rgbMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+            for (int i = 0; i < n; i++)
+            {
+                StitchInfo stitch = stitch0;
+                const StitchInfo* pStitch = p.fStitch ? &stitch : nullptr;
+
+                double vx = (pt.x + step.x * i) * p.fBaseFreqX;
+                double vy = (pt.y + step.y * i) * p.fBaseFreqY;
+                float scale = 1.0f;
+
+                __m128 sum = zero;
+                for (int octave = 0; octave < p.fOctaves; octave++)
+                {
+                    Cell c = lattice(lat, vx, vy, pStitch);
+
+                    __m128 rx0 = _mm_set1_ps((float)c.rx0);
+                    __m128 ry0 = _mm_set1_ps((float)c.ry0);
+                    __m128 rx1 = _mm_sub_ps(rx0, one);
+                    __m128 ry1 = _mm_sub_ps(ry0, one);
+                    __m128 sx = _mm_set1_ps((float)sCurve(c.rx0));
+                    __m128 sy = _mm_set1_ps((float)sCurve(c.ry0));
+
+                    __m128 u = _mm_add_ps(_mm_mul_ps(rx0, _mm_load_ps(lat.fGradX[c.b00])), _mm_mul_ps(ry0, _mm_load_ps(lat.fGradY[c.b00])));
+                    __m128 v = _mm_add_ps(_mm_mul_ps(rx1, _mm_load_ps(lat.fGradX[c.b10])), _mm_mul_ps(ry0, _mm_load_ps(lat.fGradY[c.b10])));
+                    __m128 a = _mm_add_ps(u, _mm_mul_ps(sx, _mm_sub_ps(v, u)));
+
+                    u = _mm_add_ps(_mm_mul_ps(rx0, _mm_load_ps(lat.fGradX[c.b01])), _mm_mul_ps(ry1, _mm_load_ps(lat.fGradY[c.b01])));
+                    v = _mm_add_ps(_mm_mul_ps(rx1, _mm_load_ps(lat.fGradX[c.b11])), _mm_mul_ps(ry1, _mm_load_ps(lat.fGradY[c.b11])));
+                    __m128 b = _mm_add_ps(u, _mm_mul_ps(sx, _mm_sub_ps(v, u)));
+
+                    __m128 noise = _mm_add_ps(a, _mm_mul_ps(sy, _mm_sub_ps(b, a)));
+                    if (!p.fFractalNoise)
+                        noise = _mm_andnot_ps(signMask, noise);
+
+                    sum = _mm_add_ps(sum, _mm_mul_ps(noise, _mm_set1_ps(scale)));
+
+                    vx *= 2;
+                    vy *= 2;
+                    scale *= 0.5f;
+
+                    if (nullptr != pStitch)
+                        nextOctave(stitch);
+                }
+
+                // to 0..255, then premultiplied, lanes R, G, B, A
+                __m128 c = p.fFractalNoise ? _mm_add_ps(_mm_mul_ps(sum, half255), half255) : _mm_mul_ps(sum, v255);
+                c = _mm_min_ps(_mm_max_ps(c, zero), v255);
+                c = _mm_cvtepi32_ps(_mm_cvtps_epi32(c));
+
+                __m128 alpha = _mm_mul_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)), _mm_set1_ps(1.0f / 255.0f));
+                c = _mm_mul_ps(c, _mm_or_ps(_mm_and_ps(rgbMask, alpha), _mm_andnot_ps(rgbMask, one)));
+
+                // B, G, R, A in memory
+                __m128 bgra = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 1, 2));
+
+                __m128i iv = _mm_cvtps_epi32(bgra);
+                iv = _mm_packs_epi32(iv, iv);
+                dst[i] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(iv, iv));
+            }
+#else
+            renderRowReference(lat, p, stitch0, pt, step, dst, n);
+#endif
+        }
+
+        // render
+        // Fill all of 'out', 'filterToUser' being the inverse of the
+        // filter space transform.  'params' is copied, as stitching
+        // adjusts the frequencies.
+        static void render(const TurbulenceLattice& lat, TurbulenceParams params, const BLMatrix2D& filterToUser, FilterImage& out)
+        {
+            StitchInfo stitch{};
+            if (params.fStitch)
+                setupStitch(params, stitch);
+
+            BLPoint step(filterToUser.m00, filterToUser.m01);
+
+            FilterPixels::forEachBand(out.fRect, [&](int y0, int y1) {
+                for (int y = y0; y < y1; y++)
+                {
+                    BLPoint pt = filterToUser.mapPoint(BLPoint(out.fRect.x, y));
+                    renderRow(lat, params, stitch, pt, step, out.pixels(out.fRect.x, y), out.fRect.w);
+                }
+            });
+        }
+    };
+}
@@ -5,10 +5,13 @@
 
 
 #include <algorithm>
+#include <array>
 #include <vector>
 #include <memory>
 #include <map>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 
 
@@ -16,6 +19,9 @@
 #include "blend2d.h"
 #include "maths.h"
 #include "bspan.h"
+#include "bithacks.h"
+#include "shapedtext.h"
+#include "fontindex.h"
 
 
 
@@ -34,10 +40,45 @@ namespace waavs {
     class FontHandler
     {
     public:
+        // Memo of fonts already selected
+        // Selecting a font means parsing a family list, querying the
+        // font manager for each candidate, and creating a BLFont.  The
+        // same few combinations are asked for over and over again while
+        // walking a document, so we remember what we've handed out.
+        // The memo is split into shards, each with its own lock, so
+        // multiple rendering threads don't all contend for one lock.
+        static constexpr size_t kFontMemoShards = 16;
+        static constexpr size_t kFontMemoShardCapacity = 256;
+
+        struct FontMemoEntry
+        {
+            std::string fFamilies{};
+            float fSize{ 0 };
+            uint32_t fStyle{ 0 };
+            uint32_t fWeight{ 0 };
+            uint32_t fStretch{ 0 };
+            BLFont fFont{};
+        };
+
+        struct FontMemoShard
+        {
+            std::mutex fLock{};
+            std::unordered_map<uint64_t, FontMemoEntry> fEntries{};
+        };
+
+        mutable std::array<FontMemoShard, kFontMemoShards> fFontMemo{};
+
+
         // Typography
-        BLFontManager fFontManager{};
+        // The font manager is mutable, because faces from the font
+        // index are only loaded into it when they're first selected
+        mutable BLFontManager fFontManager{};
         std::vector<std::string> fFamilyNames{};
 
+        // Index of fonts that are known about, but not loaded yet
+        mutable FontIndex fFontIndex{};
+        mutable std::mutex fFontIndexLock{};
+
         // For size helper
         int fDotsPerInch = 1;
         float fUnitsPerInch = 1;
@@ -79,6 +120,31 @@ namespace waavs {
         {
             fDotsPerInch = dpi;
             fUnitsPerInch = unitsPerInch;
+
+            clearFontMemo();
+        }
+
+        // Forget previously selected fonts, because the set
+        // of available faces, or the size units, have changed
+        void clearFontMemo() const
+        {
+            for (auto& shard : fFontMemo)
+            {
+                std::lock_guard<std::mutex> lock(shard.fLock);
+                shard.fEntries.clear();
+            }
+        }
+
+        static uint64_t fontMemoKey(const ByteSpan& names, float sz, uint32_t style, uint32_t weight, uint32_t stretch)
+        {
+            uint64_t h = fnv1a_64(names.data(), names.size());
+            uint32_t params[4]{};
+            memcpy(&params[0], &sz, sizeof(float));
+            params[1] = style;
+            params[2] = weight;
+            params[3] = stretch;
+
+            return (h ^ fnv1a_64(params, sizeof(params))) * FNV1A_64_PRIME;
         }
 
         const std::vector<std::string>& familyNames() const { return fFamilyNames; }
@@ -103,6 +169,8 @@ namespace waavs {
                 
                 fFontManager.addFace(ff);
                 fFamilyNames.push_back(std::string(ff.familyName().data()));
+                clearFontMemo();
+
                 return true;
             }
             else {
@@ -113,6 +181,61 @@ namespace waavs {
             return false;
         }
 
+        // Index the fonts in a directory, without loading them
+        // Faces are loaded the first time their family is selected.
+        // If cacheFile is given, the metadata is persisted there, so
+        // unchanged files don't need to be opened at all next time.
+        bool indexFontDirectory(const char* dir, const char* cacheFile = nullptr)
+        {
+            std::lock_guard<std::mutex> lock(fFontIndexLock);
+
+            if (!fFontIndex.indexDirectory(dir, cacheFile))
+                return false;
+
+            for (auto& family : fFontIndex.fFamilies)
+            {
+                const FontIndexEntry& e = fFontIndex.fEntries[family.second.front()];
+                const std::string& name = (FontIndex::lowerCase(e.fTypoFamily) == family.first) ? e.fTypoFamily : e.fFamily;
+
+                if (std::find(fFamilyNames.begin(), fFamilyNames.end(), name) == fFamilyNames.end())
+                    fFamilyNames.push_back(name);
+            }
+
+            clearFontMemo();
+
+            return true;
+        }
+
+        // Load any indexed faces of the named family
+        // that have not been loaded yet
+        void ensureFamilyLoaded(const ByteSpan& name) const
+        {
+            std::lock_guard<std::mutex> lock(fFontIndexLock);
+
+            if (fFontIndex.fEntries.empty())
+                return;
+
+            auto entries = fFontIndex.familyEntries(std::string((const char*)name.data(), name.size()));
+            if (nullptr == entries)
+                return;
+
+            for (size_t idx : *entries)
+            {
+                FontIndexEntry& e = fFontIndex.fEntries[idx];
+                if (e.fLoaded)
+                    continue;
+
+                // whether it works or not, we only try once
+                e.fLoaded = true;
+
+                BLFontFace ff{};
+                if (BL_SUCCESS == ff.createFromFile(e.fPath.c_str()))
+                    fFontManager.addFace(ff);
+                else
+                    printf("FontHandler::ensureFamilyLoaded Error: %s\n", e.fPath.c_str());
+            }
+        }
+
         // Load the list of font files into 
         // the font manager
         bool loadFonts(std::vector<const char*> fontNames)
@@ -179,18 +302,22 @@ namespace waavs {
                     (name == "Helvetica") ||
                     (name == "sans-serif")) 
                 {
+                    ensureFamilyLoaded("Arial");
                     success = (BL_SUCCESS == fFontManager.queryFace("Arial", qprops, face));
                 }
 				else if ((name == "Serif") ||
 					(name == "serif")) {
+                    ensureFamilyLoaded("Georgia");
 					success = (BL_SUCCESS == fFontManager.queryFace("Georgia", qprops, face));  // Times New Roman, Garamond, Georgia
 				}
 				else if ((name == "Mono") ||
 					(name == "mono") ||
 					(name == "monospace")) {
+                    ensureFamilyLoaded("Consolas");
 					success = (BL_SUCCESS == fFontManager.queryFace("Consolas", qprops, face));
 				}
                 else {
+                    ensureFamilyLoaded(name);
                     familyNameView.reset((char*)name.fStart, name.size());
                     success = (BL_SUCCESS == fFontManager.queryFace(familyNameView, qprops, face));
                 }
@@ -204,6 +331,7 @@ namespace waavs {
             }
 
             // last chance, nothing else worked, so try loading our default, Arial
+            ensureFamilyLoaded("Arial");
             bool success = (BL_SUCCESS == fFontManager.queryFace("Arial", qprops, face));
             
 			return success;
@@ -214,6 +342,45 @@ namespace waavs {
 		// If the font is not found, then return the default font
         // which should be Arial
         bool selectFont(const ByteSpan& names, BLFont& font, float sz, uint32_t style = BL_FONT_STYLE_NORMAL, uint32_t weight = BL_FONT_WEIGHT_NORMAL, uint32_t stretch = BL_FONT_STRETCH_NORMAL) const
+        {
+            uint64_t key = fontMemoKey(names, sz, style, weight, stretch);
+            FontMemoShard& shard = fFontMemo[key % kFontMemoShards];
+
+            {
+                std::lock_guard<std::mutex> lock(shard.fLock);
+                auto it = shard.fEntries.find(key);
+                if (it != shard.fEntries.end())
+                {
+                    const FontMemoEntry& e = it->second;
+                    if ((e.fSize == sz) && (e.fStyle == style) && (e.fWeight == weight) && (e.fStretch == stretch) &&
+                        (e.fFamilies.size() == names.size()) && (memcmp(e.fFamilies.data(), names.data(), names.size()) == 0))
+                    {
+                        font = e.fFont;
+                        return true;
+                    }
+                }
+            }
+
+            if (!createFont(names, font, sz, style, weight, stretch))
+                return false;
+
+            std::lock_guard<std::mutex> lock(shard.fLock);
+            if (shard.fEntries.size() >= kFontMemoShardCapacity)
+                shard.fEntries.clear();
+
+            FontMemoEntry& e = shard.fEntries[key];
+            e.fFamilies.assign((const char*)names.data(), names.size());
+            e.fSize = sz;
+            e.fStyle = style;
+            e.fWeight = weight;
+            e.fStretch = stretch;
+            e.fFont = font;
+
+            return true;
+        }
+
+        // Do the actual work of finding a face, and creating a font from it
+        bool createFont(const ByteSpan& names, BLFont& font, float sz, uint32_t style, uint32_t weight, uint32_t stretch) const
         {
             BLFontFace face;
 
@@ -251,11 +418,8 @@ namespace waavs {
 			if (!success)
                 return BLPoint( 0, 0 );
             
-            BLTextMetrics tm{};
-            BLGlyphBuffer gb;
-            gb.setUtf8Text(txt.fStart, txt.size());
-            afont.shape(gb);
-            afont.getTextMetrics(gb, tm);
+            auto run = ShapedTextCache::cache().get(afont, txt);
+            const BLTextMetrics& tm = run->fMetrics;
 
             float cx = (float)(tm.boundingBox.x1 - tm.boundingBox.x0);
             float cy = afont.size();
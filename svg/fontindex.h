@@ -0,0 +1,471 @@
+#pragma once
+
+//
+// FontIndex
+//
+// Opening every font file in a directory, just to find out what
+// families are in there, is very slow when there are thousands of
+// fonts installed.  Instead, we read just enough of each file (the
+// table directory, 'name', and 'OS/2' tables) to know the family name,
+// weight, stretch and style, and keep that in an index.  The actual
+// BLFontFace is only created the first time that family is asked for.
+//
+// The index can also be persisted to a cache file, so that next time
+// around, files that have not changed (same path, mtime, and size)
+// don't even need to be opened.
+//
+// References
+// https://learn.microsoft.com/en-us/typography/opentype/spec/otff
+// https://learn.microsoft.com/en-us/typography/opentype/spec/name
+// https://learn.microsoft.com/en-us/typography/opentype/spec/os2
+//
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_set>
+#include <cstdlib>
+
+#include "blend2d.h"
+
+
+namespace waavs
+{
+    struct FontIndexEntry
+    {
+        std::string fPath{};
+        int64_t fModified{ 0 };
+        uint64_t fFileSize{ 0 };
+
+        std::string fFamily{};          // name id 1
+        std::string fTypoFamily{};      // name id 16, if the font has one
+        uint32_t fWeight{ BL_FONT_WEIGHT_NORMAL };
+        uint32_t fStretch{ BL_FONT_STRETCH_NORMAL };
+        uint32_t fStyle{ BL_FONT_STYLE_NORMAL };
+
+        bool fLoaded{ false };
+    };
+
+
+    struct FontIndex
+    {
+        static constexpr const char* kCacheSignature = "svgandme-fontindex 1";
+
+        std::vector<FontIndexEntry> fEntries{};
+
+        // lower case family name -> indices into fEntries
+        std::unordered_map<std::string, std::vector<size_t>> fFamilies{};
+
+        bool fCacheDirty{ false };
+
+
+        static std::string lowerCase(const std::string& s)
+        {
+            std::string result = s;
+            for (auto& c : result)
+            {
+                if ((c >= 'A') && (c <= 'Z'))
+                    c = c + ('a' - 'A');
+            }
+            return result;
+        }
+
+        static bool isFontFile(const std::filesystem::path& p)
+        {
+            std::string ext = lowerCase(p.extension().string());
+            return (ext == ".ttf") || (ext == ".otf") || (ext == ".ttc");
+        }
+
+        //
+        // Minimal sfnt reading
+        //
+        static uint16_t readU16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+        static uint32_t readU32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3]; }
+
+        static bool readAt(FILE* f, uint32_t offset, uint8_t* buff, size_t len)
+        {
+            if (fseek(f, (long)offset, SEEK_SET) != 0)
+                return false;
+
+            return fread(buff, 1, len, f) == len;
+        }
+
+        // Decode a string from the name table
+        // Windows platform strings are UTF-16BE, Mac Roman is close enough to ASCII
+        static std::string decodeName(const uint8_t* data, size_t len, uint16_t platformId)
+        {
+            std::string result{};
+
+            if ((platformId == 0) || (platformId == 3))
+            {
+                for (size_t i = 0; i + 1 < len; i += 2)
+                {
+                    uint32_t cp = readU16(data + i);
+                    if (cp < 0x80) {
+                        result.push_back((char)cp);
+                    }
+                    else if (cp < 0x800) {
+                        result.push_back((char)(0xC0 | (cp >> 6)));
+                        result.push_back((char)(0x80 | (cp & 0x3F)));
+                    }
+                    else {
+                        result.push_back((char)(0xE0 | (cp >> 12)));
+                        result.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                        result.push_back((char)(0x80 | (cp & 0x3F)));
+                    }
+                }
+            }
+            else {
+                result.assign((const char*)data, len);
+            }
+
+            return result;
+        }
+
+        // Read the family names, weight, stretch, and style of the
+        // first face in a font file, without loading the whole thing
+        static bool readFaceInfo(const char* filename, FontIndexEntry& entry)
+        {
+            FILE* f = fopen(filename, "rb");
+            if (nullptr == f)
+                return false;
+
+            bool success = false;
+            uint8_t header[12];
+
+            do {
+                if (!readAt(f, 0, header, sizeof(header)))
+                    break;
+
+                uint32_t faceOffset = 0;
+
+                // For a collection, just use the first face
+                if (readU32(header) == 0x74746366)    // 'ttcf'
+                {
+                    uint8_t offset[4];
+                    if (!readAt(f, 12, offset, 4))
+                        break;
+                    faceOffset = readU32(offset);
+
+                    if (!readAt(f, faceOffset, header, sizeof(header)))
+                        break;
+                }
+
+                uint16_t numTables = readU16(header + 4);
+                if (numTables == 0 || numTables > 512)
+                    break;
+
+                std::vector<uint8_t> records(numTables * 16);
+                if (!readAt(f, faceOffset + 12, records.data(), records.size()))
+                    break;
+
+                uint32_t nameOffset = 0, nameLength = 0;
+                uint32_t os2Offset = 0, os2Length = 0;
+
+                for (size_t i = 0; i < numTables; i++)
+                {
+                    const uint8_t* rec = records.data() + (i * 16);
+                    uint32_t tag = readU32(rec);
+                    if (tag == 0x6E616D65) {                // 'name'
+                        nameOffset = readU32(rec + 8);
+                        nameLength = readU32(rec + 12);
+                    }
+                    else if (tag == 0x4F532F32) {           // 'OS/2'
+                        os2Offset = readU32(rec + 8);
+                        os2Length = readU32(rec + 12);
+                    }
+                }
+
+                if ((nameOffset == 0) || (nameLength < 6) || (nameLength > (1 << 20)))
+                    break;
+
+                std::vector<uint8_t> nameTable(nameLength);
+                if (!readAt(f, nameOffset, nameTable.data(), nameLength))
+                    break;
+
+                uint16_t count = readU16(nameTable.data() + 2);
+                uint16_t stringOffset = readU16(nameTable.data() + 4);
+
+                // Prefer Windows English names, but take anything we can find
+                int familyScore = -1;
+                int typoScore = -1;
+
+                for (size_t i = 0; i < count; i++)
+                {
+                    size_t recOffset = 6 + (i * 12);
+                    if (recOffset + 12 > nameLength)
+                        break;
+
+                    const uint8_t* rec = nameTable.data() + recOffset;
+                    uint16_t platformId = readU16(rec);
+                    uint16_t languageId = readU16(rec + 4);
+                    uint16_t nameId = readU16(rec + 6);
+                    uint16_t len = readU16(rec + 8);
+                    uint16_t off = readU16(rec + 10);
+
+                    if ((nameId != 1) && (nameId != 16))
+                        continue;
+
+                    if ((size_t)stringOffset + off + len > nameLength)
+                        continue;
+
+                    int score = (platformId == 3) ? ((languageId == 0x0409) ? 3 : 2) : 1;
+
+                    if ((nameId == 1) && (score > familyScore))
+                    {
+                        entry.fFamily = decodeName(nameTable.data() + stringOffset + off, len, platformId);
+                        familyScore = score;
+                    }
+                    else if ((nameId == 16) && (score > typoScore))
+                    {
+                        entry.fTypoFamily = decodeName(nameTable.data() + stringOffset + off, len, platformId);
+                        typoScore = score;
+                    }
+                }
+
+                if (entry.fFamily.empty())
+                    break;
+
+                if ((os2Offset != 0) && (os2Length >= 64))
+                {
+                    uint8_t os2[64];
+                    if (readAt(f, os2Offset, os2, sizeof(os2)))
+                    {
+                        uint16_t weight = readU16(os2 + 4);
+                        uint16_t width = readU16(os2 + 6);
+                        uint16_t selection = readU16(os2 + 62);
+
+                        if ((weight >= 1) && (weight <= 1000))
+                            entry.fWeight = weight;
+                        if ((width >= 1) && (width <= 9))
+                            entry.fStretch = width;
+
+                        if (selection & 0x0001)
+                            entry.fStyle = BL_FONT_STYLE_ITALIC;
+                        else if (selection & 0x0200)
+                            entry.fStyle = BL_FONT_STYLE_OBLIQUE;
+                    }
+                }
+
+                success = true;
+            } while (false);
+
+            fclose(f);
+
+            return success;
+        }
+
+
+        void addEntry(const FontIndexEntry& entry)
+        {
+            size_t idx = fEntries.size();
+            fEntries.push_back(entry);
+
+            fFamilies[lowerCase(entry.fFamily)].push_back(idx);
+            if (!entry.fTypoFamily.empty() && (lowerCase(entry.fTypoFamily) != lowerCase(entry.fFamily)))
+                fFamilies[lowerCase(entry.fTypoFamily)].push_back(idx);
+        }
+
+        // Load a previously saved index
+        // Returns entries keyed by path, so they can be checked against the file system
+        static std::unordered_map<std::string, FontIndexEntry> readCacheFile(const char* cacheFile)
+        {
+            std::unordered_map<std::string, FontIndexEntry> cached{};
+
+            if (nullptr == cacheFile)
+                return cached;
+
+            std::ifstream in(cacheFile);
+            if (!in)
+                return cached;
+
+            std::string line{};
+            if (!std::getline(in, line) || (line != kCacheSignature))
+                return cached;
+
+            while (std::getline(in, line))
+            {
+                std::vector<std::string> fields{};
+                std::stringstream ss(line);
+                std::string field{};
+                while (std::getline(ss, field, '\t'))
+                    fields.push_back(field);
+
+                if (fields.size() != 8)
+                    continue;
+
+                FontIndexEntry e{};
+                e.fPath = fields[0];
+                e.fModified = std::strtoll(fields[1].c_str(), nullptr, 10);
+                e.fFileSize = std::strtoull(fields[2].c_str(), nullptr, 10);
+                e.fFamily = fields[3];
+                e.fTypoFamily = fields[4];
+                e.fWeight = (uint32_t)std::strtoul(fields[5].c_str(), nullptr, 10);
+                e.fStretch = (uint32_t)std::strtoul(fields[6].c_str(), nullptr, 10);
+                e.fStyle = (uint32_t)std::strtoul(fields[7].c_str(), nullptr, 10);
+
+                cached[e.fPath] = e;
+            }
+
+            return cached;
+        }
+
+        // A directory, in the form that's compared against the parent of
+        // an indexed file, whether or not it was given with a trailing slash
+        static std::filesystem::path normalDirectory(const std::filesystem::path& dir)
+        {
+            std::filesystem::path p = dir.lexically_normal();
+            if (!p.has_filename() && p.has_relative_path())
+                p = p.parent_path();
+
+            return p;
+        }
+
+        // Where an application keeps its font index.  This is the user's
+        // local cache directory, not wherever the working directory
+        // happens to be.  Returns an empty string if there's nowhere to put it.
+        static std::string defaultCacheFile(const char* appName)
+        {
+            std::filesystem::path base{};
+
+#ifdef _WIN32
+            if (const char* local = std::getenv("LOCALAPPDATA"))
+                base = local;
+#else
+            if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+                base = xdg;
+            else if (const char* home = std::getenv("HOME"))
+                base = std::filesystem::path(home) / ".cache";
+#endif
+            if (base.empty())
+                return {};
+
+            std::error_code ec{};
+            std::filesystem::path dir = base / appName;
+            std::filesystem::create_directories(dir, ec);
+            if (!std::filesystem::is_directory(dir, ec))
+                return {};
+
+            return (dir / "fontindex.cache").string();
+        }
+
+        // Write out the index, along with any previously cached
+        // entries that belong to other directories.  An entry that's
+        // in the index already (from a directory indexed earlier) is
+        // only written once.
+        bool writeCacheFile(const char* cacheFile, const std::vector<FontIndexEntry>& others = {}) const
+        {
+            if (nullptr == cacheFile)
+                return false;
+
+            std::ofstream out(cacheFile, std::ios::trunc);
+            if (!out)
+                return false;
+
+            auto writeEntry = [&out](const FontIndexEntry& e) {
+                out << e.fPath << "\t" << e.fModified << "\t" << e.fFileSize << "\t"
+                    << e.fFamily << "\t" << e.fTypoFamily << "\t"
+                    << e.fWeight << "\t" << e.fStretch << "\t" << e.fStyle << "\n";
+                };
+
+            std::unordered_set<std::string> written{};
+
+            out << kCacheSignature << "\n";
+            for (auto& e : fEntries)
+            {
+                if (written.insert(e.fPath).second)
+                    writeEntry(e);
+            }
+            for (auto& e : others)
+            {
+                if (written.insert(e.fPath).second)
+                    writeEntry(e);
+            }
+
+            return true;
+        }
+
+        // Index all the font files in a directory
+        // If a cache file is given, it is used to skip files that
+        // have not changed, and it is rewritten if anything new was found
+        bool indexDirectory(const char* dir, const char* cacheFile = nullptr)
+        {
+            std::error_code ec{};
+            const std::filesystem::path fontPath = normalDirectory(dir);
+
+            if (!std::filesystem::is_directory(fontPath, ec))
+                return false;
+
+            auto cached = readCacheFile(cacheFile);
+            std::unordered_map<std::string, bool> seen{};
+
+            for (const auto& dirEntry : std::filesystem::directory_iterator(fontPath, ec))
+            {
+                if (!dirEntry.is_regular_file(ec) || !isFontFile(dirEntry.path()))
+                    continue;
+
+                std::string path = dirEntry.path().generic_string();
+                seen[path] = true;
+                uint64_t fileSize = (uint64_t)dirEntry.file_size(ec);
+                int64_t modified = (int64_t)dirEntry.last_write_time(ec).time_since_epoch().count();
+
+                auto it = cached.find(path);
+                if ((it != cached.end()) && (it->second.fModified == modified) && (it->second.fFileSize == fileSize))
+                {
+                    addEntry(it->second);
+                    continue;
+                }
+
+                FontIndexEntry e{};
+                e.fPath = path;
+                e.fModified = modified;
+                e.fFileSize = fileSize;
+                if (readFaceInfo(path.c_str(), e))
+                {
+                    addEntry(e);
+                    fCacheDirty = true;
+                }
+            }
+
+            // Keep what was cached for other directories, and notice
+            // if anything went away from this one
+            std::vector<FontIndexEntry> others{};
+            std::string dirPrefix = fontPath.generic_string();
+            for (auto& c : cached)
+            {
+                if (seen.find(c.first) != seen.end())
+                    continue;
+
+                if (normalDirectory(std::filesystem::path(c.first).parent_path()).generic_string() == dirPrefix)
+                    fCacheDirty = true;
+                else
+                    others.push_back(c.second);
+            }
+
+            if (fCacheDirty && (nullptr != cacheFile))
+            {
+                if (writeCacheFile(cacheFile, others))
+                    fCacheDirty = false;
+            }
+
+            return true;
+        }
+
+        // All the entries for a given family name
+        const std::vector<size_t>* familyEntries(const std::string& family) const
+        {
+            auto it = fFamilies.find(lowerCase(family));
+            if (it == fFamilies.end())
+                return nullptr;
+
+            return &it->second;
+        }
+    };
+}
@@ -0,0 +1,586 @@
+#pragma once
+
+//
+// Cache of decoded images
+//
+// The same embedded logo, icon, or photo tends to show up in a lot of
+// documents, and decoding a large JPEG or PNG is expensive, both in
+// time, and in the memory holding the pixels.  This cache is shared by
+// the whole process, so any number of documents (and any number of
+// <image> elements within them) that refer to the same image end up
+// sharing a single decoded BLImage.  BLImage is reference counted, so
+// handing out copies costs nothing, and the pixels are never duplicated.
+//
+// Images are keyed by a hash of the encoded payload, for 'data:' URIs,
+// or of the path, for images referenced from files.  The cache holds
+// to a memory budget, evicting the least recently used images first.
+// An evicted image stays alive for as long as someone is still using it,
+// it just won't be found in the cache any more.
+//
+// Each cached image carries its ImageMipChain, so the reduced size
+// levels built for one user of the image are there for all the others.
+//
+// When an image is only ever going to be shown small, a thumbnail, or
+// a document at low zoom, there's no sense in holding on to all of its
+// pixels.  Those are cached at a reduced level, keyed separately from
+// the full size image.
+//
+// PendingImage lets the decoding happen later, and elsewhere.  A
+// document hands the images it will draw to the WorkerPool as soon
+// as it's loaded, and they're decoded in parallel while the rest of
+// the document is bound.  Whoever needs the pixels waits for them,
+// or, if no worker has gotten to that image yet, just decodes it on
+// the spot.  Images that are never asked for are never decoded.
+//
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "blend2d.h"
+#include "bspan.h"
+#include "workerpool.h"
+#include "imagemips.h"
+
+
+namespace waavs
+{
+    enum ImageSourceKind : uint8_t
+    {
+        IMAGE_SOURCE_DATA = 1,      // embedded, 'data:' URI
+        IMAGE_SOURCE_FILE = 2,      // referenced from a file
+    };
+
+    struct ImageCacheKey
+    {
+        uint64_t fHash{ 0 };
+        uint64_t fLength{ 0 };
+        uint8_t fKind{ 0 };
+        uint8_t fLevel{ 0 };        // decoded at 1/(2^level) of full size
+
+        bool operator==(const ImageCacheKey& other) const
+        {
+            return (fHash == other.fHash) && (fLength == other.fLength) && (fKind == other.fKind) && (fLevel == other.fLevel);
+        }
+    };
+
+    struct ImageCacheKeyHash
+    {
+        size_t operator()(const ImageCacheKey& k) const
+        {
+            return (size_t)(k.fHash ^ (k.fLength * 0x9e3779b97f4a7c15ULL) ^ k.fKind ^ ((uint64_t)k.fLevel << 8));
+        }
+    };
+
+    struct ImageCacheStats
+    {
+        size_t fHits{ 0 };
+        size_t fMisses{ 0 };
+        size_t fEvictions{ 0 };
+        size_t fEvictedBytes{ 0 };
+
+        size_t fEntries{ 0 };
+        size_t fBytes{ 0 };
+        size_t fBudget{ 0 };
+    };
+
+
+    struct DecodedImageCache
+    {
+        static constexpr size_t kDefaultBudget = 256 * 1024 * 1024;
+
+        using LRUList = std::list<ImageCacheKey>;
+
+        struct Entry
+        {
+            BLImage fImage{};
+            BLSizeI fFullSize{};        // of the original, fImage may be a reduced level
+            std::shared_ptr<ImageMipChain> fMips{};
+            size_t fBytes{ 0 };
+            LRUList::iterator fPosition{};
+        };
+
+        std::mutex fLock{};
+        std::unordered_map<ImageCacheKey, Entry, ImageCacheKeyHash> fEntries{};
+        LRUList fRecent{};      // most recently used at the front
+        size_t fBytes{ 0 };
+        size_t fBudget{ kDefaultBudget };
+
+        // statistics
+        size_t fHits{ 0 };
+        size_t fMisses{ 0 };
+        size_t fEvictions{ 0 };
+        size_t fEvictedBytes{ 0 };
+
+
+        // One cache for the whole process, never destroyed, as
+        // documents can be going away during static destruction
+        static DecodedImageCache& cache()
+        {
+            static DecodedImageCache* sCache = new DecodedImageCache();
+            return *sCache;
+        }
+
+        // hashPayload
+        // Payloads can be many megabytes of base64, so this goes
+        // 8 bytes at a time, rather than the byte at a time of fnv1a
+        static uint64_t hashPayload(const void* data, size_t size) noexcept
+        {
+            const uint64_t m1 = 0x87c37b91114253d5ULL;
+            const uint64_t m2 = 0x4cf5ad432745937fULL;
+
+            const uint8_t* bytes = (const uint8_t*)data;
+            uint64_t h = 0x9e3779b97f4a7c15ULL ^ (size * m1);
+
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8)
+            {
+                uint64_t w{};
+                memcpy(&w, bytes + i, 8);
+
+                w *= m1;
+                w = (w << 31) | (w >> 33);
+                w *= m2;
+
+                h ^= w;
+                h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+            }
+
+            uint64_t tail = 0;
+            for (size_t shift = 0; i < size; i++, shift += 8)
+                tail |= (uint64_t)bytes[i] << shift;
+            h ^= tail * m2;
+
+            // final avalanche
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+
+            return h;
+        }
+
+        static ImageCacheKey keyFor(const ByteSpan& source, ImageSourceKind kind) noexcept
+        {
+            ImageCacheKey key{};
+            key.fHash = hashPayload(source.data(), source.size());
+            key.fLength = source.size();
+            key.fKind = kind;
+
+            return key;
+        }
+
+        static size_t imageBytes(const BLImage& img)
+        {
+            BLImageData data{};
+            if (img.getData(&data) != BL_SUCCESS)
+                return 0;
+
+            return (size_t)std::abs(data.stride) * (size_t)data.size.h;
+        }
+
+
+        // find
+        // 'counted' says whether this lookup should show up in the
+        // statistics, as opposed to just checking what's there
+        bool find(const ImageCacheKey& key, BLImage& out, bool counted = true)
+        {
+            BLSizeI fullSize{};
+            return find(key, out, fullSize, counted);
+        }
+
+        // Same, also returning the size of the image at full size,
+        // which a reduced level can't be scaled back up to exactly
+        bool find(const ImageCacheKey& key, BLImage& out, BLSizeI& fullSize, bool counted = true)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            auto it = fEntries.find(key);
+            if (it == fEntries.end())
+            {
+                if (counted)
+                    fMisses++;
+                return false;
+            }
+
+            if (counted)
+                fHits++;
+            fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+            out = it->second.fImage;
+            fullSize = it->second.fFullSize;
+
+            return true;
+        }
+
+        // mipChain
+        // The mip levels for the image, shared with everyone else using
+        // the same cached image.  An image that isn't in the cache gets
+        // a chain of its own.
+        static ImageCacheKey levelKey(const ImageCacheKey& key, int level) noexcept
+        {
+            ImageCacheKey k = key;
+            k.fLevel = (uint8_t)level;
+
+            return k;
+        }
+
+        std::shared_ptr<ImageMipChain> mipChain(const ImageCacheKey& key, const BLImage& img)
+        {
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+
+                auto it = fEntries.find(key);
+                if ((it != fEntries.end()) && (it->second.fMips != nullptr))
+                    return it->second.fMips;
+            }
+
+            return std::make_shared<ImageMipChain>(img);
+        }
+
+        // 'fullSize' is the size of the original image, when 'img'
+        // is a reduced level of it
+        void insert(const ImageCacheKey& key, const BLImage& img, const BLSizeI& fullSize = BLSizeI())
+        {
+            // Mip levels, if they're ever built, add at most a third
+            // more, so they're counted against the budget up front
+            size_t bytes = imageBytes(img);
+            bytes += bytes / 3;
+
+            std::lock_guard<std::mutex> lock(fLock);
+
+            // Something that would blow the whole budget on its own
+            // is not worth pushing everything else out for
+            if ((bytes == 0) || (bytes > fBudget))
+                return;
+
+            auto it = fEntries.find(key);
+            if (it != fEntries.end())
+            {
+                // Decoded twice by racing threads, keep the first
+                fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+                return;
+            }
+
+            fRecent.push_front(key);
+            BLSizeI full = ((fullSize.w > 0) && (fullSize.h > 0)) ? fullSize : img.size();
+            fEntries[key] = Entry{ img, full, std::make_shared<ImageMipChain>(img), bytes, fRecent.begin() };
+            fBytes += bytes;
+
+            evictToBudget();
+        }
+
+        // acquire
+        // Get the image for the key, using 'decoder' to create it
+        // if it's not in the cache.  The decoding happens outside the
+        // lock, so other threads can keep using the cache.
+        bool acquire(const ImageCacheKey& key, BLImage& out, const std::function<bool(BLImage&)>& decoder)
+        {
+            if (find(key, out))
+                return true;
+
+            BLImage img{};
+            if (!decoder(img) || img.empty())
+                return false;
+
+            insert(key, img);
+            out = img;
+
+            return true;
+        }
+
+        void budget(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fBudget = bytes;
+            evictToBudget();
+        }
+
+        size_t budget()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fBudget;
+        }
+
+        ImageCacheStats stats()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            ImageCacheStats s{};
+            s.fHits = fHits;
+            s.fMisses = fMisses;
+            s.fEvictions = fEvictions;
+            s.fEvictedBytes = fEvictedBytes;
+            s.fEntries = fEntries.size();
+            s.fBytes = fBytes;
+            s.fBudget = fBudget;
+
+            return s;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fEntries.clear();
+            fRecent.clear();
+            fBytes = 0;
+        }
+
+    private:
+        // Drop least recently used images until we're within budget
+        // The lock must already be held
+        void evictToBudget()
+        {
+            while ((fBytes > fBudget) && !fRecent.empty())
+            {
+                auto it = fEntries.find(fRecent.back());
+                fRecent.pop_back();
+
+                if (it == fEntries.end())
+                    continue;
+
+                fBytes -= it->second.fBytes;
+                fEvictions++;
+                fEvictedBytes += it->second.fBytes;
+                fEntries.erase(it);
+            }
+        }
+    };
+
+
+    //
+    // PendingImage
+    // An image that will be decoded, through the DecodedImageCache,
+    // by whichever comes first, a worker, or someone needing it.
+    // The source has to stay alive until the image is either
+    // finished, or cancelled.
+    //
+    // If the size the image will be shown at on the device is known,
+    // through targetSize(), the image is reduced to the smallest level
+    // that still covers it, and the full size pixels are let go.  The
+    // codecs we have can only decode at full size, so the reduction
+    // happens after decoding, but the target is looked at only once
+    // decoding is done, so a target that shows up while a worker is
+    // already busy with the image still counts.
+    //
+    struct PendingImage
+    {
+        enum State : int
+        {
+            PENDING_QUEUED = 0,
+            PENDING_DECODING = 1,
+            PENDING_READY = 2,
+        };
+
+        using Decoder = std::function<bool(const ByteSpan&, BLImage&)>;
+
+        std::mutex fLock{};
+        std::condition_variable fReady{};
+        int fState{ PENDING_QUEUED };
+
+        ByteSpan fSource{};
+        ImageSourceKind fKind{ IMAGE_SOURCE_DATA };
+        Decoder fDecoder{};
+        BLImage fImage{};
+        ImageCacheKey fKey{};
+        BLSizeI fFullSize{};            // size of the image, had it been decoded at full size
+        int fLevel{ 0 };                // level fImage was reduced to
+        BLSize fTargetSize{};           // size on the device, if known
+
+
+        PendingImage(const ByteSpan& source, ImageSourceKind kind, Decoder decoder)
+            : fSource(source)
+            , fKind(kind)
+            , fDecoder(std::move(decoder))
+        {
+        }
+
+        // Hand the image to the worker pool to be decoded
+        static void schedule(const std::shared_ptr<PendingImage>& pending)
+        {
+            if (nullptr == pending)
+                return;
+
+            WorkerPool::pool().submit([pending]() { pending->run(); });
+        }
+
+        // The cache key the image was decoded under, once it's ready
+        ImageCacheKey key()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fKey;
+        }
+
+        // The image will be drawn no larger than this, in device pixels
+        // Several targets combine into the largest of them.
+        void targetSize(double w, double h)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fTargetSize.w = std::max(fTargetSize.w, w);
+            fTargetSize.h = std::max(fTargetSize.h, h);
+        }
+
+        int level()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fLevel;
+        }
+
+        BLSizeI fullSize()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fFullSize;
+        }
+
+        bool isReady()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fState == PENDING_READY;
+        }
+
+        // Called from a worker.  If someone else got to it
+        // first, there's nothing to do.
+        void run()
+        {
+            if (claim())
+                decode();
+        }
+
+        // Get the decoded image, decoding it here and now if a worker
+        // hasn't started on it yet, or waiting for the worker if it has.
+        BLImage wait()
+        {
+            if (claim())
+                decode();
+
+            std::unique_lock<std::mutex> lock(fLock);
+            fReady.wait(lock, [this]() { return fState == PENDING_READY; });
+
+            return fImage;
+        }
+
+        // Make sure no one is going to look at the source any more.
+        // An image not yet started is dropped, one being decoded is
+        // waited on.
+        void cancel()
+        {
+            std::unique_lock<std::mutex> lock(fLock);
+            if (fState == PENDING_QUEUED)
+            {
+                fState = PENDING_READY;
+                fReady.notify_all();
+                return;
+            }
+
+            fReady.wait(lock, [this]() { return fState == PENDING_READY; });
+        }
+
+    private:
+        bool claim()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            if (fState != PENDING_QUEUED)
+                return false;
+
+            fState = PENDING_DECODING;
+            return true;
+        }
+
+        BLSize currentTarget()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            return fTargetSize;
+        }
+
+        // The most an image of the given size can be reduced,
+        // while still covering the target size
+        static int levelForTarget(const BLSizeI& full, const BLSize& target)
+        {
+            if ((target.w <= 0) || (target.h <= 0))
+                return 0;
+
+            int level = 0;
+            while ((level < 16) &&
+                ((full.w >> (level + 1)) >= std::max(ImageMipChain::kMinLevelSize, (int)std::ceil(target.w))) &&
+                ((full.h >> (level + 1)) >= std::max(ImageMipChain::kMinLevelSize, (int)std::ceil(target.h))))
+            {
+                level++;
+            }
+
+            return level;
+        }
+
+        void decode()
+        {
+            auto& cache = DecodedImageCache::cache();
+
+            BLImage img{};
+            ByteSpan source = fSource;
+            ImageCacheKey key = DecodedImageCache::keyFor(source, fKind);
+            int level = 0;
+
+            // Someone may already have the full size image, or
+            // a reduced one that's still big enough
+            BLSizeI fullSize{};
+            bool found = cache.find(key, img, fullSize);
+            if (!found)
+            {
+                BLSize target = currentTarget();
+                for (int lvl = 1; (lvl < 16) && (target.w > 0) && (target.h > 0); lvl++)
+                {
+                    BLImage reduced{};
+                    BLSizeI reducedFullSize{};
+                    if (!cache.find(DecodedImageCache::levelKey(key, lvl), reduced, reducedFullSize, false))
+                        continue;
+
+                    if ((reduced.width() >= std::ceil(target.w)) && (reduced.height() >= std::ceil(target.h)))
+                    {
+                        img = reduced;
+                        fullSize = reducedFullSize;
+                        level = lvl;
+                        found = true;
+                    }
+                    break;
+                }
+            }
+
+            if (!found && fDecoder(source, img) && !img.empty())
+            {
+                fullSize = img.size();
+
+                level = ImageMipChain::canMip(img) ? levelForTarget(fullSize, currentTarget()) : 0;
+                for (int lvl = 0; lvl < level; lvl++)
+                {
+                    BLImage half{};
+                    if (!ImageMipChain::downsample(img, half))
+                    {
+                        level = lvl;
+                        break;
+                    }
+                    img = half;
+                }
+
+                cache.insert(DecodedImageCache::levelKey(key, level), img, fullSize);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+                fImage = img;
+                fKey = DecodedImageCache::levelKey(key, level);
+                fLevel = level;
+                fFullSize = fullSize;
+                fState = PENDING_READY;
+            }
+            fReady.notify_all();
+        }
+    };
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+//
+// Mip levels for raster images
+//
+// Drawing a large photo into a small space, like a thumbnail, or a
+// document viewed at low zoom, means pulling every one of the source
+// pixels through the scaler, only to throw most of them away, and it
+// aliases badly besides.  An ImageMipChain keeps successively halved
+// copies of an image, built on demand, so drawing can start from the
+// level closest to, but not smaller than, the size on the device.
+//
+// Levels are built with a 2x2 box filter, on premultiplied 32-bit
+// pixels, using SSE2 where it's available.
+//
+
+#include <mutex>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "blend2d.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+    #define WAAVS_MIPS_SSE2 1
+    #include <emmintrin.h>
+#endif
+
+namespace waavs
+{
+    struct ImageMipChain
+    {
+        static constexpr int kMinLevelSize = 8;     // don't bother going smaller than this
+
+        std::mutex fLock{};
+        BLImage fBase{};
+        std::vector<BLImage> fLevels{};             // fLevels[0] is the base image, each after is half the size
+
+
+        explicit ImageMipChain(const BLImage& base)
+            : fBase(base)
+        {
+            fLevels.push_back(base);
+        }
+
+        static bool canMip(const BLImage& img)
+        {
+            return (img.format() == BL_FORMAT_PRGB32) || (img.format() == BL_FORMAT_XRGB32);
+        }
+
+        // The most levels that would ever be built for the base image
+        int maxLevel() const
+        {
+            if (!canMip(fBase))
+                return 0;
+
+            int level = 0;
+            int w = fBase.width();
+            int h = fBase.height();
+            while ((w / 2 >= kMinLevelSize) && (h / 2 >= kMinLevelSize))
+            {
+                w = (w + 1) / 2;
+                h = (h + 1) / 2;
+                level++;
+            }
+
+            return level;
+        }
+
+        // levelForScale
+        // 'scale' is the number of device pixels per pixel of the base
+        // image.  Pick the smallest level that still has at least one
+        // pixel per device pixel, so the scaler is always shrinking.
+        int levelForScale(double scale) const
+        {
+            if (!(scale > 0) || (scale >= 0.5))
+                return 0;
+
+            int level = (int)std::floor(std::log2(1.0 / scale));
+
+            return std::min(level, maxLevel());
+        }
+
+        // Retrieve a level, building it, and any before it, if needed
+        BLImage level(int lvl)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            lvl = std::min(std::max(lvl, 0), maxLevel());
+
+            while ((int)fLevels.size() <= lvl)
+            {
+                BLImage half{};
+                if (!downsample(fLevels.back(), half))
+                    break;
+
+                fLevels.push_back(half);
+            }
+
+            return fLevels[std::min(lvl, (int)fLevels.size() - 1)];
+        }
+
+        BLImage imageForScale(double scale)
+        {
+            return level(levelForScale(scale));
+        }
+
+
+        // downsample
+        // Create 'dst' at half the size of 'src', each pixel the average
+        // of a 2x2 block.  Odd sized images have their last row or column
+        // averaged with itself.
+        static bool downsample(const BLImage& src, BLImage& dst)
+        {
+            if (!canMip(src))
+                return false;
+
+            int sw = src.width();
+            int sh = src.height();
+            int dw = (sw + 1) / 2;
+            int dh = (sh + 1) / 2;
+
+            if (dst.create(dw, dh, (BLFormat)src.format()) != BL_SUCCESS)
+                return false;
+
+            BLImageData sdata{};
+            BLImageData ddata{};
+            if ((src.getData(&sdata) != BL_SUCCESS) || (dst.makeMutable(&ddata) != BL_SUCCESS))
+                return false;
+
+            for (int y = 0; y < dh; y++)
+            {
+                int y0 = y * 2;
+                int y1 = std::min(y0 + 1, sh - 1);
+
+                const uint32_t* row0 = (const uint32_t*)((const uint8_t*)sdata.pixelData + (intptr_t)y0 * sdata.stride);
+                const uint32_t* row1 = (const uint32_t*)((const uint8_t*)sdata.pixelData + (intptr_t)y1 * sdata.stride);
+                uint32_t* out = (uint32_t*)((uint8_t*)ddata.pixelData + (intptr_t)y * ddata.stride);
+
+                downsampleRow(row0, row1, sw, out, dw);
+            }
+
+            return true;
+        }
+
+        static void downsampleRow(const uint32_t* row0, const uint32_t* row1, int sw, uint32_t* out, int dw)
+        {
+            int x = 0;
+
+#if defined(WAAVS_MIPS_SSE2)
+            // 4 destination pixels, from 8 source pixels on each row
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi16(2);
+
+            for (; (x + 4 <= dw) && (x * 2 + 8 <= sw); x += 4)
+            {
+                __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + x * 2));
+                __m128i b0 = _mm_loadu_si128((const __m128i*)(row0 + x * 2 + 4));
+                __m128i a1 = _mm_loadu_si128((const __m128i*)(row1 + x * 2));
+                __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + x * 2 + 4));
+
+                // split into even and odd pixels
+                __m128i even0 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a0), _mm_castsi128_ps(b0), _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd0 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a0), _mm_castsi128_ps(b0), _MM_SHUFFLE(3, 1, 3, 1)));
+                __m128i even1 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a1), _mm_castsi128_ps(b1), _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd1 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a1), _mm_castsi128_ps(b1), _MM_SHUFFLE(3, 1, 3, 1)));
+
+                // sum the four, with 16 bits per channel
+                __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(even0, zero), _mm_unpacklo_epi8(odd0, zero)),
+                    _mm_add_epi16(_mm_unpacklo_epi8(even1, zero), _mm_unpacklo_epi8(odd1, zero)));
+                __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(even0, zero), _mm_unpackhi_epi8(odd0, zero)),
+                    _mm_add_epi16(_mm_unpackhi_epi8(even1, zero), _mm_unpackhi_epi8(odd1, zero)));
+
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+
+                _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(lo, hi));
+            }
+#endif
+
+            for (; x < dw; x++)
+            {
+                int x0 = x * 2;
+                int x1 = std::min(x0 + 1, sw - 1);
+
+                uint32_t p00 = row0[x0], p01 = row0[x1];
+                uint32_t p10 = row1[x0], p11 = row1[x1];
+
+                uint32_t result = 0;
+                for (int shift = 0; shift < 32; shift += 8)
+                {
+                    uint32_t sum = ((p00 >> shift) & 0xff) + ((p01 >> shift) & 0xff) + ((p10 >> shift) & 0xff) + ((p11 >> shift) & 0xff);
+                    result |= ((sum + 2) >> 2) << shift;
+                }
+
+                out[x] = result;
+            }
+        }
+    };
+}
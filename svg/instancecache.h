@@ -0,0 +1,208 @@
+#pragma once
+
+//
+// Cache of rendered <use> instances
+//
+// Icon sheets define a few dozen symbols, and then <use> them
+// hundreds or thousands of times.  Drawing each of those walks the
+// symbol's subtree again, with all of the property and binding
+// machinery that involves, only to produce the same pixels as the
+// last time the icon was drawn at that size.
+//
+// This cache holds the device space raster of an instance, keyed by
+// everything that can make it look different: the symbol, the scale
+// it's drawn at, where it falls within a device pixel (quantized to
+// a quarter pixel), the viewport and object frame it's drawn in, and
+// the paint and font state it inherits from the <use>.  Any <use>
+// that comes up with the same key just blits the raster.
+//
+// Only small instances are cached, and only when the device transform
+// is a plain scale and translate.  An entry can also record that an
+// instance isn't suitable (it draws outside its viewport, say), so
+// the next <use> doesn't go through the trouble of finding out again.
+//
+// The cache is shared by the whole process, and holds to a memory
+// budget, evicting the least recently used rasters first.
+//
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+
+#include "blend2d.h"
+
+
+namespace waavs
+{
+    struct InstanceCacheKey
+    {
+        static constexpr int kMaxWords = 40;
+
+        uint64_t fWords[kMaxWords]{};
+        int fCount{ 0 };
+
+        void add(uint64_t v)
+        {
+            if (fCount < kMaxWords)
+                fWords[fCount++] = v;
+        }
+
+        void add(double v)
+        {
+            uint64_t bits = 0;
+            std::memcpy(&bits, &v, sizeof(bits));
+            add(bits);
+        }
+
+        void add(const BLRect& r)
+        {
+            add(r.x); add(r.y); add(r.w); add(r.h);
+        }
+
+        void add(const void* p)
+        {
+            add((uint64_t)(uintptr_t)p);
+        }
+
+        bool operator==(const InstanceCacheKey& other) const
+        {
+            return (fCount == other.fCount) && (std::memcmp(fWords, other.fWords, sizeof(uint64_t) * fCount) == 0);
+        }
+    };
+
+    struct InstanceCacheKeyHash
+    {
+        size_t operator()(const InstanceCacheKey& k) const
+        {
+            uint64_t h = 0xcbf29ce484222325ULL;
+            for (int i = 0; i < k.fCount; i++)
+            {
+                h ^= k.fWords[i];
+                h *= 0x9e3779b97f4a7c15ULL;
+                h ^= h >> 29;
+            }
+
+            return (size_t)h;
+        }
+    };
+
+    // A rendered instance, and where it goes, relative to the
+    // integer part of the instance's device space translation
+    struct InstanceRaster
+    {
+        BLImage fImage{};
+        BLPointI fOffset{};
+        bool fUsable{ false };      // false, it has to be drawn the long way
+    };
+
+
+    struct InstanceCache
+    {
+        static constexpr size_t kDefaultBudget = 32 * 1024 * 1024;
+        static constexpr int kMaxInstanceSize = 256;     // device pixels, in either direction
+
+        using LRUList = std::list<InstanceCacheKey>;
+
+        struct Entry
+        {
+            InstanceRaster fRaster{};
+            size_t fBytes{ 0 };
+            LRUList::iterator fPosition{};
+        };
+
+        std::mutex fLock{};
+        std::unordered_map<InstanceCacheKey, Entry, InstanceCacheKeyHash> fEntries{};
+        LRUList fRecent{};      // most recently used at the front
+        size_t fBytes{ 0 };
+        size_t fBudget{ kDefaultBudget };
+
+
+        // One cache for the whole process, never destroyed, as
+        // documents can be going away during static destruction
+        static InstanceCache& cache()
+        {
+            static InstanceCache* sCache = new InstanceCache();
+            return *sCache;
+        }
+
+        // Every time instanced content is (re)bound, it takes a new
+        // generation, which goes into the key.  Whatever was cached
+        // for its old content, or for some earlier node that happened
+        // to live at the same address, is never found again, and ages
+        // out of the cache.
+        static uint64_t nextGeneration()
+        {
+            static std::atomic<uint64_t> sGeneration{ 0 };
+            return ++sGeneration;
+        }
+
+        bool find(const InstanceCacheKey& key, InstanceRaster& out)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            auto it = fEntries.find(key);
+            if (it == fEntries.end())
+                return false;
+
+            fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+            out = it->second.fRaster;
+
+            return true;
+        }
+
+        void insert(const InstanceCacheKey& key, const InstanceRaster& raster)
+        {
+            // even an unusable entry costs something
+            size_t bytes = 64;
+            if (!raster.fImage.empty())
+                bytes += (size_t)raster.fImage.width() * raster.fImage.height() * 4;
+
+            std::lock_guard<std::mutex> lock(fLock);
+
+            if (bytes > fBudget)
+                return;
+
+            auto it = fEntries.find(key);
+            if (it != fEntries.end())
+            {
+                fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+                return;
+            }
+
+            fRecent.push_front(key);
+            fEntries[key] = Entry{ raster, bytes, fRecent.begin() };
+            fBytes += bytes;
+
+            evictToBudget(fBudget);
+        }
+
+        void budget(size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fBudget = bytes;
+            evictToBudget(fBudget);
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            evictToBudget(0);
+        }
+
+    private:
+        // fLock must be held
+        void evictToBudget(size_t budget)
+        {
+            while ((fBytes > budget) && !fRecent.empty())
+            {
+                auto victim = fEntries.find(fRecent.back());
+                fBytes -= victim->second.fBytes;
+                fEntries.erase(victim);
+                fRecent.pop_back();
+            }
+        }
+    };
+}
@@ -9,6 +9,7 @@
 #include "collections.h"
 #include "svgenums.h"
 #include "imanagesvgstate.h"
+#include "shapedtext.h"
 
 namespace waavs
 {
@@ -25,6 +26,7 @@ namespace waavs
         BLVar fBackground{};
         BLPoint fTextCursor{};
         FontHandler* fFontHandler{ nullptr };
+        bool fGeometryOnly{ false };
 
 
         
@@ -41,6 +43,7 @@ namespace waavs
 
         void initState()
         {
+            fGeometryOnly = false;
             fBackground = BLRgba32(0xFFFFFFFF);
             strokeJoin(BL_STROKE_JOIN_MITER_CLIP);
             strokeMiterLimit(4);
@@ -62,7 +65,37 @@ namespace waavs
         {
             BLContext::end();
         }
-        
+
+        // Take on the drawing state of another context, so that content
+        // can be redirected into an offscreen layer, and look the same
+        // as if it had been drawn directly.  'origin' is where the
+        // layer's pixel (0,0) sits in the other context's device space.
+        // Global alpha and compositing are left alone, as they are applied
+        // when the layer is composited back.
+        void inheritState(IRenderSVG& other, const BLPointI& origin)
+        {
+            SVGDrawingState::operator=(other);
+            fClipRect = BLRect{};
+            fFontHandler = other.fFontHandler;
+            fTextCursor = other.fTextCursor;
+            fGeometryOnly = other.fGeometryOnly;
+
+            BLVar style{};
+            other.getFillStyle(style);
+            BLContext::setFillStyle(style);
+            other.getStrokeStyle(style);
+            BLContext::setStrokeStyle(style);
+
+            BLContext::setFillRule(other.BLContext::fillRule());
+            BLContext::setFillAlpha(other.BLContext::fillAlpha());
+            BLContext::setStrokeAlpha(other.BLContext::strokeAlpha());
+            BLContext::setStrokeOptions(other.BLContext::strokeOptions());
+
+            BLMatrix2D m = other.finalTransform();
+            m.postTranslate(-origin.x, -origin.y);
+            BLContext::setTransform(m);
+        }
+
 
         
 
@@ -166,8 +199,28 @@ namespace waavs
             setStrokeTransformOrder(b ? BL_STROKE_TRANSFORM_ORDER_BEFORE : BL_STROKE_TRANSFORM_ORDER_AFTER);
         }
         
-        virtual void blendMode(int mode) { BLContext::setCompOp((BLCompOp)mode); }
-        virtual void globalOpacity(double opacity) { BLContext::setGlobalAlpha(opacity); }
+        // Geometry only drawing
+        // Clip path content is drawn for its shapes alone.  While this
+        // is on, the paint, stroke, opacity and fill rule the content
+        // asks for are ignored, everything is filled opaque, and the
+        // clip-rule decides the fill rule.
+        void geometryOnly(bool b)
+        {
+            fGeometryOnly = b;
+            if (!b)
+                return;
+
+            BLContext::setCompOp(BL_COMP_OP_SRC_OVER);
+            BLContext::setGlobalAlpha(1.0);
+            BLContext::setFillStyle(BLRgba32(0xffffffff));
+            BLContext::setFillAlpha(1.0);
+            BLContext::setFillRule(BL_FILL_RULE_NON_ZERO);
+            BLContext::setStrokeStyle(BLVar::null());
+        }
+        bool geometryOnly() const { return fGeometryOnly; }
+
+        virtual void blendMode(int mode) { if (!fGeometryOnly) BLContext::setCompOp((BLCompOp)mode); }
+        virtual void globalOpacity(double opacity) { if (!fGeometryOnly) BLContext::setGlobalAlpha(opacity); }
 
         virtual void strokeCap(int cap, int position) { BLContext::setStrokeCap((BLStrokeCapPosition)position, (BLStrokeCap)cap); }
         virtual void strokeCaps(int caps) { BLContext::setStrokeCaps((BLStrokeCap)caps); }
@@ -194,18 +247,19 @@ namespace waavs
         }
 
         // paint for filling shapes
-        virtual void fill(const BLVar& value) { BLContext::setFillStyle(value); }
+        virtual void fill(const BLVar& value) { if (!fGeometryOnly) BLContext::setFillStyle(value); }
         virtual void fill(const BLRgba32& value) { 
-            BLContext::setFillStyle(value); 
+            if (!fGeometryOnly)
+                BLContext::setFillStyle(value); 
         }
-        virtual void fillOpacity(double o) { BLContext::setFillAlpha(o); }
+        virtual void fillOpacity(double o) { if (!fGeometryOnly) BLContext::setFillAlpha(o); }
 
-        virtual void noFill() { BLContext::setFillStyle(BLVar::null()); }
+        virtual void noFill() { if (!fGeometryOnly) BLContext::setFillStyle(BLVar::null()); }
 
         // paint for stroking lines
-        virtual void stroke(const BLVar& value) { BLContext::setStrokeStyle(value); }
-        virtual void stroke(const BLRgba32& value) { BLContext::setStrokeStyle(value); }
-        virtual void strokeOpacity(double o) { BLContext::setStrokeAlpha(o); }
+        virtual void stroke(const BLVar& value) { if (!fGeometryOnly) BLContext::setStrokeStyle(value); }
+        virtual void stroke(const BLRgba32& value) { if (!fGeometryOnly) BLContext::setStrokeStyle(value); }
+        virtual void strokeOpacity(double o) { if (!fGeometryOnly) BLContext::setStrokeAlpha(o); }
 
         virtual void noStroke() { setStrokeStyle(BLVar::null()); }
 
@@ -265,7 +319,14 @@ namespace waavs
         // Geometry
         // hard set a specfic pixel value
         virtual void fillRule(int rule) { 
-            BLContext::setFillRule((BLFillRule)rule); 
+            if (!fGeometryOnly)
+                BLContext::setFillRule((BLFillRule)rule); 
+        }
+
+        // The clip-rule only means something to clip path content
+        virtual void clipRule(int rule) {
+            if (fGeometryOnly)
+                BLContext::setFillRule((BLFillRule)rule);
         }
 
 
@@ -305,12 +366,50 @@ namespace waavs
         
         
         // Text Drawing
+        // The text is shaped once, and the shaped run is cached.  The
+        // outline of the run is kept in font units, so drawing is a
+        // path fill, scaled to the font size.
 		virtual void strokeText(const ByteSpan& txt, double x, double y) {
-            BLContext::strokeUtf8Text(BLPoint(x, y), font(), (char*)txt.data(), txt.size());
+            auto run = ShapedTextCache::cache().get(font(), txt);
+
+            const BLPath* path = nullptr;
+            double scale = 1.0;
+            if (!run->outline(font(), path, scale) || (scale <= 0))
+            {
+                BLContext::strokeGlyphRun(BLPoint(x, y), font(), run->glyphRun());
+                return;
+            }
+
+            BLContext::save();
+            BLContext::translate(x, y);
+            BLContext::scale(scale);
+
+            // Keep the stroke the same width it would have been
+            // had we not scaled down from font units
+            if (BLContext::strokeTransformOrder() == BL_STROKE_TRANSFORM_ORDER_AFTER)
+                BLContext::setStrokeWidth(BLContext::strokeWidth() / scale);
+
+            BLContext::strokePath(*path);
+            BLContext::restore();
 		}
         
         virtual void fillText(const ByteSpan& txt, double x, double y) {
-            BLContext::fillUtf8Text(BLPoint(x, y), font(), (char*)txt.data(), txt.size());
+            auto run = ShapedTextCache::cache().get(font(), txt);
+
+            const BLPath* path = nullptr;
+            double scale = 1.0;
+            if (!run->outline(font(), path, scale) || (scale <= 0))
+            {
+                BLContext::fillGlyphRun(BLPoint(x, y), font(), run->glyphRun());
+                return;
+            }
+
+            BLContext::save();
+            BLContext::translate(x, y);
+            BLContext::scale(scale);
+            BLContext::setFillRule(BL_FILL_RULE_NON_ZERO);    // glyphs are always non-zero
+            BLContext::fillPath(*path);
+            BLContext::restore();
         }
         
 
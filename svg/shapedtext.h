@@ -0,0 +1,332 @@
+#pragma once
+
+//
+// Cache of shaped text runs
+//
+// Shaping a run of text (utf8 -> glyph ids -> positioned glyphs) is
+// the expensive part of getting text on the screen.  The same strings
+// get measured for layout, then shaped again for fill, and again for
+// stroke, on every single draw.  Here we shape a run once, and keep
+// the glyphs and placements around, keyed by font face, size, font
+// settings, and the text itself.  Both measuring and drawing then
+// work from the cached run.
+//
+// Drawing goes one step further, and fills the outline of the run,
+// assembled from per face glyph outlines kept in font units, so the
+// same glyphs drawn at many different sizes are only decoded once.
+//
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+
+#include "blend2d.h"
+#include "bspan.h"
+#include "bithacks.h"
+
+namespace waavs
+{
+    // GlyphOutlineCache
+    // Outlines of individual glyphs, per font face, in font units.
+    // Decoding glyph outlines is most of the cost of drawing text, and
+    // outlines in font units are the same no matter what size the text
+    // is drawn at, so they are decoded once, and scaled when drawn.
+    struct GlyphOutlineCache
+    {
+        static constexpr size_t kMaxFaces = 64;
+
+        struct FaceOutlines
+        {
+            BLFont fUnitFont{};         // the face, at a size of 1 unit per em
+            double fUnitsPerEm{ 0 };
+
+            std::mutex fLock{};
+            std::unordered_map<uint32_t, BLPath> fGlyphs{};
+        };
+
+        std::mutex fLock{};
+        std::unordered_map<uint64_t, std::shared_ptr<FaceOutlines>> fFaces{};
+
+
+        static GlyphOutlineCache& cache()
+        {
+            static GlyphOutlineCache* sCache = new GlyphOutlineCache();
+            return *sCache;
+        }
+
+        std::shared_ptr<FaceOutlines> faceOutlines(const BLFontFace& face)
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            auto it = fFaces.find(face.uniqueId());
+            if (it != fFaces.end())
+                return it->second;
+
+            auto outlines = std::make_shared<FaceOutlines>();
+            outlines->fUnitsPerEm = face.designMetrics().unitsPerEm;
+            if ((outlines->fUnitsPerEm <= 0) || (outlines->fUnitFont.createFromFace(face, (float)outlines->fUnitsPerEm) != BL_SUCCESS))
+                return nullptr;
+
+            if (fFaces.size() >= kMaxFaces)
+                fFaces.clear();
+
+            fFaces[face.uniqueId()] = outlines;
+
+            return outlines;
+        }
+
+        // Append the outline of a single glyph, in font units, offset by 'origin'
+        static void appendGlyph(FaceOutlines& face, uint32_t glyphId, const BLPoint& origin, BLPath& out)
+        {
+            std::lock_guard<std::mutex> lock(face.fLock);
+
+            auto it = face.fGlyphs.find(glyphId);
+            if (it == face.fGlyphs.end())
+            {
+                BLPath glyphPath{};
+                face.fUnitFont.getGlyphOutlines(glyphId, glyphPath);
+                it = face.fGlyphs.emplace(glyphId, std::move(glyphPath)).first;
+            }
+
+            out.addPath(it->second, origin);
+        }
+    };
+
+
+    // A run of text, shaped with a particular font
+    struct ShapedTextRun
+    {
+        std::string fText{};
+        std::vector<uint32_t> fGlyphs{};
+        std::vector<BLGlyphPlacement> fPlacements{};
+        uint32_t fFlags{ 0 };
+        uint8_t fPlacementType{ BL_GLYPH_PLACEMENT_TYPE_NONE };
+        BLTextMetrics fMetrics{};
+
+        // Outline of the whole run, in font units, built on first use
+        std::once_flag fOutlineOnce{};
+        BLPath fOutline{};
+        double fUnitsPerEm{ 0 };
+
+        // Get the outline of the run, in font units, and the scale
+        // needed to bring it to the size of the given font.
+        // Returns false if outlines are not available for the font
+        bool outline(const BLFont& font, const BLPath*& path, double& scale)
+        {
+            std::call_once(fOutlineOnce, [this, &font]() { buildOutline(font); });
+
+            if (fUnitsPerEm <= 0)
+                return false;
+
+            path = &fOutline;
+            scale = font.size() / fUnitsPerEm;
+
+            return true;
+        }
+
+        // Lay the cached glyph outlines out along the run, the same
+        // way blend2d positions glyphs when drawing a glyph run.
+        void buildOutline(const BLFont& font)
+        {
+            auto face = GlyphOutlineCache::cache().faceOutlines(font.face());
+            if (nullptr == face)
+                return;
+
+            const BLFontMatrix& fm = face->fUnitFont.matrix();
+            BLPoint pen{};
+
+            for (size_t i = 0; i < fGlyphs.size(); i++)
+            {
+                BLPoint pos = pen;
+                if (fPlacementType == BL_GLYPH_PLACEMENT_TYPE_ADVANCE_OFFSET)
+                {
+                    pos.x += fPlacements[i].placement.x;
+                    pos.y += fPlacements[i].placement.y;
+                    pen.x += fPlacements[i].advance.x;
+                    pen.y += fPlacements[i].advance.y;
+                }
+
+                BLPoint origin(pos.x * fm.m00 + pos.y * fm.m10, pos.x * fm.m01 + pos.y * fm.m11);
+                GlyphOutlineCache::appendGlyph(*face, fGlyphs[i], origin, fOutline);
+            }
+
+            fUnitsPerEm = face->fUnitsPerEm;
+        }
+
+        // The run in a form blend2d can draw directly
+        BLGlyphRun glyphRun() const
+        {
+            BLGlyphRun run{};
+            run.glyphData = (void*)fGlyphs.data();
+            run.placementData = fPlacements.empty() ? nullptr : (void*)fPlacements.data();
+            run.size = fGlyphs.size();
+            run.placementType = fPlacementType;
+            run.glyphAdvance = sizeof(uint32_t);
+            run.placementAdvance = sizeof(BLGlyphPlacement);
+            run.flags = fFlags;
+
+            return run;
+        }
+    };
+
+
+    struct ShapedTextKey
+    {
+        uint64_t fFaceId{ 0 };
+        float fSize{ 0 };
+        uint64_t fSettingsHash{ 0 };
+        uint64_t fTextHash{ 0 };
+        size_t fTextLength{ 0 };
+
+        bool operator==(const ShapedTextKey& other) const
+        {
+            return (fFaceId == other.fFaceId) && (fSize == other.fSize) &&
+                (fSettingsHash == other.fSettingsHash) &&
+                (fTextHash == other.fTextHash) && (fTextLength == other.fTextLength);
+        }
+    };
+
+    struct ShapedTextKeyHash
+    {
+        size_t operator()(const ShapedTextKey& k) const
+        {
+            uint64_t h = k.fTextHash;
+            h ^= k.fFaceId + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            h ^= k.fSettingsHash + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+
+            uint32_t sizeBits{};
+            memcpy(&sizeBits, &k.fSize, sizeof(sizeBits));
+            h ^= sizeBits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+
+            return (size_t)h;
+        }
+    };
+
+
+    struct ShapedTextCache
+    {
+        static constexpr size_t kMaxEntries = 4096;
+
+        using LRUList = std::list<ShapedTextKey>;
+
+        struct Entry
+        {
+            std::shared_ptr<ShapedTextRun> fRun{};
+            LRUList::iterator fPosition{};
+        };
+
+        std::mutex fLock{};
+        std::unordered_map<ShapedTextKey, Entry, ShapedTextKeyHash> fEntries{};
+        LRUList fRecent{};     // most recently used at the front
+
+
+        static ShapedTextCache& cache()
+        {
+            static ShapedTextCache* sCache = new ShapedTextCache();
+            return *sCache;
+        }
+
+        // Hash the feature and variation settings of the font
+        // so differently configured fonts of the same face don't collide
+        static uint64_t settingsHash(const BLFont& font)
+        {
+            uint64_t h = FNV1A_64_INIT;
+
+            BLFontFeatureSettingsView features{};
+            if ((font.featureSettings().getView(&features) == BL_SUCCESS) && (features.size > 0))
+                h = (h ^ fnv1a_64(features.data, features.size * sizeof(BLFontFeatureItem))) * FNV1A_64_PRIME;
+
+            BLFontVariationSettingsView variations{};
+            if ((font.variationSettings().getView(&variations) == BL_SUCCESS) && (variations.size > 0))
+                h = (h ^ fnv1a_64(variations.data, variations.size * sizeof(BLFontVariationItem))) * FNV1A_64_PRIME;
+
+            return h;
+        }
+
+        static std::shared_ptr<ShapedTextRun> shape(const BLFont& font, const ByteSpan& txt)
+        {
+            auto run = std::make_shared<ShapedTextRun>();
+            run->fText.assign((const char*)txt.data(), txt.size());
+
+            BLGlyphBuffer gb;
+            gb.setUtf8Text(txt.data(), txt.size());
+            font.shape(gb);
+            font.getTextMetrics(gb, run->fMetrics);
+
+            const BLGlyphRun& gr = gb.glyphRun();
+            const uint32_t* glyphs = gr.glyphDataAs<uint32_t>();
+            run->fGlyphs.assign(glyphs, glyphs + gr.size);
+
+            if (gr.placementData != nullptr)
+            {
+                const BLGlyphPlacement* placements = gr.placementDataAs<BLGlyphPlacement>();
+                run->fPlacements.assign(placements, placements + gr.size);
+                run->fPlacementType = gr.placementType;
+            }
+            run->fFlags = gr.flags;
+
+            return run;
+        }
+
+        // Retrieve a shaped run for the text, shaping
+        // it if it's not already in the cache
+        std::shared_ptr<ShapedTextRun> get(const BLFont& font, const ByteSpan& txt)
+        {
+            ShapedTextKey key{};
+            key.fFaceId = font.face().uniqueId();
+            key.fSize = font.size();
+            key.fSettingsHash = settingsHash(font);
+            key.fTextHash = fnv1a_64(txt.data(), txt.size());
+            key.fTextLength = txt.size();
+
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+
+                auto it = fEntries.find(key);
+                if ((it != fEntries.end()) && ((txt.size() == 0) || (memcmp(it->second.fRun->fText.data(), txt.data(), txt.size()) == 0)))
+                {
+                    fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+                    return it->second.fRun;
+                }
+            }
+
+            // Shape outside the lock, so other threads aren't held up
+            auto run = shape(font, txt);
+
+            std::lock_guard<std::mutex> lock(fLock);
+
+            auto it = fEntries.find(key);
+            if (it != fEntries.end())
+            {
+                // Someone beat us to it, or a hash collision, either way
+                // the most recent shaping wins
+                it->second.fRun = run;
+                fRecent.splice(fRecent.begin(), fRecent, it->second.fPosition);
+                return run;
+            }
+
+            if (fEntries.size() >= kMaxEntries)
+            {
+                fEntries.erase(fRecent.back());
+                fRecent.pop_back();
+            }
+
+            fRecent.push_front(key);
+            fEntries[key] = Entry{ run, fRecent.begin() };
+
+            return run;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+            fEntries.clear();
+            fRecent.clear();
+        }
+    };
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+//
+// Pooled offscreen surfaces, and scratch rendering contexts
+//
+// Patterns, clip paths, masks, filters and cached views all need
+// offscreen BLImages, and a context to draw into them.  Allocating
+// fresh multi-megabyte buffers for every frame during animation or
+// interactive zoom is a lot of page faulting for nothing.
+//
+// SurfacePool hands out BLImages whose pixel memory comes from a
+// size bucketed free list.  The image returned is exactly the size
+// asked for, but lives inside a bucket sized backing store.  When the
+// last reference to the image goes away (including references held
+// by BLPattern, BLVar, etc), the backing store goes back to the pool
+// automatically, so callers just treat it as a regular BLImage.
+//
+// ContextPool does the same for IRenderSVG contexts, so the state
+// stack and other bits don't need to be built up every time.
+//
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+#include "blend2d.h"
+#include "irendersvg.h"
+
+namespace waavs
+{
+    struct SurfacePool
+    {
+        static constexpr size_t kMaxPooledBytes = 128 * 1024 * 1024;
+        static constexpr size_t kMaxPerBucket = 4;
+
+        // A backing store, as it moves between the free list
+        // and being borrowed by an image
+        struct Slot
+        {
+            BLImage fBacking{};
+            uint64_t fKey{ 0 };
+            size_t fBytes{ 0 };
+        };
+
+        std::mutex fLock{};
+        std::unordered_map<uint64_t, std::vector<Slot*>> fFree{};
+        size_t fPooledBytes{ 0 };
+
+        // statistics
+        size_t fHits{ 0 };
+        size_t fMisses{ 0 };
+
+
+        // There's one pool for the whole process.  It is intentionally
+        // never destroyed, as images can be released during static
+        // destruction, in any order.
+        static SurfacePool& pool()
+        {
+            static SurfacePool* sPool = new SurfacePool();
+            return *sPool;
+        }
+
+        // Round dimensions up so that similar sizes, like a window
+        // being resized, or a zoom in progress, land in the same bucket
+        static int bucketDimension(int d)
+        {
+            if (d <= 1024)
+                return (d + 63) & ~63;
+
+            return (d + 255) & ~255;
+        }
+
+        static uint64_t bucketKey(int bw, int bh, BLFormat format)
+        {
+            return ((uint64_t)format << 48) | ((uint64_t)(uint32_t)bw << 24) | (uint64_t)(uint32_t)bh;
+        }
+
+        // Called by blend2d when the last reference to a borrowed image is released
+        static void BL_CDECL returnSlot(void*, void*, void* userData) noexcept
+        {
+            SurfacePool::pool().recycle((Slot*)userData);
+        }
+
+        void recycle(Slot* slot) noexcept
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            auto& bucket = fFree[slot->fKey];
+            if ((bucket.size() >= kMaxPerBucket) || (fPooledBytes + slot->fBytes > kMaxPooledBytes))
+            {
+                delete slot;
+                return;
+            }
+
+            fPooledBytes += slot->fBytes;
+            bucket.push_back(slot);
+        }
+
+        // Make 'img' a w x h image of the given format, with memory from
+        // the pool.  The pixel content is whatever was left behind, so
+        // the caller needs to clear it.
+        bool acquire(BLImage& img, int w, int h, BLFormat format)
+        {
+            if ((w <= 0) || (h <= 0))
+                return false;
+
+            int bw = bucketDimension(w);
+            int bh = bucketDimension(h);
+            uint64_t key = bucketKey(bw, bh, format);
+
+            Slot* slot = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+                auto it = fFree.find(key);
+                if ((it != fFree.end()) && !it->second.empty())
+                {
+                    slot = it->second.back();
+                    it->second.pop_back();
+                    fPooledBytes -= slot->fBytes;
+                    fHits++;
+                }
+                else {
+                    fMisses++;
+                }
+            }
+
+            if (nullptr == slot)
+            {
+                slot = new Slot();
+                if (slot->fBacking.create(bw, bh, format) != BL_SUCCESS)
+                {
+                    delete slot;
+                    return false;
+                }
+                slot->fKey = key;
+            }
+
+            BLImageData data{};
+            slot->fBacking.makeMutable(&data);
+            slot->fBytes = (size_t)data.stride * (size_t)bh;
+
+            if (img.createFromData(w, h, format, data.pixelData, data.stride, BL_DATA_ACCESS_RW, returnSlot, slot) != BL_SUCCESS)
+            {
+                recycle(slot);
+                return false;
+            }
+
+            return true;
+        }
+
+        // Let go of everything sitting in the free lists
+        void trim()
+        {
+            std::lock_guard<std::mutex> lock(fLock);
+
+            for (auto& bucket : fFree)
+            {
+                for (auto slot : bucket.second)
+                    delete slot;
+            }
+            fFree.clear();
+            fPooledBytes = 0;
+        }
+    };
+
+
+    struct ContextPool
+    {
+        static constexpr size_t kMaxPooledContexts = 8;
+
+        std::mutex fLock{};
+        std::vector<std::unique_ptr<IRenderSVG>> fFree{};
+
+        static ContextPool& pool()
+        {
+            static ContextPool* sPool = new ContextPool();
+            return *sPool;
+        }
+
+        std::unique_ptr<IRenderSVG> acquire(FontHandler* fh)
+        {
+            std::unique_ptr<IRenderSVG> ctx{};
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+                if (!fFree.empty())
+                {
+                    ctx = std::move(fFree.back());
+                    fFree.pop_back();
+                }
+            }
+
+            if (nullptr == ctx)
+                return std::make_unique<IRenderSVG>(fh);
+
+            if (ctx->fontHandler() != fh)
+                ctx->fontHandler(fh);
+
+            return ctx;
+        }
+
+        void release(std::unique_ptr<IRenderSVG> ctx)
+        {
+            if (nullptr == ctx)
+                return;
+
+            // Make sure the context no longer references its target
+            ctx->detach();
+            ctx->fStateStack.clear();
+            ctx->resetState();
+
+            std::lock_guard<std::mutex> lock(fLock);
+            if (fFree.size() < kMaxPooledContexts)
+                fFree.push_back(std::move(ctx));
+        }
+    };
+
+
+    // ScratchContext
+    // Borrow a context from the ContextPool for the lifetime of this object
+    //
+    //  ScratchContext sctx(ctx->fontHandler());
+    //  sctx->attach(img);
+    //  ...
+    //
+    struct ScratchContext
+    {
+        std::unique_ptr<IRenderSVG> fContext{};
+
+        ScratchContext(FontHandler* fh)
+            : fContext(ContextPool::pool().acquire(fh))
+        {
+        }
+
+        ScratchContext(const ScratchContext&) = delete;
+        ScratchContext& operator=(const ScratchContext&) = delete;
+
+        ~ScratchContext()
+        {
+            ContextPool::pool().release(std::move(fContext));
+        }
+
+        IRenderSVG* get() const { return fContext.get(); }
+        IRenderSVG* operator->() const { return fContext.get(); }
+        IRenderSVG& operator*() const { return *fContext; }
+    };
+}
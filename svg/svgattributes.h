@@ -602,6 +602,7 @@ namespace waavs {
     struct SVGPaint : public SVGPaintAttribute
     {
         ByteSpan fPaintReference{};
+        std::weak_ptr<IViewable> fPaintNode{};      // what fPaintReference resolved to
 
 
         SVGPaint(IAmGroot* iMap) : SVGPaintAttribute(iMap) {}
@@ -628,6 +629,8 @@ namespace waavs {
                 if (nullptr == node)
                     return;
 
+                fPaintNode = node;
+
 
                 // Tell the referant node to resolve itself
                 //node->bindToContext(ctx, groot);
@@ -740,18 +743,17 @@ namespace waavs {
 
         void update(IAmGroot* groot) override
         {
-            ByteSpan ref = rawValue();
-
-            if (chunk_starts_with_cstr(ref, "url("))
+            // Look the reference up the first time only, after that
+            // the node it resolved to is kept
+            auto node = fPaintNode.lock();
+            if ((nullptr == node) && fPaintReference && (groot != nullptr))
             {
-                if (groot != nullptr) {
-                    auto node = groot->findNodeByUrl(ref);
-                    if (nullptr != node)
-                    {
-                        node->update(groot);
-                    }
-                }
+                node = groot->findNodeByUrl(fPaintReference);
+                fPaintNode = node;
             }
+
+            if (nullptr != node)
+                node->update(groot);
         }
 
         
@@ -856,6 +858,41 @@ namespace waavs {
             ctx->fillRule(fValue);
         }
     };
+
+    //=========================================================
+    // SVGClipRule
+    // The fill rule for the content of a clip path
+    //=========================================================
+
+    struct SVGClipRuleAttribute : public SVGVisualProperty
+    {
+        static void registerFactory() {
+            registerSVGAttribute("clip-rule", [](const XmlAttributeCollection& attrs) {
+                auto node = std::make_shared<SVGClipRuleAttribute>(nullptr);
+                node->loadFromAttributes(attrs);
+                return node;
+                });
+        }
+
+
+        BLFillRule fValue{ BL_FILL_RULE_NON_ZERO };
+
+        SVGClipRuleAttribute(IAmGroot* iMap) : SVGVisualProperty(iMap) { id("clip-rule"); }
+
+        bool loadSelfFromChunk(const ByteSpan& inChunk) override
+        {
+            bool success = getEnumValue(SVGFillRule, inChunk, (uint32_t &)fValue);
+            set(success);
+            needsBinding(false);
+
+            return success;
+        }
+
+        void drawSelf(IRenderSVG* ctx, IAmGroot* groot) override
+        {
+            ctx->clipRule(fValue);
+        }
+    };
 }
 
 
@@ -1402,7 +1439,7 @@ namespace waavs {
         
 		std::shared_ptr<IViewable> markerNode(IRenderSVG* ctx, IAmGroot* groot)
 		{
-            if (fWrappedNode == nullptr)
+            if ((fWrappedNode == nullptr) || needsBinding())
             {
                 bindToContext(ctx, groot);
             }
@@ -1442,98 +1479,6 @@ namespace waavs {
     };
 }
 
-namespace waavs {
-    //======================================================
-    // SVGClipAttribute
-    // This is the attribute that can be connected to some
-    // shape that's being drawn.  Whatever is doing the drawing
-    // should call getVariant() to retrieve the BLImage which
-    // represents the clipPath 
-	//======================================================
-    struct SVGClipPathAttribute : public SVGVisualProperty
-    {
-        static void registerFactory()
-        {
-            registerSVGAttribute("clip-path", [](const XmlAttributeCollection& attrs) {
-                auto node = std::make_shared<SVGClipPathAttribute>(nullptr);
-                node->loadFromAttributes(attrs);
-
-                return node;
-                });
-
-        }
-
-
-        std::shared_ptr<IViewable> fClipNode{ nullptr };
-        BLVar fClipVar;
-        
-        
-        SVGClipPathAttribute(IAmGroot* groot) : SVGVisualProperty(groot) { id("clip-path"); }
-
-        const BLVar getVariant(IRenderSVG*, IAmGroot*) noexcept override
-        {
-            if (fClipNode == nullptr)
-                return fClipVar;
-
-            // BUGBUG
-            //return fClipNode->getVariant();
-            return BLVar::null();
-        }
-
-        
-        bool loadFromUrl(IRenderSVG *ctx, IAmGroot* groot, const ByteSpan& inChunk)
-        {
-            if (nullptr == groot)
-                return false;
-
-            ByteSpan str = inChunk;
-
-            fClipNode = groot->findNodeByUrl(inChunk);
-
-            if (fClipNode == nullptr) {
-                set(false);
-                return false;
-            }
-
-            // pull out the color value
-            // BUGBUG - this will not always be the case
-            // as what we point to might be a gradient or pattern
-            if (fClipNode->needsBinding())
-                fClipNode->bindToContext(ctx, groot);
-
-            set(true);
-
-            return true;
-        }
-
-        
-
-
-        // Let's get a connection to our referenced thing
-        void bindToContext(IRenderSVG *ctx, IAmGroot* groot) noexcept override
-        {
-            ByteSpan str = rawValue();
-
-            // Just load the referenced node at this point
-            
-            if (chunk_starts_with_cstr(str, "url("))
-            {
-                loadFromUrl(ctx, groot, str);
-            }
-
-            needsBinding(false);
-        }
-        
-        bool loadSelfFromChunk(const ByteSpan& ) override
-        {
-            needsBinding(true);
-            set(true);
-            
-            return true;
-        }
-    };
-}
-    
 namespace waavs {
     
     struct SVGVectorEffectAttribute : public SVGVisualProperty
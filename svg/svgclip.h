@@ -6,25 +6,52 @@
 //
 
 #include <functional>
-#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <cmath>
 
 #include "svgattributes.h"
 #include "svgstructuretypes.h"
+#include "svgshapes.h"
+#include "surfacepool.h"
 
 
 namespace waavs {
 
+	//============================================================
+	// SVGClipCoverage
+	// The rasterized coverage of a clip path, for one specific
+	// device transform.  The A8 image is only as big as the device
+	// space bounds of the clip content (intersected with the target
+	// surface), and fArea says where it sits on the target.
+	//============================================================
+	struct SVGClipCoverage
+	{
+		BLMatrix2D fTransform{};	// content to device transform it was rendered with
+		BLRectI fArea{};			// placement of fImage in device space
+		BLImage fImage{};
+
+		bool isEmpty() const { return (fArea.w <= 0) || (fArea.h <= 0); }
+	};
+
+
 	//============================================================
 	// SVGClipPath
-	// Create a SVGSurface that we can draw into
-	// get the size by asking for the extent of the enclosed
-	// visuals.
-	// 
-	// At render time, use the clip path in a pattern and fill
-	// based on that.
+	//
+	// The clip content is rendered into an A8 coverage image, in
+	// device space, and the clipped element is composited through it.
+	// Coverage is cached per device transform, so redrawing the same
+	// view (or a clip path referenced many times from the same
+	// coordinate system) does not rasterize the clip again.
+	//
+	// A clip path that is just a single plain rectangle, which stays
+	// axis aligned on the device, skips all that, and is turned into
+	// a clipToRect() on the context.
 	//============================================================
 	struct SVGClipPathElement : public SVGGraphicsElement
 	{
+		static constexpr size_t kMaxCachedCoverage = 8;
+
 		// Static constructor to register factory method in map
 		static void registerFactory()
 		{
@@ -34,10 +61,13 @@ namespace waavs {
 
 				return node;
 			});
-			
+
 		}
 
-		BLImage fImage;		// Where we'll render the mask
+		bool fUseObjectBoundingBox{ false };
+		std::vector<std::shared_ptr<SVGClipCoverage>> fCoverageCache{};
+		size_t fNextCacheSlot{ 0 };
+
 
 		// Instance Constructor
 		SVGClipPathElement(IAmGroot* )
@@ -46,43 +76,309 @@ namespace waavs {
 			isStructural(false);
 		}
 
-		// 
-		// BUGBUG - this needs to happen in resolvePaint, or bingToGroot()
-		//
-		const BLVar getVariant(IRenderSVG*, IAmGroot*) noexcept override
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
 		{
-			if (!fVar.isNull())
-				return fVar;
+			fUseObjectBoundingBox = (chunk_trim(getAttribute("clipPathUnits"), chrWspChars) == "objectBoundingBox");
 
-			// get our frame() extent
-			BLRect extent = frame();
+			// whatever we had cached was built from old content
+			fCoverageCache.clear();
+			fNextCacheSlot = 0;
+		}
 
-			// create a surface of that size
-			// if it's valid
-			if (extent.w > 0 && extent.h > 0)
+		// Transform from the clip content coordinates to the
+		// user space of the element being clipped
+		BLMatrix2D contentTransform(const BLRect& objectBox) const
+		{
+			BLMatrix2D m = BLMatrix2D::makeIdentity();
+
+			if (fUseObjectBoundingBox)
 			{
-				fImage.create((int)floor((float)extent.w + 0.5f), (int)floor((float)extent.h + 0.5f), BL_FORMAT_A8);
+				m.translate(objectBox.x, objectBox.y);
+				m.scale(objectBox.w, objectBox.h);
+			}
+
+			if (fHasTransform)
+				m.transform(fTransform);
 
-				// Draw our content into the image
+			return m;
+		}
+
+		// Union of the frames of the clip content, in content coordinates
+		BLRect contentFrame() const
+		{
+			BLBox box{};
+			bool firstOne = true;
+
+			for (auto& node : fNodes)
+			{
+				BLRect fr = node->frame();
+				BLPoint pts[4] = { {fr.x, fr.y}, {fr.x + fr.w, fr.y}, {fr.x + fr.w, fr.y + fr.h}, {fr.x, fr.y + fr.h} };
+
+				auto g = std::dynamic_pointer_cast<SVGGraphicsElement>(node);
+				if (g && g->fHasTransform)
+				{
+					for (auto& pt : pts)
+						pt = g->fTransform.mapPoint(pt);
+				}
+
+				for (auto& pt : pts)
 				{
-					IRenderSVG ctx(nullptr);
-					ctx.begin(fImage);
-
-					ctx.setCompOp(BL_COMP_OP_SRC_COPY);
-					ctx.clearAll();
-					ctx.setFillStyle(BLRgba32(0xffffffff));
-					ctx.translate(-extent.x, -extent.y);
-					draw(&ctx, nullptr);
-					ctx.flush();
+					if (firstOne) {
+						box = BLBox(pt.x, pt.y, pt.x, pt.y);
+						firstOne = false;
+					}
+					else {
+						box.x0 = std::min(box.x0, pt.x); box.y0 = std::min(box.y0, pt.y);
+						box.x1 = std::max(box.x1, pt.x); box.y1 = std::max(box.y1, pt.y);
+					}
 				}
+			}
+
+			return BLRect(box.x0, box.y0, box.x1 - box.x0, box.y1 - box.y0);
+		}
+
+		// If the clip path is a single plain rectangle that stays axis
+		// aligned in device space, return that rectangle in the clipped
+		// element's user space.  It can go straight to clipToRect().
+		bool simpleClipRect(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, BLRect& outRect)
+		{
+			if (fNodes.size() != 1)
+				return false;
+
+			auto rectNode = std::dynamic_pointer_cast<SVGRectElement>(fNodes[0]);
+			if (nullptr == rectNode || !rectNode->visible())
+				return false;
+
+			if (rectNode->needsBinding())
+				rectNode->bindToContext(ctx, groot);
+
+			if (rectNode->fIsRound || rectNode->fHasTransform)
+				return false;
+
+			BLMatrix2D m = contentTransform(objectBox);
+			BLMatrix2D dm = m;
+			dm.postTransform(ctx->finalTransform());
+			if (dm.type() > BL_TRANSFORM_TYPE_SCALE)
+				return false;
+
+			const BLRoundRect& r = rectNode->geom;
+			BLPoint p0 = m.mapPoint(r.x, r.y);
+			BLPoint p1 = m.mapPoint(r.x + r.w, r.y + r.h);
+
+			outRect = BLRect(std::min(p0.x, p1.x), std::min(p0.y, p1.y), std::abs(p1.x - p0.x), std::abs(p1.y - p0.y));
+
+			return true;
+		}
+
+		// Retrieve the coverage for the current device transform
+		// from the cache, rendering it if it's not there yet.
+		std::shared_ptr<SVGClipCoverage> coverage(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox)
+		{
+			BLMatrix2D dm = contentTransform(objectBox);
+			dm.postTransform(ctx->finalTransform());
+
+			// Device space bounds of the content, padded for
+			// antialiasing, and limited to the target surface
+			BLRect fr = contentFrame();
+			BLPoint pts[4] = { {fr.x, fr.y}, {fr.x + fr.w, fr.y}, {fr.x + fr.w, fr.y + fr.h}, {fr.x, fr.y + fr.h} };
+			BLBox box(dm.mapPoint(pts[0]).x, dm.mapPoint(pts[0]).y, dm.mapPoint(pts[0]).x, dm.mapPoint(pts[0]).y);
+			for (auto& pt : pts)
+			{
+				BLPoint dp = dm.mapPoint(pt);
+				box.x0 = std::min(box.x0, dp.x); box.y0 = std::min(box.y0, dp.y);
+				box.x1 = std::max(box.x1, dp.x); box.y1 = std::max(box.y1, dp.y);
+			}
+
+			BLSize tsize = ctx->targetSize();
+			int x0 = (int)std::max(0.0, std::floor(box.x0) - 1);
+			int y0 = (int)std::max(0.0, std::floor(box.y0) - 1);
+			int x1 = (int)std::min(tsize.w, std::ceil(box.x1) + 1);
+			int y1 = (int)std::min(tsize.h, std::ceil(box.y1) + 1);
+			BLRectI area(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+
+			for (auto& cov : fCoverageCache)
+			{
+				if ((cov->fTransform == dm) && (cov->fArea == area))
+					return cov;
+			}
+
+			auto cov = std::make_shared<SVGClipCoverage>();
+			cov->fTransform = dm;
+			cov->fArea = area;
+
+			if (!cov->isEmpty() && SurfacePool::pool().acquire(cov->fImage, area.w, area.h, BL_FORMAT_A8))
+			{
+				ScratchContext actx(ctx->fontHandler());
+				actx->attach(cov->fImage);
+				actx->clearAll();
+
+				BLMatrix2D m = dm;
+				m.postTranslate(-area.x, -area.y);
+				actx->setTransform(m);
+
+				// Only the geometry matters, so the children's own
+				// paint, stroke and opacity are locked out
+				actx->geometryOnly(true);
+				uint32_t rule = BL_FILL_RULE_NON_ZERO;
+				if (getEnumValue(SVGFillRule, getAttribute("clip-rule"), rule))
+					actx->clipRule(rule);
+				drawChildren(actx.get(), groot);
+
+				actx->detach();
+			}
+
+			if (fCoverageCache.size() < kMaxCachedCoverage) {
+				fCoverageCache.push_back(cov);
+			}
+			else {
+				fCoverageCache[fNextCacheSlot] = cov;
+				fNextCacheSlot = (fNextCacheSlot + 1) % kMaxCachedCoverage;
+			}
+
+			return cov;
+		}
+
+		// Draw whatever 'content' draws, clipped by this clip path
+		void drawClipped(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content)
+		{
+			if (needsBinding())
+				bindToContext(ctx, groot);
 
-				// bind our image to fVar for later retrieval
-				fVar.assign(fImage);
+			BLRect clipR{};
+			if (simpleClipRect(ctx, groot, objectBox, clipR))
+			{
+				ctx->clipRect(clipR);
+				content(ctx);
+				return;
 			}
 
-			return fVar;
+			auto cov = coverage(ctx, groot, objectBox);
+			if (cov->isEmpty())
+				return;
+
+			const BLRectI& area = cov->fArea;
+
+			// Draw the content into a layer covering the same area
+			BLImage layer{};
+			if (!SurfacePool::pool().acquire(layer, area.w, area.h, BL_FORMAT_PRGB32))
+				return;
+
+			{
+				ScratchContext lctx(ctx->fontHandler());
+				lctx->attach(layer);
+				lctx->clearAll();
+				lctx->inheritState(*ctx, BLPointI(area.x, area.y));
+				content(lctx.get());
+				lctx->detach();
+			}
+
+			// Then composite the layer, using the coverage as the mask
+			BLPattern pat(layer);
+			pat.translate(area.x, area.y);
+
+			ctx->save();
+			ctx->resetTransform();
+			ctx->setFillAlpha(1.0);
+			ctx->fillMask(BLPointI(area.x, area.y), cov->fImage, pat);
+			ctx->restore();
 		}
 
+	};
+}
+
+
+namespace waavs {
+	//======================================================
+	// SVGClipPathAttribute
+	// The 'clip-path' attribute that can be connected to an
+	// element being drawn.  It wraps the drawing of the element's
+	// content, so it can be clipped by the referenced clipPath.
+	//======================================================
+	struct SVGClipPathAttribute : public SVGVisualProperty
+	{
+		static void registerFactory()
+		{
+			registerSVGAttribute("clip-path", [](const XmlAttributeCollection& attrs) {
+				auto node = std::make_shared<SVGClipPathAttribute>(nullptr);
+				node->loadFromAttributes(attrs);
+
+				return node;
+				});
+
+		}
+
+
+		std::shared_ptr<SVGClipPathElement> fClipNode{ nullptr };
+
+
+		SVGClipPathAttribute(IAmGroot* groot) : SVGVisualProperty(groot) { id("clip-path"); }
+
+		int contentWrapOrder() const override { return 2; }
+
+		bool loadFromUrl(IRenderSVG* ctx, IAmGroot* groot, const ByteSpan& inChunk)
+		{
+			if (nullptr == groot)
+				return false;
 
+			fClipNode = std::dynamic_pointer_cast<SVGClipPathElement>(groot->findNodeByUrl(inChunk));
+
+			if (fClipNode == nullptr) {
+				set(false);
+				return false;
+			}
+
+			if (fClipNode->needsBinding())
+				fClipNode->bindToContext(ctx, groot);
+
+			set(true);
+
+			return true;
+		}
+
+
+		// Let's get a connection to our referenced thing
+		void bindToContext(IRenderSVG* ctx, IAmGroot* groot) noexcept override
+		{
+			ByteSpan str = rawValue();
+
+			if (chunk_starts_with_cstr(str, "url("))
+			{
+				loadFromUrl(ctx, groot, str);
+			}
+			else {
+				set(false);
+			}
+
+			needsBinding(false);
+		}
+
+		bool loadSelfFromChunk(const ByteSpan& inChunk) override
+		{
+			// we only act when wrapping the content, not as part
+			// of applying the regular properties
+			autoDraw(false);
+
+			if (inChunk == "none")
+				return set(false);
+
+			needsBinding(true);
+			set(true);
+
+			return true;
+		}
+
+		void drawContent(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content) override
+		{
+			if (needsBinding())
+				bindToContext(ctx, groot);
+
+			if (!isSet() || (nullptr == fClipNode))
+			{
+				content(ctx);
+				return;
+			}
+
+			fClipNode->drawClipped(ctx, groot, objectBox, content);
+		}
 	};
-}
\ No newline at end of file
+}
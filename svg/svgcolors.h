@@ -6,6 +6,7 @@
 
 #include "blend2d.h"
 #include "bspan.h"
+#include "wsenum.h"
 
 
 namespace waavs
@@ -15,8 +16,8 @@ namespace waavs
     // Database of SVG colors
     // BUGBUG - it might be better if these used float instead of byte values
     // Then they can be converted to various forms as needed.
-    // Note:  Everything is in lowercase.  So, when looking up a key
-    // the caller should ensure their key is lowercase first
+    // Note:  Everything is in lowercase.  The lookup folds the case
+    // of the key (ASCII only), so the caller doesn't need to.
     // https://www.w3.org/TR/SVG11/types.html#ColorKeywords
     //
     // 
@@ -27,7 +28,7 @@ namespace waavs
     static BLRgba32 getSVGColorByName(const ByteSpan &colorName) noexcept
     {
 
-        static std::unordered_map<ByteSpan, BLRgba32, ByteSpanInsensitiveHash, ByteSpanCaseInsensitive> svgcolors =
+        static constexpr WSKeyword<BLRgba32> colorNames[] =
         {
             {("white"),  BLRgba32(255, 255, 255)},
             {("ivory"), BLRgba32(255, 255, 240)},
@@ -203,11 +204,13 @@ namespace waavs
             { "windowtext", BLRgba32(0xff000000) },
         };
 
-        
-        auto it = svgcolors.find(colorName);
-		if (it != svgcolors.end())
+        // Built at compile time, folding case as it goes
+        static constexpr auto svgcolors = makeKeywordTable<true>(colorNames);
+
+        BLRgba32 c{};
+		if (svgcolors.find(colorName, c))
 		{
-			return it->second;
+			return c;
 		}
         //printf("UNKNOWN COLOR: ");
 		//printChunk(colorName);
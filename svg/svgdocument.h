@@ -58,6 +58,10 @@ namespace waavs {
     {
         
         MemBuff fSourceMem{};
+
+        // Images being decoded in the background, which read
+        // straight out of fSourceMem
+        std::vector<std::shared_ptr<PendingImage>> fPendingImages{};
         
 		FontHandler* fFontHandler = nullptr;
         
@@ -108,6 +112,13 @@ namespace waavs {
         {
             resetFromSpan(srcChunk, fh, w, h, ppi);
         }
+
+        ~SVGDocument()
+        {
+            // Our source memory goes away before the nodes do
+            // so make sure nothing is still decoding from it
+            cancelPendingImages();
+        }
         
         
         void resetFromSpan(const ByteSpan& srcChunk, FontHandler* fh, const double w, const double h, const double ppi=96)
@@ -287,6 +298,9 @@ namespace waavs {
 		// Assuming we've already got a file mapped into memory, load the document
         bool loadFromChunk(const ByteSpan &srcChunk, FontHandler* fh)
         {
+            // Anything still decoding is reading from the old source
+            cancelPendingImages();
+
             // create a memBuff from srcChunk
             // since we use memory references, we need
             // to keep the memory around for the duration of the 
@@ -299,10 +313,45 @@ namespace waavs {
             // The first pass builds the DOM
             loadFromXmlIterator(iter, this);
             
+            // Get the images decoding while the document is being bound
+            prefetchImages(fNodes);
             
             return true;
         }
 
+        // prefetchImages
+        // Start decoding, in the background, the images that are part of
+        // the rendered tree.  Things in <defs>, <symbol>, <pattern>, and
+        // the like aren't structural, so they're not in here.  Their images
+        // are decoded if, and when, they're actually drawn.
+        void prefetchImages(const std::vector<std::shared_ptr<IViewable>>& nodes)
+        {
+            for (auto& node : nodes)
+            {
+                auto img = std::dynamic_pointer_cast<SVGImageElement>(node);
+                if (img != nullptr)
+                {
+                    auto pending = img->prefetchImage();
+                    if (pending != nullptr)
+                        fPendingImages.push_back(pending);
+
+                    continue;
+                }
+
+                auto g = std::dynamic_pointer_cast<SVGGraphicsElement>(node);
+                if (g != nullptr)
+                    prefetchImages(g->fNodes);
+            }
+        }
+
+        void cancelPendingImages()
+        {
+            for (auto& pending : fPendingImages)
+                pending->cancel();
+
+            fPendingImages.clear();
+        }
+
         // For compound nodes (which have children) we want to 
         // do the base stuff (binding properties) then bind the children
         // If you sub-class this, you should call this first
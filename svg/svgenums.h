@@ -5,13 +5,11 @@
 //
 // There are numerous enums in SVG, and we want to quickly convert between their
 // textual representation, and their numeric value.  
-// The WSEnum represents the enumeration as a map between the static text and the numeric value.
-// We use ByteSpan as the key, and ByteSpanHash as the hashing function.  ByteSpan is a good choice, 
-// because the literal text is fixed at compile time, so does not change during the duration
-// of the program.  Using the ByteSpanHash, will make for a quick lookup.  This may or may not be
-// faster than the typical if-else chain, but it's more flexible, and unifies
-// around a single implementation, which can be changed in the future if a 
-// faster way is found.
+// The WSEnum represents the enumeration as a table between the static text and the numeric value.
+// The literal text is fixed at compile time, so the table is built at compile time as well,
+// with a perfect hash (see wsenum.h).  A lookup is a hash of the key, and a single compare,
+// without the allocation and probing of a std::unordered_map, and it unifies around a
+// single implementation, which can be changed in the future if a faster way is found.
 //
 // In the cases where the enum values map directly to a blend2d equivalent, we use
 // that value.  In other cases, we create a standard enum, and use those values.
@@ -33,10 +31,10 @@ namespace waavs {
 		SVG_SPACE_STROKEWIDTH = 2
 	};
 
-	static WSEnum SVGSpaceUnits = {
+	static constexpr auto SVGSpaceUnits = makeWSEnum({
 		{ "userSpaceOnUse", SpaceUnitsKind::SVG_SPACE_USER },
 		{ "objectBoundingBox", SpaceUnitsKind::SVG_SPACE_OBJECT }
-	};
+	});
 }
 
 namespace waavs {
@@ -58,7 +56,7 @@ namespace waavs {
 		SVG_ASPECT_RATIO_SLICE = 11
 	};
 
-	static WSEnum SVGAspectRatioAlignEnum = {
+	static constexpr auto SVGAspectRatioAlignEnum = makeWSEnum({
 		{"none", AspectRatioAlignKind::SVG_ASPECT_RATIO_NONE},
 		{"xMinYMin", AspectRatioAlignKind::SVG_ASPECT_RATIO_XMINYMIN},
 		{"xMidYMin", AspectRatioAlignKind::SVG_ASPECT_RATIO_XMIDYMIN},
@@ -70,12 +68,12 @@ namespace waavs {
 		{"xMidYMax", AspectRatioAlignKind::SVG_ASPECT_RATIO_XMIDYMAX},
 		{"xMaxYMax", AspectRatioAlignKind::SVG_ASPECT_RATIO_XMAXYMAX},
 
-	};
+	});
 
-	static WSEnum SVGAspectRatioMeetOrSliceEnum = {
+	static constexpr auto SVGAspectRatioMeetOrSliceEnum = makeWSEnum({
 		{"meet", AspectRatioMeetOrSliceKind::SVG_ASPECT_RATIO_MEET},
 		{"slice", AspectRatioMeetOrSliceKind::SVG_ASPECT_RATIO_SLICE}
-	};
+	});
 }
 
 namespace waavs {
@@ -87,11 +85,11 @@ namespace waavs {
 		SVG_PAINT_ORDER_NORMAL = 57,	// 111001
 	};
 
-	static WSEnum SVGPaintOrderEnum = {
+	static constexpr auto SVGPaintOrderEnum = makeWSEnum({
 		{"fill", PaintOrderKind::SVG_PAINT_ORDER_FILL},
 		{"stroke", PaintOrderKind::SVG_PAINT_ORDER_STROKE},
 		{"markers", PaintOrderKind::SVG_PAINT_ORDER_MARKERS},
-	};
+	});
 }
 
 
@@ -117,17 +115,17 @@ namespace waavs {
 	};
 
 
-	static WSEnum MarkerOrientationEnum = {
+	static constexpr auto MarkerOrientationEnum = makeWSEnum({
 		{"auto", MarkerOrientation::MARKER_ORIENT_AUTO},
 		{"auto-start-reverse", MarkerOrientation::MARKER_ORIENT_AUTOSTARTREVERSE},
-	};
+	});
 
 
 
-	static WSEnum MarkerUnitEnum = {
+	static constexpr auto MarkerUnitEnum = makeWSEnum({
 		{"strokeWidth", SpaceUnitsKind::SVG_SPACE_STROKEWIDTH},
 		{"userSpaceOnUse", SpaceUnitsKind::SVG_SPACE_USER},
-	};
+	});
 }
 
 namespace waavs {
@@ -157,7 +155,7 @@ namespace waavs {
 		SVG_SIZE_ABSOLUTE_XXX_LARGE = 8,
 	};
 
-	static WSEnum SVGSizeAbsoluteEnum = {
+	static constexpr auto SVGSizeAbsoluteEnum = makeWSEnum({
 	{"xx-small", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_XX_SMALL},
 	{"x-small", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_X_SMALL},
 	{"small", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_SMALL},
@@ -166,7 +164,7 @@ namespace waavs {
 	{"x-large", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_X_LARGE},
 	{"xx-large", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_XX_LARGE},
 	{"xxx-large", SVGSizeAbsoluteKind::SVG_SIZE_ABSOLUTE_XXX_LARGE},
-	};
+	});
 
 	enum SVGSizeRelativeKind : uint32_t
 	{
@@ -174,10 +172,10 @@ namespace waavs {
 		SVG_SIZE_RELATIVE_SMALLER = 2,
 	};
 
-	static WSEnum SVGSizeRelativeEnum = {
+	static constexpr auto SVGSizeRelativeEnum = makeWSEnum({
 		{"larger", SVGSizeRelativeKind::SVG_SIZE_RELATIVE_LARGER},
 		{"smaller", SVGSizeRelativeKind::SVG_SIZE_RELATIVE_SMALLER},
-	};
+	});
 
 	// SVG_SIZE_KIND_LENGTH
 	enum SVGLengthKind : uint32_t {
@@ -194,7 +192,7 @@ namespace waavs {
 		SVG_LENGTHTYPE_PC = 10,
 	};
 
-	static WSEnum SVGDimensionEnum = {
+	static constexpr auto SVGDimensionEnum = makeWSEnum({
 		{"",SVG_LENGTHTYPE_NUMBER },
 		{"px", SVG_LENGTHTYPE_PX},
 		{"pt", SVG_LENGTHTYPE_PT},
@@ -205,7 +203,7 @@ namespace waavs {
 		{"%",  SVG_LENGTHTYPE_PERCENTAGE},
 		{"em", SVG_LENGTHTYPE_EMS},
 		{"ex", SVG_LENGTHTYPE_EXS}
-	};
+	});
 
 
 }
@@ -233,17 +231,17 @@ namespace waavs {
 		SVG_ALIGNMENT_END		= 0x04,
 	};
 	
-	static WSEnum SVGTextAnchor = {
+	static constexpr auto SVGTextAnchor = makeWSEnum({
 		{ "start", SVG_ALIGNMENT_START },
 		{ "middle", SVG_ALIGNMENT_MIDDLE },
 		{ "end", SVG_ALIGNMENT_END }
-	};
+	});
 
-    static WSEnum SVGTextAlign = {
+    static constexpr auto SVGTextAlign = makeWSEnum({
         { "start", (int)SVG_ALIGNMENT_START },
         { "middle", (int)SVG_ALIGNMENT_MIDDLE },
         { "end", (int)SVG_ALIGNMENT_END }
-    };
+    });
     
 
 	// Dominant Baseline
@@ -265,7 +263,7 @@ namespace waavs {
         USE_SCRIPT,
     };
 
-	static WSEnum SVGDominantBaseline = {
+	static constexpr auto SVGDominantBaseline = makeWSEnum({
 		{ "auto", DOMINANTBASELINE::AUTO },
 		{ "alphabetic", DOMINANTBASELINE::ALPHABETIC },
 		{ "central", DOMINANTBASELINE::CENTRAL },
@@ -280,9 +278,9 @@ namespace waavs {
 		{ "text-bottom", DOMINANTBASELINE::TEXT_BOTTOM },
 		{ "text-top", DOMINANTBASELINE::TEXT_TOP },
 		{ "use-script", DOMINANTBASELINE::USE_SCRIPT }
-	};
+	});
     
-	static WSEnum SVGFontWeight = {
+	static constexpr auto SVGFontWeight = makeWSEnum({
 		{ "100", BL_FONT_WEIGHT_THIN },
 		{ "200", BL_FONT_WEIGHT_EXTRA_LIGHT },
 		{ "300", BL_FONT_WEIGHT_LIGHT },
@@ -295,9 +293,9 @@ namespace waavs {
 		{ "800", BL_FONT_WEIGHT_SEMI_BOLD },
 		{ "900", BL_FONT_WEIGHT_EXTRA_BOLD },
 		{ "1000", BL_FONT_WEIGHT_BLACK }
-	};
+	});
     
-    static WSEnum SVGFontStretch = {
+    static constexpr auto SVGFontStretch = makeWSEnum({
 		{"condensed", BL_FONT_STRETCH_CONDENSED},
 		{"expanded", BL_FONT_STRETCH_EXPANDED},
 		{"extra-condensed", BL_FONT_STRETCH_EXTRA_CONDENSED},
@@ -307,18 +305,18 @@ namespace waavs {
 		{"semi-expanded", BL_FONT_STRETCH_SEMI_EXPANDED},
 		{"ultra-condensed", BL_FONT_STRETCH_ULTRA_CONDENSED},
 		{"ultra-expanded", BL_FONT_STRETCH_ULTRA_EXPANDED}
-    };
+    });
     
-	static WSEnum SVGFontStyle = {
+	static constexpr auto SVGFontStyle = makeWSEnum({
 		{"normal", BL_FONT_STYLE_NORMAL},
 		{"italic", BL_FONT_STYLE_ITALIC},
 		{"oblique", BL_FONT_STYLE_OBLIQUE}
-	};
+	});
     
 }
 
 namespace waavs {
-	static WSEnum SVGLineCaps = {
+	static constexpr auto SVGLineCaps = makeWSEnum({
 		{ "butt", BL_STROKE_CAP_BUTT },
 		{ "round", BL_STROKE_CAP_ROUND },
 		{ "square", BL_STROKE_CAP_SQUARE },
@@ -327,10 +325,10 @@ namespace waavs {
         {"round-reverse", BL_STROKE_CAP_ROUND_REV},
         {"triangle", BL_STROKE_CAP_TRIANGLE},
         {"triangle-reverse", BL_STROKE_CAP_TRIANGLE_REV},
-	};
+	});
 
 
-	static WSEnum SVGLineJoin = {
+	static constexpr auto SVGLineJoin = makeWSEnum({
 		{ "miter", BL_STROKE_JOIN_MITER_BEVEL },
 		{ "round", BL_STROKE_JOIN_ROUND },
 		{ "bevel", BL_STROKE_JOIN_BEVEL },
@@ -338,7 +336,7 @@ namespace waavs {
 		// blend2d specific extensions
         {"miter-clip",BL_STROKE_JOIN_MITER_CLIP },
 
-	};
+	});
     
 
 }
@@ -352,23 +350,23 @@ namespace waavs {
         VECTOR_EFFECT_FIXED_POSITION,
     };
 
-	static WSEnum SVGVectorEffect = {
+	static constexpr auto SVGVectorEffect = makeWSEnum({
 		{ "none", VECTOR_EFFECT_NONE },
 		{ "non-scaling-stroke", VECTOR_EFFECT_NON_SCALING_STROKE },
 		{ "non-scaling-size", VECTOR_EFFECT_NON_SCALING_SIZE },
 		{ "non-rotation", VECTOR_EFFECT_NON_ROTATION },
 		{ "fixed-position", VECTOR_EFFECT_FIXED_POSITION },
-	};
+	});
     
 
 }
 
 namespace waavs {
 
-	static WSEnum SVGFillRule = {
+	static constexpr auto SVGFillRule = makeWSEnum({
 		{ "nonzero", BL_FILL_RULE_NON_ZERO },
 		{ "evenodd", BL_FILL_RULE_EVEN_ODD },
-	};
+	});
 
 
 
@@ -378,13 +376,13 @@ namespace waavs {
 // Parsing spreadMethod, which is applied to the 
 // ExtendMode of the gradient
 namespace waavs {
-	static WSEnum SVGSpreadMethod = {
+	static constexpr auto SVGSpreadMethod = makeWSEnum({
 		{ "pad", BL_EXTEND_MODE_PAD },
 		{ "reflect", BL_EXTEND_MODE_REFLECT },
 		{ "repeat", BL_EXTEND_MODE_REPEAT },
-	};
+	});
 
-	static WSEnum SVGExtendMode = {
+	static constexpr auto SVGExtendMode = makeWSEnum({
 		{"pad", BL_EXTEND_MODE_PAD},
 		{"reflect", BL_EXTEND_MODE_REFLECT},
 		{"repeat", BL_EXTEND_MODE_REPEAT},
@@ -401,7 +399,7 @@ namespace waavs {
 		{"reflect-x-repeat-y", BL_EXTEND_MODE_REFLECT_X_REPEAT_Y},
 		{"reflect-x-reflect-y", BL_EXTEND_MODE_REFLECT_X_REFLECT_Y},
 		{"reflect-x-pad-y", BL_EXTEND_MODE_REFLECT_X_PAD_Y},
-	};
+	});
 	
 
 }
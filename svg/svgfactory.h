@@ -32,6 +32,7 @@ namespace waavs {
             SVGFillPaint::registerFactory();
             SVGFillOpacity::registerFactory();
             SVGFillRuleAttribute::registerFactory();
+            SVGClipRuleAttribute::registerFactory();
 
             SVGStrokePaint::registerFactory();
             SVGStrokeOpacity::registerFactory();
@@ -55,7 +56,9 @@ namespace waavs {
             SVGFontWeightAttribute::registerFactory();
             SVGFontStretchAttribute::registerFactory();
 
-            //SVGClipPathAttribute::registerFactory();
+            SVGClipPathAttribute::registerFactory();
+            SVGFilterAttribute::registerFactory();
+            SVGMaskAttribute::registerFactory();
             //SVGTransform::registerFactory();
 
 
@@ -103,8 +106,13 @@ namespace waavs {
             SVGFeDiffuseLightingElement::registerFactory(); // 'feDiffuseLighting'
             SVGFeDisplacementMapElement::registerFactory(); // 'feDisplacementMap'
             SVGFeDistantLightElement::registerFactory();    // 'feDistantLightMap'
+            SVGFePointLightElement::registerFactory();      // 'fePointLight'
+            SVGFeSpotLightElement::registerFactory();       // 'feSpotLight'
+            SVGFeFuncElement::registerFactory();            // 'feFuncR', 'feFuncG', 'feFuncB', 'feFuncA'
             SVGFeFloodElement::registerFactory();           // 'feFlood'
             SVGFeGaussianBlurElement::registerFactory();    // 'feGaussianBlur'
+            SVGFeMergeElement::registerFactory();           // 'feMerge'
+            SVGFeMergeNodeElement::registerFactory();       // 'feMergeNode'
             SVGFeOffsetElement::registerFactory();          // 'feOffset'
             SVGFeTurbulenceElement::registerFactory();      // 'feTurbulence'
 
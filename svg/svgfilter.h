@@ -1,13 +1,22 @@
 #pragma once
 
+#include "svgattributes.h"
 #include "svgstructuretypes.h"
+#include "surfacepool.h"
+#include "filterengine.h"
+#include "filterblur.h"
+#include "filterkernels.h"
+#include "filterturbulence.h"
+#include "filterlighting.h"
+#include "filterconvolve.h"
 
 
 #include <string>
 #include <array>
+#include <vector>
+#include <memory>
 #include <functional>
-#include <unordered_map>
-
+#include <mutex>
 
 // Elements related to filters
 // filter			- compound
@@ -44,9 +53,133 @@
 
 namespace waavs {
 
+	// Resolve one of x/y/width/height, for a filter region or primitive
+	// subregion.  In objectBoundingBox units, a plain number is a
+	// fraction of 'length', otherwise 'length' is the viewport's size.
+	// 'defaultPercent' is used when the value isn't set at all.
+	static double resolveFilterLength(const SVGDimension& dim, double defaultPercent, bool objectBox, double length)
+	{
+		if (!dim.isSet())
+			return (defaultPercent / 100.0) * length;
+
+		if (objectBox)
+			return dim.isPercentage() ? (dim.value() / 100.0) * length : dim.value() * length;
+
+		return dim.calculatePixels(length);
+	}
+
+	// color-interpolation-filters, or -1 if it's to be inherited
+	static int parseFilterColorSpace(const ByteSpan& inChunk)
+	{
+		ByteSpan s = chunk_trim(inChunk, chrWspChars);
+
+		if (s == "linearRGB")
+			return FILTER_COLORSPACE_LINEARRGB;
+		if ((s == "sRGB") || (s == "auto"))
+			return FILTER_COLORSPACE_SRGB;
+
+		return -1;
+	}
+
+
+	//============================================================
+	// SVGFilterPrimitive
+	// What all the fe* elements have in common; the names of their
+	// inputs and result, the primitive subregion, and the color space
+	// they work in.  Unless a primitive says otherwise, it passes its
+	// first input through untouched.
+	//============================================================
+	struct SVGFilterPrimitive : public SVGGraphicsElement, public IFilterPrimitive
+	{
+		ByteSpan fIn{};
+		ByteSpan fIn2{};
+		ByteSpan fResult{};
+
+		SVGDimension fX{};
+		SVGDimension fY{};
+		SVGDimension fWidth{};
+		SVGDimension fHeight{};
+
+		int fColorSpace{ -1 };
+
+
+		SVGFilterPrimitive()
+			: SVGGraphicsElement()
+		{
+			isStructural(true);
+		}
+
+		ByteSpan filterInputName(size_t idx) const override { return (idx == 0) ? fIn : fIn2; }
+		ByteSpan filterResultName() const override { return fResult; }
+
+		int filterColorSpace(int inherited) const override
+		{
+			return (fColorSpace < 0) ? inherited : fColorSpace;
+		}
+
+		// The primitive subregion, in user space.
+		// Anything not given comes from the filter region.
+		BLRect filterSubregionUser(const FilterSpace& space) const
+		{
+			const BLRect& fr = space.fRegion;
+			const BLRect& box = space.fObjectBox;
+			bool obb = space.fPrimitiveObjectBox;
+
+			double x = fX.isSet() ? (obb ? box.x : 0) + resolveFilterLength(fX, 0, obb, obb ? box.w : space.fViewport.w) : fr.x;
+			double y = fY.isSet() ? (obb ? box.y : 0) + resolveFilterLength(fY, 0, obb, obb ? box.h : space.fViewport.h) : fr.y;
+			double w = fWidth.isSet() ? resolveFilterLength(fWidth, 0, obb, obb ? box.w : space.fViewport.w) : fr.w;
+			double h = fHeight.isSet() ? resolveFilterLength(fHeight, 0, obb, obb ? box.h : space.fViewport.h) : fr.h;
+
+			return BLRect(x, y, w, h);
+		}
+
+		BLRectI filterSubregion(const FilterSpace& space) const override
+		{
+			if (!fX.isSet() && !fY.isSet() && !fWidth.isSet() && !fHeight.isSet())
+				return space.bounds();
+
+			return FilterPixels::intersect(space.mapUserRect(filterSubregionUser(space)), space.bounds());
+		}
+
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if ((nInputs == 0) || inputs[0]->isEmpty())
+				return;
+
+			const FilterImage& in = *inputs[0];
+			if (out.allocate(out.fRect, (BLFormat)in.fImage.format()))
+			{
+				out.fColorSpace = in.fColorSpace;
+				FilterPixels::copy(in, out);
+			}
+		}
+
+		// Sub-classes binding their own attributes should call this first
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fIn = chunk_trim(getAttribute("in"), chrWspChars);
+			fIn2 = chunk_trim(getAttribute("in2"), chrWspChars);
+			fResult = chunk_trim(getAttribute("result"), chrWspChars);
+
+			fX.loadFromChunk(getAttribute("x"));
+			fY.loadFromChunk(getAttribute("y"));
+			fWidth.loadFromChunk(getAttribute("width"));
+			fHeight.loadFromChunk(getAttribute("height"));
+
+			fColorSpace = parseFilterColorSpace(getAttribute("color-interpolation-filters"));
+		}
+	};
+
+
+	//============================================================
+	// SVGFilterElement
 	//
-	// filter
-	//
+	// At bind time, the primitives are gathered up, and turned into
+	// a FilterPlan.  When an element is drawn through the filter, its
+	// content is rendered into a layer that covers only what the
+	// primitives will read, the plan is run, and the result is
+	// composited back onto the device.
+	//============================================================
 	struct SVGFilterElement : public SVGGraphicsElement
 	{
 		static void registerSingularNode()
@@ -58,81 +191,154 @@ namespace waavs {
 				return node;
 			};
 		}
-		
+
 		static void registerFactory()
 		{
 			getSVGContainerCreationMap()["filter"] = [](IAmGroot* groot, XmlElementIterator& iter) {
 				auto node = std::make_shared<SVGFilterElement>(groot);
 				node->loadFromXmlIterator(iter, groot);
-				
+
 				return node;
 			};
 
 			registerSingularNode();
 		}
 
-		// filters need to setup an execution environment.  
+		// The filter region
 		SVGDimension fX{};
 		SVGDimension fY{};
 		SVGDimension fWidth{};
 		SVGDimension fHeight{};
-		
-		// dictionary of images used in the filter
-		std::unordered_map<std::string, BLImage> fFilterImages;
-		
-		
+		bool fUserSpaceUnits{ false };			// filterUnits="userSpaceOnUse"
+		bool fPrimitiveObjectBox{ false };		// primitiveUnits="objectBoundingBox"
+		int fColorSpace{ FILTER_COLORSPACE_LINEARRGB };
+
+		std::vector<std::shared_ptr<SVGFilterPrimitive>> fPrimitives{};
+		FilterPlan fPlan{};
+
+
 		SVGFilterElement(IAmGroot* )
 			: SVGGraphicsElement()
 		{
 			isStructural(false);
 		}
 
-		bool addImage(const std::string &name, BLImage &img)
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
 		{
-			auto it = fFilterImages.find(name);
-			if (it != fFilterImages.end())
-				return false;
+			fX.loadFromChunk(getAttribute("x"));
+			fY.loadFromChunk(getAttribute("y"));
+			fWidth.loadFromChunk(getAttribute("width"));
+			fHeight.loadFromChunk(getAttribute("height"));
 
-			fFilterImages[name] = img;
-			return true;
-		}
+			fUserSpaceUnits = (chunk_trim(getAttribute("filterUnits"), chrWspChars) == "userSpaceOnUse");
+			fPrimitiveObjectBox = (chunk_trim(getAttribute("primitiveUnits"), chrWspChars) == "objectBoundingBox");
 
-		bool getImage(const std::string& name, BLImage &img)
-		{
-			auto it = fFilterImages.find(name);
-			if (it == fFilterImages.end())
-				return false;
+			int space = parseFilterColorSpace(getAttribute("color-interpolation-filters"));
+			fColorSpace = (space < 0) ? FILTER_COLORSPACE_LINEARRGB : space;
 
-			img = it->second;
-			return true;
+			// Bind the primitives, and plan how to run them
+			fPrimitives.clear();
+			std::vector<IFilterPrimitive*> prims{};
+			for (auto& node : fNodes)
+			{
+				auto prim = std::dynamic_pointer_cast<SVGFilterPrimitive>(node);
+				if (nullptr == prim)
+					continue;
+
+				if (prim->needsBinding())
+					prim->bindToContext(ctx, groot);
+
+				fPrimitives.push_back(prim);
+				prims.push_back(prim.get());
+			}
+
+			fPlan.build(prims, fColorSpace);
 		}
 
-		virtual bool addNode(std::shared_ptr < ISVGElement > node, IAmGroot* groot)
+		// The filter region, in the user space of the element being filtered
+		BLRect filterRegion(const BLRect& objectBox, const BLRect& viewport) const
 		{
-			// if superclass fails to add the node, then forget it
-			if (!SVGGraphicsElement::addNode(node, groot))
-				return false;
-			
-			//printf("SVGFeFilter.addNode(%s)\n", node->id().c_str());
-			
-			return true;
+			if (fUserSpaceUnits)
+			{
+				return BLRect(resolveFilterLength(fX, -10, false, viewport.w), resolveFilterLength(fY, -10, false, viewport.h),
+					resolveFilterLength(fWidth, 120, false, viewport.w), resolveFilterLength(fHeight, 120, false, viewport.h));
+			}
+
+			return BLRect(objectBox.x + resolveFilterLength(fX, -10, true, objectBox.w), objectBox.y + resolveFilterLength(fY, -10, true, objectBox.h),
+				resolveFilterLength(fWidth, 120, true, objectBox.w), resolveFilterLength(fHeight, 120, true, objectBox.h));
 		}
 
-		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		// Draw whatever 'content' draws, through this filter
+		void drawFiltered(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content)
 		{
-			fX.loadFromChunk(getAttribute("x"));
-			fY.loadFromChunk(getAttribute("y"));
-			fWidth.loadFromChunk(getAttribute("width"));
-			fHeight.loadFromChunk(getAttribute("height"));
-
+			if (needsBinding())
+				bindToContext(ctx, groot);
+
+			// A filter with no primitives, or an empty region,
+			// means the element isn't drawn at all
+			if (fPlan.isEmpty())
+				return;
+
+			if (!fUserSpaceUnits && ((objectBox.w <= 0) || (objectBox.h <= 0)))
+				return;
+
+			BLRect region = filterRegion(objectBox, ctx->viewport());
+			if ((region.w <= 0) || (region.h <= 0))
+				return;
+
+			FilterSpace space{};
+			space.fRegion = region;
+			space.fObjectBox = objectBox;
+			space.fViewport = ctx->viewport();
+			space.fPrimitiveObjectBox = fPrimitiveObjectBox;
+
+			BLMatrix2D dm = ctx->finalTransform();
+			space.fScale = BLPoint(std::sqrt(dm.m00 * dm.m00 + dm.m01 * dm.m01), std::sqrt(dm.m10 * dm.m10 + dm.m11 * dm.m11));
+
+			// Filter region on the device.  It can be much bigger than
+			// the target when zoomed in, but only the part near the
+			// target can ever contribute to what's visible.
+			space.fUserToFilter = dm;
+			BLRectI area = space.mapUserRect(region);
+
+			BLSize tsize = ctx->targetSize();
+			int tw = (int)std::ceil(tsize.w);
+			int th = (int)std::ceil(tsize.h);
+			area = FilterPixels::intersect(area, BLRectI(-tw, -th, tw * 3, th * 3));
+			if (FilterPixels::isEmpty(area))
+				return;
+
+			space.fArea = area;
+			space.fUserToFilter.postTranslate(-area.x, -area.y);
+
+			BLRectI visible(-area.x, -area.y, tw, th);
+
+			FilterImage result{};
+			bool success = fPlan.execute(space, visible, [ctx, &area, &content](FilterImage& src) {
+				ScratchContext lctx(ctx->fontHandler());
+				lctx->attach(src.fImage);
+				lctx->clearAll();
+				lctx->inheritState(*ctx, BLPointI(area.x + src.fRect.x, area.y + src.fRect.y));
+				content(lctx.get());
+				lctx->detach();
+
+				return true;
+			}, result);
+
+			if (!success || result.isEmpty())
+				return;
+
+			ctx->save();
+			ctx->resetTransform();
+			ctx->blitImage(BLPointI(area.x + result.fRect.x, area.y + result.fRect.y), result.fImage);
+			ctx->restore();
 		}
-		
 	};
 
 	//
 	// feBlend
 	//
-	struct SVGFeBlendElement : public SVGGraphicsElement
+	struct SVGFeBlendElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -159,17 +365,186 @@ namespace waavs {
 
 
 
+		int fMode{ FILTER_BLEND_NORMAL };
+
+
 		SVGFeBlendElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
+
+		static int parseBlendMode(const ByteSpan& inChunk)
+		{
+			static const char* kModes[] = { "normal", "multiply", "screen", "darken", "lighten", "difference", "exclusion",
+				"overlay", "color-dodge", "color-burn", "hard-light", "soft-light", "hue", "saturation", "color", "luminosity" };
+
+			ByteSpan s = chunk_trim(inChunk, chrWspChars);
+			for (int i = 0; i < (int)(sizeof(kModes) / sizeof(kModes[0])); i++)
+			{
+				if (s == kModes[i])
+					return i;
+			}
+
+			return FILTER_BLEND_NORMAL;
+		}
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fMode = parseBlendMode(getAttribute("mode"));
+		}
+
+		size_t filterInputCount() const override { return 2; }
+
+		// 'in' is drawn onto 'in2'
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (nInputs < 2)
+				return;
+
+			// Every mode leaves transparent on transparent alone,
+			// so only where the inputs have pixels needs doing
+			BLRectI area = FilterPixels::intersect(out.fRect, FilterPixels::unite(FilterKernels::coverage(inputs[0]), FilterKernels::coverage(inputs[1])));
+			if (FilterPixels::isEmpty(area))
+				return;
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, area != out.fRect))
+				return;
+
+			int mode = fMode;
+			FilterKernels::mapRows(inputs[0], inputs[1], out, area, [mode](const uint32_t* s, const uint32_t* b, uint32_t* dst, int n) {
+				FilterKernels::blend(s, b, dst, n, mode);
+			});
+		}
 	};
 	
+	//
+	// feFuncR, feFuncG, feFuncB, feFuncA
+	// The transfer function for one channel of an feComponentTransfer
+	//
+	struct SVGFeFuncElement : public SVGGraphicsElement
+	{
+		static void registerFactory()
+		{
+			for (const char* name : { "feFuncR", "feFuncG", "feFuncB", "feFuncA" })
+			{
+				getSVGSingularCreationMap()[name] = [](IAmGroot* groot, const XmlElement& elem) {
+					auto node = std::make_shared<SVGFeFuncElement>(groot);
+					node->loadFromXmlElement(elem, groot);
+
+					return node;
+					};
+
+				getSVGContainerCreationMap()[name] = [](IAmGroot* groot, XmlElementIterator& iter) {
+					auto node = std::make_shared<SVGFeFuncElement>(groot);
+					node->loadFromXmlIterator(iter, groot);
+
+					return node;
+					};
+			}
+		}
+
+
+		enum { FUNC_IDENTITY, FUNC_TABLE, FUNC_DISCRETE, FUNC_LINEAR, FUNC_GAMMA };
+
+		int fChannel{ -1 };				// 0..3 for R, G, B, A
+		int fType{ FUNC_IDENTITY };
+		std::vector<double> fTableValues{};
+		double fSlope{ 1 };
+		double fIntercept{ 0 };
+		double fAmplitude{ 1 };
+		double fExponent{ 1 };
+		double fOffset{ 0 };
+
+
+		SVGFeFuncElement(IAmGroot* )
+			: SVGGraphicsElement()
+		{
+			isStructural(true);
+		}
+
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			ByteSpan n = name();
+			fChannel = -1;
+			if (n == "feFuncR") fChannel = 0;
+			else if (n == "feFuncG") fChannel = 1;
+			else if (n == "feFuncB") fChannel = 2;
+			else if (n == "feFuncA") fChannel = 3;
+
+			ByteSpan type = chunk_trim(getAttribute("type"), chrWspChars);
+			fType = FUNC_IDENTITY;
+			if (type == "table") fType = FUNC_TABLE;
+			else if (type == "discrete") fType = FUNC_DISCRETE;
+			else if (type == "linear") fType = FUNC_LINEAR;
+			else if (type == "gamma") fType = FUNC_GAMMA;
+
+			fTableValues.clear();
+			ByteSpan values = getAttribute("tableValues");
+			double v{ 0 };
+			while (readNextNumber(values, v))
+				fTableValues.push_back(v);
+
+			fSlope = 1;
+			fIntercept = 0;
+			fAmplitude = 1;
+			fExponent = 1;
+			fOffset = 0;
+			parseNumber(chunk_trim(getAttribute("slope"), chrWspChars), fSlope);
+			parseNumber(chunk_trim(getAttribute("intercept"), chrWspChars), fIntercept);
+			parseNumber(chunk_trim(getAttribute("amplitude"), chrWspChars), fAmplitude);
+			parseNumber(chunk_trim(getAttribute("exponent"), chrWspChars), fExponent);
+			parseNumber(chunk_trim(getAttribute("offset"), chrWspChars), fOffset);
+		}
+
+		// The function, evaluated at all 256 levels
+		void buildTable(uint8_t* table) const
+		{
+			size_t count = fTableValues.size();
+
+			for (int i = 0; i < 256; i++)
+			{
+				double c = i / 255.0;
+				double v = c;
+
+				switch (fType)
+				{
+				case FUNC_TABLE:
+					if (count == 1) {
+						v = fTableValues[0];
+					}
+					else if (count > 1) {
+						size_t n = count - 1;
+						size_t k = std::min(n - 1, (size_t)(c * n));
+						v = fTableValues[k] + (c * n - k) * (fTableValues[k + 1] - fTableValues[k]);
+					}
+					break;
+
+				case FUNC_DISCRETE:
+					if (count > 0)
+						v = fTableValues[std::min(count - 1, (size_t)(c * count))];
+					break;
+
+				case FUNC_LINEAR:
+					v = fSlope * c + fIntercept;
+					break;
+
+				case FUNC_GAMMA:
+					v = fAmplitude * std::pow(c, fExponent) + fOffset;
+					break;
+				}
+
+				table[i] = (uint8_t)std::lround(std::min(1.0, std::max(0.0, v)) * 255.0);
+			}
+		}
+	};
+
 	//
 	// feComponentTransfer
 	//
-	struct SVGFeComponentTransferElement : public SVGGraphicsElement
+	struct SVGFeComponentTransferElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -194,19 +569,63 @@ namespace waavs {
 
 
 
+		TransferTables fTables{};
+
+
 		SVGFeComponentTransferElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
 
+		// The tables are built here, once, from the feFuncX children
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fTables = TransferTables{};
+			for (auto& node : fNodes)
+			{
+				auto func = std::dynamic_pointer_cast<SVGFeFuncElement>(node);
+				if (nullptr == func)
+					continue;
+
+				if (func->needsBinding())
+					func->bindToContext(ctx, groot);
+
+				if (func->fChannel >= 0)
+					func->buildTable(fTables.fTable[func->fChannel]);
+			}
+		}
+
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (nInputs == 0)
+				return;
+
+			// Unless the alpha table lifts zero, transparent stays
+			// transparent, and only the input's pixels need doing
+			BLRectI area = out.fRect;
+			if (fTables.fTable[3][0] == 0)
+				area = FilterPixels::intersect(area, FilterKernels::coverage(inputs[0]));
+			if (FilterPixels::isEmpty(area))
+				return;
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, area != out.fRect))
+				return;
+
+			const TransferTables& tables = fTables;
+			FilterKernels::mapRows(inputs[0], nullptr, out, area, [&tables](const uint32_t* s, const uint32_t*, uint32_t* dst, int n) {
+				FilterKernels::componentTransfer(s, dst, n, tables);
+			});
+		}
 	};
 	
 	
 	//
 	// feComposite
 	//
-	struct SVGFeCompositeElement : public SVGGraphicsElement
+	struct SVGFeCompositeElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -232,18 +651,71 @@ namespace waavs {
 
 
 
+		int fOperator{ FILTER_COMPOSITE_OVER };
+		float fK[4]{ 0, 0, 0, 0 };
+
+
 		SVGFeCompositeElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
 
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			ByteSpan op = chunk_trim(getAttribute("operator"), chrWspChars);
+			fOperator = FILTER_COMPOSITE_OVER;
+			if (op == "in") fOperator = FILTER_COMPOSITE_IN;
+			else if (op == "out") fOperator = FILTER_COMPOSITE_OUT;
+			else if (op == "atop") fOperator = FILTER_COMPOSITE_ATOP;
+			else if (op == "xor") fOperator = FILTER_COMPOSITE_XOR;
+			else if (op == "lighter") fOperator = FILTER_COMPOSITE_LIGHTER;
+			else if (op == "arithmetic") fOperator = FILTER_COMPOSITE_ARITHMETIC;
+
+			const char* kNames[4] = { "k1", "k2", "k3", "k4" };
+			for (int i = 0; i < 4; i++)
+			{
+				double k{ 0 };
+				parseNumber(chunk_trim(getAttribute(kNames[i]), chrWspChars), k);
+				fK[i] = (float)k;
+			}
+		}
+
+		size_t filterInputCount() const override { return 2; }
+
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (nInputs < 2)
+				return;
+
+			// Only arithmetic, with k4 > 0, can make something out of
+			// nothing.  Otherwise, the result is limited to where the
+			// inputs are, and for 'in', where both of them are.
+			BLRectI area = out.fRect;
+			if (fOperator == FILTER_COMPOSITE_IN)
+				area = FilterPixels::intersect(area, FilterPixels::intersect(FilterKernels::coverage(inputs[0]), FilterKernels::coverage(inputs[1])));
+			else if ((fOperator != FILTER_COMPOSITE_ARITHMETIC) || (fK[3] <= 0))
+				area = FilterPixels::intersect(area, FilterPixels::unite(FilterKernels::coverage(inputs[0]), FilterKernels::coverage(inputs[1])));
+			if (FilterPixels::isEmpty(area))
+				return;
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, area != out.fRect))
+				return;
+
+			int op = fOperator;
+			const float* k = fK;
+			FilterKernels::mapRows(inputs[0], inputs[1], out, area, [op, k](const uint32_t* a, const uint32_t* b, uint32_t* dst, int n) {
+				FilterKernels::composite(a, b, dst, n, op, k);
+			});
+		}
 	};
 
 	//
 	// feColorMatrix
 	//
-	struct SVGFeColorMatrixElement : public SVGGraphicsElement
+	struct SVGFeColorMatrixElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -268,18 +740,103 @@ namespace waavs {
 		}
 
 
+		// 4 rows of 5, offsets in the range [0..1]
+		float fMatrix[20]{};
+
+
 		SVGFeColorMatrixElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
 
+		// Every type comes down to a matrix, worked out here
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			std::vector<double> values{};
+			ByteSpan s = getAttribute("values");
+			double v{ 0 };
+			while (readNextNumber(s, v))
+				values.push_back(v);
+
+			double m[20] = {
+				1, 0, 0, 0, 0,
+				0, 1, 0, 0, 0,
+				0, 0, 1, 0, 0,
+				0, 0, 0, 1, 0 };
+
+			ByteSpan type = chunk_trim(getAttribute("type"), chrWspChars);
+			if (type == "saturate")
+			{
+				double sat = values.empty() ? 1.0 : values[0];
+				double rows[3][3] = {
+					{ 0.213 + 0.787 * sat, 0.715 - 0.715 * sat, 0.072 - 0.072 * sat },
+					{ 0.213 - 0.213 * sat, 0.715 + 0.285 * sat, 0.072 - 0.072 * sat },
+					{ 0.213 - 0.213 * sat, 0.715 - 0.715 * sat, 0.072 + 0.928 * sat } };
+				for (int r = 0; r < 3; r++)
+					for (int c = 0; c < 3; c++)
+						m[r * 5 + c] = rows[r][c];
+			}
+			else if (type == "hueRotate")
+			{
+				double angle = (values.empty() ? 0.0 : values[0]) * 3.14159265358979323846 / 180.0;
+				double cs = std::cos(angle);
+				double sn = std::sin(angle);
+				double rows[3][3] = {
+					{ 0.213 + cs * 0.787 - sn * 0.213, 0.715 - cs * 0.715 - sn * 0.715, 0.072 - cs * 0.072 + sn * 0.928 },
+					{ 0.213 - cs * 0.213 + sn * 0.143, 0.715 + cs * 0.285 + sn * 0.140, 0.072 - cs * 0.072 - sn * 0.283 },
+					{ 0.213 - cs * 0.213 - sn * 0.787, 0.715 - cs * 0.715 + sn * 0.715, 0.072 + cs * 0.928 + sn * 0.072 } };
+				for (int r = 0; r < 3; r++)
+					for (int c = 0; c < 3; c++)
+						m[r * 5 + c] = rows[r][c];
+			}
+			else if (type == "luminanceToAlpha")
+			{
+				for (double& e : m)
+					e = 0;
+				m[15] = 0.2125;
+				m[16] = 0.7154;
+				m[17] = 0.0721;
+			}
+			else if (values.size() == 20)
+			{
+				// type="matrix", the default.  Anything other
+				// than a full set of values leaves the identity.
+				std::copy(values.begin(), values.end(), m);
+			}
+
+			for (int i = 0; i < 20; i++)
+				fMatrix[i] = (float)m[i];
+		}
+
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (nInputs == 0)
+				return;
+
+			// Transparent stays transparent unless the alpha offset is above zero
+			BLRectI area = out.fRect;
+			if (fMatrix[19] <= 0)
+				area = FilterPixels::intersect(area, FilterKernels::coverage(inputs[0]));
+			if (FilterPixels::isEmpty(area))
+				return;
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, area != out.fRect))
+				return;
+
+			const float* m = fMatrix;
+			FilterKernels::mapRows(inputs[0], nullptr, out, area, [m](const uint32_t* s, const uint32_t*, uint32_t* dst, int n) {
+				FilterKernels::colorMatrix(s, dst, n, m);
+			});
+		}
 	};
 
 	//
 	// feConvolveMatrix
 	//
-	struct SVGFeConvolveMatrixElement : public SVGGraphicsElement
+	struct SVGFeConvolveMatrixElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -303,24 +860,149 @@ namespace waavs {
 		}
 
 
+		ConvolveParams fParams{};
+		bool fValid{ false };
+
+
 		SVGFeConvolveMatrixElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
 
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fParams = ConvolveParams{};
+			fValid = false;
+
+			double orderX{ 3 }, orderY{ 3 };
+			ByteSpan s = getAttribute("order");
+			if (readNextNumber(s, orderX))
+			{
+				if (!readNextNumber(s, orderY))
+					orderY = orderX;
+			}
+			if ((orderX < 1) || (orderY < 1) || (orderX != std::floor(orderX)) || (orderY != std::floor(orderY)))
+				return;
+
+			fParams.fOrderX = (int)orderX;
+			fParams.fOrderY = (int)orderY;
+
+			s = getAttribute("kernelMatrix");
+			double v{ 0 };
+			while (readNextNumber(s, v))
+				fParams.fKernel.push_back((float)v);
+			if (fParams.fKernel.size() != (size_t)fParams.fOrderX * fParams.fOrderY)
+				return;
+
+			// The divisor defaults to the sum of the kernel, or 1 if that's 0
+			double divisor{ 0 };
+			parseNumber(chunk_trim(getAttribute("divisor"), chrWspChars), divisor);
+			if (divisor == 0)
+			{
+				for (float k : fParams.fKernel)
+					divisor += k;
+				if (divisor == 0)
+					divisor = 1;
+			}
+			fParams.fDivisor = (float)divisor;
+
+			double bias{ 0 };
+			parseNumber(chunk_trim(getAttribute("bias"), chrWspChars), bias);
+			fParams.fBias = (float)bias;
+
+			double targetX = std::floor(fParams.fOrderX / 2.0);
+			double targetY = std::floor(fParams.fOrderY / 2.0);
+			parseNumber(chunk_trim(getAttribute("targetX"), chrWspChars), targetX);
+			parseNumber(chunk_trim(getAttribute("targetY"), chrWspChars), targetY);
+			if ((targetX < 0) || (targetX >= fParams.fOrderX) || (targetY < 0) || (targetY >= fParams.fOrderY))
+				return;
+			fParams.fTargetX = (int)targetX;
+			fParams.fTargetY = (int)targetY;
+
+			ByteSpan edge = chunk_trim(getAttribute("edgeMode"), chrWspChars);
+			if (edge == "wrap")
+				fParams.fEdgeMode = FILTER_EDGE_WRAP;
+			else if (edge == "none")
+				fParams.fEdgeMode = FILTER_EDGE_NONE;
+
+			fParams.fPreserveAlpha = (chunk_trim(getAttribute("preserveAlpha"), chrWspChars) == "true");
+
+			fValid = true;
+		}
+
+		BLRectI filterInputRegion(size_t, const BLRectI& outRect, const FilterSpace& space) const override
+		{
+			// wrapping can reach across to the far side of the filter region
+			if (!fValid || (fParams.fEdgeMode == FILTER_EDGE_WRAP))
+				return space.bounds();
+
+			return BLRectI(outRect.x - fParams.fTargetX, outRect.y - fParams.fTargetY,
+				outRect.w + fParams.fOrderX - 1, outRect.h + fParams.fOrderY - 1);
+		}
+
+		// An invalid kernel makes the result transparent
+		void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (!fValid || (nInputs == 0))
+				return;
+
+			ConvolveMatrix::render(fParams, *inputs[0], space.bounds(), out);
+		}
 	};
 
 
 	//
-	// feDiffuseLighting
+	// SVGFeLightElement
+	// What the light sources have in common, turning
+	// their attributes into a light in filter space
+	//
+	struct SVGFeLightElement : public SVGGraphicsElement
+	{
+		SVGFeLightElement()
+			: SVGGraphicsElement()
+		{
+			isStructural(true);
+		}
+
+		virtual LightSource lightSource(const FilterSpace& space) const = 0;
+
+		double number(const char* name, double dflt) const
+		{
+			double v = dflt;
+			parseNumber(chunk_trim(getAttribute(name), chrWspChars), v);
+			return v;
+		}
+
+		// A position, in primitive units, to filter space
+		static void mapPosition(const FilterSpace& space, double x, double y, double z, double* out)
+		{
+			if (space.fPrimitiveObjectBox)
+			{
+				const BLRect& box = space.fObjectBox;
+				x = box.x + x * box.w;
+				y = box.y + y * box.h;
+				z = z * std::sqrt((box.w * box.w + box.h * box.h) / 2.0);
+			}
+
+			BLPoint p = space.fUserToFilter.mapPoint(BLPoint(x, y));
+			out[0] = p.x;
+			out[1] = p.y;
+			out[2] = z * std::sqrt(space.fScale.x * space.fScale.y);
+		}
+	};
+
 	//
-	struct SVGFeDiffuseLightingElement : public SVGGraphicsElement
+	// feDistantLight
+	//
+	struct SVGFeDistantLightElement : public SVGFeLightElement
 	{
 		static void registerSingularNode()
 		{
-			getSVGSingularCreationMap()["feDiffuseLighting"] = [](IAmGroot* groot, const XmlElement& elem) {
-				auto node = std::make_shared<SVGFeDiffuseLightingElement>(groot);
+			getSVGSingularCreationMap()["feDistantLight"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeDistantLightElement>(groot);
 				node->loadFromXmlElement(elem, groot);
 
 				return node;
@@ -329,9 +1011,10 @@ namespace waavs {
 
 		static void registerFactory()
 		{
-			getSVGContainerCreationMap()["feDiffuseLighting"] = [](IAmGroot* groot, XmlElementIterator& iter) {
-				auto node = std::make_shared<SVGFeDiffuseLightingElement>(groot);
+			getSVGContainerCreationMap()["feDistantLight"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeDistantLightElement>(groot);
 				node->loadFromXmlIterator(iter, groot);
+				
 				return node;
 				};
 
@@ -339,24 +1022,52 @@ namespace waavs {
 		}
 
 
-		SVGFeDiffuseLightingElement(IAmGroot* )
-			: SVGGraphicsElement()
+		double fAzimuth{ 0 };
+		double fElevation{ 0 };
+
+
+		SVGFeDistantLightElement(IAmGroot* )
+			: SVGFeLightElement()
 		{
-			isStructural(true);
 		}
 
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fAzimuth = number("azimuth", 0);
+			fElevation = number("elevation", 0);
+		}
+
+		// The direction turns along with the user space
+		LightSource lightSource(const FilterSpace& space) const override
+		{
+			const double toRadians = 3.14159265358979323846 / 180.0;
+			double az = fAzimuth * toRadians;
+			double el = fElevation * toRadians;
+
+			BLPoint d = space.fUserToFilter.mapVector(BLPoint(std::cos(az), std::sin(az)));
+			double len = std::sqrt(d.x * d.x + d.y * d.y);
+			if (len > 0)
+				d = BLPoint(d.x / len, d.y / len);
+
+			LightSource light{};
+			light.fType = FILTER_LIGHT_DISTANT;
+			light.fDirection[0] = d.x * std::cos(el);
+			light.fDirection[1] = d.y * std::cos(el);
+			light.fDirection[2] = std::sin(el);
+
+			return light;
+		}
 	};
-	
-	
+
 	//
-	// feDisplacementMap
+	// fePointLight
 	//
-	struct SVGFeDisplacementMapElement : public SVGGraphicsElement
+	struct SVGFePointLightElement : public SVGFeLightElement
 	{
 		static void registerSingularNode()
 		{
-			getSVGSingularCreationMap()["feDisplacementMap"] = [](IAmGroot* groot, const XmlElement& elem) {
-				auto node = std::make_shared<SVGFeDisplacementMapElement>(groot);
+			getSVGSingularCreationMap()["fePointLight"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFePointLightElement>(groot);
 				node->loadFromXmlElement(elem, groot);
 
 				return node;
@@ -365,9 +1076,10 @@ namespace waavs {
 
 		static void registerFactory()
 		{
-			getSVGContainerCreationMap()["feDisplacementMap"] = [](IAmGroot* groot, XmlElementIterator& iter) {
-				auto node = std::make_shared<SVGFeDisplacementMapElement>(groot);
+			getSVGContainerCreationMap()["fePointLight"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFePointLightElement>(groot);
 				node->loadFromXmlIterator(iter, groot);
+
 				return node;
 				};
 
@@ -375,23 +1087,42 @@ namespace waavs {
 		}
 
 
-		SVGFeDisplacementMapElement(IAmGroot* )
-			: SVGGraphicsElement()
+		double fX{ 0 };
+		double fY{ 0 };
+		double fZ{ 0 };
+
+
+		SVGFePointLightElement(IAmGroot* )
+			: SVGFeLightElement()
 		{
-			isStructural(true);
 		}
 
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fX = number("x", 0);
+			fY = number("y", 0);
+			fZ = number("z", 0);
+		}
+
+		LightSource lightSource(const FilterSpace& space) const override
+		{
+			LightSource light{};
+			light.fType = FILTER_LIGHT_POINT;
+			mapPosition(space, fX, fY, fZ, light.fPosition);
+
+			return light;
+		}
 	};
 
 	//
-	// feDistantLight
+	// feSpotLight
 	//
-	struct SVGFeDistantLightElement : public SVGGraphicsElement
+	struct SVGFeSpotLightElement : public SVGFeLightElement
 	{
 		static void registerSingularNode()
 		{
-			getSVGSingularCreationMap()["feDistantLight"] = [](IAmGroot* groot, const XmlElement& elem) {
-				auto node = std::make_shared<SVGFeDistantLightElement>(groot);
+			getSVGSingularCreationMap()["feSpotLight"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeSpotLightElement>(groot);
 				node->loadFromXmlElement(elem, groot);
 
 				return node;
@@ -400,10 +1131,10 @@ namespace waavs {
 
 		static void registerFactory()
 		{
-			getSVGContainerCreationMap()["feDistantLight"] = [](IAmGroot* groot, XmlElementIterator& iter) {
-				auto node = std::make_shared<SVGFeDistantLightElement>(groot);
+			getSVGContainerCreationMap()["feSpotLight"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeSpotLightElement>(groot);
 				node->loadFromXmlIterator(iter, groot);
-				
+
 				return node;
 				};
 
@@ -411,23 +1142,72 @@ namespace waavs {
 		}
 
 
-		SVGFeDistantLightElement(IAmGroot* )
-			: SVGGraphicsElement()
+		double fX{ 0 };
+		double fY{ 0 };
+		double fZ{ 0 };
+		double fPointsAtX{ 0 };
+		double fPointsAtY{ 0 };
+		double fPointsAtZ{ 0 };
+		double fSpecularExponent{ 1 };
+		double fLimitingConeAngle{ 0 };
+		bool fHasCone{ false };
+
+
+		SVGFeSpotLightElement(IAmGroot* )
+			: SVGFeLightElement()
 		{
-			isStructural(true);
 		}
 
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fX = number("x", 0);
+			fY = number("y", 0);
+			fZ = number("z", 0);
+			fPointsAtX = number("pointsAtX", 0);
+			fPointsAtY = number("pointsAtY", 0);
+			fPointsAtZ = number("pointsAtZ", 0);
+			fSpecularExponent = number("specularExponent", 1);
+
+			fHasCone = parseNumber(chunk_trim(getAttribute("limitingConeAngle"), chrWspChars), fLimitingConeAngle);
+		}
+
+		LightSource lightSource(const FilterSpace& space) const override
+		{
+			LightSource light{};
+			light.fType = FILTER_LIGHT_SPOT;
+			mapPosition(space, fX, fY, fZ, light.fPosition);
+
+			double at[3];
+			mapPosition(space, fPointsAtX, fPointsAtY, fPointsAtZ, at);
+
+			double sx = at[0] - light.fPosition[0];
+			double sy = at[1] - light.fPosition[1];
+			double sz = at[2] - light.fPosition[2];
+			double len = std::sqrt(sx * sx + sy * sy + sz * sz);
+			if (len > 0)
+			{
+				light.fSpotAxis[0] = sx / len;
+				light.fSpotAxis[1] = sy / len;
+				light.fSpotAxis[2] = sz / len;
+			}
+
+			light.fSpecularExponent = fSpecularExponent;
+			if (fHasCone)
+				light.fCosCone = std::cos(std::fabs(fLimitingConeAngle) * 3.14159265358979323846 / 180.0);
+
+			return light;
+		}
 	};
 	
 	//
-	// feFlood
+	// feDiffuseLighting
 	//
-	struct SVGFeFloodElement : public SVGGraphicsElement
+	struct SVGFeDiffuseLightingElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
-			getSVGSingularCreationMap()["feFlood"] = [](IAmGroot* groot, const XmlElement& elem) {
-				auto node = std::make_shared<SVGFeFloodElement>(groot);
+			getSVGSingularCreationMap()["feDiffuseLighting"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeDiffuseLightingElement>(groot);
 				node->loadFromXmlElement(elem, groot);
 
 				return node;
@@ -436,9 +1216,200 @@ namespace waavs {
 
 		static void registerFactory()
 		{
-			getSVGContainerCreationMap()["feFlood"] = [](IAmGroot* groot, XmlElementIterator& iter) {
-				auto node = std::make_shared<SVGFeFloodElement>(groot);
-				node->loadFromXmlIterator(iter, groot);
+			getSVGContainerCreationMap()["feDiffuseLighting"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeDiffuseLightingElement>(groot);
+				node->loadFromXmlIterator(iter, groot);
+				return node;
+				};
+
+			registerSingularNode();
+		}
+
+
+		double fSurfaceScale{ 1 };
+		double fDiffuseConstant{ 1 };
+		BLRgba32 fLightingColor{ 255, 255, 255, 255 };
+		std::shared_ptr<SVGFeLightElement> fLight{};
+
+
+		SVGFeDiffuseLightingElement(IAmGroot* )
+			: SVGFilterPrimitive()
+		{
+			isStructural(true);
+		}
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fSurfaceScale = 1;
+			fDiffuseConstant = 1;
+			parseNumber(chunk_trim(getAttribute("surfaceScale"), chrWspChars), fSurfaceScale);
+			parseNumber(chunk_trim(getAttribute("diffuseConstant"), chrWspChars), fDiffuseConstant);
+
+			fLightingColor = BLRgba32(255, 255, 255, 255);
+			ByteSpan colorChunk = chunk_trim(getAttribute("lighting-color"), chrWspChars);
+			if (colorChunk)
+			{
+				SVGPaint paint(groot);
+				paint.loadFromChunk(colorChunk);
+
+				uint32_t value{};
+				if (BL_SUCCESS == blVarToRgba32(&paint.fPaintVar, &value))
+					fLightingColor = BLRgba32(value);
+			}
+
+			// The first light source is the one that's used
+			fLight = nullptr;
+			for (auto& node : fNodes)
+			{
+				auto light = std::dynamic_pointer_cast<SVGFeLightElement>(node);
+				if (nullptr == light)
+					continue;
+
+				if (light->needsBinding())
+					light->bindToContext(ctx, groot);
+
+				fLight = light;
+				break;
+			}
+		}
+
+		bool filterAcceptsAlphaOnly(size_t) const override { return true; }
+
+		BLRectI filterInputRegion(size_t, const BLRectI& outRect, const FilterSpace&) const override
+		{
+			return BLRectI(outRect.x - 1, outRect.y - 1, outRect.w + 2, outRect.h + 2);
+		}
+
+		// Without a light, or with a negative diffuseConstant, there's nothing to show
+		void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if ((nullptr == fLight) || (fDiffuseConstant < 0) || (nInputs == 0))
+				return;
+
+			DiffuseLightingParams params{};
+			params.fLight = fLight->lightSource(space);
+			params.fSurfaceScale = fSurfaceScale;
+			params.fDiffuseConstant = fDiffuseConstant;
+
+			BLRgba32 c = FilterPixels::convertColor(fLightingColor, out.fColorSpace);
+			params.fColor[0] = c.r() / 255.0;
+			params.fColor[1] = c.g() / 255.0;
+			params.fColor[2] = c.b() / 255.0;
+
+			DiffuseLighting::render(params, *inputs[0], space.bounds(), out);
+		}
+	};
+	
+	
+	//
+	// feDisplacementMap
+	//
+	struct SVGFeDisplacementMapElement : public SVGFilterPrimitive
+	{
+		static void registerSingularNode()
+		{
+			getSVGSingularCreationMap()["feDisplacementMap"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeDisplacementMapElement>(groot);
+				node->loadFromXmlElement(elem, groot);
+
+				return node;
+				};
+		}
+
+		static void registerFactory()
+		{
+			getSVGContainerCreationMap()["feDisplacementMap"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeDisplacementMapElement>(groot);
+				node->loadFromXmlIterator(iter, groot);
+				return node;
+				};
+
+			registerSingularNode();
+		}
+
+
+		double fScale{ 0 };
+		int fChannelX{ 3 };
+		int fChannelY{ 3 };
+
+
+		SVGFeDisplacementMapElement(IAmGroot* )
+			: SVGFilterPrimitive()
+		{
+			isStructural(true);
+		}
+
+		static int parseChannel(const ByteSpan& inChunk)
+		{
+			ByteSpan s = chunk_trim(inChunk, chrWspChars);
+			if (s == "R") return 0;
+			if (s == "G") return 1;
+			if (s == "B") return 2;
+
+			return 3;
+		}
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fScale = 0;
+			parseNumber(chunk_trim(getAttribute("scale"), chrWspChars), fScale);
+			fChannelX = parseChannel(getAttribute("xChannelSelector"));
+			fChannelY = parseChannel(getAttribute("yChannelSelector"));
+		}
+
+		size_t filterInputCount() const override { return 2; }
+
+		// 'in' is read up to half the scale away, the map only where the output is
+		BLRectI filterInputRegion(size_t idx, const BLRectI& outRect, const FilterSpace& space) const override
+		{
+			if (idx == 1)
+				return outRect;
+
+			int rx = (int)std::ceil(std::fabs(space.lengthX(fScale)) * 0.5) + 1;
+			int ry = (int)std::ceil(std::fabs(space.lengthY(fScale)) * 0.5) + 1;
+
+			return BLRectI(outRect.x - rx, outRect.y - ry, outRect.w + rx * 2, outRect.h + ry * 2);
+		}
+
+		void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if ((nInputs < 2) || inputs[0]->isEmpty())
+				return;
+
+			DisplacementParams params{};
+			params.fScaleX = space.lengthX(fScale);
+			params.fScaleY = space.lengthY(fScale);
+			params.fChannelX = fChannelX;
+			params.fChannelY = fChannelY;
+
+			DisplacementMap::render(params, *inputs[0], *inputs[1], out);
+		}
+	};
+
+	//
+	// feFlood
+	//
+	struct SVGFeFloodElement : public SVGFilterPrimitive
+	{
+		static void registerSingularNode()
+		{
+			getSVGSingularCreationMap()["feFlood"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeFloodElement>(groot);
+				node->loadFromXmlElement(elem, groot);
+
+				return node;
+				};
+		}
+
+		static void registerFactory()
+		{
+			getSVGContainerCreationMap()["feFlood"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeFloodElement>(groot);
+				node->loadFromXmlIterator(iter, groot);
 				node->visible(false);
 				
 				return node;
@@ -449,18 +1420,62 @@ namespace waavs {
 
 
 
+		BLRgba32 fFloodColor{ 0, 0, 0, 255 };
+		double fFloodOpacity{ 1.0 };
+
+
 		SVGFeFloodElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
+
+		size_t filterInputCount() const override { return 0; }
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fFloodColor = BLRgba32(0, 0, 0, 255);
+			ByteSpan colorChunk = chunk_trim(getAttribute("flood-color"), chrWspChars);
+			if (colorChunk)
+			{
+				SVGPaint paint(groot);
+				paint.loadFromChunk(colorChunk);
+
+				uint32_t value{};
+				if (BL_SUCCESS == blVarToRgba32(&paint.fPaintVar, &value))
+					fFloodColor = BLRgba32(value);
+			}
+
+			fFloodOpacity = 1.0;
+			ByteSpan opacityChunk = chunk_trim(getAttribute("flood-opacity"), chrWspChars);
+			if (opacityChunk && parseNumber(opacityChunk, fFloodOpacity))
+				fFloodOpacity = std::min(1.0, std::max(0.0, fFloodOpacity));
+		}
+
+		void applyFilter(const FilterSpace&, const FilterImage* const*, size_t, FilterImage& out) override
+		{
+			BLRgba32 c = FilterPixels::convertColor(fFloodColor, out.fColorSpace);
+			uint32_t a = (uint32_t)std::lround(c.a() * fFloodOpacity);
+			if (a == 0)
+				return;
+
+			uint32_t pixel = (a << 24) | (((c.r() * a + 127) / 255) << 16) | (((c.g() * a + 127) / 255) << 8) | ((c.b() * a + 127) / 255);
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, false))
+				return;
+
+			for (int y = out.fRect.y; y < out.fRect.y + out.fRect.h; y++)
+				std::fill_n(out.pixels(out.fRect.x, y), out.fRect.w, pixel);
+		}
 	};
 
 	
 	//
 	// feGaussianBlur
 	//
-	struct SVGFeGaussianBlurElement : public SVGGraphicsElement
+	struct SVGFeGaussianBlurElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -486,24 +1501,72 @@ namespace waavs {
 		}
 		
 
-		SVGDimension fStdDeviation;
-		
+		// standard deviation along x and y, in primitive units
+		double fStdDeviationX{ 0 };
+		double fStdDeviationY{ 0 };
+
 		SVGFeGaussianBlurElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
 
 		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
 		{
-			fStdDeviation.loadFromChunk(getAttribute("stdDeviation"));
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			// One number for both directions, or one for each.  A
+			// negative value turns the blur off, same as zero.
+			fStdDeviationX = 0;
+			fStdDeviationY = 0;
+
+			ByteSpan s = getAttribute("stdDeviation");
+			if (readNextNumber(s, fStdDeviationX))
+			{
+				if (!readNextNumber(s, fStdDeviationY))
+					fStdDeviationY = fStdDeviationX;
+			}
+
+			if ((fStdDeviationX < 0) || (fStdDeviationY < 0))
+			{
+				fStdDeviationX = 0;
+				fStdDeviationY = 0;
+			}
+		}
+
+		bool filterAcceptsAlphaOnly(size_t) const override { return true; }
+
+		BLRectI filterInputRegion(size_t, const BLRectI& outRect, const FilterSpace& space) const override
+		{
+			BlurKernel kx = BlurKernel::forSigma(space.lengthX(fStdDeviationX), space.fArea.w);
+			BlurKernel ky = BlurKernel::forSigma(space.lengthY(fStdDeviationY), space.fArea.h);
+
+			return BLRectI(outRect.x - kx.reachBefore(), outRect.y - ky.reachBefore(),
+				outRect.w + kx.reachBefore() + kx.reachAfter(), outRect.h + ky.reachBefore() + ky.reachAfter());
+		}
+
+		void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			BlurKernel kx = BlurKernel::forSigma(space.lengthX(fStdDeviationX), space.fArea.w);
+			BlurKernel ky = BlurKernel::forSigma(space.lengthY(fStdDeviationY), space.fArea.h);
+
+			if (kx.isIdentity() && ky.isIdentity())
+			{
+				SVGFilterPrimitive::applyFilter(space, inputs, nInputs, out);
+				return;
+			}
+
+			if ((nInputs == 0) || inputs[0]->isEmpty())
+				return;
+
+			GaussianBlur::blur(*inputs[0], kx, ky, out);
 		}
 	};
 
 	//
 	// feOffset
 	//
-	struct SVGFeOffsetElement : public SVGGraphicsElement
+	struct SVGFeOffsetElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -529,18 +1592,204 @@ namespace waavs {
 		}
 
 
+		double fDx{ 0 };
+		double fDy{ 0 };
+
+
 		SVGFeOffsetElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fDx = 0;
+			fDy = 0;
+			parseNumber(chunk_trim(getAttribute("dx"), chrWspChars), fDx);
+			parseNumber(chunk_trim(getAttribute("dy"), chrWspChars), fDy);
+		}
+
+		// The offset, rounded to whole filter space pixels
+		BLPointI pixelOffset(const FilterSpace& space) const
+		{
+			return BLPointI((int)std::lround(space.lengthX(fDx)), (int)std::lround(space.lengthY(fDy)));
+		}
+
+		bool filterAcceptsAlphaOnly(size_t) const override { return true; }
+
+		BLRectI filterInputRegion(size_t, const BLRectI& outRect, const FilterSpace& space) const override
+		{
+			BLPointI d = pixelOffset(space);
+			return BLRectI(outRect.x - d.x, outRect.y - d.y, outRect.w, outRect.h);
+		}
+
+		void applyFilter(const FilterSpace& space, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if ((nInputs == 0) || inputs[0]->isEmpty())
+				return;
+
+			const FilterImage& in = *inputs[0];
+			if (!out.allocate(out.fRect, (BLFormat)in.fImage.format()))
+				return;
+
+			BLPointI d = pixelOffset(space);
+			FilterPixels::copy(in, out, d.x, d.y);
+		}
 	};
 	
 	
+
+	//
+	// feMergeNode
+	// One input of an feMerge
+	//
+	struct SVGFeMergeNodeElement : public SVGGraphicsElement
+	{
+		static void registerSingularNode()
+		{
+			getSVGSingularCreationMap()["feMergeNode"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeMergeNodeElement>(groot);
+				node->loadFromXmlElement(elem, groot);
+
+				return node;
+				};
+		}
+
+		static void registerFactory()
+		{
+			getSVGContainerCreationMap()["feMergeNode"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeMergeNodeElement>(groot);
+				node->loadFromXmlIterator(iter, groot);
+
+				return node;
+				};
+
+			registerSingularNode();
+		}
+
+
+		ByteSpan fIn{};
+
+
+		SVGFeMergeNodeElement(IAmGroot* )
+			: SVGGraphicsElement()
+		{
+			isStructural(true);
+		}
+
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fIn = chunk_trim(getAttribute("in"), chrWspChars);
+		}
+	};
+
+	//
+	// feMerge
+	// Composite each of the feMergeNode inputs, in order, with 'over'
+	//
+	struct SVGFeMergeElement : public SVGFilterPrimitive
+	{
+		static void registerSingularNode()
+		{
+			getSVGSingularCreationMap()["feMerge"] = [](IAmGroot* groot, const XmlElement& elem) {
+				auto node = std::make_shared<SVGFeMergeElement>(groot);
+				node->loadFromXmlElement(elem, groot);
+
+				return node;
+				};
+		}
+
+		static void registerFactory()
+		{
+			getSVGContainerCreationMap()["feMerge"] = [](IAmGroot* groot, XmlElementIterator& iter) {
+				auto node = std::make_shared<SVGFeMergeElement>(groot);
+				node->loadFromXmlIterator(iter, groot);
+
+				return node;
+				};
+
+			registerSingularNode();
+		}
+
+
+		std::vector<ByteSpan> fInputNames{};
+
+
+		SVGFeMergeElement(IAmGroot* )
+			: SVGFilterPrimitive()
+		{
+			isStructural(true);
+		}
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fInputNames.clear();
+			for (auto& node : fNodes)
+			{
+				auto mergeNode = std::dynamic_pointer_cast<SVGFeMergeNodeElement>(node);
+				if (nullptr == mergeNode)
+					continue;
+
+				if (mergeNode->needsBinding())
+					mergeNode->bindToContext(ctx, groot);
+
+				fInputNames.push_back(mergeNode->fIn);
+			}
+		}
+
+		size_t filterInputCount() const override { return fInputNames.size(); }
+		ByteSpan filterInputName(size_t idx) const override { return fInputNames[idx]; }
+
+		void applyFilter(const FilterSpace&, const FilterImage* const* inputs, size_t nInputs, FilterImage& out) override
+		{
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32))
+				return;
+
+			for (size_t i = 0; i < nInputs; i++)
+			{
+				const FilterImage& in = *inputs[i];
+				BLRectI r = FilterPixels::intersect(in.fRect, out.fRect);
+				if (in.isEmpty() || FilterPixels::isEmpty(r))
+					continue;
+
+				for (int y = r.y; y < r.y + r.h; y++)
+				{
+					const uint32_t* s = in.pixels(r.x, y);
+					uint32_t* d = out.pixels(r.x, y);
+
+					for (int x = 0; x < r.w; x++)
+					{
+						uint32_t sp = s[x];
+						uint32_t sa = sp >> 24;
+
+						if (sa == 255) {
+							d[x] = sp;
+						}
+						else if (sa != 0) {
+							// premultiplied over, both channel pairs at once
+							uint32_t ia = 255 - sa;
+							uint32_t dp = d[x];
+							uint32_t rb = (dp & 0x00ff00ff) * ia + 0x00800080;
+							uint32_t ag = ((dp >> 8) & 0x00ff00ff) * ia + 0x00800080;
+							rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+							ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+							d[x] = sp + (rb | ag);
+						}
+					}
+				}
+			}
+		}
+	};
+
 	//
 	// feTurbulence
 	//
-	struct SVGFeTurbulenceElement : public SVGGraphicsElement
+	struct SVGFeTurbulenceElement : public SVGFilterPrimitive
 	{
 		static void registerSingularNode()
 		{
@@ -566,10 +1815,188 @@ namespace waavs {
 
 
 
+		// Contributions past this many octaves are below what 8 bits can show
+		static constexpr int kMaxOctaves = 16;
+
+		TurbulenceParams fParams{};
+		long fSeed{ 0 };
+		bool fValid{ true };
+
+		// The last result, reused for as long as it's asked for again
+		// with the same transform, area and color space
+		std::mutex fCacheLock{};
+		FilterImage fCached{};
+		BLMatrix2D fCachedTransform{};
+
+
 		SVGFeTurbulenceElement(IAmGroot* )
-			: SVGGraphicsElement()
+			: SVGFilterPrimitive()
 		{
 			isStructural(true);
 		}
+
+		size_t filterInputCount() const override { return 0; }
+
+		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGFilterPrimitive::bindSelfToContext(ctx, groot);
+
+			fParams = TurbulenceParams{};
+			fValid = true;
+
+			ByteSpan s = getAttribute("baseFrequency");
+			if (readNextNumber(s, fParams.fBaseFreqX))
+			{
+				if (!readNextNumber(s, fParams.fBaseFreqY))
+					fParams.fBaseFreqY = fParams.fBaseFreqX;
+			}
+
+			// A negative frequency is an error, which disables the primitive
+			if ((fParams.fBaseFreqX < 0) || (fParams.fBaseFreqY < 0))
+				fValid = false;
+
+			double octaves{ 1 };
+			parseNumber(chunk_trim(getAttribute("numOctaves"), chrWspChars), octaves);
+			fParams.fOctaves = (int)std::min((double)kMaxOctaves, std::max(0.0, octaves));
+
+			// the seed is truncated towards zero
+			double seed{ 0 };
+			parseNumber(chunk_trim(getAttribute("seed"), chrWspChars), seed);
+			fSeed = (long)std::max(-2147483647.0, std::min(2147483647.0, seed));
+
+			fParams.fStitch = (chunk_trim(getAttribute("stitchTiles"), chrWspChars) == "stitch");
+			fParams.fFractalNoise = (chunk_trim(getAttribute("type"), chrWspChars) == "fractalNoise");
+
+			std::lock_guard<std::mutex> lock(fCacheLock);
+			fCached.reset();
+		}
+
+		void applyFilter(const FilterSpace& space, const FilterImage* const*, size_t, FilterImage& out) override
+		{
+			if (!fValid)
+				return;
+
+			std::lock_guard<std::mutex> lock(fCacheLock);
+
+			const BLMatrix2D& m = space.fUserToFilter;
+			if (!fCached.isEmpty() && (fCached.fRect == out.fRect) && (fCached.fColorSpace == out.fColorSpace) &&
+				(fCachedTransform.m00 == m.m00) && (fCachedTransform.m01 == m.m01) && (fCachedTransform.m10 == m.m10) &&
+				(fCachedTransform.m11 == m.m11) && (fCachedTransform.m20 == m.m20) && (fCachedTransform.m21 == m.m21))
+			{
+				// The pixels are shared, nothing writes to an image once it's made
+				out = fCached;
+				return;
+			}
+
+			BLMatrix2D filterToUser{};
+			if (BLMatrix2D::invert(filterToUser, m) != BL_SUCCESS)
+				return;
+
+			if (!out.allocate(out.fRect, BL_FORMAT_PRGB32, false))
+				return;
+
+			TurbulenceParams params = fParams;
+			params.fTile = filterSubregionUser(space);
+
+			auto lattice = TurbulenceLattice::forSeed(fSeed);
+			Turbulence::render(*lattice, params, filterToUser, out);
+
+			fCached = out;
+			fCachedTransform = m;
+		}
+	};
+}
+
+
+namespace waavs {
+	//======================================================
+	// SVGFilterAttribute
+	// The 'filter' attribute, which wraps the drawing of an
+	// element's content, and runs it through the referenced filter.
+	// Filter functions (blur(), drop-shadow(), ...) aren't supported,
+	// and leave the element as it is.
+	//======================================================
+	struct SVGFilterAttribute : public SVGVisualProperty
+	{
+		static void registerFactory()
+		{
+			registerSVGAttribute("filter", [](const XmlAttributeCollection& attrs) {
+				auto node = std::make_shared<SVGFilterAttribute>(nullptr);
+				node->loadFromAttributes(attrs);
+
+				return node;
+				});
+		}
+
+
+		std::shared_ptr<SVGFilterElement> fFilterNode{ nullptr };
+
+
+		SVGFilterAttribute(IAmGroot* groot) : SVGVisualProperty(groot) { id("filter"); }
+
+		int contentWrapOrder() const override { return 1; }
+
+		bool loadFromUrl(IRenderSVG* ctx, IAmGroot* groot, const ByteSpan& inChunk)
+		{
+			if (nullptr == groot)
+				return false;
+
+			fFilterNode = std::dynamic_pointer_cast<SVGFilterElement>(groot->findNodeByUrl(inChunk));
+
+			if (fFilterNode == nullptr) {
+				set(false);
+				return false;
+			}
+
+			if (fFilterNode->needsBinding())
+				fFilterNode->bindToContext(ctx, groot);
+
+			set(true);
+
+			return true;
+		}
+
+		void bindToContext(IRenderSVG* ctx, IAmGroot* groot) noexcept override
+		{
+			ByteSpan str = rawValue();
+
+			if (chunk_starts_with_cstr(str, "url("))
+			{
+				loadFromUrl(ctx, groot, str);
+			}
+			else {
+				set(false);
+			}
+
+			needsBinding(false);
+		}
+
+		bool loadSelfFromChunk(const ByteSpan& inChunk) override
+		{
+			// we only act when wrapping the content
+			autoDraw(false);
+
+			if (inChunk == "none")
+				return set(false);
+
+			needsBinding(true);
+			set(true);
+
+			return true;
+		}
+
+		void drawContent(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content) override
+		{
+			if (needsBinding())
+				bindToContext(ctx, groot);
+
+			if (!isSet() || (nullptr == fFilterNode))
+			{
+				content(ctx);
+				return;
+			}
+
+			fFilterNode->drawFiltered(ctx, groot, objectBox, content);
+		}
 	};
 }
@@ -214,6 +214,8 @@ namespace waavs {
 			parseNumber(getAttribute("vert-origin-y"), fVertOriginY);
 			
 			
+			fPath.clear();
+
 			auto d = getAttribute("d");
 			if (!d)
 				return;
@@ -253,8 +255,12 @@ namespace waavs {
 
 		SVGGlyphNode(IAmGroot* iMap) :SVGPathBasedGeometry(iMap) {}
 
-		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		// Nothing here depends on the context, so it's loaded
+		// once, rather than every time the glyph is bound
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
 		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
 			//SVGGeometryElement::loadSelfFromXmlElement(elem, groot);
 
 			// load unicode property
@@ -268,6 +274,8 @@ namespace waavs {
 			parseNumber(getAttribute("vert-origin-y"), fVertOriginY);
 			
 			
+			fPath.clear();
+
 			auto d = getAttribute("d");
 			if (!d)
 				return;
@@ -253,6 +253,7 @@ namespace waavs {
 			else if (getAttribute("xlink:href"))
 				fTemplateReference = getAttribute("xlink:href");
 
+			fHasGradientTransform = parseTransform(getAttribute("gradientTransform"), fGradientTransform);
 		}
 		
 
@@ -286,11 +287,26 @@ namespace waavs {
 			registerSingularNode();
 		}
 
+		SVGDimension fX1{};
+		SVGDimension fY1{};
+		SVGDimension fX2{};
+		SVGDimension fY2{};
+
 		SVGLinearGradient(IAmGroot* aroot) :SVGGradient(aroot)
 		{
 			fGradient.setType(BL_GRADIENT_TYPE_LINEAR);
 		}
 
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGGradient::fixupSelfStyleAttributes(ctx, groot);
+
+			fX1.loadFromChunk(getAttribute("x1"));
+			fY1.loadFromChunk(getAttribute("y1"));
+			fX2.loadFromChunk(getAttribute("x2"));
+			fY2.loadFromChunk(getAttribute("y2"));
+		}
+
 		
 		void bindSelfToContext(IRenderSVG *ctx, IAmGroot* groot) override
 		{
@@ -310,17 +326,6 @@ namespace waavs {
 			// loaded from a template
 			BLLinearGradientValues values{ 0,0,0,1 };// = fGradient.linear();
 
-			SVGDimension fX1; //{ 0, SVG_LENGTHTYPE_PERCENTAGE };
-			SVGDimension fY1; //{ 0, SVG_LENGTHTYPE_NUMBER };
-			SVGDimension fX2; //{ 100, SVG_LENGTHTYPE_PERCENTAGE };
-			SVGDimension fY2; //{ 0, SVG_LENGTHTYPE_PERCENTAGE };
-			
-			fX1.loadFromChunk(getAttribute("x1"));
-			fY1.loadFromChunk(getAttribute("y1"));
-			fX2.loadFromChunk(getAttribute("x2"));
-			fY2.loadFromChunk(getAttribute("y2"));
-
-			
 			// Before we go any further, get our current gradientUnits
 			// this should override whatever was set if we had referred to a template
 			// if there is NOT a gradientUnits attribute, then we'll either
@@ -333,9 +338,6 @@ namespace waavs {
 
 			getEnumValue(SVGSpaceUnits, getAttribute("gradientUnits"), (uint32_t&)fGradientUnits);
 
-			fHasGradientTransform = parseTransform(getAttribute("gradientTransform"), fGradientTransform);
-
-
 
 			
 			if (fGradientUnits == SVG_SPACE_OBJECT )
@@ -464,11 +466,28 @@ namespace waavs {
 
 
 
+		SVGDimension fCx{};
+		SVGDimension fCy{};
+		SVGDimension fR{};
+		SVGDimension fFx{};
+		SVGDimension fFy{};
+
 		SVGRadialGradient(IAmGroot* groot) :SVGGradient(groot)
 		{
 			fGradient.setType(BL_GRADIENT_TYPE_RADIAL);
 		}
 
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGGradient::fixupSelfStyleAttributes(ctx, groot);
+
+			fCx.loadFromChunk(getAttribute("cx"));
+			fCy.loadFromChunk(getAttribute("cy"));
+			fR.loadFromChunk(getAttribute("r"));
+			fFx.loadFromChunk(getAttribute("fx"));
+			fFy.loadFromChunk(getAttribute("fy"));
+		}
+
 		void bindSelfToContext(IRenderSVG *ctx, IAmGroot* groot) override
 		{
 			// Start by resolving any reference, if there is one
@@ -483,18 +502,6 @@ namespace waavs {
 
 			BLRadialGradientValues values = fGradient.radial();
 
-			SVGDimension fCx;	// { 50, SVG_LENGTHTYPE_PERCENTAGE };
-			SVGDimension fCy;	//  { 50, SVG_LENGTHTYPE_PERCENTAGE };
-			SVGDimension fR;	// { 50, SVG_LENGTHTYPE_PERCENTAGE };
-			SVGDimension fFx;	// { 50, SVG_LENGTHTYPE_PERCENTAGE, false };
-			SVGDimension fFy;	// { 50, SVG_LENGTHTYPE_PERCENTAGE, false };
-			
-			fCx.loadFromChunk(getAttribute("cx"));
-			fCy.loadFromChunk(getAttribute("cy"));
-			fR.loadFromChunk(getAttribute("r"));
-			fFx.loadFromChunk(getAttribute("fx"));
-			fFy.loadFromChunk(getAttribute("fy"));
-			
 
 			// Before we go any further, get our current gradientUnits
 			// this should override whatever was set if we had referred to a template
@@ -508,8 +515,6 @@ namespace waavs {
 
 			getEnumValue(SVGSpaceUnits, getAttribute("gradientUnits"), (uint32_t&)fGradientUnits);
 
-			fHasGradientTransform = parseTransform(getAttribute("gradientTransform"), fGradientTransform);
-
 			
 			if (fGradientUnits == SVG_SPACE_OBJECT)
 			{
@@ -662,11 +667,34 @@ namespace waavs {
 
 
 
+		SVGDimension fX1{};
+		SVGDimension fY1{};
+		SVGDimension fRepeat{};
+		double fAngle{ 0 };
+		bool fHasAngle{ false };
+
 		SVGConicGradient(IAmGroot* aroot) :SVGGradient(aroot)
 		{
 			fGradient.setType(BLGradientType::BL_GRADIENT_TYPE_CONIC);
 		}
 
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGGradient::fixupSelfStyleAttributes(ctx, groot);
+
+			fX1.loadFromChunk(getAttribute("x1"));
+			fY1.loadFromChunk(getAttribute("y1"));
+			fRepeat.loadFromChunk(getAttribute("repeat"));
+
+			// treat the angle as an angle type
+			ByteSpan angAttr = getAttribute("angle");
+			if (angAttr)
+			{
+				SVGAngleUnits units;
+				fHasAngle = parseAngle(angAttr, fAngle, units);
+			}
+		}
+
 
 		void bindSelfToContext(IRenderSVG *ctx, IAmGroot* groot) override
 		{
@@ -686,35 +714,17 @@ namespace waavs {
 
 			BLConicGradientValues values = fGradient.conic();
 
-			SVGDimension x0{};
-			SVGDimension y0{};
-			SVGDimension angle{};
-			SVGDimension repeat{};
-			
-			if (hasAttribute("x1")) {
-				x0.loadFromChunk(getAttribute("x1"));
-				values.x0 = x0.calculatePixels(w, 0, dpi);
-			}
+			if (fX1.isSet())
+				values.x0 = fX1.calculatePixels(w, 0, dpi);
 
-			if (hasAttribute("y1")) {
-				y0.loadFromChunk(getAttribute("y1"));
-				values.y0 = y0.calculatePixels(h, 0, dpi);
-			}
+			if (fY1.isSet())
+				values.y0 = fY1.calculatePixels(h, 0, dpi);
 
-			if (hasAttribute("angle")) {
-				// treat the angle as an angle type
-				ByteSpan angAttr = getAttribute("angle");
-				if (angAttr)
-				{
-					SVGAngleUnits units;
-					parseAngle(angAttr, values.angle, units);
-				}
-			}
+			if (fHasAngle)
+				values.angle = fAngle;
 
-			if (hasAttribute("repeat")) {
-				repeat.loadFromChunk(getAttribute("repeat"));
-				values.repeat = repeat.calculatePixels(1.0, 0, dpi);
-			}
+			if (fRepeat.isSet())
+				values.repeat = fRepeat.calculatePixels(1.0, 0, dpi);
 			else if (values.repeat == 0)
 				values.repeat = 1.0;
 			
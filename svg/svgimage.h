@@ -10,10 +10,14 @@
 #include <functional>
 #include <unordered_map>
 #include <string>
+#include <memory>
+#include <cmath>
+#include <algorithm>
 
 #include "svgattributes.h"
 #include "svgstructuretypes.h"
 #include "converters.h"
+#include "imagecache.h"
 
 namespace waavs {
     //
@@ -62,7 +66,7 @@ namespace waavs {
             
 			// See if it's a format that blend2d can deal with using its
             // own codecs
-            BLResult res = img.readFromData(outBuff.data(), outBuff.size());
+            BLResult res = img.readFromData(outBuff.data(), decodedSize);
             success = (res == BL_SUCCESS);
             
             // If we didn't succeed in decoding, then try any specilized methods of decoding
@@ -123,6 +127,10 @@ namespace waavs {
 		BLImage fImage{};
 		ByteSpan fImageRef{};
 		BLVar fImageVar{};
+		std::shared_ptr<PendingImage> fPendingImage{};
+		std::shared_ptr<ImageMipChain> fMips{};
+		int fImageLevel{ 0 };		// fImage is 1/(2^level) of the full size
+		BLSizeI fFullSize{};
 
 		double fX{ 0 };
 		double fY{ 0 };
@@ -138,6 +146,108 @@ namespace waavs {
 			needsBinding(true);
 		}
 
+		~SVGImageElement()
+		{
+			// The decoder might still be reading from the document
+			if (fPendingImage)
+				fPendingImage->cancel();
+		}
+
+		// The reference never changes after loading, so it can be
+		// picked up from the element's own attributes, before any
+		// styling is done.
+		ByteSpan imageReference() const
+		{
+			ByteSpan ref = fPresentationAttributes.getAttribute("href");
+			if (!ref)
+				ref = fPresentationAttributes.getAttribute("xlink:href");
+
+			return ref;
+		}
+
+		// pendingImage
+		// Get the decoding of our image lined up, without actually decoding
+		// anything.  Decoded images are shared, through the image cache, with
+		// any other element, in any document, referring to the same thing.
+		std::shared_ptr<PendingImage> pendingImage()
+		{
+			if (fPendingImage)
+				return fPendingImage;
+
+			ByteSpan ref = imageReference();
+			if (!ref)
+				return nullptr;
+
+			// First, see if it's embedded data
+			if (chunk_starts_with_cstr(ref, "data:"))
+			{
+				fPendingImage = std::make_shared<PendingImage>(ref, IMAGE_SOURCE_DATA,
+					[](const ByteSpan& src, BLImage& img) { return parseImage(src, img); });
+			}
+			else {
+				// Otherwise, assume it's a file reference
+				fPendingImage = std::make_shared<PendingImage>(ref, IMAGE_SOURCE_FILE,
+					[](const ByteSpan& src, BLImage& img) {
+						auto path = toString(src);
+						return (path.size() > 0) && (img.readFromFile(path.c_str()) == BL_SUCCESS);
+					});
+			}
+
+			return fPendingImage;
+		}
+
+		// Start decoding on the worker pool, while the caller gets on with
+		// other things.  The document does this for the images it will draw,
+		// as soon as it's loaded.
+		std::shared_ptr<PendingImage> prefetchImage()
+		{
+			if (fPendingImage || !fImage.empty())
+				return nullptr;
+
+			auto pending = pendingImage();
+			PendingImage::schedule(pending);
+
+			return pending;
+		}
+
+		// Wait for the image, if we actually need the pixels
+		bool ensureImage()
+		{
+			if (!fImage.empty())
+				return true;
+
+			auto pending = pendingImage();
+			if (nullptr == pending)
+				return false;
+
+			fImage = pending->wait();
+			fImageVar = fImage;
+			fImageLevel = pending->level();
+			fFullSize = pending->fullSize();
+
+			if (!fImage.empty())
+				fMips = DecodedImageCache::cache().mipChain(pending->key(), fImage);
+
+			return !fImage.empty();
+		}
+
+		// The image was reduced for a smaller size than we're now
+		// being asked to draw at, so get one that's big enough
+		bool redecodeImage(const BLSize& target)
+		{
+			fPendingImage = nullptr;
+			fImage.reset();
+			fMips = nullptr;
+
+			auto pending = pendingImage();
+			if (nullptr == pending)
+				return false;
+
+			pending->targetSize(target.w, target.h);
+
+			return ensureImage();
+		}
+
 		BLRect frame() const override
 		{
 
@@ -160,6 +270,7 @@ namespace waavs {
 			if (fImageVar.isNull())
 			{
 				bindSelfToContext(ctx, groot);
+				ensureImage();
 			}
 			
 			return fImageVar;
@@ -191,34 +302,19 @@ namespace waavs {
 			fDimWidth.loadFromChunk(getAttribute("width"));
 			fDimHeight.loadFromChunk(getAttribute("height"));
 
-			fImageRef = getAttribute("href");
-			if (!fImageRef)
-				fImageRef = getAttribute("xlink:href");
+			fImageRef = imageReference();
 
-			
-			// Parse the image so we can get its dimensions
-			if (fImageRef)
-			{
-				// First, see if it's embedded data
-				if (chunk_starts_with_cstr(fImageRef, "data:"))
-				{
-					bool success = parseImage(fImageRef, fImage);
-				}
-				else {
-					// Otherwise, assume it's a file reference
-					auto path = toString(fImageRef);
-					if (path.size() > 0)
-					{
-						fImage.readFromFile(path.c_str());
-					}
-				}
-			}
+			// Only wait for the image here if we need it for its
+			// dimensions.  Otherwise, it can keep decoding in the
+			// background until it's drawn.
+			if (!fDimWidth.isSet() || !fDimHeight.isSet())
+				ensureImage();
 
 
 			fX = 0;
 			fY = 0;
-			fWidth = fImage.size().w;
-			fHeight = fImage.size().h;
+			fWidth = fFullSize.w;
+			fHeight = fFullSize.h;
 
 			if (fDimX.isSet())
 				fX = fDimX.calculatePixels(w, 0, dpi);
@@ -229,19 +325,74 @@ namespace waavs {
 			if (fDimHeight.isSet())
 				fHeight = fDimHeight.calculatePixels(h, 0, dpi);
 
-			fImageVar = fImage;
+			// We're being bound in the middle of drawing, so the context
+			// already knows how big we'll be on the device.  If the image
+			// hasn't been decoded yet, there's no need to keep more of it
+			// than that.
+			if (fImage.empty() && (fWidth > 0) && (fHeight > 0))
+			{
+				BLMatrix2D m = ctx->finalTransform();
+				if (fHasTransform)
+				{
+					BLMatrix2D t = fTransform;
+					t.postTransform(m);
+					m = t;
+				}
+
+				auto pending = pendingImage();
+				if (pending != nullptr)
+				{
+					BLSize target = deviceSize(m);
+					pending->targetSize(target.w, target.h);
+				}
+			}
+
+			if (!fImage.empty())
+				fImageVar = fImage;
 		}
 
 
-		void drawSelf(IRenderSVG* ctx, IAmGroot* groot) override
+		// The size of the image on the device, given the full transform
+		BLSize deviceSize(const BLMatrix2D& m) const
+		{
+			return BLSize(std::sqrt(m.m00 * m.m00 + m.m01 * m.m01) * fWidth,
+				std::sqrt(m.m10 * m.m10 + m.m11 * m.m11) * fHeight);
+		}
+
+		// Device pixels per image pixel, the way we're about to be drawn
+		double deviceScale(const BLSize& devSize) const
 		{
 			if (fImage.empty())
+				return 1.0;
+
+			return std::max(devSize.w / fImage.size().w, devSize.h / fImage.size().h);
+		}
+
+		void drawSelf(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			if (!ensureImage())
 				return;
 
+			BLSize devSize = deviceSize(ctx->finalTransform());
+
+			// If the image was reduced when decoded, and we're now
+			// being shown bigger than that, go back for more pixels
+			if ((fImageLevel > 0) && (deviceScale(devSize) > 1.0))
+			{
+				if (!redecodeImage(devSize))
+					return;
+			}
+
+			// When shrinking, start from the mip level nearest to the
+			// size on the device, rather than the full resolution image
+			BLImage img = fImage;
+			if (fMips != nullptr)
+				img = fMips->imageForScale(deviceScale(devSize));
+
 			BLRect dst{ fX,fY, fWidth,fHeight };
-			BLRectI src{ 0,0,fImage.size().w,fImage.size().h };
+			BLRectI src{ 0,0,img.size().w,img.size().h };
 
-			ctx->scaleImage(fImage, src.x, src.y, src.w, src.h, fX, fY, fWidth, fHeight);
+			ctx->scaleImage(img, src.x, src.y, src.w, src.h, fX, fY, fWidth, fHeight);
 		}
 
 	};
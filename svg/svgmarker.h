@@ -5,12 +5,25 @@
 //
 //#include <functional>
 //#include <unordered_map>
+#include <vector>
 
 #include "svgattributes.h"
 #include "svgstructuretypes.h"
 #include "svgportal.h"
 
 namespace waavs {
+	//=================================================
+	// SVGMarkerShape
+	// One solid filled path of a marker's content, already
+	// in the marker's coordinates (viewBox, refX/refY and the
+	// child's own transform folded in).
+	//=================================================
+	struct SVGMarkerShape
+	{
+		BLPath fPath{};
+		BLRgba32 fColor{};
+	};
+
 	//=================================================
 	// SVGMarkerNode
 
@@ -35,6 +48,8 @@ namespace waavs {
 		SVGPortal fPortal{};
 		SVGVariableSize fDimRefX{};
 		SVGVariableSize fDimRefY{};
+		SVGDimension fDimWidth{};
+		SVGDimension fDimHeight{};
 
 		SpaceUnitsKind fMarkerUnits{ SpaceUnitsKind::SVG_SPACE_STROKEWIDTH };
 		SVGOrient fOrientation{ nullptr };
@@ -48,6 +63,15 @@ namespace waavs {
 		BLPoint fMarkerTranslation{ 0,0 };
 		BLRect fMarkerBoundingBox{ 0,0,3,3 };
 		BLRect fViewbox{};
+		bool fHasViewbox{ false };
+
+		// When the content is nothing but solid filled paths, it's
+		// kept as a list of shapes, so instances along a path can be
+		// filled directly, without drawing the marker's subtree.
+		// Built by SVGPathBasedGeometry, when it resolves its markers.
+		std::vector<SVGMarkerShape> fShapes{};
+		bool fShapesResolved{ false };
+		bool fInstanceable{ false };
 		
 		
 		SVGMarkerElement(IAmGroot* root)
@@ -56,6 +80,17 @@ namespace waavs {
 			isStructural(false);
 		}
 
+		// Transform from the marker's content coordinates to the
+		// coordinates of a marker instance, the same as drawSelf() applies
+		BLMatrix2D contentTransform() const
+		{
+			BLMatrix2D m = BLMatrix2D::makeIdentity();
+			m.scale(fMarkerContentScale.x, fMarkerContentScale.y);
+			m.translate(-fMarkerTranslation.x, -fMarkerTranslation.y);
+
+			return m;
+		}
+
 		BLRect frame() const override
 		{
 			return fPortal.getBBox();
@@ -92,16 +127,6 @@ namespace waavs {
 				dpi = groot->dpi();
 			}
 
-			// Load parameters for the portal
-			SVGDimension fDimWidth{};
-			SVGDimension fDimHeight{};
-
-			// If these are not specified, then we use default values of '3'
-			fDimWidth.loadFromChunk(getAttribute("markerWidth"));
-			fDimHeight.loadFromChunk(getAttribute("markerHeight"));
-			bool haveViewbox = parseViewBox(getAttribute("viewBox"), fViewbox);
-			fPortal.loadFromAttributes(fAttributes);
-			
 			double sWidth = ctx->getStrokeWidth();
 
 			// First, we setup the marker bounding box
@@ -153,7 +178,7 @@ namespace waavs {
 			// Now that we have the markerBoundingBox settled, we need to calculate an additional 
 			// scaling for the content area if a viewBox is specified
 			
-			if (haveViewbox) {
+			if (fHasViewbox) {
 				fMarkerContentScale.x = fMarkerBoundingBox.w / fViewbox.w;
 				fMarkerContentScale.y = fMarkerBoundingBox.h / fViewbox.h;
 			}
@@ -178,6 +203,11 @@ namespace waavs {
 			fDimRefY.loadFromChunk(getAttribute("refY"));
 			fOrientation.loadFromChunk(getAttribute("orient"));
 
+			// If these are not specified, then we use default values of '3'
+			fDimWidth.loadFromChunk(getAttribute("markerWidth"));
+			fDimHeight.loadFromChunk(getAttribute("markerHeight"));
+			fHasViewbox = parseViewBox(getAttribute("viewBox"), fViewbox);
+			fPortal.loadFromAttributes(fAttributes);
 		}
 
 		
@@ -185,6 +215,10 @@ namespace waavs {
 		{
 			createPortal(ctx, groot);
 
+			// the shapes depend on the portal, so are rebuilt
+			fShapes.clear();
+			fShapesResolved = false;
+			fInstanceable = false;
 		}
 
 
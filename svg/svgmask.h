@@ -6,21 +6,57 @@
 //
 
 #include <functional>
-#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <cmath>
+#include <cstdint>
 
 #include "svgattributes.h"
 #include "svgstructuretypes.h"
+#include "surfacepool.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#include <emmintrin.h>
+#define WAAVS_MASK_SSE2 1
+#endif
 
 
 namespace waavs {
 
-	//================================================
-	// SVGMaskNode
+	//============================================================
+	// SVGMaskCoverage
+	// A rendered mask, reduced to an A8 image, for one specific
+	// device transform and object bounding box.  The image only
+	// covers the part of the mask region that lands on the target,
+	// and fArea says where it sits in device space.
+	//============================================================
+	struct SVGMaskCoverage
+	{
+		BLMatrix2D fTransform{};	// user to device transform of the masked element
+		BLRect fObjectBox{};		// bounding box of the masked element
+		BLRectI fArea{};			// placement of fImage in device space
+		BLImage fImage{};
+
+		bool isEmpty() const { return (fArea.w <= 0) || (fArea.h <= 0); }
+	};
+
+
+	//============================================================
+	// SVGMaskElement
 	// 'mask' element
-	// Similar to SVGClipPath, except uses SRC_OUT
-	//================================================
+	//
+	// The mask content is drawn once into a PRGB32 scratch surface,
+	// covering just the device space part of the mask region that
+	// is on the target.  That's reduced to an A8 coverage image, of
+	// luminance times alpha (or alpha alone, for mask-type="alpha"),
+	// and the masked element is composited through it.
+	// Coverage is cached per (transform, bounding box), so redrawing
+	// the same view doesn't render the mask content again.
+	//============================================================
 	struct SVGMaskElement : public SVGGraphicsElement
 	{
+		static constexpr size_t kMaxCachedCoverage = 8;
+
 		static void registerSingularNode()
 		{
 			getSVGSingularCreationMap()["mask"] = [](IAmGroot* groot, const XmlElement& elem) {
@@ -41,31 +77,370 @@ namespace waavs {
 
 					return node;
 				});
-			
+
 
 			registerSingularNode();
 		}
 
 
+		// The mask region
+		SVGDimension fX{};
+		SVGDimension fY{};
+		SVGDimension fWidth{};
+		SVGDimension fHeight{};
+		bool fUserSpaceUnits{ false };			// maskUnits="userSpaceOnUse"
+		bool fContentObjectBox{ false };		// maskContentUnits="objectBoundingBox"
+		bool fAlphaMask{ false };				// mask-type="alpha"
+
+		std::vector<std::shared_ptr<SVGMaskCoverage>> fCoverageCache{};
+		size_t fNextCacheSlot{ 0 };
+
+
 		// Instance Constructor
-		SVGMaskElement(IAmGroot* groot)
+		SVGMaskElement(IAmGroot* )
 			: SVGGraphicsElement()
 		{
 			isStructural(false);
-			//fUseCacheIsolation = true;
 		}
 
+		void bindSelfToContext(IRenderSVG*, IAmGroot*) override
+		{
+			fX.loadFromChunk(getAttribute("x"));
+			fY.loadFromChunk(getAttribute("y"));
+			fWidth.loadFromChunk(getAttribute("width"));
+			fHeight.loadFromChunk(getAttribute("height"));
+
+			fUserSpaceUnits = (chunk_trim(getAttribute("maskUnits"), chrWspChars) == "userSpaceOnUse");
+			fContentObjectBox = (chunk_trim(getAttribute("maskContentUnits"), chrWspChars) == "objectBoundingBox");
+			fAlphaMask = (chunk_trim(getAttribute("mask-type"), chrWspChars) == "alpha");
+
+			// whatever we had cached was built from old content
+			fCoverageCache.clear();
+			fNextCacheSlot = 0;
+		}
+
+		// Resolve one of x/y/width/height of the mask region.  In
+		// objectBoundingBox units a plain number is a fraction of 'length'.
+		static double resolveLength(const SVGDimension& dim, double defaultPercent, bool objectBox, double length)
+		{
+			if (!dim.isSet())
+				return (defaultPercent / 100.0) * length;
+
+			if (objectBox)
+				return dim.isPercentage() ? (dim.value() / 100.0) * length : dim.value() * length;
+
+			return dim.calculatePixels(length);
+		}
 
-		void drawSelf(IRenderSVG* ctx, IAmGroot* groot) override
+		// The mask region, in the user space of the element being masked
+		BLRect maskRegion(const BLRect& objectBox, const BLRect& viewport) const
 		{
-			//The parent graphic should be stuffed into a BLPattern
-			// and set as a fill style, then we can 
-			// do this fillMask
-			// parent->getVar()
-			// BLPattern* pattern = new BLPattern(parent->getVar());
-			// ctx->setFillStyle(pattern);
-			//ctx->fillMask(BLPoint(0, 0), fCachedImage);
+			if (fUserSpaceUnits)
+			{
+				return BLRect(resolveLength(fX, -10, false, viewport.w), resolveLength(fY, -10, false, viewport.h),
+					resolveLength(fWidth, 120, false, viewport.w), resolveLength(fHeight, 120, false, viewport.h));
+			}
+
+			return BLRect(objectBox.x + resolveLength(fX, -10, true, objectBox.w), objectBox.y + resolveLength(fY, -10, true, objectBox.h),
+				resolveLength(fWidth, 120, true, objectBox.w), resolveLength(fHeight, 120, true, objectBox.h));
+		}
+
+		// Device space pixels covered by 'r' under 'm', padded for
+		// antialiasing, and limited to the target surface
+		static BLRectI deviceArea(const BLMatrix2D& m, const BLRect& r, const BLSize& tsize)
+		{
+			BLPoint pts[4] = { {r.x, r.y}, {r.x + r.w, r.y}, {r.x + r.w, r.y + r.h}, {r.x, r.y + r.h} };
+			BLPoint p0 = m.mapPoint(pts[0]);
+			BLBox box(p0.x, p0.y, p0.x, p0.y);
+			for (auto& pt : pts)
+			{
+				BLPoint dp = m.mapPoint(pt);
+				box.x0 = std::min(box.x0, dp.x); box.y0 = std::min(box.y0, dp.y);
+				box.x1 = std::max(box.x1, dp.x); box.y1 = std::max(box.y1, dp.y);
+			}
+
+			int x0 = (int)std::max(0.0, std::floor(box.x0) - 1);
+			int y0 = (int)std::max(0.0, std::floor(box.y0) - 1);
+			int x1 = (int)std::min(tsize.w, std::ceil(box.x1) + 1);
+			int y1 = (int)std::min(tsize.h, std::ceil(box.y1) + 1);
+
+			return BLRectI(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+		}
+
+		// Luminance of premultiplied pixels, which is the luminance of
+		// the color times its alpha, as the mask wants.  The sRGB
+		// coefficients are in 1/32768ths, and add up to exactly 32768.
+		static constexpr int kLumaR = 6963;
+		static constexpr int kLumaG = 23442;
+		static constexpr int kLumaB = 2363;
+
+		static void luminanceRow(const uint32_t* src, uint8_t* dst, int n)
+		{
+			int i = 0;
+
+#if WAAVS_MASK_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i coeffs = _mm_setr_epi16(kLumaB, kLumaG, kLumaR, 0, kLumaB, kLumaG, kLumaR, 0);
+			const __m128i half = _mm_set1_epi32(16384);
+
+			// Four pixels to four 32 bit luminance values
+			auto luma4 = [&](__m128i px) {
+				__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coeffs);
+				__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coeffs);
+				__m128 evens = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+				__m128 odds = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+				__m128i sum = _mm_add_epi32(_mm_castps_si128(evens), _mm_castps_si128(odds));
+				return _mm_srli_epi32(_mm_add_epi32(sum, half), 15);
+			};
+
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i a = luma4(_mm_loadu_si128((const __m128i*)(src + i)));
+				__m128i b = luma4(_mm_loadu_si128((const __m128i*)(src + i + 4)));
+				__m128i v = _mm_packs_epi32(a, b);
+				_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(v, v));
+			}
+#endif
+
+			for (; i < n; i++)
+			{
+				uint32_t p = src[i];
+				uint32_t l = ((p & 0xff) * kLumaB + ((p >> 8) & 0xff) * kLumaG + ((p >> 16) & 0xff) * kLumaR + 16384) >> 15;
+				dst[i] = (uint8_t)l;
+			}
+		}
+
+		static void alphaRow(const uint32_t* src, uint8_t* dst, int n)
+		{
+			int i = 0;
+
+#if WAAVS_MASK_SSE2
+			for (; i + 8 <= n; i += 8)
+			{
+				__m128i a = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(src + i)), 24);
+				__m128i b = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(src + i + 4)), 24);
+				__m128i v = _mm_packs_epi32(a, b);
+				_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(v, v));
+			}
+#endif
+
+			for (; i < n; i++)
+				dst[i] = (uint8_t)(src[i] >> 24);
+		}
+
+		// Retrieve the coverage for the current transform and bounding
+		// box from the cache, rendering it if it's not there yet.
+		std::shared_ptr<SVGMaskCoverage> coverage(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox)
+		{
+			BLMatrix2D dm = ctx->finalTransform();
+			BLRect region = maskRegion(objectBox, ctx->viewport());
+			BLRectI area{};
+			if ((region.w > 0) && (region.h > 0))
+				area = deviceArea(dm, region, ctx->targetSize());
+
+			for (auto& cov : fCoverageCache)
+			{
+				if ((cov->fTransform == dm) && (cov->fObjectBox == objectBox) && (cov->fArea == area))
+					return cov;
+			}
+
+			auto cov = std::make_shared<SVGMaskCoverage>();
+			cov->fTransform = dm;
+			cov->fObjectBox = objectBox;
+			cov->fArea = area;
+
+			BLImage content{};
+			if (!cov->isEmpty() &&
+				SurfacePool::pool().acquire(content, area.w, area.h, BL_FORMAT_PRGB32) &&
+				SurfacePool::pool().acquire(cov->fImage, area.w, area.h, BL_FORMAT_A8))
+			{
+				{
+					// Mask content takes its properties from the mask,
+					// not from the element being masked, so start from
+					// a fresh state, keeping just the viewport and fonts
+					ScratchContext mctx(ctx->fontHandler());
+					mctx->attach(content);
+					mctx->clearAll();
+					mctx->inheritState(*ctx, BLPointI(area.x, area.y));
+					mctx->initState();
+					mctx->clipToRect(region);
+
+					if (fContentObjectBox)
+					{
+						mctx->translate(objectBox.x, objectBox.y);
+						mctx->scale(objectBox.w, objectBox.h);
+					}
+
+					applyProperties(mctx.get(), groot);
+					drawChildren(mctx.get(), groot);
+					mctx->detach();
+				}
+
+				BLImageData src{};
+				BLImageData dst{};
+				content.getData(&src);
+				cov->fImage.getData(&dst);
+
+				for (int y = 0; y < area.h; y++)
+				{
+					const uint32_t* srow = (const uint32_t*)((const uint8_t*)src.pixelData + (intptr_t)y * src.stride);
+					uint8_t* drow = (uint8_t*)dst.pixelData + (intptr_t)y * dst.stride;
+
+					if (fAlphaMask)
+						alphaRow(srow, drow, area.w);
+					else
+						luminanceRow(srow, drow, area.w);
+				}
+			}
+			else {
+				cov->fArea = BLRectI{};
+			}
+
+			if (fCoverageCache.size() < kMaxCachedCoverage) {
+				fCoverageCache.push_back(cov);
+			}
+			else {
+				fCoverageCache[fNextCacheSlot] = cov;
+				fNextCacheSlot = (fNextCacheSlot + 1) % kMaxCachedCoverage;
+			}
+
+			return cov;
+		}
+
+		// Draw whatever 'content' draws, through this mask
+		void drawMasked(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content)
+		{
+			if (needsBinding())
+				bindToContext(ctx, groot);
+
+			// An objectBoundingBox mask on something with no
+			// size means the element isn't drawn
+			if (!fUserSpaceUnits && ((objectBox.w <= 0) || (objectBox.h <= 0)))
+				return;
+
+			auto cov = coverage(ctx, groot, objectBox);
+			if (cov->isEmpty())
+				return;
+
+			const BLRectI& area = cov->fArea;
+
+			// Draw the content into a layer covering the same area
+			BLImage layer{};
+			if (!SurfacePool::pool().acquire(layer, area.w, area.h, BL_FORMAT_PRGB32))
+				return;
+
+			{
+				ScratchContext lctx(ctx->fontHandler());
+				lctx->attach(layer);
+				lctx->clearAll();
+				lctx->inheritState(*ctx, BLPointI(area.x, area.y));
+				content(lctx.get());
+				lctx->detach();
+			}
+
+			// Then composite the layer, using the coverage as the mask
+			BLPattern pat(layer);
+			pat.translate(area.x, area.y);
+
+			ctx->save();
+			ctx->resetTransform();
+			ctx->setFillAlpha(1.0);
+			ctx->fillMask(BLPointI(area.x, area.y), cov->fImage, pat);
+			ctx->restore();
+		}
+	};
+}
+
+
+namespace waavs {
+	//======================================================
+	// SVGMaskAttribute
+	// The 'mask' attribute, which wraps the drawing of an
+	// element's content, and composites it through the
+	// referenced mask.  It's applied outside of any filter
+	// and clip-path on the same element.
+	//======================================================
+	struct SVGMaskAttribute : public SVGVisualProperty
+	{
+		static void registerFactory()
+		{
+			registerSVGAttribute("mask", [](const XmlAttributeCollection& attrs) {
+				auto node = std::make_shared<SVGMaskAttribute>(nullptr);
+				node->loadFromAttributes(attrs);
+
+				return node;
+				});
+		}
+
+
+		std::shared_ptr<SVGMaskElement> fMaskNode{ nullptr };
+
+
+		SVGMaskAttribute(IAmGroot* groot) : SVGVisualProperty(groot) { id("mask"); }
+
+		int contentWrapOrder() const override { return 3; }
+
+		bool loadFromUrl(IRenderSVG* ctx, IAmGroot* groot, const ByteSpan& inChunk)
+		{
+			if (nullptr == groot)
+				return false;
+
+			fMaskNode = std::dynamic_pointer_cast<SVGMaskElement>(groot->findNodeByUrl(inChunk));
+
+			if (fMaskNode == nullptr) {
+				set(false);
+				return false;
+			}
+
+			if (fMaskNode->needsBinding())
+				fMaskNode->bindToContext(ctx, groot);
+
+			set(true);
+
+			return true;
+		}
+
+		void bindToContext(IRenderSVG* ctx, IAmGroot* groot) noexcept override
+		{
+			ByteSpan str = rawValue();
+
+			if (chunk_starts_with_cstr(str, "url("))
+			{
+				loadFromUrl(ctx, groot, str);
+			}
+			else {
+				set(false);
+			}
+
+			needsBinding(false);
+		}
+
+		bool loadSelfFromChunk(const ByteSpan& inChunk) override
+		{
+			// we only act when wrapping the content
+			autoDraw(false);
+
+			if (inChunk == "none")
+				return set(false);
+
+			needsBinding(true);
+			set(true);
+
+			return true;
+		}
+
+		void drawContent(IRenderSVG* ctx, IAmGroot* groot, const BLRect& objectBox, const std::function<void(IRenderSVG*)>& content) override
+		{
+			if (needsBinding())
+				bindToContext(ctx, groot);
+
+			if (!isSet() || (nullptr == fMaskNode))
+			{
+				content(ctx);
+				return;
+			}
 
+			fMaskNode->drawMasked(ctx, groot, objectBox, content);
 		}
 	};
-}
\ No newline at end of file
+}
@@ -12,6 +12,7 @@
 #include "svgattributes.h"
 #include "svgstructuretypes.h"
 #include "viewport.h"
+#include "surfacepool.h"
 
 namespace waavs {
 
@@ -64,6 +65,12 @@ namespace waavs {
 		BLRect viewboxRect{};
 		bool haveViewbox{ false };
 
+		// Parsed once, resolved against the frames each time we're bound
+		SVGVariableSize fDimX{};
+		SVGVariableSize fDimY{};
+		SVGVariableSize fDimWidth{};
+		SVGVariableSize fDimHeight{};
+
 
 		// Things we'll need to calculate
 		BLRect fObjectBoundingBox{};
@@ -167,7 +174,8 @@ namespace waavs {
 		// values, after styling has been applied.
 		//
 		// We want to load things here that are invariant between 
-		// coordinate spaces, mostly enums, transform, and viewbox.
+		// coordinate spaces, mostly enums, transform, viewbox, and
+		// the unresolved dimensions.
 		//
 		void fixupSelfStyleAttributes(IRenderSVG *ctx, IAmGroot *groot) override
 		{
@@ -188,6 +196,11 @@ namespace waavs {
 			fHasPatternTransform = parseTransform(getAttribute("patternTransform"), fPatternTransform);
 
 			getEnumValue(SVGExtendMode, getAttribute("extendMode"), (uint32_t&)fExtendMode);
+
+			fDimX.loadFromChunk(getAttribute("x"));
+			fDimY.loadFromChunk(getAttribute("y"));
+			fDimWidth.loadFromChunk(getAttribute("width"));
+			fDimHeight.loadFromChunk(getAttribute("height"));
 		}
 		
 		//
@@ -209,18 +222,6 @@ namespace waavs {
 			BLRect objectBoundingBox = ctx->objectFrame();
 			// We also want to know the size of the container the object is in
 			BLRect containerBoundingBox = ctx->viewport();
-			
-			// Load parameters for the portal
-			SVGVariableSize fDimX{};
-			SVGVariableSize fDimY{};
-			SVGVariableSize fDimWidth{};
-			SVGVariableSize fDimHeight{};
-
-
-			fDimX.loadFromChunk(getAttribute("x"));
-			fDimY.loadFromChunk(getAttribute("y"));
-			fDimWidth.loadFromChunk(getAttribute("width"));
-			fDimHeight.loadFromChunk(getAttribute("height"));
 
 			// We need to calculate the fPatternBoundingBox
 			// this is based on the patternUnits
@@ -335,19 +336,28 @@ namespace waavs {
 
 			auto box = getBBox();
 
-			fPatternCache.create(static_cast<int>(fPatternBoundingBox.w), static_cast<int>(fPatternBoundingBox.h), BL_FORMAT_PRGB32);
-			IRenderSVG ictx(ctx->fontHandler());
-			ictx.begin(fPatternCache);
+			int w = static_cast<int>(fPatternBoundingBox.w);
+			int h = static_cast<int>(fPatternBoundingBox.h);
+
+			// Let go of the old cache before borrowing a new one, so the 
+			// pool can hand the same memory right back to us
+			fPattern.setImage(BLImage());
+			fPatternCache.reset();
+			if (!SurfacePool::pool().acquire(fPatternCache, w, h, BL_FORMAT_PRGB32))
+				return;
+
+			ScratchContext ictx(ctx->fontHandler());
+			ictx->attach(fPatternCache);
 
 
-			ictx.renew();
-			ictx.clear();
-			ictx.scale(fPatternContentScale.x, fPatternContentScale.y);
+			ictx->renew();
+			ictx->clear();
+			ictx->scale(fPatternContentScale.x, fPatternContentScale.y);
 
-			draw(&ictx, groot);
+			draw(ictx.get(), groot);
 
-			ictx.flush();
-			ictx.end();
+			ictx->flush();
+			ictx->detach();
 
 			fPattern.setImage(fPatternCache);
 		}
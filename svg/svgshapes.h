@@ -3,6 +3,9 @@
 #include <string>
 #include <array>
 #include <list>
+#include <vector>
+#include <cmath>
+#include <algorithm>
 #include <functional>
 #include <unordered_map>
 
@@ -27,6 +30,45 @@ namespace waavs {
 		BLPath fPath{};
 		bool fHasMarkers{ false };
 
+		// A marker drawn at one vertex of the path
+		struct MarkerInstance
+		{
+			SVGMarkerElement* fMarker{ nullptr };
+			BLMatrix2D fTransform{};
+		};
+
+		// Markers resolved at bind time, indexed by MarkerPosition,
+		// and the instances they're drawn at along the path
+		std::shared_ptr<SVGMarkerElement> fMarkers[3]{};
+		std::vector<MarkerInstance> fMarkerInstances{};
+		bool fMarkerInstancesValid{ false };
+		BLPath fMarkerBatch{};
+
+		// What the cached stroke outline was made with
+		struct StrokeOutlineKey
+		{
+			double fWidth{ 0 };
+			double fMiterLimit{ 0 };
+			double fDashOffset{ 0 };
+			BLArray<double> fDashArray{};
+			uint32_t fCapsAndJoin{ 0 };
+			uint32_t fTransformOrder{ 0 };
+			int fScaleStep{ 0 };			// device scale, quantized
+
+			bool operator==(const StrokeOutlineKey& other) const
+			{
+				return (fWidth == other.fWidth) && (fMiterLimit == other.fMiterLimit) && (fDashOffset == other.fDashOffset) &&
+					(fCapsAndJoin == other.fCapsAndJoin) && (fTransformOrder == other.fTransformOrder) &&
+					(fScaleStep == other.fScaleStep) && fDashArray.equals(other.fDashArray);
+			}
+		};
+
+		// The stroked outline of fPath, kept from one draw to the
+		// next, so an unchanged shape is filled, not stroked again
+		BLPath fStrokeOutline{};
+		StrokeOutlineKey fStrokeKey{};
+		bool fStrokeOutlineValid{ false };
+
 		SVGPathBasedGeometry(IAmGroot* iMap)
 			:SVGGraphicsElement()
 		{
@@ -101,82 +143,347 @@ namespace waavs {
 			checkForMarkers();
 		}
 		
-		bool drawMarker(IRenderSVG* ctx, IAmGroot* groot, const ByteSpan propname, MarkerPosition pos, const BLPoint& p1, const BLPoint& p2, const BLPoint& p3)
+		// Find the marker element a marker property refers to,
+		// falling back to the 'marker' shorthand
+		std::shared_ptr<SVGMarkerElement> resolveMarker(IRenderSVG* ctx, IAmGroot* groot, const ByteSpan& propname)
 		{
 			std::shared_ptr<SVGVisualProperty> prop = getVisualProperty(propname);
-			
+			if (nullptr == prop)
+				prop = getVisualProperty("marker");
 
+			auto marker = std::dynamic_pointer_cast<SVGMarkerAttribute>(prop);
+			if (nullptr == marker)
+				return nullptr;
 
-			
-			// Look for the default marker if the specified one is not found
-			if (nullptr == prop)
+			return std::dynamic_pointer_cast<SVGMarkerElement>(marker->markerNode(ctx, groot));
+		}
+
+		// Read a plain color (or 'none') from a fill or stroke property
+		static bool solidPaint(const std::shared_ptr<SVGVisualProperty>& prop, IRenderSVG* ctx, IAmGroot* groot, BLRgba32& color, bool& isNone)
+		{
+			auto paint = std::dynamic_pointer_cast<SVGPaint>(prop);
+			if ((nullptr == paint) || paint->fPaintReference)
+				return false;
+
+			BLVar v = paint->getVariant(ctx, groot);
+			isNone = v.isNull();
+			if (isNone)
+				return true;
+
+			uint32_t c = 0;
+			if (BL_SUCCESS != blVarToRgba32(&v, &c))
+				return false;
+
+			color = BLRgba32(c);
+
+			return true;
+		}
+
+		// Check that an element's properties amount to no more than a
+		// solid fill, and pick up that fill.  Stroke properties are
+		// fine, as long as nothing is actually stroked.
+		static bool solidFillStyle(SVGGraphicsElement* elem, IRenderSVG* ctx, IAmGroot* groot, BLRgba32& fill, bool& hasFill, BLFillRule& rule)
+		{
+			if (!elem->fContentWrappers.empty())
+				return false;
+
+			for (auto& prop : elem->fVisualProperties)
 			{
-				prop = getVisualProperty("marker");
-				if (nullptr == prop)
+				if (!prop.second->isSet() || !prop.second->autoDraw())
+					continue;
+
+				const ByteSpan& name = prop.first;
+				if (name == "fill")
+				{
+					bool isNone = false;
+					if (!solidPaint(prop.second, ctx, groot, fill, isNone))
+						return false;
+					hasFill = !isNone;
+				}
+				else if (name == "stroke")
+				{
+					BLRgba32 c{};
+					bool isNone = false;
+					if (!solidPaint(prop.second, ctx, groot, c, isNone) || !isNone)
+						return false;
+				}
+				else if (name == "fill-rule")
+				{
+					auto fr = std::dynamic_pointer_cast<SVGFillRuleAttribute>(prop.second);
+					if (nullptr == fr)
+						return false;
+					rule = fr->fValue;
+				}
+				else if (!chunk_starts_with_cstr(name, "stroke-"))
+				{
 					return false;
+				}
 			}
-			
-			// cast the prop to a SVGMarkerAttribute
-			auto marker = std::dynamic_pointer_cast<SVGMarkerAttribute>(prop);
 
-			if (nullptr == marker)
+			return true;
+		}
+
+		// Turn a marker's content into a list of solid filled shapes,
+		// if it's simple enough.  Otherwise the marker is left to draw
+		// its subtree for each instance.
+		static void resolveMarkerShapes(SVGMarkerElement* marker, IRenderSVG* ctx, IAmGroot* groot)
+		{
+			marker->fShapesResolved = true;
+			marker->fInstanceable = false;
+			marker->fShapes.clear();
+
+			// The marker's own fill and stroke are overridden when
+			// its children are drawn, so only need checking for
+			// anything else it might do
+			BLRgba32 ignoredFill{};
+			bool ignoredHasFill = false;
+			BLFillRule markerRule = BL_FILL_RULE_NON_ZERO;
+			if (!solidFillStyle(marker, ctx, groot, ignoredFill, ignoredHasFill, markerRule))
+				return;
+
+			BLMatrix2D contentTransform = marker->contentTransform();
+
+			for (auto& node : marker->fNodes)
+			{
+				auto shape = std::dynamic_pointer_cast<SVGPathBasedGeometry>(node);
+				if (nullptr == shape)
+				{
+					marker->fShapes.clear();
+					return;
+				}
+
+				if (!shape->visible())
+					continue;
+
+				if (shape->needsBinding())
+					shape->bindToContext(ctx, groot);
+
+				BLRgba32 fill(0, 0, 0);
+				bool hasFill = true;
+				BLFillRule rule = markerRule;
+				if (shape->fHasMarkers || !shape->fNodes.empty() || !solidFillStyle(shape.get(), ctx, groot, fill, hasFill, rule) || (rule != BL_FILL_RULE_NON_ZERO))
+				{
+					marker->fShapes.clear();
+					return;
+				}
+
+				if (!hasFill)
+					continue;
+
+				BLMatrix2D m = contentTransform;
+				if (shape->fHasTransform)
+					m.transform(shape->fTransform);
+
+				SVGMarkerShape ms{};
+				ms.fColor = fill;
+				ms.fPath.addPath(shape->fPath, m);
+				marker->fShapes.push_back(std::move(ms));
+			}
+
+			marker->fInstanceable = true;
+		}
+
+		// Markers are looked up once, when the geometry is bound,
+		// rather than for every vertex they're drawn on
+		void resolveMarkers(IRenderSVG* ctx, IAmGroot* groot)
+		{
+			fMarkerInstancesValid = false;
+
+			for (auto& m : fMarkers)
+				m = nullptr;
+
+			if (!fHasMarkers)
+				return;
+
+			fMarkers[MarkerPosition::MARKER_POSITION_START] = resolveMarker(ctx, groot, "marker-start");
+			fMarkers[MarkerPosition::MARKER_POSITION_MIDDLE] = resolveMarker(ctx, groot, "marker-mid");
+			fMarkers[MarkerPosition::MARKER_POSITION_END] = resolveMarker(ctx, groot, "marker-end");
+
+			for (auto& m : fMarkers)
+			{
+				if ((nullptr != m) && !m->fShapesResolved)
+					resolveMarkerShapes(m.get(), ctx, groot);
+			}
+		}
+
+		void bindToContext(IRenderSVG* ctx, IAmGroot* groot) noexcept override
+		{
+			SVGGraphicsElement::bindToContext(ctx, groot);
+
+			// fPath has most likely been rebuilt
+			fStrokeOutline.clear();
+			fStrokeOutlineValid = false;
+
+			resolveMarkers(ctx, groot);
+		}
+
+		// Whether stroke outlines are cached.  It trades the memory
+		// of an outline per stroked shape for not running the stroker
+		// on every draw.
+		static bool& cacheStrokeOutlines()
+		{
+			static bool sCacheStrokeOutlines = true;
+			return sCacheStrokeOutlines;
+		}
+
+		// Stroke fPath by filling its cached outline, building the
+		// outline first if the stroke settings, or the scale it's
+		// seen at, have changed.  Returns false if the stroke has to
+		// be done by the context instead.
+		bool strokeFromOutline(IRenderSVG* ctx)
+		{
+			if (!cacheStrokeOutlines())
 				return false;
 
-			// get the marker node, as shared_ptr<IViewable>
-			auto aNode = marker->markerNode(ctx, groot);
-			if (nullptr == aNode)
+			BLVar style{};
+			ctx->getStrokeStyle(style);
+			if (style.isNull())
 				return false;
 
-			// cast the node to a SVGMarkerNode
-			std::shared_ptr<SVGMarkerElement> markerNode = std::dynamic_pointer_cast<SVGMarkerElement>(aNode);
+			const BLStrokeOptions& so = ctx->BLContext::strokeOptions();
+			if (so.width <= 0)
+				return false;
 
+			BLMatrix2D m = ctx->finalTransform();
+			double sx = std::sqrt(m.m00 * m.m00 + m.m01 * m.m01);
+			double sy = std::sqrt(m.m10 * m.m10 + m.m11 * m.m11);
+			if ((sx <= 0) || (sy <= 0))
+				return false;
 
+			StrokeOutlineKey key{};
+			key.fWidth = so.width;
+			key.fMiterLimit = so.miterLimit;
+			key.fDashOffset = so.dashOffset;
+			key.fDashArray = so.dashArray;
+			key.fCapsAndJoin = (uint32_t)so.startCap | ((uint32_t)so.endCap << 8) | ((uint32_t)so.join << 16);
+			key.fTransformOrder = so.transformOrder;
 
-			BLPoint transP{};
-			BLRgba32 transC{};
+			BLStrokeOptions options = so;
+			double precision = 1.0;
 
-			switch (pos)
+			if (so.transformOrder == BL_STROKE_TRANSFORM_ORDER_BEFORE)
 			{
-			case MarkerPosition::MARKER_POSITION_START:
-				transP = p1;
-				transC = BLRgba32(0x7fff0000);
+				// A non-scaling stroke, the width is in device pixels.
+				// Under a uniform scale, that's the same as stroking in
+				// user space with the width divided by the scale.  The
+				// scale is quantized to 1/64 of an octave, so a little
+				// jitter doesn't rebuild the outline.
+				if ((std::abs(sx - sy) > 1e-6 * sx) || (std::abs(m.m00 * m.m10 + m.m01 * m.m11) > 1e-6 * sx * sy))
+					return false;
+				if (!so.dashArray.empty())
+					return false;
 
-				break;
-			case MarkerPosition::MARKER_POSITION_MIDDLE:
-				transP = p2;
-				transC = BLRgba32(0x7f00ff00);
-				break;
-			case MarkerPosition::MARKER_POSITION_END:
-				transP = p2;
-				transC = BLRgba32(0x7f0000ff);
-				break;
+				key.fScaleStep = (int)std::lround(std::log2(sx) * 64);
+				precision = std::exp2(key.fScaleStep / 64.0);
+				options.width = so.width / precision;
+				options.transformOrder = BL_STROKE_TRANSFORM_ORDER_AFTER;
+			}
+			else {
+				// Only the flattening depends on the scale, so whole
+				// octaves are enough, using the finer of the two ends
+				key.fScaleStep = (int)std::ceil(std::log2(std::max(sx, sy)));
+				precision = std::exp2(key.fScaleStep);
 			}
 
-			// BUGBUG - red (start), green (mid), blue(end)
-			ctx->fillCircle(transP.x, transP.y, 2, transC);
+			if (!fStrokeOutlineValid || !(key == fStrokeKey))
+			{
+				BLApproximationOptions approx = blDefaultApproximationOptions;
+				approx.flattenTolerance /= precision;
+				approx.simplifyTolerance /= precision;
 
+				fStrokeOutline.clear();
+				fStrokeOutlineValid = false;
+				if (BL_SUCCESS != fStrokeOutline.addStrokedPath(fPath, options, approx))
+					return false;
 
+				fStrokeKey = key;
+				fStrokeOutlineValid = true;
+			}
 
-			// Use the three given points to calculate the angle of rotation 
-			// from the markerNode
-			double rads = markerNode->orientation().calcRadians(pos, p1, p2, p3);
-			
-			BLRect objectFrame = markerNode->getBBox();
-			//BLRect viewport = ctx->viewport();
-			
-			ctx->push();
-			//ctx->objectFrame(objectFrame);
-			
-			ctx->translate(transP);
-			ctx->rotate(rads);
+			ctx->save();
+			ctx->setFillAlpha(ctx->BLContext::strokeAlpha());
+			ctx->setFillRule(BL_FILL_RULE_NON_ZERO);
+			ctx->fillPath(fStrokeOutline, style);
+			ctx->restore();
 
-			// draw the marker
-			markerNode->draw(ctx, groot);
+			return true;
+		}
 
+		// Record a marker instance at one vertex of the path
+		void addMarker(MarkerPosition pos, const BLPoint& p1, const BLPoint& p2, const BLPoint& p3)
+		{
+			SVGMarkerElement* marker = fMarkers[pos].get();
+			if (nullptr == marker)
+				return;
 
-			ctx->pop();
+			BLPoint transP = (pos == MarkerPosition::MARKER_POSITION_START) ? p1 : p2;
 
-			return true;
+			// Use the three given points to calculate the angle of rotation
+			double rads = marker->orientation().calcRadians(pos, p1, p2, p3);
+
+			BLMatrix2D m = BLMatrix2D::makeTranslation(transP);
+			m.rotate(rads);
+
+			fMarkerInstances.push_back({ marker, m });
+		}
+
+		// Draw the recorded instances.  Consecutive instances of a
+		// marker made of a single opaque shape become one combined
+		// path, and a single fill.
+		void drawMarkerInstances(IRenderSVG* ctx, IAmGroot* groot)
+		{
+			size_t i = 0;
+			while (i < fMarkerInstances.size())
+			{
+				SVGMarkerElement* marker = fMarkerInstances[i].fMarker;
+				size_t end = i + 1;
+				while ((end < fMarkerInstances.size()) && (fMarkerInstances[end].fMarker == marker))
+					end++;
+
+				// the marker may have been rebound since we looked at it
+				if (!marker->fShapesResolved)
+					resolveMarkerShapes(marker, ctx, groot);
+
+				if (!marker->fInstanceable)
+				{
+					for (size_t k = i; k < end; k++)
+					{
+						ctx->push();
+						ctx->applyTransform(fMarkerInstances[k].fTransform);
+						marker->draw(ctx, groot);
+						ctx->pop();
+					}
+				}
+				else if (marker->visible())
+				{
+					ctx->blendMode(BL_COMP_OP_SRC_OVER);
+					ctx->fillRule(BL_FILL_RULE_NON_ZERO);
+
+					const std::vector<SVGMarkerShape>& shapes = marker->fShapes;
+					if ((shapes.size() == 1) && (shapes[0].fColor.a() == 255))
+					{
+						fMarkerBatch.clear();
+						for (size_t k = i; k < end; k++)
+							fMarkerBatch.addPath(shapes[0].fPath, fMarkerInstances[k].fTransform);
+
+						ctx->fillPath(fMarkerBatch, shapes[0].fColor);
+					}
+					else
+					{
+						for (size_t k = i; k < end; k++)
+						{
+							for (auto& shape : shapes)
+							{
+								fMarkerBatch.clear();
+								fMarkerBatch.addPath(shape.fPath, fMarkerInstances[k].fTransform);
+								ctx->fillPath(fMarkerBatch, shape.fColor);
+							}
+						}
+					}
+				}
+
+				i = end;
+			}
 		}
 
 
@@ -186,8 +493,24 @@ namespace waavs {
 			if (!fHasMarkers)
 				return;
 
+			// The instances only depend on the path, and the markers,
+			// so they're gathered once, and reused until rebound
+			if (!fMarkerInstancesValid)
+			{
+				buildMarkerInstances();
+				fMarkerInstancesValid = true;
+			}
+
+			ctx->push();
+			drawMarkerInstances(ctx, groot);
+			ctx->pop();
+		}
+
+		// Walk the path, and record the marker instances on its vertices
+		void buildMarkerInstances()
+		{
+			fMarkerInstances.clear();
 
-			
 			static const uint8_t CMD_INVALID = 0xffu;
 
 			ByteSpan cmdSpan(fPath.commandData(), fPath.commandDataEnd());
@@ -204,8 +527,7 @@ namespace waavs {
 			BLPoint lastOnPoint{};
 
 			//printf("Command Size: %d  Path Size: %d\n", cmdSpan.size(), fPath.size());
-			ctx->push();
-			
+
 			while (cmdSpan)
 			{
 				int nVerts = 0;
@@ -249,7 +571,7 @@ namespace waavs {
 						}
 					}
 
-					drawMarker(ctx, groot, "marker-start", MarkerPosition::MARKER_POSITION_START, vecpts[0], vecpts[1], vecpts[2]);
+					addMarker(MarkerPosition::MARKER_POSITION_START, vecpts[0], vecpts[1], vecpts[2]);
 
 					lastCmd = BL_PATH_CMD_MOVE;
 				}
@@ -274,26 +596,26 @@ namespace waavs {
 						case BL_PATH_CMD_ON:
 						case BL_PATH_CMD_CUBIC:
 							vecpts[2] = verts[vertOffset + nVerts];
-							drawMarker(ctx, groot, "marker-mid", MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
+							addMarker(MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
 							lastOnPoint = vecpts[1];
 							break;
 
 						case BL_PATH_CMD_CLOSE:
 							vecpts[2] = lastMoveTo;
-							drawMarker(ctx, groot, "marker-mid", MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
+							addMarker(MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
 							lastOnPoint = vecpts[1];
 							break;
 
 						case BL_PATH_CMD_MOVE:
 						default:
 							vecpts[2] = vecpts[1];
-							drawMarker(ctx, groot, "marker-end", MarkerPosition::MARKER_POSITION_END, verts[vertOffset - 1], verts[vertOffset], verts[vertOffset]);
+							addMarker(MarkerPosition::MARKER_POSITION_END, verts[vertOffset - 1], verts[vertOffset], verts[vertOffset]);
 							lastOnPoint = vecpts[1];
 						}
 					}
 					else {
 						// If there is no next command, then this is an 'end', so we should use the end marker if it exists
-						drawMarker(ctx, groot, "marker-end", MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
+						addMarker(MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
 					}
 
 					lastCmd = BL_PATH_CMD_ON;
@@ -324,23 +646,23 @@ namespace waavs {
 						case BL_PATH_CMD_ON:
 						case BL_PATH_CMD_CUBIC:
 							vecpts[2] = verts[vertOffset + nVerts];
-							drawMarker(ctx, groot, "marker-mid", MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
+							addMarker(MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
 							break;
 
 						case BL_PATH_CMD_CLOSE:
 							vecpts[2] = lastMoveTo;
-							drawMarker(ctx, groot, "marker-mid", MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
+							addMarker(MarkerPosition::MARKER_POSITION_MIDDLE, vecpts[0], vecpts[1], vecpts[2]);
 							break;
 
 						case BL_PATH_CMD_MOVE:
 						default:
 							vecpts[2] = vecpts[1];
-							drawMarker(ctx, groot, "marker-end", MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
+							addMarker(MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
 						}
 					}
 					else {
 						// If there is no next command, then this is an 'end', so we should use the end marker if it exists
-						drawMarker(ctx, groot, "marker-end", MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
+						addMarker(MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
 					}
 
 					lastCmd = BL_PATH_CMD_CUBIC;
@@ -358,7 +680,7 @@ namespace waavs {
 
 					nVerts = 1;
 
-					drawMarker(ctx, groot, "marker-end", MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
+					addMarker(MarkerPosition::MARKER_POSITION_END, vecpts[0], vecpts[1], vecpts[2]);
 
 					lastCmd = BL_PATH_CMD_CLOSE;
 					lastOnPoint = vecpts[1];
@@ -370,8 +692,6 @@ namespace waavs {
 				cmdSpan += nVerts;
 				vertOffset += nVerts;
 			}
-
-			ctx->pop();
 		}
 
 
@@ -391,7 +711,8 @@ namespace waavs {
 					break;
 					
 				case PaintOrderKind::SVG_PAINT_ORDER_STROKE:
-					ctx->strokePath(fPath);
+					if (!strokeFromOutline(ctx))
+						ctx->strokePath(fPath);
 					break;
 
 				case PaintOrderKind::SVG_PAINT_ORDER_MARKERS:
@@ -429,9 +750,24 @@ namespace waavs {
 
 		BLLine geom{};
 
+		SVGDimension fDimX1{};
+		SVGDimension fDimY1{};
+		SVGDimension fDimX2{};
+		SVGDimension fDimY2{};
+
 		SVGLineElement(IAmGroot* iMap)
 			:SVGPathBasedGeometry(iMap) {}
 
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fDimX1.loadFromChunk(getAttribute("x1"));
+			fDimY1.loadFromChunk(getAttribute("y1"));
+			fDimX2.loadFromChunk(getAttribute("x2"));
+			fDimY2.loadFromChunk(getAttribute("y2"));
+		}
+
 		/*
 		BLRect getBBox() const override
 		{
@@ -465,17 +801,6 @@ namespace waavs {
 				h = cFrame.h;
 
 			
-			SVGDimension fDimX1{};
-			SVGDimension fDimY1{};
-			SVGDimension fDimX2{};
-			SVGDimension fDimY2{};
-			
-			fDimX1.loadFromChunk(getAttribute("x1"));
-			fDimY1.loadFromChunk(getAttribute("y1"));
-			fDimX2.loadFromChunk(getAttribute("x2"));
-			fDimY2.loadFromChunk(getAttribute("y2"));
-
-			
 			if (fDimX1.isSet())
 				geom.x0 = fDimX1.calculatePixels(w, 0, dpi);
 			if (fDimY1.isSet())
@@ -485,6 +810,7 @@ namespace waavs {
 			if (fDimY2.isSet())
 				geom.y1 = fDimY2.calculatePixels(h, 0, dpi);
 			
+			fPath.clear();
 			fPath.addLine(geom);
 			fPath.shrink();
 		}
@@ -521,8 +847,28 @@ namespace waavs {
 		BLRoundRect geom{};
 		bool fIsRound{ false };
 
+		SVGDimension fX{};
+		SVGDimension fY{};
+		SVGDimension fWidth{};
+		SVGDimension fHeight{};
+		SVGDimension fRx{};
+		SVGDimension fRy{};
+
 		
 		SVGRectElement(IAmGroot* iMap) :SVGPathBasedGeometry(iMap) {}
+
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fX.loadFromChunk(getAttribute("x"));
+			fY.loadFromChunk(getAttribute("y"));
+			fWidth.loadFromChunk(getAttribute("width"));
+			fHeight.loadFromChunk(getAttribute("height"));
+
+			fRx.loadFromChunk(getAttribute("rx"));
+			fRy.loadFromChunk(getAttribute("ry"));
+		}
 		
 		BLRect getBBox() const override
 		{
@@ -547,22 +893,6 @@ namespace waavs {
 				h = cFrame.h;
 
 
-			SVGDimension fX{};
-			SVGDimension fY{};
-			SVGDimension fWidth{};
-			SVGDimension fHeight{};
-			SVGDimension fRx{};
-			SVGDimension fRy{};
-
-			fX.loadFromChunk(getAttribute("x"));
-			fY.loadFromChunk(getAttribute("y"));
-			fWidth.loadFromChunk(getAttribute("width"));
-			fHeight.loadFromChunk(getAttribute("height"));
-
-			fRx.loadFromChunk(getAttribute("rx"));
-			fRy.loadFromChunk(getAttribute("ry"));
-
-
 			// If height or width <= 0, they are invalid
 			//if (fWidth.value() < 0) { fWidth.fValue = 0; fWidth.fIsSet = false; }
 			//if (fHeight.value() < 0) { fHeight.fValue = 0; fHeight.fIsSet = false; }
@@ -603,6 +933,7 @@ namespace waavs {
 			{
 			}
 
+			fPath.clear();
 			if (fIsRound)
 				fPath.addRoundRect(geom);
 			else {
@@ -643,9 +974,22 @@ namespace waavs {
 		
 		BLCircle geom{};
 
+		SVGDimension fCx{};
+		SVGDimension fCy{};
+		SVGDimension fR{};
+
 
 		SVGCircleElement(IAmGroot* iMap) :SVGPathBasedGeometry(iMap) {}
 
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fCx.loadFromChunk(getAttribute("cx"));
+			fCy.loadFromChunk(getAttribute("cy"));
+			fR.loadFromChunk(getAttribute("r"));
+		}
+
 		
 		void bindSelfToContext(IRenderSVG *ctx, IAmGroot *groot) override
 		{
@@ -663,19 +1007,11 @@ namespace waavs {
 				w = cFrame.w;
 				h = cFrame.h;
 
-			
-			SVGDimension fCx{};
-			SVGDimension fCy{};
-			SVGDimension fR{};
-			
-			fCx.loadFromChunk(getAttribute("cx"));
-			fCy.loadFromChunk(getAttribute("cy"));
-			fR.loadFromChunk(getAttribute("r"));
-			
 			geom.cx = fCx.calculatePixels(w, 0, dpi);
 			geom.cy = fCy.calculatePixels(h, 0, dpi);
 			geom.r = fR.calculatePixels(w, h, dpi);
 
+			fPath.clear();
 			fPath.addCircle(geom);
 			fPath.shrink();
 
@@ -699,9 +1035,24 @@ namespace waavs {
 
 		BLEllipse geom{};
 
+		SVGDimension fCx{};
+		SVGDimension fCy{};
+		SVGDimension fRx{};
+		SVGDimension fRy{};
+
 		
 		SVGEllipseElement(IAmGroot* iMap)
 			:SVGPathBasedGeometry(iMap) {}
+
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
+		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fCx.loadFromChunk(getAttribute("cx"));
+			fCy.loadFromChunk(getAttribute("cy"));
+			fRx.loadFromChunk(getAttribute("rx"));
+			fRy.loadFromChunk(getAttribute("ry"));
+		}
 		
 		
 		BLRect getBBox() const override
@@ -725,24 +1076,12 @@ namespace waavs {
 			w = cFrame.w;
 			h = cFrame.h;
 
-			
-
-			SVGDimension fCx{};
-			SVGDimension fCy{};
-			SVGDimension fRx{};
-			SVGDimension fRy{};
-			
-			fCx.loadFromChunk(getAttribute("cx"));
-			fCy.loadFromChunk(getAttribute("cy"));
-			fRx.loadFromChunk(getAttribute("rx"));
-			fRy.loadFromChunk(getAttribute("ry"));
-			
-			
 			geom.cx = fCx.calculatePixels(w, 0, dpi);
 			geom.cy = fCy.calculatePixels(h, 0, dpi);
 			geom.rx = fRx.calculatePixels(w, 0, dpi);
 			geom.ry = fRy.calculatePixels(h, 0, dpi);
 
+			fPath.clear();
 			fPath.addEllipse(geom);
 			fPath.shrink();
 		}
@@ -791,8 +1130,13 @@ namespace waavs {
 			}
 		}
 		
-		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		// The points don't depend on the context, so they're
+		// turned into the path once, rather than on every binding
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
 		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fPath.clear();
 			loadPoints(getAttribute("points"));
 			fPath.shrink();
 		}
@@ -831,9 +1175,9 @@ namespace waavs {
 		SVGPolygonElement(IAmGroot* iMap) 
 			:SVGPolylineElement(iMap) {}
 
-		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
 		{
-			SVGPolylineElement::bindSelfToContext(ctx, groot);
+			SVGPolylineElement::fixupSelfStyleAttributes(ctx, groot);
 			
 			fPath.close();
 			fPath.shrink();
@@ -875,8 +1219,14 @@ namespace waavs {
 		{
 		}
 		
-		virtual void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
+		// Like the points of a polyline, the path data is
+		// parsed once, and not again on every binding
+		void fixupSelfStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
 		{
+			SVGPathBasedGeometry::fixupSelfStyleAttributes(ctx, groot);
+
+			fPath.clear();
+
 			auto d = getAttribute("d");
 			if (d) {
 				auto success = blpathparser::parsePath(d, fPath);
@@ -15,9 +15,14 @@
 #include <array>
 #include <functional>
 #include <unordered_map>
+#include <cmath>
+#include <algorithm>
 
 #include "svgattributes.h"
 #include "svgcontainer.h"
+#include "svgsymbol.h"
+#include "surfacepool.h"
+#include "instancecache.h"
 
 
 namespace waavs {
@@ -170,6 +175,7 @@ namespace waavs {
 
 		ByteSpan fWrappedID{};
 		std::shared_ptr<IViewable> fWrappedNode{ nullptr };
+		std::shared_ptr<SVGSymbolNode> fWrappedSymbol{ nullptr };	// when that's what we wrap
 
 
 		//double x{ 0 };
@@ -254,6 +260,185 @@ namespace waavs {
 			if (fWrappedID) {
 				fWrappedNode = groot->findNodeByHref(fWrappedID);
 			}
+
+			fWrappedSymbol = std::dynamic_pointer_cast<SVGSymbolNode>(fWrappedNode);
+		}
+
+		// Add the inherited drawing state that can change how the
+		// wrapped content looks to the key.  Returns false if some of
+		// it (a gradient, a dash pattern) isn't worth keying on.
+		static bool addStateToKey(IRenderSVG* ctx, InstanceCacheKey& key)
+		{
+			auto addPaint = [&key](const BLVar& v) {
+				if (v.isNull()) {
+					key.add((uint64_t)1 << 32);
+					return true;
+				}
+
+				uint32_t c = 0;
+				if (BL_SUCCESS != blVarToRgba32(&v, &c))
+					return false;
+
+				key.add((uint64_t)c);
+				return true;
+			};
+
+			BLVar style{};
+			ctx->getFillStyle(style);
+			if (!addPaint(style))
+				return false;
+			ctx->getStrokeStyle(style);
+			if (!addPaint(style))
+				return false;
+			if (!addPaint(ctx->defaultColor()))
+				return false;
+
+			const BLStrokeOptions& so = ctx->BLContext::strokeOptions();
+			if (!so.dashArray.empty())
+				return false;
+
+			key.add(so.width);
+			key.add(so.miterLimit);
+			key.add((uint64_t)so.startCap | ((uint64_t)so.endCap << 8) | ((uint64_t)so.join << 16) | ((uint64_t)so.transformOrder << 24) | ((uint64_t)ctx->BLContext::fillRule() << 32));
+			key.add(ctx->BLContext::fillAlpha());
+			key.add(ctx->BLContext::strokeAlpha());
+			key.add((uint64_t)ctx->paintOrder());
+			key.add((uint64_t)ctx->geometryOnly());
+
+			key.add((double)ctx->fFontSize);
+			key.add((uint64_t)ByteSpanHash{}(ctx->fFamilyNames));
+			key.add((uint64_t)ctx->fFontStyle | ((uint64_t)ctx->fFontWeight << 8) | ((uint64_t)ctx->fFontStretch << 24) |
+				((uint64_t)ctx->fTextHAlignment << 32) | ((uint64_t)ctx->fTextVAlignment << 40));
+
+			return true;
+		}
+
+		// Render the wrapped symbol, by itself, into a raster.  The raster
+		// covers the symbol's viewport, 'frame', at the scale in 'dm', with
+		// the fraction of a pixel in 'frac'.  If anything is drawn on the
+		// edges of the raster, the content spills out of the viewport, and
+		// the raster can't stand in for it.
+		InstanceRaster renderInstance(IRenderSVG* ctx, IAmGroot* groot, const BLMatrix2D& dm, const BLRect& frame, const BLPoint& frac)
+		{
+			InstanceRaster raster{};
+
+			double x0 = std::min(dm.m00 * frame.x, dm.m00 * (frame.x + frame.w)) + frac.x;
+			double x1 = std::max(dm.m00 * frame.x, dm.m00 * (frame.x + frame.w)) + frac.x;
+			double y0 = std::min(dm.m11 * frame.y, dm.m11 * (frame.y + frame.h)) + frac.y;
+			double y1 = std::max(dm.m11 * frame.y, dm.m11 * (frame.y + frame.h)) + frac.y;
+
+			raster.fOffset = BLPointI((int)std::floor(x0) - 1, (int)std::floor(y0) - 1);
+			int w = (int)std::ceil(x1) + 1 - raster.fOffset.x;
+			int h = (int)std::ceil(y1) + 1 - raster.fOffset.y;
+
+			if (BL_SUCCESS != raster.fImage.create(w, h, BL_FORMAT_PRGB32))
+				return raster;
+
+			{
+				ScratchContext ictx(ctx->fontHandler());
+				ictx->attach(raster.fImage);
+				ictx->clearAll();
+				ictx->inheritState(*ctx, BLPointI(0, 0));
+				ictx->setTransform(BLMatrix2D(dm.m00, 0, 0, dm.m11, frac.x - raster.fOffset.x, frac.y - raster.fOffset.y));
+				fWrappedNode->draw(ictx.get(), groot);
+				ictx->detach();
+			}
+
+			BLImageData data{};
+			raster.fImage.getData(&data);
+			auto pixel = [&data](int x, int y) {
+				return ((const uint32_t*)((const uint8_t*)data.pixelData + (intptr_t)y * data.stride))[x];
+			};
+
+			for (int x = 0; x < w; x++)
+			{
+				if (pixel(x, 0) || pixel(x, h - 1))
+					return raster;
+			}
+			for (int y = 0; y < h; y++)
+			{
+				if (pixel(0, y) || pixel(w - 1, y))
+					return raster;
+			}
+
+			// Nothing at all inside the viewport most likely means the
+			// content is somewhere else entirely, so don't trust it either
+			for (int y = 1; (y < h - 1) && !raster.fUsable; y++)
+			{
+				for (int x = 1; x < w - 1; x++)
+				{
+					if (pixel(x, y)) {
+						raster.fUsable = true;
+						break;
+					}
+				}
+			}
+
+			return raster;
+		}
+
+		// Draw the wrapped symbol from the InstanceCache, if it can be.
+		// It has to be small, drawn with a plain scale and translate, and
+		// composited normally.
+		bool drawInstance(IRenderSVG* ctx, IAmGroot* groot)
+		{
+			if ((nullptr == fWrappedSymbol) || !fWrappedSymbol->visible())
+				return false;
+
+			BLMatrix2D dm = ctx->finalTransform();
+			if ((dm.m01 != 0) || (dm.m10 != 0) || (dm.m00 == 0) || (dm.m11 == 0))
+				return false;
+
+			if ((ctx->BLContext::globalAlpha() != 1.0) || (ctx->BLContext::compOp() != BL_COMP_OP_SRC_OVER))
+				return false;
+
+			if (fWrappedSymbol->needsBinding())
+				fWrappedSymbol->bindToContext(ctx, groot);
+
+			if (!fWrappedSymbol->instanceable(groot))
+				return false;
+
+			BLRect frame = fWrappedSymbol->getBBox();
+			if ((frame.w <= 0) || (frame.h <= 0) ||
+				(frame.w * std::abs(dm.m00) > InstanceCache::kMaxInstanceSize) || (frame.h * std::abs(dm.m11) > InstanceCache::kMaxInstanceSize))
+				return false;
+
+			// Whole pixels of the translation are just where the raster
+			// goes, the quarter pixel it falls on is part of the key
+			BLPointI origin((int)std::floor(dm.m20), (int)std::floor(dm.m21));
+			int qx = (int)std::lround((dm.m20 - origin.x) * 4);
+			int qy = (int)std::lround((dm.m21 - origin.y) * 4);
+			if (qx == 4) { origin.x++; qx = 0; }
+			if (qy == 4) { origin.y++; qy = 0; }
+
+			InstanceCacheKey key{};
+			key.add(fWrappedSymbol.get());
+			key.add(fWrappedSymbol->fInstanceGeneration);
+			key.add(dm.m00);
+			key.add(dm.m11);
+			key.add((uint64_t)(qx | (qy << 8)));
+			key.add(frame);
+			key.add(ctx->viewport());
+			key.add(ctx->objectFrame());
+			if (!addStateToKey(ctx, key))
+				return false;
+
+			InstanceRaster raster{};
+			if (!InstanceCache::cache().find(key, raster))
+			{
+				raster = renderInstance(ctx, groot, dm, frame, BLPoint(qx / 4.0, qy / 4.0));
+				InstanceCache::cache().insert(key, raster);
+			}
+
+			if (!raster.fUsable)
+				return false;
+
+			ctx->save();
+			ctx->resetTransform();
+			ctx->blitImage(BLPointI(origin.x + raster.fOffset.x, origin.y + raster.fOffset.y), raster.fImage);
+			ctx->restore();
+
+			return true;
 		}
 
 
@@ -282,7 +467,8 @@ namespace waavs {
 			ctx->objectFrame(fBoundingBox);
 			ctx->setViewport(BLRect{0,0,fBoundingBox.w, fBoundingBox.h});
 
-			fWrappedNode->draw(ctx, groot);
+			if (!drawInstance(ctx, groot))
+				fWrappedNode->draw(ctx, groot);
 
 			ctx->pop();
 		}
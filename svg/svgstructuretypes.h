@@ -5,6 +5,10 @@
 
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <functional>
+#include <atomic>
 #include <map>
 #include <unordered_map>
 #include <cstdint>		// uint8_t, etc
@@ -107,6 +111,7 @@ namespace waavs {
     {
         bool fAutoDraw{ true };
         bool fIsSet{ false };
+        bool fBindsToContext{ false };  // has something to resolve against the context it's drawn in
         ByteSpan fRawValue;
 
 
@@ -122,6 +127,9 @@ namespace waavs {
         void autoDraw(bool value) { fAutoDraw = value; }
         bool autoDraw() const { return fAutoDraw; }
 
+        void bindsToContext(bool value) { fBindsToContext = value; }
+        bool bindsToContext() const { return fBindsToContext; }
+
         const ByteSpan& rawValue() const { return fRawValue; }
 
         virtual bool loadSelfFromChunk(const ByteSpan&)
@@ -162,6 +170,18 @@ namespace waavs {
         // Apply propert to the context conditionally
         virtual void drawSelf(IRenderSVG*, IAmGroot*) { ; }
 
+        // Some properties (clip-path) can't be expressed as a simple
+        // state change on the context.  They need to wrap the drawing
+        // of the element's content instead, possibly redirecting it
+        // into another context.
+        // contentWrapOrder() > 0 indicates the property is such a wrapper.
+        // Higher values wrap outside of lower values.
+        virtual int contentWrapOrder() const { return 0; }
+        virtual void drawContent(IRenderSVG* ctx, IAmGroot*, const BLRect&, const std::function<void(IRenderSVG*)>& content)
+        {
+            content(ctx);
+        }
+
         virtual void draw(IRenderSVG* ctx, IAmGroot* groot)
         {
             //printf("SVGVisualProperty::draw == ");
@@ -179,11 +199,99 @@ namespace waavs {
     //===================================================
     // Handling attribute conversion to properties
     // 
+    // Every element's attributes go through here each time it's bound,
+    // so the presentation attributes we know how to convert are given
+    // an atom, through a table built at compile time.  The converter
+    // for an attribute is then found by indexing an array with its atom,
+    // and called directly, rather than through a std::function.
+    //
+    // Anything registered under a name that isn't one of the atoms
+    // still works, it just goes through a map.
+    //
+    enum SVGAttributeAtom : uint32_t {
+        SVG_ATTR_EXTEND_MODE,
+        SVG_ATTR_OPACITY,
+        SVG_ATTR_FILL_OPACITY,
+        SVG_ATTR_STROKE_OPACITY,
+        SVG_ATTR_PAINT_ORDER,
+        SVG_ATTR_TEXT_ANCHOR,
+        SVG_ATTR_FONT_SIZE,
+        SVG_ATTR_FONT_FAMILY,
+        SVG_ATTR_FONT_STYLE,
+        SVG_ATTR_FONT_WEIGHT,
+        SVG_ATTR_FONT_STRETCH,
+        SVG_ATTR_COLOR,
+        SVG_ATTR_FILL,
+        SVG_ATTR_FILL_RULE,
+        SVG_ATTR_STROKE,
+        SVG_ATTR_STROKE_WIDTH,
+        SVG_ATTR_STROKE_MITERLIMIT,
+        SVG_ATTR_STROKE_LINECAP,
+        SVG_ATTR_STROKE_LINECAP_START,
+        SVG_ATTR_STROKE_LINECAP_END,
+        SVG_ATTR_STROKE_LINEJOIN,
+        SVG_ATTR_TRANSFORM,
+        SVG_ATTR_VIEWBOX,
+        SVG_ATTR_MARKER,
+        SVG_ATTR_MARKER_START,
+        SVG_ATTR_MARKER_MID,
+        SVG_ATTR_MARKER_END,
+        SVG_ATTR_VECTOR_EFFECT,
+        SVG_ATTR_CLIP_PATH,
+        SVG_ATTR_CLIP_RULE,
+        SVG_ATTR_FILTER,
+        SVG_ATTR_MASK,
+
+        SVG_ATTR_COUNT
+    };
+
+    static constexpr auto SVGAttributeAtoms = makeWSEnum({
+        {"extendMode", SVG_ATTR_EXTEND_MODE},
+        {"opacity", SVG_ATTR_OPACITY},
+        {"fill-opacity", SVG_ATTR_FILL_OPACITY},
+        {"stroke-opacity", SVG_ATTR_STROKE_OPACITY},
+        {"paint-order", SVG_ATTR_PAINT_ORDER},
+        {"text-anchor", SVG_ATTR_TEXT_ANCHOR},
+        {"font-size", SVG_ATTR_FONT_SIZE},
+        {"font-family", SVG_ATTR_FONT_FAMILY},
+        {"font-style", SVG_ATTR_FONT_STYLE},
+        {"font-weight", SVG_ATTR_FONT_WEIGHT},
+        {"font-stretch", SVG_ATTR_FONT_STRETCH},
+        {"color", SVG_ATTR_COLOR},
+        {"fill", SVG_ATTR_FILL},
+        {"fill-rule", SVG_ATTR_FILL_RULE},
+        {"stroke", SVG_ATTR_STROKE},
+        {"stroke-width", SVG_ATTR_STROKE_WIDTH},
+        {"stroke-miterlimit", SVG_ATTR_STROKE_MITERLIMIT},
+        {"stroke-linecap", SVG_ATTR_STROKE_LINECAP},
+        {"stroke-linecap-start", SVG_ATTR_STROKE_LINECAP_START},
+        {"stroke-linecap-end", SVG_ATTR_STROKE_LINECAP_END},
+        {"stroke-linejoin", SVG_ATTR_STROKE_LINEJOIN},
+        {"transform", SVG_ATTR_TRANSFORM},
+        {"viewBox", SVG_ATTR_VIEWBOX},
+        {"marker", SVG_ATTR_MARKER},
+        {"marker-start", SVG_ATTR_MARKER_START},
+        {"marker-mid", SVG_ATTR_MARKER_MID},
+        {"marker-end", SVG_ATTR_MARKER_END},
+        {"vector-effect", SVG_ATTR_VECTOR_EFFECT},
+        {"clip-path", SVG_ATTR_CLIP_PATH},
+        {"clip-rule", SVG_ATTR_CLIP_RULE},
+        {"filter", SVG_ATTR_FILTER},
+        {"mask", SVG_ATTR_MASK},
+    });
+
     // Collection of property constructors
-    using SVGAttributeToPropertyConverter = std::function<std::shared_ptr<SVGVisualProperty>(const XmlAttributeCollection& attrs)>;
+    using SVGAttributeToPropertyConverter = std::shared_ptr<SVGVisualProperty> (*)(const XmlAttributeCollection& attrs);
     using SVGPropertyConstructorMap = std::unordered_map<ByteSpan, SVGAttributeToPropertyConverter, ByteSpanHash, ByteSpanEquivalent>;
 
+    static SVGAttributeToPropertyConverter* getPropertyConstructionTable()
+    {
+        static SVGAttributeToPropertyConverter gSVGAttributeConverters[SVG_ATTR_COUNT]{};
+
+        return gSVGAttributeConverters;
+    }
 
+    // Converters for attributes that don't have an atom
     static SVGPropertyConstructorMap & getPropertyConstructionMap()
     {
         static SVGPropertyConstructorMap gSVGAttributeCreation{};
@@ -194,13 +302,39 @@ namespace waavs {
     // Convenient function to register property constructors
     static void registerSVGAttribute(const ByteSpan& name, SVGAttributeToPropertyConverter func)
     {
-        getPropertyConstructionMap()[name] = func;
+        uint32_t atom = 0;
+        if (getEnumValue(SVGAttributeAtoms, name, atom))
+            getPropertyConstructionTable()[atom] = func;
+        else
+            getPropertyConstructionMap()[name] = func;
+    }
+
+    // The registrations are capture-less lambdas, returning whatever
+    // kind of property they construct.  Each one gets a thunk of the
+    // converter type, which calls it directly.  The thunk keeps one
+    // copy per lambda type, so a lambda with captures (whose state
+    // could differ from one registration to the next) isn't allowed.
+    template <typename F>
+    static void registerSVGAttribute(const ByteSpan& name, F func)
+    {
+        static_assert(std::is_empty<F>::value, "registerSVGAttribute() takes a lambda without captures");
+
+        static F sFunc = func;
+
+        registerSVGAttribute(name, +[](const XmlAttributeCollection& attrs) -> std::shared_ptr<SVGVisualProperty> { return sFunc(attrs); });
     }
 
     static SVGAttributeToPropertyConverter getAttributeConverter(const ByteSpan &name)
     {
         // Next, see if there is a property registered for the attribute
+        uint32_t atom = 0;
+        if (getEnumValue(SVGAttributeAtoms, name, atom))
+            return getPropertyConstructionTable()[atom];
+
         auto & mapper = getPropertyConstructionMap();
+        if (mapper.empty())
+            return nullptr;
+
         auto it = mapper.find(name);
         if (it != mapper.end())
         {
@@ -216,6 +350,20 @@ namespace waavs {
 
 
 namespace waavs {
+    // Edit stamps
+    // Every time an element is edited, or a node starts or stops being
+    // animated, it takes a new stamp.  Anything holding on to rendered
+    // content (the InstanceCache) compares stamps to know when to look
+    // at that content again.
+    static std::atomic<uint64_t>& editStamp() noexcept
+    {
+        static std::atomic<uint64_t> sStamp{ 0 };
+        return sStamp;
+    }
+
+    static uint64_t nextEditStamp() noexcept { return ++editStamp(); }
+    static uint64_t latestEditStamp() noexcept { return editStamp().load(); }
+
     // Interface Am Graphics Root (IAmGroot) 
     // Core interface to hold document level state, primarily
     // for the purpose of looking up nodes, but also for style sheets
@@ -224,6 +372,74 @@ namespace waavs {
         std::unordered_map<ByteSpan, std::shared_ptr<IViewable>, ByteSpanHash, ByteSpanEquivalent> fDefinitions{};
         std::unordered_map<ByteSpan, ByteSpan, ByteSpanHash, ByteSpanEquivalent> fEntities{};
         
+        // Nodes with state that changes over time.  Only these are
+        // updated on a frame, rather than walking the whole tree.
+        // They're held weakly, so a node that goes away simply
+        // drops out of the list.
+        std::vector<std::weak_ptr<IViewable>> fAnimatedNodes{};
+        
+        
+        virtual void addAnimatedNode(std::shared_ptr<IViewable> node)
+        {
+            if (nullptr == node)
+                return;
+
+            for (auto& existing : fAnimatedNodes)
+            {
+                if (existing.lock() == node)
+                    return;
+            }
+
+            fAnimatedNodes.push_back(node);
+            nextEditStamp();
+        }
+
+        virtual void removeAnimatedNode(const IViewable* node)
+        {
+            fAnimatedNodes.erase(std::remove_if(fAnimatedNodes.begin(), fAnimatedNodes.end(),
+                [node](const std::weak_ptr<IViewable>& wp) {
+                    auto sp = wp.lock();
+                    return (nullptr == sp) || (sp.get() == node);
+                }), fAnimatedNodes.end());
+            nextEditStamp();
+        }
+
+        bool hasAnimatedNodes() const { return !fAnimatedNodes.empty(); }
+
+        bool isAnimatedNode(const IViewable* node) const
+        {
+            for (auto& wp : fAnimatedNodes)
+            {
+                if (wp.lock().get() == node)
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Update the animated nodes for a new frame.  Returns false if
+        // there aren't any, in which case nothing has changed, and
+        // there's no need to draw again.
+        virtual bool updateAnimatedNodes()
+        {
+            bool updated = false;
+
+            for (size_t i = 0; i < fAnimatedNodes.size(); )
+            {
+                auto node = fAnimatedNodes[i].lock();
+                if (nullptr == node)
+                {
+                    fAnimatedNodes.erase(fAnimatedNodes.begin() + i);
+                    continue;
+                }
+
+                node->update(this);
+                updated = true;
+                i++;
+            }
+
+            return updated;
+        }
         
         virtual void addElementReference(const ByteSpan& name, std::shared_ptr<IViewable> obj)
         {
@@ -427,8 +643,12 @@ namespace waavs {
 
 		BLMatrix2D fTransform{};
 		bool fHasTransform{ false };
+        bool fStyleAttributesFixed{ false };  // attributes merged, and parsed into their numeric forms
+        bool fPropertiesConverted{ false };   // fVisualProperties built from the attributes
+        uint64_t fEditStamp{ 0 };             // from the last time the element was edited
         
         std::unordered_map<ByteSpan, std::shared_ptr<SVGVisualProperty>, ByteSpanHash, ByteSpanEquivalent> fVisualProperties{};
+        std::vector<std::shared_ptr<SVGVisualProperty>> fContentWrappers{};   // outermost first
         std::vector<std::shared_ptr<IViewable>> fNodes{};
 
 
@@ -495,6 +715,12 @@ namespace waavs {
 		void setAttribute(const ByteSpan& key, const ByteSpan& value) noexcept
 		{
 			fAttributes.addAttribute(key,value);
+
+			// have the attributes parsed again on the next binding
+			fStyleAttributesFixed = false;
+			fPropertiesConverted = false;
+			needsBinding(true);
+			fEditStamp = nextEditStamp();
 		}
 
         std::shared_ptr<SVGVisualProperty> getVisualProperty(const ByteSpan& name)
@@ -721,8 +947,18 @@ namespace waavs {
         }
 
 
+        // fixupStyleAttributes
+        //
+        // Merge the styling into the attributes, and parse them into
+        // whatever numeric form they're kept in.  Nothing here depends on
+        // the context, so it's only done the first time we're bound.
+        // Binding again, for a new canvas size, or dpi, only resolves
+        // the values that were parsed here, without going back to the text.
         void fixupStyleAttributes(IRenderSVG* ctx, IAmGroot* groot) override
         {
+            if (fStyleAttributesFixed)
+                return;
+
             // First, lookup CSS based on tagname
             // See if there's an element selector for the current element
             if (groot != nullptr) {
@@ -804,6 +1040,7 @@ namespace waavs {
             // but after attributes have been set.
             fHasTransform = parseTransform(getAttribute("transform"), fTransform);
 
+            fStyleAttributesFixed = true;
         }
         
         // IViewable
@@ -849,8 +1086,25 @@ namespace waavs {
         // Take the step of converting a raw attribute
         // value into a specific display property if a routine
         // exists for it.
+        //
+        // The properties are only constructed the first time.  Binding
+        // again, for a new canvas size, or dpi, keeps them, and marks the
+        // ones that resolve against the context (url() references, font
+        // relative sizes) to be bound again when they're next used.
+        // So a rebind doesn't allocate anything here.
         void convertAttributesToProperties(IRenderSVG* ctx, IAmGroot* groot)
         {
+            if (fPropertiesConverted)
+            {
+                for (auto& prop : fVisualProperties)
+                {
+                    if (prop.second->bindsToContext())
+                        prop.second->needsBinding(true);
+                }
+
+                return;
+            }
+
             //
             for (auto& attr : fAttributes.attributes())
             {
@@ -860,9 +1114,28 @@ namespace waavs {
                 {
                     auto prop = propertyMapper(fAttributes);
                     if (prop != nullptr)
+                    {
+                        // whatever still needs binding, after being
+                        // loaded, depends on the context
+                        prop->bindsToContext(prop->needsBinding());
                         fVisualProperties[attr.first] = prop;
+                    }
                 }
             }
+
+            // Gather up the properties that wrap the drawing
+            // of our content, outermost first
+            fContentWrappers.clear();
+            for (auto& prop : fVisualProperties)
+            {
+                if (prop.second->contentWrapOrder() > 0)
+                    fContentWrappers.push_back(prop.second);
+            }
+            std::sort(fContentWrappers.begin(), fContentWrappers.end(), [](const std::shared_ptr<SVGVisualProperty>& a, const std::shared_ptr<SVGVisualProperty>& b) {
+                return a->contentWrapOrder() > b->contentWrapOrder();
+                });
+
+            fPropertiesConverted = true;
         }
 
         virtual void bindSelfToContext(IRenderSVG*, IAmGroot*) { ; }
@@ -911,8 +1184,29 @@ namespace waavs {
         {
             ;
         }
-        
-        
+
+        // Draw self and children, through whichever content
+        // wrappers (clip-path, etc) are in effect, starting at 'idx'
+        void drawWrappedContent(IRenderSVG* ctx, IAmGroot* groot, size_t idx)
+        {
+            if (idx >= fContentWrappers.size())
+            {
+                this->drawSelf(ctx, groot);
+                this->drawChildren(ctx, groot);
+                return;
+            }
+
+            // Containers don't have a bounding box of their own,
+            // so fall back to the extent of what they contain
+            BLRect objectBox = getBBox();
+            if ((objectBox.w <= 0) || (objectBox.h <= 0))
+                objectBox = frame();
+
+            fContentWrappers[idx]->drawContent(ctx, groot, objectBox, [this, groot, idx](IRenderSVG* actx) {
+                drawWrappedContent(actx, groot, idx + 1);
+                });
+        }
+
         void draw(IRenderSVG* ctx, IAmGroot* groot) override
         {
             if (!visible())
@@ -922,15 +1216,21 @@ namespace waavs {
 
             if (needsBinding())
                 this->bindToContext(ctx, groot);
-            
+
             // Should have valid bounding box by now
             // so set objectFrame on the context
 			ctx->objectFrame(getBBox());
-            
+
             this->applyProperties(ctx, groot);
-            this->drawSelf(ctx, groot);
 
-            this->drawChildren(ctx, groot);
+            if (fContentWrappers.empty())
+            {
+                this->drawSelf(ctx, groot);
+                this->drawChildren(ctx, groot);
+            }
+            else {
+                drawWrappedContent(ctx, groot, 0);
+            }
 
             ctx->pop();
         }
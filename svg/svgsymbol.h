@@ -1,6 +1,7 @@
 #pragma once
 
 #include "svgcontainer.h"
+#include "instancecache.h"
 
 namespace waavs {
 	//===========================================
@@ -32,6 +33,13 @@ namespace waavs {
 
 		BLPoint fSymbolContentTranslation{};
 
+		// Identifies the content, as bound, for the InstanceCache
+		uint64_t fInstanceGeneration{ 0 };
+
+		// What the content looked like, the last time it was checked
+		uint64_t fContentCheckedAt{ 0 };
+		uint64_t fContentEditStamp{ 0 };
+		bool fHasAnimatedContent{ false };
 
 
 		SVGSymbolNode(IAmGroot* root)
@@ -113,6 +121,53 @@ namespace waavs {
 		void bindSelfToContext(IRenderSVG* ctx, IAmGroot* groot) override
 		{
 			fPortal.bindToContext(ctx, groot);
+
+			fInstanceGeneration = InstanceCache::nextGeneration();
+		}
+
+		// Latest edit anywhere in the subtree, and whether any of it
+		// is animated
+		static void scanContent(const SVGGraphicsElement* elem, IAmGroot* groot, uint64_t& editStamp, bool& animated)
+		{
+			editStamp = std::max(editStamp, elem->fEditStamp);
+
+			for (auto& node : elem->fNodes)
+			{
+				if ((nullptr != groot) && groot->isAnimatedNode(node.get()))
+					animated = true;
+
+				auto child = std::dynamic_pointer_cast<SVGGraphicsElement>(node);
+				if (nullptr != child)
+					scanContent(child.get(), groot, editStamp, animated);
+			}
+		}
+
+		// Whether the content can be drawn from the InstanceCache.  An
+		// edit anywhere below the symbol takes a new instance generation,
+		// so the rasters of the old content are never found again.
+		// Content that changes from frame to frame is never cached.
+		// The subtree is only looked at again after something, somewhere,
+		// was edited.
+		bool instanceable(IAmGroot* groot)
+		{
+			uint64_t latest = latestEditStamp();
+			if (latest != fContentCheckedAt)
+			{
+				uint64_t editStamp = 0;
+				bool animated = false;
+				scanContent(this, groot, editStamp, animated);
+
+				if (editStamp != fContentEditStamp)
+				{
+					fContentEditStamp = editStamp;
+					fInstanceGeneration = InstanceCache::nextGeneration();
+				}
+
+				fHasAnimatedContent = animated;
+				fContentCheckedAt = latest;
+			}
+
+			return !fHasAnimatedContent;
 		}
 
 		void drawSelf(IRenderSVG* ctx, IAmGroot* groot) override
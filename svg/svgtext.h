@@ -10,13 +10,12 @@ namespace waavs {
 	struct Fontography {
 		static BLPoint textMeasure(const BLFont& font, const ByteSpan& txt) noexcept
 		{
-			BLTextMetrics tm;
-			BLGlyphBuffer gb;
 			BLFontMetrics fm = font.metrics();
 
-			gb.setUtf8Text(txt.data(), txt.size());
-			font.shape(gb);
-			font.getTextMetrics(gb, tm);
+			// Shaped runs are cached, so measuring here, and drawing
+			// later, only shapes the text once
+			auto run = ShapedTextCache::cache().get(font, txt);
+			const BLTextMetrics& tm = run->fMetrics;
 
 			float cx = (float)(tm.boundingBox.x1 - tm.boundingBox.x0);
 			float cy = fm.ascent + fm.descent;
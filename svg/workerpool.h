@@ -0,0 +1,157 @@
+#pragma once
+
+//
+// A small pool of worker threads
+//
+// Work that can be done off to the side, like decoding images while
+// the rest of the document is being bound, is handed to the pool as
+// a task, and picked up by whichever worker is free.  The pool is
+// shared by the whole process, and sized to the machine, leaving a
+// core for the thread doing the submitting.
+//
+// parallelFor() spreads a loop across the pool, for work like
+// running filter kernels a band of rows at a time.
+//
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace waavs
+{
+    struct WorkerPool
+    {
+        static constexpr size_t kMaxThreads = 8;
+
+        std::mutex fLock{};
+        std::condition_variable fWorkAvailable{};
+        std::deque<std::function<void()>> fQueue{};
+        size_t fThreadCount{ 0 };
+
+
+        // The pool is intentionally never destroyed.  The workers are
+        // detached, and just sit waiting for work until the process exits.
+        static WorkerPool& pool()
+        {
+            static WorkerPool* sPool = new WorkerPool(defaultThreadCount());
+            return *sPool;
+        }
+
+        static size_t defaultThreadCount()
+        {
+            size_t n = std::thread::hardware_concurrency();
+            if (n > 1)
+                n -= 1;
+
+            if (n < 1)
+                n = 1;
+            if (n > kMaxThreads)
+                n = kMaxThreads;
+
+            return n;
+        }
+
+        explicit WorkerPool(size_t threadCount)
+        {
+            for (size_t i = 0; i < threadCount; i++)
+            {
+                std::thread worker([this]() { workLoop(); });
+                worker.detach();
+                fThreadCount++;
+            }
+        }
+
+        size_t threadCount() const { return fThreadCount; }
+
+        void submit(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(fLock);
+                fQueue.push_back(std::move(task));
+            }
+
+            fWorkAvailable.notify_one();
+        }
+
+        // parallelFor
+        // Run fn(i), for i in [0, count), spread across the pool, with
+        // the calling thread doing its share.  Returns once every index
+        // has been run.  The caller only ever waits on helpers that have
+        // actually started, never on tasks still sitting in the queue,
+        // so it's safe to call from within a pool task.
+        void parallelFor(size_t count, const std::function<void(size_t)>& fn)
+        {
+            if (count == 0)
+                return;
+
+            if ((count == 1) || (fThreadCount == 0))
+            {
+                for (size_t i = 0; i < count; i++)
+                    fn(i);
+                return;
+            }
+
+            struct Job
+            {
+                std::atomic<size_t> fNext{ 0 };
+                std::atomic<size_t> fActive{ 0 };
+                size_t fCount{ 0 };
+                const std::function<void(size_t)>* fFunction{ nullptr };
+                std::mutex fLock{};
+                std::condition_variable fDone{};
+            };
+
+            auto job = std::make_shared<Job>();
+            job->fCount = count;
+            job->fFunction = &fn;
+
+            // A helper registers as active before it claims anything, so
+            // once the caller sees no active helpers, and no indices left,
+            // nobody can touch 'fn' again.
+            auto work = [job]() {
+                job->fActive++;
+                for (size_t i = job->fNext++; i < job->fCount; i = job->fNext++)
+                    (*job->fFunction)(i);
+
+                if (--job->fActive == 0)
+                {
+                    std::lock_guard<std::mutex> lock(job->fLock);
+                    job->fDone.notify_all();
+                }
+            };
+
+            size_t helpers = std::min(fThreadCount, count - 1);
+            for (size_t i = 0; i < helpers; i++)
+                submit(work);
+
+            for (size_t i = job->fNext++; i < count; i = job->fNext++)
+                fn(i);
+
+            std::unique_lock<std::mutex> lock(job->fLock);
+            job->fDone.wait(lock, [&job]() { return job->fActive == 0; });
+        }
+
+    private:
+        void workLoop()
+        {
+            while (true)
+            {
+                std::function<void()> task{};
+                {
+                    std::unique_lock<std::mutex> lock(fLock);
+                    fWorkAvailable.wait(lock, [this]() { return !fQueue.empty(); });
+
+                    task = std::move(fQueue.front());
+                    fQueue.pop_front();
+                }
+
+                task();
+            }
+        }
+    };
+}
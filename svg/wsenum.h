@@ -1,31 +1,262 @@
 #pragma once
 
-#include <unordered_map>
+//
+// Keyword tables
+//
+// Enum keywords, and color names, are looked up constantly while
+// parsing attributes.  Rather than hashing into a std::unordered_map,
+// these tables are built at compile time, with a perfect hash (hash
+// and displace).  The keywords are first spread across buckets with
+// one hash.  Each bucket then gets a seed for a second hash, which
+// puts every keyword in it into a slot of its own.
+//
+// A lookup is then two hashes of the key, a couple of table reads,
+// and a single compare against the only keyword that could possibly
+// match.  There's no allocation, and case folding (for the tables
+// that want it) is plain ASCII, so doesn't depend on the locale.
+//
+
+#include <cstddef>
+#include <cstdint>
+
 #include "bspan.h"
 
 namespace waavs {
-	using WSEnum = std::unordered_map<ByteSpan, uint32_t, ByteSpanHash, ByteSpanEquivalent>;
+	template <typename T>
+	struct WSKeyword
+	{
+		const char* fName;
+		T fValue;
+	};
 
-	static INLINE bool getEnumValue(WSEnum enumMap, const ByteSpan& key, uint32_t& value) noexcept
+	static constexpr uint8_t asciiFold(uint8_t c) noexcept
 	{
-		auto it = enumMap.find(key);
-		if (it == enumMap.end())
-			return false;
-		value = it->second;
-		return true;
+		return ((c >= 'A') && (c <= 'Z')) ? (uint8_t)(c | 0x20) : c;
 	}
 
-	// Return the key that corresponds to the specified value
-	static INLINE bool getEnumKey(WSEnum enumMap, uint32_t value, ByteSpan& key) noexcept
+	template <bool kFoldCase, typename C>
+	static constexpr uint32_t keywordHash(const C* s, size_t len, uint32_t seed) noexcept
+	{
+		uint32_t h = FNV1A_32_INIT ^ (seed * 0x9e3779b9u);
+		for (size_t i = 0; i < len; i++)
+		{
+			uint8_t c = (uint8_t)s[i];
+			if (kFoldCase)
+				c = asciiFold(c);
+
+			h ^= c;
+			h *= FNV1A_32_PRIME;
+		}
+
+		// the slot comes from the low bits, so bring the high ones down
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+
+		return h;
+	}
+
+	template <typename T, size_t N, bool kFoldCase = false>
+	struct WSKeywordTable
 	{
-		for (auto it = enumMap.begin(); it != enumMap.end(); ++it)
+		static constexpr size_t pow2AtLeast(size_t n) noexcept
 		{
-			if (it->second == value)
+			size_t p = 1;
+			while (p < n)
+				p <<= 1;
+			return p;
+		}
+
+		// At most half the slots are used, so a seed that fits
+		// a bucket is found after a handful of tries
+		static constexpr size_t kSlots = pow2AtLeast(N * 2);
+		static constexpr size_t kBuckets = pow2AtLeast((N + 1) / 2);
+
+		template <typename C>
+		static constexpr bool sameKeyword(const char* name, size_t nameLen, const C* s, size_t len) noexcept
+		{
+			if (nameLen != len)
+				return false;
+
+			for (size_t i = 0; i < len; i++)
 			{
-				key = it->first;
-				return true;
+				uint8_t a = (uint8_t)s[i];
+				uint8_t c = (uint8_t)name[i];
+				if (kFoldCase) {
+					a = asciiFold(a);
+					c = asciiFold(c);
+				}
+
+				if (a != c)
+					return false;
 			}
+
+			return true;
 		}
-		return false;
+
+		const char* fNames[N]{};
+		size_t fLengths[N]{};
+		T fValues[N]{};
+		uint32_t fSeeds[kBuckets]{};
+		int16_t fSlots[kSlots]{};
+
+
+		// A bucket that no seed can place throws, which, as the tables
+		// are built in constant expressions, fails the build rather
+		// than quietly losing the bucket's keywords.
+		constexpr WSKeywordTable(const WSKeyword<T>(&keywords)[N])
+		{
+			uint32_t hashOf[N]{};
+			size_t bucketStart[kBuckets + 1]{};
+
+			for (size_t i = 0; i < N; i++)
+			{
+				size_t len = 0;
+				while (keywords[i].fName[len] != 0)
+					len++;
+
+				fNames[i] = keywords[i].fName;
+				fLengths[i] = len;
+				fValues[i] = keywords[i].fValue;
+				hashOf[i] = keywordHash<kFoldCase>(fNames[i], len, 0);
+				bucketStart[(hashOf[i] & (kBuckets - 1)) + 1]++;
+			}
+
+			for (size_t b = 0; b < kBuckets; b++)
+				bucketStart[b + 1] += bucketStart[b];
+
+			// Group the keywords by bucket.  A keyword that's repeated
+			// could never be given a slot of its own, so only the first
+			// one goes in.  Repeats always share a bucket, so that's
+			// the only place to look for them.
+			size_t members[N]{};
+			size_t bucketSize[kBuckets]{};
+			size_t largestBucket = 0;
+			for (size_t i = 0; i < N; i++)
+			{
+				size_t b = hashOf[i] & (kBuckets - 1);
+
+				bool repeated = false;
+				for (size_t m = bucketStart[b]; (m < bucketStart[b] + bucketSize[b]) && !repeated; m++)
+				{
+					size_t j = members[m];
+					repeated = (hashOf[j] == hashOf[i]) && sameKeyword(fNames[j], fLengths[j], fNames[i], fLengths[i]);
+				}
+				if (repeated)
+					continue;
+
+				members[bucketStart[b] + bucketSize[b]++] = i;
+				if (bucketSize[b] > largestBucket)
+					largestBucket = bucketSize[b];
+			}
+
+			for (size_t s = 0; s < kSlots; s++)
+				fSlots[s] = -1;
+
+			// Place the largest buckets first, while there's the most room
+			size_t taken[N]{};
+			for (size_t size = largestBucket; size > 0; size--)
+			{
+				for (size_t b = 0; b < kBuckets; b++)
+				{
+					if (bucketSize[b] != size)
+						continue;
+
+					bool placed = false;
+					for (uint32_t seed = 1; (seed < 0x10000) && !placed; seed++)
+					{
+						// remember the slots this seed takes, so a failed
+						// try only gives back those
+						size_t takenCount = 0;
+
+						placed = true;
+						for (size_t m = bucketStart[b]; m < bucketStart[b] + size; m++)
+						{
+							size_t i = members[m];
+							size_t slot = keywordHash<kFoldCase>(fNames[i], fLengths[i], seed) & (kSlots - 1);
+							if (fSlots[slot] != -1)
+							{
+								placed = false;
+								break;
+							}
+
+							fSlots[slot] = (int16_t)i;
+							taken[takenCount++] = slot;
+						}
+
+						if (placed)
+							fSeeds[b] = seed;
+						else {
+							for (size_t t = 0; t < takenCount; t++)
+								fSlots[taken[t]] = -1;
+						}
+					}
+
+					if (!placed)
+						throw "WSKeywordTable: no seed places every keyword of a bucket";
+				}
+			}
+		}
+
+		constexpr size_t size() const noexcept { return N; }
+
+		bool find(const ByteSpan& key, T& value) const noexcept
+		{
+			const size_t len = key.size();
+			const uint8_t* s = key.data();
+
+			uint32_t b = keywordHash<kFoldCase>(s, len, 0) & (kBuckets - 1);
+			int idx = fSlots[keywordHash<kFoldCase>(s, len, fSeeds[b]) & (kSlots - 1)];
+
+			if ((idx < 0) || !sameKeyword(fNames[idx], fLengths[idx], s, len))
+				return false;
+
+			value = fValues[idx];
+			return true;
+		}
+
+		// Reverse lookup, for debugging, so a plain scan will do
+		bool findKey(const T& value, ByteSpan& key) const noexcept
+		{
+			for (size_t i = 0; i < N; i++)
+			{
+				if (fValues[i] == value)
+				{
+					key = ByteSpan(fNames[i], fLengths[i]);
+					return true;
+				}
+			}
+
+			return false;
+		}
+	};
+
+	template <bool kFoldCase = false, typename T, size_t N>
+	static constexpr WSKeywordTable<T, N, kFoldCase> makeKeywordTable(const WSKeyword<T>(&keywords)[N])
+	{
+		return WSKeywordTable<T, N, kFoldCase>(keywords);
+	}
+
+	// An enum is a (case sensitive) table of keywords to numeric values
+	template <size_t N>
+	using WSEnum = WSKeywordTable<uint32_t, N>;
+
+	template <size_t N>
+	static constexpr WSEnum<N> makeWSEnum(const WSKeyword<uint32_t>(&keywords)[N])
+	{
+		return WSEnum<N>(keywords);
+	}
+
+	template <size_t N>
+	static INLINE bool getEnumValue(const WSEnum<N>& enumMap, const ByteSpan& key, uint32_t& value) noexcept
+	{
+		return enumMap.find(key, value);
+	}
+
+	// Return the key that corresponds to the specified value
+	template <size_t N>
+	static INLINE bool getEnumKey(const WSEnum<N>& enumMap, uint32_t value, ByteSpan& key) noexcept
+	{
+		return enumMap.findKey(value, key);
 	}
-}
\ No newline at end of file
+}
@@ -0,0 +1,167 @@
+
+//
+// filterbench
+// Throughput of the per-pixel filter kernels, each working version
+// against its floating point reference, on the same pixels.
+// The largest difference in any channel is reported alongside, as
+// the working versions are meant to stay within a unit of the reference.
+//
+// Usage: filterbench [pixels per run]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "filterkernels.h"
+
+using namespace waavs;
+
+
+static const char* kCompositeNames[] = { "over", "in", "out", "atop", "xor", "lighter", "arithmetic" };
+static const char* kBlendNames[] = { "normal", "multiply", "screen", "darken", "lighten", "difference", "exclusion" };
+
+
+// Premultiplied pixels, with a fair share of opaque and
+// transparent ones, as real content tends to have
+static std::vector<uint32_t> makePixels(int n, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint32_t> px(n);
+
+    for (auto& p : px)
+    {
+        uint32_t a = rng() & 0xff;
+        switch (rng() % 4)
+        {
+        case 0: a = 255; break;
+        case 1: a = 0; break;
+        }
+
+        uint32_t r = a ? (rng() % (a + 1)) : 0;
+        uint32_t g = a ? (rng() % (a + 1)) : 0;
+        uint32_t b = a ? (rng() % (a + 1)) : 0;
+        p = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+
+    return px;
+}
+
+// Largest difference in any one channel
+static int maxDifference(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b)
+{
+    int worst = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            int d = std::abs((int)((a[i] >> shift) & 0xff) - (int)((b[i] >> shift) & 0xff));
+            worst = std::max(worst, d);
+        }
+    }
+
+    return worst;
+}
+
+// Run 'fn' until at least a tenth of a second has gone by, a few
+// times over, and report the best rate in millions of pixels a second
+template <typename F>
+static double measure(int n, F&& fn)
+{
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+
+    for (int trial = 0; trial < 3; trial++)
+    {
+        size_t calls = 0;
+        auto start = clock::now();
+        double secs = 0;
+        do {
+            fn();
+            calls++;
+            secs = std::chrono::duration<double>(clock::now() - start).count();
+        } while (secs < 0.1);
+
+        best = std::max(best, ((double)n * calls) / secs / 1e6);
+    }
+
+    return best;
+}
+
+static void report(const char* kernel, const char* mode, double ref, double fast, int diff)
+{
+    printf("  %-20s %-12s %9.1f %9.1f %7.1fx %5d %s\n", kernel, mode, ref, fast, fast / ref, diff, diff > 1 ? "MISMATCH" : "");
+}
+
+
+int main(int argc, char** argv)
+{
+    int n = 64 * 1024;
+    if (argc > 1)
+        n = atoi(argv[1]);
+
+    std::vector<uint32_t> src = makePixels(n, 1);
+    std::vector<uint32_t> backdrop = makePixels(n, 2);
+    std::vector<uint32_t> ref(n);
+    std::vector<uint32_t> fast(n);
+
+#if defined(WAAVS_KERNELS_SSE2)
+    printf("SSE2 kernels, %d pixels\n\n", n);
+#else
+    printf("scalar kernels, %d pixels\n\n", n);
+#endif
+    printf("  %-20s %-12s %9s %9s %8s %5s\n", "kernel", "mode", "ref Mpx/s", "Mpx/s", "speedup", "diff");
+
+    // feColorMatrix, type="saturate" values="0.4", with a touch of alpha
+    {
+        const float s = 0.4f;
+        const float m[20] = {
+            0.213f + 0.787f * s, 0.715f - 0.715f * s, 0.072f - 0.072f * s, 0, 0,
+            0.213f - 0.213f * s, 0.715f + 0.285f * s, 0.072f - 0.072f * s, 0, 0,
+            0.213f - 0.213f * s, 0.715f - 0.715f * s, 0.072f + 0.928f * s, 0, 0,
+            0, 0, 0, 0.9f, 0.05f,
+        };
+
+        double r = measure(n, [&]() { FilterKernels::colorMatrixReference(src.data(), ref.data(), n, m); });
+        double f = measure(n, [&]() { FilterKernels::colorMatrix(src.data(), fast.data(), n, m); });
+        report("colorMatrix", "saturate", r, f, maxDifference(ref, fast));
+    }
+
+    // feComponentTransfer, a gamma curve on the colors, and a table on alpha
+    {
+        TransferTables t;
+        for (int i = 0; i < 256; i++)
+        {
+            uint8_t v = (uint8_t)std::lround(255.0 * std::pow(i / 255.0, 0.6));
+            t.fTable[0][i] = t.fTable[1][i] = t.fTable[2][i] = v;
+            t.fTable[3][i] = (uint8_t)(i / 2 + 64);
+        }
+
+        double r = measure(n, [&]() { FilterKernels::componentTransferReference(src.data(), ref.data(), n, t); });
+        double f = measure(n, [&]() { FilterKernels::componentTransfer(src.data(), fast.data(), n, t); });
+        report("componentTransfer", "gamma", r, f, maxDifference(ref, fast));
+    }
+
+    // feComposite, every operator
+    {
+        const float k[4] = { 0.5f, 0.25f, 0.25f, 0.1f };
+        for (int op = FILTER_COMPOSITE_OVER; op <= FILTER_COMPOSITE_ARITHMETIC; op++)
+        {
+            double r = measure(n, [&]() { FilterKernels::compositeReference(src.data(), backdrop.data(), ref.data(), n, op, k); });
+            double f = measure(n, [&]() { FilterKernels::composite(src.data(), backdrop.data(), fast.data(), n, op, k); });
+            report("composite", kCompositeNames[op], r, f, maxDifference(ref, fast));
+        }
+    }
+
+    // feBlend, the modes that have a fast version
+    for (int mode = FILTER_BLEND_NORMAL; mode <= FILTER_BLEND_EXCLUSION; mode++)
+    {
+        double r = measure(n, [&]() { FilterKernels::blendReference(src.data(), backdrop.data(), ref.data(), n, mode); });
+        double f = measure(n, [&]() { FilterKernels::blend(src.data(), backdrop.data(), fast.data(), n, mode); });
+        report("blend", kBlendNames[mode], r, f, maxDifference(ref, fast));
+    }
+
+    return 0;
+}
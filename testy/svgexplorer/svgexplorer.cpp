@@ -136,7 +136,7 @@ static void onFrameEvent(const FrameCountEvent& fe)
 	// update current document
 	gBrowsingView.onFrameEvent(fe);
 	
-	if (gAnimate)
+	if (gAnimate && gBrowsingView.needsRedraw())
 	{
 		refreshDoc();
 	}
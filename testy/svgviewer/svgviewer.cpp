@@ -175,9 +175,8 @@ static void onFrameEvent(const FrameCountEvent& fe)
 	// update current document
 	if (gDoc != nullptr)
 	{
-		if (gAnimate)
+		if (gAnimate && gDoc->updateAnimatedNodes())
 		{
-			gDoc->update(gDoc.get());
 			handleChange(true);
 		}
 	}